@@ -0,0 +1,135 @@
+#pragma once
+
+#include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
+#include <arpa/inet.h>
+#include <optional>
+#include <vector>
+
+// Hands out client addresses from the private network and takes them back
+// when a session ends.
+//
+// Free addresses are tracked in a hierarchical bitmap: level 0 has one bit per
+// address (set = free) and every bit in level N + 1 tells whether the matching
+// 64-bit word in level N still has a free bit. Allocation walks down from the
+// single top-level word taking the lowest free bit on every level, so both
+// allocate() and release() touch at most one word per level (4 levels for a
+// /8) and the memory footprint is about one bit per address.
+class AddressPool {
+  public:
+    AddressPool(const pcpp::IPv4Network &network)
+        : m_FirstAddress(ntohl(network.getLowestAddress().toInt())) {
+        if (network.getPrefixLen() < m_MinPrefixLen) {
+            throw std::invalid_argument(
+                "Private network is too large, the minimum prefix length is " +
+                std::to_string(m_MinPrefixLen));
+        }
+
+        m_Size =
+            ntohl(network.getHighestAddress().toInt()) - m_FirstAddress + 1;
+
+        size_t bitCount = m_Size;
+        do {
+            size_t wordCount = (bitCount + m_BitsPerWord - 1) / m_BitsPerWord;
+            std::vector<uint64_t> level(wordCount, ~uint64_t(0));
+            if (bitCount % m_BitsPerWord != 0) {
+                level.back() = (uint64_t(1) << (bitCount % m_BitsPerWord)) - 1;
+            }
+            m_Levels.push_back(std::move(level));
+            bitCount = wordCount;
+        } while (bitCount > 1);
+
+        m_FreeCount = m_Size;
+    }
+
+    std::optional<pcpp::IPv4Address> allocate() {
+        if (m_FreeCount == 0) {
+            return std::nullopt;
+        }
+
+        size_t index = 0;
+        for (auto level = m_Levels.rbegin(); level != m_Levels.rend();
+             ++level) {
+            index = index * m_BitsPerWord + __builtin_ctzll((*level)[index]);
+        }
+
+        markUsed(index);
+        return toAddress(index);
+    }
+
+    bool reserve(const pcpp::IPv4Address &address) {
+        auto index = toIndex(address);
+        if (!index.has_value() || !isFree(index.value())) {
+            return false;
+        }
+
+        markUsed(index.value());
+        return true;
+    }
+
+    void release(const pcpp::IPv4Address &address) {
+        auto addressIndex = toIndex(address);
+        if (!addressIndex.has_value() || isFree(addressIndex.value())) {
+            return;
+        }
+
+        size_t index = addressIndex.value();
+        for (auto &level : m_Levels) {
+            auto &word = level[index / m_BitsPerWord];
+            bool wasEmpty = word == 0;
+            word |= uint64_t(1) << (index % m_BitsPerWord);
+            if (!wasEmpty) {
+                break;
+            }
+            index /= m_BitsPerWord;
+        }
+
+        m_FreeCount++;
+    }
+
+    size_t getFreeCount() const { return m_FreeCount; }
+
+    size_t getSize() const { return m_Size; }
+
+  private:
+    constexpr static size_t m_BitsPerWord = 64;
+    constexpr static int m_MinPrefixLen = 8;
+
+    uint32_t m_FirstAddress;
+    size_t m_Size;
+    size_t m_FreeCount;
+    std::vector<std::vector<uint64_t>> m_Levels;
+
+    std::optional<size_t> toIndex(const pcpp::IPv4Address &address) const {
+        uint32_t hostOrderAddress = ntohl(address.toInt());
+        if (hostOrderAddress < m_FirstAddress ||
+            hostOrderAddress - m_FirstAddress >= m_Size) {
+            return std::nullopt;
+        }
+
+        return hostOrderAddress - m_FirstAddress;
+    }
+
+    pcpp::IPv4Address toAddress(size_t index) const {
+        return pcpp::IPv4Address(
+            htonl(m_FirstAddress + static_cast<uint32_t>(index)));
+    }
+
+    bool isFree(size_t index) const {
+        return (m_Levels[0][index / m_BitsPerWord] >>
+                (index % m_BitsPerWord)) &
+               1;
+    }
+
+    void markUsed(size_t index) {
+        for (auto &level : m_Levels) {
+            auto &word = level[index / m_BitsPerWord];
+            word &= ~(uint64_t(1) << (index % m_BitsPerWord));
+            if (word != 0) {
+                break;
+            }
+            index /= m_BitsPerWord;
+        }
+
+        m_FreeCount--;
+    }
+};
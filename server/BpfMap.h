@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <linux/bpf.h>
+#include <stdexcept>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// A BPF map, created by the server or opened where another process pinned
+// it, read and written with the bpf() system call so the server needs no
+// libbpf
+class BpfMap {
+  public:
+    virtual ~BpfMap() { reset(); }
+
+    void create(bpf_map_type type, uint32_t keySize, uint32_t valueSize,
+                uint32_t maxEntries) {
+        reset();
+        bpf_attr attr{};
+        attr.map_type = type;
+        attr.key_size = keySize;
+        attr.value_size = valueSize;
+        attr.max_entries = maxEntries;
+        m_Fd = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+        if (m_Fd < 0) {
+            throw std::runtime_error("Couldn't create BPF map: " + getError());
+        }
+    }
+
+    void open(const std::string &pinnedPath) {
+        reset();
+        bpf_attr attr{};
+        attr.pathname = reinterpret_cast<uint64_t>(pinnedPath.c_str());
+        m_Fd = syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+        if (m_Fd < 0) {
+            throw std::runtime_error("Couldn't open BPF map '" + pinnedPath +
+                                     "': " + getError());
+        }
+    }
+
+    // Returns false if something is pinned at the path already
+    bool pin(const std::string &pinnedPath) {
+        bpf_attr attr{};
+        attr.bpf_fd = m_Fd;
+        attr.pathname = reinterpret_cast<uint64_t>(pinnedPath.c_str());
+        if (syscall(__NR_bpf, BPF_OBJ_PIN, &attr, sizeof(attr)) == 0) {
+            return true;
+        }
+        if (errno == EEXIST) {
+            return false;
+        }
+        throw std::runtime_error("Couldn't pin BPF map at '" + pinnedPath +
+                                 "': " + getError());
+    }
+
+    int getFd() const { return m_Fd; }
+
+    template <typename KEY, typename VALUE>
+    void update(const KEY &key, const VALUE &value) {
+        bpf_attr attr = getAttr(key);
+        attr.value = reinterpret_cast<uint64_t>(&value);
+        attr.flags = BPF_ANY;
+        if (syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)) < 0) {
+            throw std::runtime_error("Couldn't update BPF map: " + getError());
+        }
+    }
+
+    template <typename KEY> void erase(const KEY &key) {
+        bpf_attr attr = getAttr(key);
+        syscall(__NR_bpf, BPF_MAP_DELETE_ELEM, &attr, sizeof(attr));
+    }
+
+    template <typename KEY, typename VALUE>
+    bool lookup(const KEY &key, VALUE &value) const {
+        bpf_attr attr = getAttr(key);
+        attr.value = reinterpret_cast<uint64_t>(&value);
+        return syscall(__NR_bpf, BPF_MAP_LOOKUP_ELEM, &attr, sizeof(attr)) ==
+               0;
+    }
+
+    // Every key in the map, in no particular order
+    template <typename KEY> std::vector<KEY> getKeys() const {
+        std::vector<KEY> keys;
+        KEY key;
+        bpf_attr attr{};
+        attr.map_fd = m_Fd;
+        attr.next_key = reinterpret_cast<uint64_t>(&key);
+        // No key gets the first one
+        while (syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr)) ==
+               0) {
+            keys.push_back(key);
+            attr.key = reinterpret_cast<uint64_t>(&keys.back());
+        }
+        return keys;
+    }
+
+  private:
+    int m_Fd = -1;
+
+    void reset() {
+        if (m_Fd != -1) {
+            close(m_Fd);
+            m_Fd = -1;
+        }
+    }
+
+    template <typename KEY> bpf_attr getAttr(const KEY &key) const {
+        bpf_attr attr{};
+        attr.map_fd = m_Fd;
+        attr.key = reinterpret_cast<uint64_t>(&key);
+        return attr;
+    }
+
+    static std::string getError() {
+        std::array<char, 256> buffer;
+        return strerror_r(errno, buffer.data(), buffer.size());
+    }
+};
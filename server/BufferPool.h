@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct PacketBuffer {
+    constexpr static size_t capacity = 2048;
+
+    std::array<uint8_t, capacity> data;
+    size_t dataSize = 0;
+    std::chrono::steady_clock::time_point timestamp;
+    bool isSealed = false;
+};
+
+// A bounded pool of packet buffers. Buffers are allocated on first use and
+// recycled after that, so the steady state doesn't allocate at all.
+class BufferPool {
+  public:
+    BufferPool(size_t maxBuffers) : m_MaxBuffers(maxBuffers) {}
+
+    PacketBuffer *acquire() {
+        if (!m_FreeBuffers.empty()) {
+            auto buffer = m_FreeBuffers.back();
+            m_FreeBuffers.pop_back();
+            return buffer;
+        }
+
+        if (m_Buffers.size() == m_MaxBuffers) {
+            return nullptr;
+        }
+
+        m_Buffers.push_back(std::make_unique<PacketBuffer>());
+        return m_Buffers.back().get();
+    }
+
+    void release(PacketBuffer *buffer) {
+        buffer->dataSize = 0;
+        buffer->isSealed = false;
+        m_FreeBuffers.push_back(buffer);
+    }
+
+    size_t getUsedCount() const {
+        return m_Buffers.size() - m_FreeBuffers.size();
+    }
+
+  private:
+    size_t m_MaxBuffers;
+    std::vector<std::unique_ptr<PacketBuffer>> m_Buffers;
+    std::vector<PacketBuffer *> m_FreeBuffers;
+};
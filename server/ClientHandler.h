@@ -1,115 +1,357 @@
 #pragma once
 
+#include "EgressScheduler.h"
+#include "FastPathWrapper.h"
+#include "ForwardErrorCorrection.h"
+#include "HandshakeGuard.h"
+#include "HandshakeWorkerPool.h"
+#include "HeaderCompression.h"
 #include "Log.h"
+#include "PacketCoalescer.h"
+#include "PacketCompressor.h"
 #include "PacketHandler.h"
-#include "ServerSocketWrapper.h"
-#include "TunInterfaceWrapper.h"
+#include "ServerSocket.h"
+#include "StageLatency.h"
+#include "StatsSegment.h"
+#include "TokenBucket.h"
+#include "Tracing.h"
+#include "TunInterface.h"
+#include "TunnelCipher.h"
+#include "Utils.h"
 #include "VpnSettings.h"
 #include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
 #include <chrono>
 #include <netinet/in.h>
+#include <openssl/crypto.h>
+#include <string>
+#include <tuple>
+
+struct ClientCounters {
+    uint64_t droppedFromClient = 0;
+    uint64_t droppedFromTun = 0;
+    uint64_t invalidFromClient = 0;
+    uint64_t recoveredFromClient = 0;
+    EgressQueueCounters egressQueue;
+};
+
+struct ClientOptions {
+    std::optional<TokenBucket> rateLimiter;
+    uint16_t egressWeight = 1;
+    TunnelCipher::Algorithm encryptionAlgorithm =
+        TunnelCipher::Algorithm::ChaCha20Poly1305;
+    // Only set when the client asked for compression in its hello
+    PacketCompressor *compressor = nullptr;
+    // Only set when the client asked for coalescing in its hello
+    bool coalescing = false;
+    // Only set when the client asked for FEC in its hello
+    bool fec = false;
+    // Only set when the client asked for header compression in its hello
+    bool headerCompression = false;
+    // Only set when the client asked for roaming in its hello
+    std::optional<uint32_t> sessionId;
+    // Where the client's counters are published, if it has a free slot
+    StatsSegment *stats = nullptr;
+    // Only set when the client's datagrams carry bare IPv4 packets, which
+    // the kernel can forward once the client is connected
+    FastPathWrapper *fastPath = nullptr;
+    // The client's own connected socket, used instead of the shared one
+    std::shared_ptr<ServerSocket> connectedSocket;
+};
 
 class ClientHandler {
   public:
-    ClientHandler(const ServerSocketWrapper &serverSocket,
+    // Clients that roam prefix every datagram with (10, session ID)
+    constexpr static uint8_t sessionMessageType = 10;
+    constexpr static size_t sessionHeaderSize = 5;
+
+    ClientHandler(const ServerSocket &serverSocket,
                   const sockaddr_in6 &clientExternalAddress,
-                  const TunInterfaceWrapper &tunInterface,
+                  const TunInterface &tunInterface,
                   const VpnSettings &vpnSettings,
-                  std::optional<PacketHandler> &packetHandler)
-        : m_ServerSocket(serverSocket),
+                  std::optional<PacketHandler> &packetHandler,
+                  std::optional<EgressScheduler> &egressScheduler,
+                  const ClientOptions &options)
+        : m_ServerSocket(options.connectedSocket ? *options.connectedSocket
+                                                 : serverSocket),
+          m_ConnectedSocket(options.connectedSocket),
           m_ClientExternalAddress(clientExternalAddress),
           m_TunInterface(tunInterface), m_VpnSettings(vpnSettings),
-          m_PacketHandler(packetHandler) {}
+          m_PacketHandler(packetHandler),
+          m_ClientRateLimiter(options.rateLimiter),
+          m_TunRateLimiter(options.rateLimiter),
+          m_EgressScheduler(egressScheduler),
+          m_EncryptionAlgorithm(options.encryptionAlgorithm),
+          m_Compressor(options.compressor), m_SessionId(options.sessionId),
+          m_StatsSegment(options.stats), m_FastPath(options.fastPath) {
+        if (m_StatsSegment != nullptr) {
+            m_Stats = m_StatsSegment->acquireClient(
+                m_VpnSettings.clientAddress.toInt());
+        }
+        if (m_Stats == nullptr) {
+            m_Stats = &m_PrivateStats;
+        }
+        if (m_EgressScheduler.has_value()) {
+            m_EgressQueue = m_EgressScheduler->createQueue(
+                m_ClientExternalAddress, options.egressWeight);
+        }
+        if (options.headerCompression) {
+            m_HeaderCompressor.emplace();
+            m_HeaderDecompressor.emplace();
+        }
+        if (options.fec) {
+            m_FecEncoder.emplace();
+            m_FecDecoder.emplace();
+        }
+        if (options.coalescing) {
+            // Leave room for the FEC header in the client's MTU
+            m_Coalescer.emplace(m_VpnSettings.mtu -
+                                    (options.fec
+                                         ? ForwardErrorCorrection::headerSize
+                                         : 0),
+                                TunnelCipher::overhead);
+        }
+    }
 
+    virtual ~ClientHandler() {
+        if (m_Stats != &m_PrivateStats) {
+            m_StatsSegment->releaseClient(m_Stats);
+        }
+        if (m_EgressQueue) {
+            m_EgressScheduler->closeQueue(*m_EgressQueue);
+        }
+    }
+
+    // Encrypted datagrams are decrypted in place, so the buffer is modified
     template <std::size_t BUFFER_SIZE>
-    void handleDataFromClient(const std::array<uint8_t, BUFFER_SIZE> &buffer,
-                              size_t dataSize) {
-        m_LastMessageTimestamp = std::chrono::steady_clock::now();
+    void handleDataFromClient(
+        std::array<uint8_t, BUFFER_SIZE> &buffer, size_t dataSize,
+        const std::chrono::steady_clock::time_point &now) {
         switch (m_State) {
         case State::START: {
-            if (dataSize < 2 || buffer[0] != 0) {
-                break;
-            }
-
-            std::string secret(buffer.begin() + 1, buffer.begin() + dataSize);
-            if (secret != m_VpnSettings.secret) {
-                TOYVPN_LOG_ERROR("Got the wrong secret: '" << secret << "'");
-                m_State = State::ERROR;
-                break;
-            }
-
-            auto params = m_VpnSettings.toParamString();
-            TOYVPN_LOG_DEBUG("Sending params to client: '" << params << "'");
-            std::vector<uint8_t> paramsMessage;
-            paramsMessage.push_back(0);
-            paramsMessage.insert(paramsMessage.end(), params.begin(),
-                                 params.end());
-            auto bytesSent =
-                m_ServerSocket.send(paramsMessage, m_ClientExternalAddress);
-            if (bytesSent == -1) {
-                m_State = State::ERROR;
-            } else {
-                m_State = State::CONNECTED;
-
-                std::array<uint8_t, 16> ipv6AddressBytes;
-                std::copy(std::begin(m_ClientExternalAddress.sin6_addr.s6_addr),
-                          std::end(m_ClientExternalAddress.sin6_addr.s6_addr),
-                          ipv6AddressBytes.begin());
+            m_LastMessageTimestamp = now;
+            handleHello(buffer.data(), dataSize);
+            break;
+        }
+        case State::CONNECTED: {
+            uint8_t *message = buffer.data();
+            if (m_Cipher) {
+                if (isHelloRetransmission(message, dataSize)) {
+                    // The response got lost, the session keys are the same
+                    m_ServerSocket.send(m_KeyExchangeResponse,
+                                        m_ClientExternalAddress);
+                    break;
+                }
 
-                TOYVPN_LOG_INFO(
-                    "New client connected! External address: ("
-                    << pcpp::IPv6Address(ipv6AddressBytes).toString() << ","
-                    << m_ClientExternalAddress.sin6_port << ")"
-                    << ", Internal address: " << m_VpnSettings.clientAddress);
+                if (!openDatagram(message, dataSize)) {
+                    break;
+                }
             }
+
+            handleDatagram(message, dataSize, buffer.data() + BUFFER_SIZE,
+                           now);
             break;
         }
-        case State::CONNECTED: {
-            // Got a control packet
-            if (dataSize == 1 && buffer[0] == 0) {
-                break;
+        default: {
+        }
+        }
+    }
+
+    // Handles a datagram of a session, (10, session ID, encrypted datagram),
+    // which may come from a new address after the client roamed. Returns true
+    // if the session moved to that address.
+    template <std::size_t BUFFER_SIZE>
+    bool handleSessionDataFromClient(
+        std::array<uint8_t, BUFFER_SIZE> &buffer, size_t dataSize,
+        const sockaddr_in6 &clientExternalAddress,
+        const std::chrono::steady_clock::time_point &now) {
+        if (m_State != State::CONNECTED || !m_SessionId.has_value() ||
+            dataSize < sessionHeaderSize + TunnelCipher::overhead) {
+            return false;
+        }
+
+        uint8_t *message = buffer.data() + sessionHeaderSize;
+        dataSize -= sessionHeaderSize;
+        auto counter = TunnelCipher::getCounter(message);
+        if (!openDatagram(message, dataSize)) {
+            return false;
+        }
+
+        // Only the newest authenticated datagram moves the session, so a
+        // replayed or late one from the old address can't move it back
+        bool hasMoved = !sockaddrIn6Equal()(clientExternalAddress,
+                                            m_ClientExternalAddress) &&
+                        counter == m_Cipher->getHighestOpenedCounter();
+        if (hasMoved) {
+            auto previousAddress = formatExternalAddress();
+            m_ClientExternalAddress = clientExternalAddress;
+            if (m_EgressQueue) {
+                m_EgressQueue->setDestination(clientExternalAddress);
             }
+            if (m_FastPath != nullptr) {
+                m_FastPath->moveSession(m_VpnSettings.clientAddress,
+                                        clientExternalAddress);
+            }
+            TOYVPN_LOG_INFO("Client " << m_VpnSettings.clientAddress
+                                      << " moved from " << previousAddress
+                                      << " to " << formatExternalAddress());
+            TOYVPN_TRACE(ClientMoved, 'i',
+                         m_VpnSettings.clientAddress.toInt());
+        }
 
-            if (dataSize == 11 && buffer[0] == 0) {
-                std::string message(buffer.begin() + 1,
-                                    buffer.begin() + dataSize);
-                if (message == m_DisconnectMessage) {
-                    m_State = State::DISCONNECTED;
+        handleDatagram(message, dataSize, buffer.data() + BUFFER_SIZE, now);
+        return hasMoved;
+    }
 
-                    if (m_PacketHandler.has_value()) {
-                        m_PacketHandler->clientDisconnected(
-                            m_VpnSettings.clientAddress);
-                    }
+    // Encrypted datagrams are encrypted in place, so the buffer is modified.
+    // With coalescing the packet may only be sent by flushPendingPackets().
+    template <std::size_t BUFFER_SIZE>
+    void handleDataFromTun(std::array<uint8_t, BUFFER_SIZE> &buffer,
+                           size_t dataSize,
+                           const std::chrono::steady_clock::time_point &now) {
+        if (m_State != State::CONNECTED) {
+            return;
+        }
 
-                    TOYVPN_LOG_INFO(
-                        "Client disconnected: " << m_VpnSettings.clientAddress);
-                    break;
+        if (m_TunRateLimiter.has_value() &&
+            !m_TunRateLimiter->consume(dataSize, now)) {
+            m_Stats->droppedFromTun.add();
+            return;
+        }
+
+        m_Stats->packetsToClient.add();
+        m_Stats->bytesToClient.add(dataSize);
+
+        if (m_PacketHandler.has_value()) {
+            TOYVPN_TIMED(CaptureEnqueue, m_PacketHandler->handlePacket(
+                                             m_VpnSettings.clientAddress,
+                                             buffer, dataSize));
+        }
+
+        if (m_EgressQueue) {
+            if (!m_EgressScheduler->enqueue(m_EgressQueue, buffer.data(),
+                                            dataSize, now)) {
+                m_Stats->droppedFromTun.add();
+            }
+        } else if (m_Cipher) {
+            uint8_t *message = buffer.data();
+            if (m_Compressor != nullptr && 2 * dataSize <= BUFFER_SIZE) {
+                // Compress into the free space after the packet
+                auto compressedSize = m_Compressor->compress(
+                    buffer.data(), dataSize, buffer.data() + dataSize);
+                if (compressedSize != 0) {
+                    message = buffer.data() + dataSize;
+                    dataSize = compressedSize;
                 }
             }
 
-            m_TunInterface.send(buffer, dataSize);
+            // Packets LZ4 didn't compress may still have their headers
+            // compressed
+            if (message == buffer.data() && m_HeaderCompressor.has_value() &&
+                2 * dataSize + HeaderCompressor::maxExpansion <= BUFFER_SIZE) {
+                auto compressedSize = m_HeaderCompressor->compress(
+                    buffer.data(), dataSize, buffer.data() + dataSize);
+                if (compressedSize != 0) {
+                    message = buffer.data() + dataSize;
+                    dataSize = compressedSize;
+                }
+            }
 
-            if (m_PacketHandler.has_value()) {
-                m_PacketHandler->handlePacket(m_VpnSettings.clientAddress,
-                                              buffer, dataSize);
+            if (m_Coalescer.has_value()) {
+                if (!m_Coalescer->canAdd(dataSize)) {
+                    flushCoalescer();
+                }
+                if (m_Coalescer->canAdd(dataSize)) {
+                    m_Coalescer->add(message, dataSize);
+                    return;
+                }
             }
 
-            break;
-        }
-        default: {
+            if (message + dataSize + TunnelCipher::overhead >
+                buffer.data() + BUFFER_SIZE) {
+                m_Stats->droppedFromTun.add();
+                return;
+            }
+            sendPayload(message, dataSize);
+        } else {
+            TOYVPN_TIMED(SocketSend, m_ServerSocket.send(
+                                         buffer, dataSize,
+                                         m_ClientExternalAddress));
         }
+    }
+
+    // Coalesced packets, or an FEC group that didn't get its parity yet
+    bool hasPendingPackets() const {
+        return (m_Coalescer.has_value() && !m_Coalescer->isEmpty()) ||
+               (m_FecEncoder.has_value() && m_FecEncoder->hasOpenGroup());
+    }
+
+    // Sends the coalesced packets and the parity of the open FEC group, so
+    // the last packets of a burst are protected too
+    void flushPendingPackets() {
+        flushCoalescer();
+        if (m_FecEncoder.has_value() && m_FecEncoder->hasOpenGroup()) {
+            auto [parity, paritySize] = m_FecEncoder->takeParity();
+            if (m_State == State::CONNECTED) {
+                sealAndSend(parity, paritySize);
+            }
         }
     }
 
-    template <std::size_t BUFFER_SIZE>
-    void handleDataFromTun(const std::array<uint8_t, BUFFER_SIZE> &buffer,
-                           size_t dataSize) {
-        m_ServerSocket.send(buffer, dataSize, m_ClientExternalAddress);
+    // Sets up the session of an encrypted hello once the worker pool has
+    // done the key exchange, and answers with
+    // (3, server nonce, server public key, algorithm, features,
+    //  encrypted params)
+    void completeKeyExchange(const KeyExchangeResult &result,
+                             const std::chrono::steady_clock::time_point &now) {
+        m_LastMessageTimestamp = now;
+        m_ClientNonce = result.clientNonce;
+        m_Cipher = std::make_shared<TunnelCipher>(m_EncryptionAlgorithm,
+                                                  result.keys.serverToClient,
+                                                  result.keys.clientToServer);
+        if (m_EgressQueue) {
+            m_EgressQueue->setCipher(m_Cipher);
+            m_EgressQueue->setCompressor(m_Compressor);
+        }
 
-        if (m_PacketHandler.has_value()) {
-            m_PacketHandler->handlePacket(m_VpnSettings.clientAddress, buffer,
-                                          dataSize);
+        auto params = m_VpnSettings.toParamString();
+        TOYVPN_LOG_DEBUG("Sending encrypted params to client: '" << params
+                                                                 << "'");
+        auto &response = m_KeyExchangeResponse;
+        response.push_back(m_EncryptedParamsMessageType);
+        response.insert(response.end(), result.serverNonce.begin(),
+                        result.serverNonce.end());
+        response.insert(response.end(), result.serverPublicKey.begin(),
+                        result.serverPublicKey.end());
+        response.push_back(static_cast<uint8_t>(m_Cipher->getAlgorithm()));
+        response.push_back(
+            (m_Compressor != nullptr ? HelloMessage::compressionFeature : 0) |
+            (m_Coalescer.has_value() ? HelloMessage::coalescingFeature : 0) |
+            (m_FecEncoder.has_value() ? HelloMessage::fecFeature : 0) |
+            (m_HeaderCompressor.has_value()
+                 ? HelloMessage::headerCompressionFeature
+                 : 0) |
+            (m_SessionId.has_value() ? HelloMessage::roamingFeature : 0));
+        if (m_SessionId.has_value()) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                response.push_back(m_SessionId.value() >> shift);
+            }
+        }
+
+        auto sealedOffset = response.size();
+        response.push_back(m_ControlMessageType);
+        response.insert(response.end(), params.begin(), params.end());
+        response.resize(response.size() + TunnelCipher::overhead);
+        auto sealedSize =
+            m_Cipher->seal(response.data() + sealedOffset, params.size() + 1);
+        response.resize(sealedOffset + sealedSize);
+
+        if (m_ServerSocket.send(response, m_ClientExternalAddress) == -1) {
+            setState(State::ERROR);
+            return;
         }
+
+        setState(State::CONNECTED);
+        logConnected();
     }
 
     void disconnect() {
@@ -117,16 +359,12 @@ class ClientHandler {
             return;
         }
 
-        std::vector<uint8_t> disconnectMessage;
-        disconnectMessage.push_back(0);
-        disconnectMessage.insert(disconnectMessage.end(),
-                                 m_DisconnectMessage.begin(),
-                                 m_DisconnectMessage.end());
+        flushPendingPackets();
         for (int i = 0; i < 3; i++) {
-            m_ServerSocket.send(disconnectMessage, m_ClientExternalAddress);
+            sendControlMessage(m_DisconnectMessage);
         }
 
-        m_State = State::DISCONNECTED;
+        setState(State::DISCONNECTED);
 
         if (m_PacketHandler.has_value()) {
             m_PacketHandler->clientDisconnected(m_VpnSettings.clientAddress);
@@ -139,6 +377,62 @@ class ClientHandler {
         return m_VpnSettings.clientAddress;
     }
 
+    const sockaddr_in6 &getClientExternalAddress() const {
+        return m_ClientExternalAddress;
+    }
+
+    std::optional<uint32_t> getSessionId() const { return m_SessionId; }
+
+    // Null when the client shares the server socket
+    const ServerSocket *getConnectedSocket() const {
+        return m_ConnectedSocket.get();
+    }
+
+    ClientCounters getCounters() const {
+        ClientCounters counters;
+        counters.droppedFromClient = m_Stats->droppedFromClient.get();
+        counters.droppedFromTun = m_Stats->droppedFromTun.get();
+        counters.invalidFromClient = m_Stats->invalidFromClient.get();
+        counters.recoveredFromClient = m_Stats->recoveredFromClient.get();
+        if (m_EgressQueue) {
+            counters.egressQueue = m_EgressQueue->getCounters();
+        }
+        return counters;
+    }
+
+    // A client that went away without saying goodbye may come back with its
+    // resumption token
+    bool isResumable() const {
+        return m_State == State::CONNECTED &&
+               m_VpnSettings.resumptionToken.has_value();
+    }
+
+    // Packets the fast path forwards never reach the client handler, so its
+    // counters are added to the client's and count as activity
+    void updateFromFastPath(const std::chrono::steady_clock::time_point &now) {
+        if (m_FastPath == nullptr || m_State != State::CONNECTED) {
+            return;
+        }
+
+        auto counters = m_FastPath->getCounters(m_VpnSettings.clientAddress);
+        if (!counters.has_value()) {
+            return;
+        }
+        if (counters->packetsFromClient !=
+            m_FastPathCounters.packetsFromClient) {
+            m_LastMessageTimestamp = now;
+        }
+        m_Stats->packetsFromClient.add(counters->packetsFromClient -
+                                       m_FastPathCounters.packetsFromClient);
+        m_Stats->bytesFromClient.add(counters->bytesFromClient -
+                                     m_FastPathCounters.bytesFromClient);
+        m_Stats->packetsToClient.add(counters->packetsToClient -
+                                     m_FastPathCounters.packetsToClient);
+        m_Stats->bytesToClient.add(counters->bytesToClient -
+                                   m_FastPathCounters.bytesToClient);
+        m_FastPathCounters = counters.value();
+    }
+
     bool isIdle(const std::chrono::steady_clock::time_point &now) {
         return m_State == State::DISCONNECTED ||
                now - m_LastMessageTimestamp > m_ClientIdleTimeoutSec;
@@ -147,16 +441,332 @@ class ClientHandler {
   private:
     enum class State { START, CONNECTED, DISCONNECTED, ERROR };
 
+    constexpr static uint8_t m_ControlMessageType = 0;
+    constexpr static uint8_t m_EncryptedParamsMessageType = 3;
     constexpr static std::string_view m_DisconnectMessage = "DISCONNECT";
     constexpr static std::chrono::duration m_ClientIdleTimeoutSec =
         std::chrono::seconds(60);
 
-    const ServerSocketWrapper &m_ServerSocket;
-    const TunInterfaceWrapper &m_TunInterface;
+    const ServerSocket &m_ServerSocket;
+    std::shared_ptr<ServerSocket> m_ConnectedSocket;
+    const TunInterface &m_TunInterface;
     std::optional<PacketHandler> &m_PacketHandler;
     int m_BufferSize;
     State m_State = State::START;
     sockaddr_in6 m_ClientExternalAddress;
     VpnSettings m_VpnSettings;
     std::chrono::steady_clock::time_point m_LastMessageTimestamp;
+    std::optional<TokenBucket> m_ClientRateLimiter;
+    std::optional<TokenBucket> m_TunRateLimiter;
+    std::optional<EgressScheduler> &m_EgressScheduler;
+    std::shared_ptr<EgressQueue> m_EgressQueue;
+    TunnelCipher::Algorithm m_EncryptionAlgorithm;
+    std::shared_ptr<TunnelCipher> m_Cipher;
+    PacketCompressor *m_Compressor;
+    std::optional<uint32_t> m_SessionId;
+    std::optional<PacketCoalescer> m_Coalescer;
+    std::optional<HeaderCompressor> m_HeaderCompressor;
+    std::optional<HeaderDecompressor> m_HeaderDecompressor;
+    std::optional<FecEncoder> m_FecEncoder;
+    std::optional<FecDecoder> m_FecDecoder;
+    LossEstimator m_LossEstimator;
+    std::array<uint8_t, HelloMessage::nonceSize> m_ClientNonce;
+    std::vector<uint8_t> m_KeyExchangeResponse;
+    StatsSegment *m_StatsSegment;
+    ClientStats m_PrivateStats;
+    ClientStats *m_Stats = nullptr;
+    FastPathWrapper *m_FastPath;
+    FastPathCounters m_FastPathCounters;
+
+    // Every change of state is a trace event
+    void setState(State state) {
+        m_State = state;
+        switch (state) {
+        case State::CONNECTED:
+            TOYVPN_TRACE(ClientConnected, 'i',
+                         m_VpnSettings.clientAddress.toInt());
+            if (m_FastPath != nullptr) {
+                m_FastPath->addSession(m_VpnSettings.clientAddress,
+                                       m_ClientExternalAddress);
+            }
+            break;
+        case State::DISCONNECTED:
+            TOYVPN_TRACE(ClientDisconnected, 'i',
+                         m_VpnSettings.clientAddress.toInt());
+            break;
+        case State::ERROR:
+            TOYVPN_TRACE(ClientFailed, 'i',
+                         m_VpnSettings.clientAddress.toInt());
+            break;
+        case State::START:
+            break;
+        }
+    }
+
+    void handleHello(const uint8_t *data, size_t dataSize) {
+        // Encrypted hellos are handled by completeKeyExchange
+        auto hello = HandshakeGuard::parseHello(data, dataSize);
+        if (!hello.has_value() ||
+            hello->type != HelloMessage::Type::Plaintext) {
+            return;
+        }
+
+        // Anyone can send hellos from the client's address, so one with the
+        // wrong secret is dropped without failing the session, and the
+        // secret it guessed isn't logged
+        const auto &secret = m_VpnSettings.secret;
+        if (hello->secret.size() != secret.size() ||
+            CRYPTO_memcmp(hello->secret.data(), secret.data(),
+                          secret.size()) != 0) {
+            TOYVPN_LOG_DEBUG("Dropped a hello with the wrong secret");
+            return;
+        }
+
+        auto params = m_VpnSettings.toParamString();
+        TOYVPN_LOG_DEBUG("Sending params to client: '" << params << "'");
+        std::vector<uint8_t> paramsMessage;
+        paramsMessage.push_back(m_ControlMessageType);
+        paramsMessage.insert(paramsMessage.end(), params.begin(),
+                             params.end());
+        if (m_ServerSocket.send(paramsMessage, m_ClientExternalAddress) ==
+            -1) {
+            setState(State::ERROR);
+            return;
+        }
+
+        setState(State::CONNECTED);
+        logConnected();
+    }
+
+    std::string formatExternalAddress() const {
+        std::array<uint8_t, 16> ipv6AddressBytes;
+        std::copy(std::begin(m_ClientExternalAddress.sin6_addr.s6_addr),
+                  std::end(m_ClientExternalAddress.sin6_addr.s6_addr),
+                  ipv6AddressBytes.begin());
+
+        return "(" + pcpp::IPv6Address(ipv6AddressBytes).toString() + "," +
+               std::to_string(m_ClientExternalAddress.sin6_port) + ")";
+    }
+
+    void logConnected() const {
+        TOYVPN_LOG_INFO("New client connected! External address: "
+                        << formatExternalAddress() << ", Internal address: "
+                        << m_VpnSettings.clientAddress
+                        << (m_Cipher ? ", encrypted" : ""));
+    }
+
+    // Opens an encrypted datagram in place, message and dataSize are updated
+    // to the plaintext
+    bool openDatagram(uint8_t *&message, size_t &dataSize) {
+        auto plaintextSize =
+            TOYVPN_TIMED(Open, m_Cipher->open(message, dataSize));
+        if (!plaintextSize.has_value()) {
+            m_Stats->invalidFromClient.add();
+            return false;
+        }
+
+        message += TunnelCipher::headerSize;
+        dataSize = plaintextSize.value();
+        if (m_FecEncoder.has_value()) {
+            updateFecGroupSize();
+        }
+        return true;
+    }
+
+    // Handles a datagram from the client, decrypted if it was encrypted, with
+    // free space after it up to bufferEnd
+    void handleDatagram(uint8_t *message, size_t dataSize, uint8_t *bufferEnd,
+                        const std::chrono::steady_clock::time_point &now) {
+        m_LastMessageTimestamp = now;
+
+        // Decompressed packets go to the free space after the message
+        auto freeSpace = message + dataSize;
+        size_t freeSpaceSize = bufferEnd - freeSpace;
+
+        if (m_FecDecoder.has_value() && dataSize > 0) {
+            std::optional<ForwardErrorCorrection::Payload> payload;
+            if (message[0] == ForwardErrorCorrection::dataMessageType) {
+                // Duplicates of a recovered message are dropped here
+                payload = m_FecDecoder->receiveData(message, dataSize);
+                if (!payload.has_value()) {
+                    return;
+                }
+            } else if (message[0] ==
+                       ForwardErrorCorrection::parityMessageType) {
+                payload = m_FecDecoder->receiveParity(message, dataSize);
+                if (!payload.has_value()) {
+                    return;
+                }
+                m_Stats->recoveredFromClient.add();
+            }
+            if (payload.has_value()) {
+                std::tie(message, dataSize) = payload.value();
+            }
+        }
+
+        if (m_Coalescer.has_value() && dataSize > 0 &&
+            message[0] == PacketCoalescer::messageType) {
+            bool isValid = PacketCoalescer::forEachFrame(
+                message, dataSize, [&](const uint8_t *frame, size_t frameSize) {
+                    handleTunnelMessage(frame, frameSize, freeSpace,
+                                        freeSpaceSize, now);
+                });
+            if (!isValid) {
+                m_Stats->invalidFromClient.add();
+            }
+        } else {
+            handleTunnelMessage(message, dataSize, freeSpace, freeSpaceSize,
+                                now);
+        }
+    }
+
+    bool isHelloRetransmission(const uint8_t *data, size_t dataSize) const {
+        if (data[0] == TunnelCipher::messageType) {
+            return false;
+        }
+
+        auto hello = HandshakeGuard::parseHello(data, dataSize);
+        return hello.has_value() &&
+               hello->type == HelloMessage::Type::Encrypted &&
+               std::equal(m_ClientNonce.begin(), m_ClientNonce.end(),
+                          hello->nonce);
+    }
+
+    // Handles one message of a decrypted datagram, which may be compressed or
+    // have its headers compressed
+    void handleTunnelMessage(const uint8_t *message, size_t messageSize,
+                             uint8_t *freeSpace, size_t freeSpaceSize,
+                             const std::chrono::steady_clock::time_point &now) {
+        if (m_State != State::CONNECTED) {
+            return;
+        }
+
+        if (m_Compressor != nullptr && messageSize > 0 &&
+            message[0] == PacketCompressor::messageType) {
+            auto packetSize = PacketCompressor::decompress(
+                message, messageSize, freeSpace, freeSpaceSize);
+            if (!packetSize.has_value()) {
+                m_Stats->invalidFromClient.add();
+                return;
+            }
+            message = freeSpace;
+            messageSize = packetSize.value();
+        } else if (m_HeaderDecompressor.has_value() && messageSize > 0 &&
+                   (message[0] == HeaderCompression::compressedMessageType ||
+                    message[0] == HeaderCompression::contextMessageType)) {
+            auto packetSize = m_HeaderDecompressor->decompress(
+                message, messageSize, freeSpace, freeSpaceSize);
+            if (!packetSize.has_value()) {
+                m_Stats->invalidFromClient.add();
+                return;
+            }
+            message = freeSpace;
+            messageSize = packetSize.value();
+        }
+
+        handleMessageFromClient(message, messageSize, now);
+    }
+
+    void handleMessageFromClient(
+        const uint8_t *data, size_t dataSize,
+        const std::chrono::steady_clock::time_point &now) {
+        // Got a control packet
+        if (dataSize == 1 && data[0] == m_ControlMessageType) {
+            return;
+        }
+
+        if (dataSize == 11 && data[0] == m_ControlMessageType) {
+            std::string_view message(reinterpret_cast<const char *>(data + 1),
+                                     dataSize - 1);
+            if (message == m_DisconnectMessage) {
+                setState(State::DISCONNECTED);
+
+                if (m_PacketHandler.has_value()) {
+                    m_PacketHandler->clientDisconnected(
+                        m_VpnSettings.clientAddress);
+                }
+
+                TOYVPN_LOG_INFO(
+                    "Client disconnected: " << m_VpnSettings.clientAddress);
+                return;
+            }
+        }
+
+        if (m_ClientRateLimiter.has_value() &&
+            !m_ClientRateLimiter->consume(dataSize, now)) {
+            m_Stats->droppedFromClient.add();
+            return;
+        }
+
+        TOYVPN_TIMED(TunSend, m_TunInterface.send(data, dataSize));
+        m_Stats->packetsFromClient.add();
+        m_Stats->bytesFromClient.add(dataSize);
+
+        if (m_PacketHandler.has_value()) {
+            TOYVPN_TIMED(CaptureEnqueue, m_PacketHandler->handlePacket(
+                                             m_VpnSettings.clientAddress,
+                                             data, dataSize));
+        }
+    }
+
+    void flushCoalescer() {
+        if (!m_Coalescer.has_value() || m_Coalescer->isEmpty()) {
+            return;
+        }
+
+        auto [payload, payloadSize] = m_Coalescer->take();
+        if (m_State == State::CONNECTED) {
+            sendPayload(payload, payloadSize);
+        }
+    }
+
+    // Sends a payload that has room for the cipher overhead after it, behind
+    // an FEC header if the client asked for FEC. The parity of a group goes
+    // out right after its last message.
+    void sendPayload(uint8_t *payload, size_t payloadSize) {
+        if (!m_FecEncoder.has_value() ||
+            !m_FecEncoder->canProtect(payloadSize)) {
+            sealAndSend(payload, payloadSize);
+            return;
+        }
+
+        auto [message, messageSize] =
+            m_FecEncoder->protect(payload, payloadSize);
+        sealAndSend(message, messageSize);
+        if (m_FecEncoder->isGroupComplete()) {
+            auto [parity, paritySize] = m_FecEncoder->takeParity();
+            sealAndSend(parity, paritySize);
+        }
+    }
+
+    void sealAndSend(uint8_t *payload, size_t payloadSize) {
+        auto sealedSize =
+            TOYVPN_TIMED(Seal, m_Cipher->seal(payload, payloadSize));
+        TOYVPN_TIMED(SocketSend, m_ServerSocket.send(payload, sealedSize,
+                                                     m_ClientExternalAddress));
+    }
+
+    // The client has no way to report the loss it sees, so the redundancy
+    // to the client follows the loss measured on the datagrams from it
+    void updateFecGroupSize() {
+        m_LossEstimator.onReceived(m_Cipher->getHighestOpenedCounter());
+        auto lossRate = m_LossEstimator.getLossRate();
+        m_FecEncoder->setGroupSize(
+            ForwardErrorCorrection::getGroupSize(lossRate));
+    }
+
+    void sendControlMessage(const std::string_view &message) {
+        std::vector<uint8_t> controlMessage;
+        controlMessage.push_back(m_ControlMessageType);
+        controlMessage.insert(controlMessage.end(), message.begin(),
+                              message.end());
+        if (m_Cipher) {
+            auto plaintextSize = controlMessage.size();
+            controlMessage.resize(plaintextSize + TunnelCipher::overhead);
+            controlMessage.resize(
+                m_Cipher->seal(controlMessage.data(), plaintextSize));
+        }
+
+        m_ServerSocket.send(controlMessage, m_ClientExternalAddress);
+    }
 };
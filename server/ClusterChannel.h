@@ -0,0 +1,643 @@
+#pragma once
+
+#include "Log.h"
+#include "Utils.h"
+#include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// The UDP channel between the servers of an active-active cluster behind one
+// address. Every node tells its peers which sessions it owns, so a node that
+// gets a client's datagram or a packet for a client's VPN address it doesn't
+// own hands it to the owner.
+//
+// Nodes send a heartbeat every heartbeatInterval with the number of sessions
+// they own. A node that joins, restarts or whose count doesn't match what a
+// peer knows twice in a row is asked for all its sessions again, so lost
+// updates heal without acknowledgements. A node that misses
+// m_MissedHeartbeats is forgotten with its sessions.
+//
+// Every message ends with an HMAC keyed from the shared secret, and only
+// messages from the configured peers that carry a valid one are handled.
+// Apart from heartbeats they also have to come from a peer that is alive,
+// under the node index its heartbeats gave. The channel isn't encrypted or
+// protected from replays, so it still belongs on a private network.
+class ClusterChannel {
+  public:
+    using DatagramCallback = std::function<void(
+        const sockaddr_in6 &clientAddress, const uint8_t *data,
+        size_t dataSize)>;
+    using TunPacketCallback =
+        std::function<void(const uint8_t *data, size_t dataSize)>;
+
+    // The node index is the top byte of session IDs
+    constexpr static size_t maxNodes = 64;
+    constexpr static std::chrono::duration heartbeatInterval =
+        std::chrono::seconds(1);
+
+    ClusterChannel(const DatagramCallback &onDatagram,
+                   const TunPacketCallback &onTunPacket)
+        : m_OnDatagram(onDatagram), m_OnTunPacket(onTunPacket) {}
+
+    virtual ~ClusterChannel() {
+        if (m_Socket != -1) {
+            close(m_Socket);
+        }
+    }
+
+    void init(uint8_t nodeIndex, const in6_addr &bindAddress, uint16_t port,
+              const std::vector<sockaddr_in6> &peers,
+              const std::string &secret) {
+        m_NodeIndex = nodeIndex;
+        for (const auto &address : peers) {
+            Peer peer;
+            peer.address = address;
+            m_Peers.push_back(peer);
+        }
+        if (RAND_bytes(reinterpret_cast<uint8_t *>(&m_Generation),
+                       sizeof(m_Generation)) != 1) {
+            throw std::runtime_error("Couldn't generate a cluster generation");
+        }
+        initMac(secret);
+
+        m_Socket = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (m_Socket < 0) {
+            throw std::runtime_error("Couldn't create the cluster socket");
+        }
+        int flag = 0;
+        setsockopt(m_Socket, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+
+        sockaddr_in6 address;
+        memset(&address, 0, sizeof(address));
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = bindAddress;
+        address.sin6_port = htons(port);
+        if (bind(m_Socket, reinterpret_cast<sockaddr *>(&address),
+                 sizeof(address)) < 0) {
+            std::array<char, 256> buffer;
+            throw std::runtime_error(
+                "Couldn't bind the cluster socket: " +
+                std::string(strerror_r(errno, buffer.data(), buffer.size())));
+        }
+
+        TOYVPN_LOG_INFO("Node " << int(nodeIndex) << " of a cluster of "
+                                << m_Peers.size() + 1
+                                << ", talking to peers on UDP port " << port);
+    }
+
+    int getSocketFd() const { return m_Socket; }
+
+    uint8_t getNodeIndex() const { return m_NodeIndex; }
+
+    // address:port, with IPv6 addresses in brackets
+    static std::optional<sockaddr_in6> parsePeer(const std::string &peer) {
+        auto separator = peer.rfind(':');
+        if (separator == std::string::npos) {
+            return std::nullopt;
+        }
+        auto host = peer.substr(0, separator);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        sockaddr_in6 address;
+        memset(&address, 0, sizeof(address));
+        address.sin6_family = AF_INET6;
+        auto hostAddress = parseAddress(host);
+        if (!hostAddress.has_value()) {
+            return std::nullopt;
+        }
+        address.sin6_addr = hostAddress.value();
+
+        int port = 0;
+        try {
+            port = std::stoi(peer.substr(separator + 1));
+        } catch (const std::exception &) {
+            return std::nullopt;
+        }
+        if (port < 1 || port > UINT16_MAX) {
+            return std::nullopt;
+        }
+        address.sin6_port = htons(port);
+        return address;
+    }
+
+    // An IPv4 address is mapped into IPv6, like the peers of the dual-stack
+    // socket appear
+    static std::optional<in6_addr> parseAddress(const std::string &host) {
+        in6_addr address{};
+        in_addr ipv4Address;
+        if (inet_pton(AF_INET, host.c_str(), &ipv4Address) == 1) {
+            address.s6_addr[10] = 0xff;
+            address.s6_addr[11] = 0xff;
+            memcpy(&address.s6_addr[12], &ipv4Address, sizeof(ipv4Address));
+        } else if (inet_pton(AF_INET6, host.c_str(), &address) != 1) {
+            return std::nullopt;
+        }
+        return address;
+    }
+
+    // Every node allocates client addresses from its own slice of the
+    // private network, so no two nodes ever hand out the same address
+    static pcpp::IPv4Network
+    getAddressPartition(const pcpp::IPv4Network &network, uint8_t nodeIndex,
+                        size_t nodeCount) {
+        int partitionBits = 0;
+        while ((size_t(1) << partitionBits) < nodeCount) {
+            partitionBits++;
+        }
+        int prefixLen = network.getPrefixLen() + partitionBits;
+        if (prefixLen > m_MaxPartitionPrefixLen) {
+            throw std::invalid_argument(
+                "Private network is too small for " +
+                std::to_string(nodeCount) + " nodes, the partitions' prefix "
+                "length would be " + std::to_string(prefixLen));
+        }
+
+        uint32_t first =
+            ntohl(network.getNetworkPrefix().toInt()) +
+            (uint32_t(nodeIndex) << (32 - prefixLen));
+        return pcpp::IPv4Network(pcpp::IPv4Address(htonl(first)), prefixLen);
+    }
+
+    void announceSession(const pcpp::IPv4Address &vpnAddress,
+                         const sockaddr_in6 &clientAddress) {
+        m_LocalSessions[vpnAddress.toInt()] = clientAddress;
+        SessionEntry entry{vpnAddress.toInt(), clientAddress};
+        for (const auto &peer : m_Peers) {
+            if (peer.isAlive) {
+                sendSessions(peer, MessageType::SessionUp, &entry, 1);
+            }
+        }
+    }
+
+    void withdrawSession(const pcpp::IPv4Address &vpnAddress,
+                         const sockaddr_in6 &clientAddress) {
+        m_LocalSessions.erase(vpnAddress.toInt());
+        SessionEntry entry{vpnAddress.toInt(), clientAddress};
+        for (const auto &peer : m_Peers) {
+            if (peer.isAlive) {
+                sendSessions(peer, MessageType::SessionDown, &entry, 1);
+            }
+        }
+    }
+
+    std::optional<uint8_t>
+    findClientOwner(const sockaddr_in6 &clientAddress) const {
+        auto it = m_RemoteClients.find(clientAddress);
+        if (it == m_RemoteClients.end()) {
+            return std::nullopt;
+        }
+        return m_RemoteSessions.at(it->second).node;
+    }
+
+    std::optional<uint8_t>
+    findAddressOwner(const pcpp::IPv4Address &vpnAddress) const {
+        auto it = m_RemoteSessions.find(vpnAddress.toInt());
+        if (it == m_RemoteSessions.end()) {
+            return std::nullopt;
+        }
+        return it->second.node;
+    }
+
+    // Returns false if the node isn't reachable
+    bool forwardDatagram(uint8_t node, const sockaddr_in6 &clientAddress,
+                         const uint8_t *data, size_t dataSize) {
+        auto peer = findPeer(node);
+        if (peer == nullptr) {
+            return false;
+        }
+        std::array<uint8_t, m_HeaderSize + m_EndpointSize> header;
+        writeHeader(header.data(), MessageType::ClientDatagram);
+        writeEndpoint(header.data() + m_HeaderSize, clientAddress);
+        return send(*peer, header.data(), header.size(), data, dataSize);
+    }
+
+    bool forwardTunPacket(uint8_t node, const uint8_t *data,
+                          size_t dataSize) {
+        auto peer = findPeer(node);
+        if (peer == nullptr) {
+            return false;
+        }
+        std::array<uint8_t, m_HeaderSize> header;
+        writeHeader(header.data(), MessageType::TunPacket);
+        return send(*peer, header.data(), header.size(), data, dataSize);
+    }
+
+    // Called every heartbeatInterval
+    void tick(const std::chrono::steady_clock::time_point &now) {
+        std::array<uint8_t, m_HeaderSize + 8> heartbeat;
+        writeHeader(heartbeat.data(), MessageType::Heartbeat);
+        writeUint32(heartbeat.data() + m_HeaderSize, m_Generation);
+        writeUint32(heartbeat.data() + m_HeaderSize + 4,
+                    m_LocalSessions.size());
+        for (auto &peer : m_Peers) {
+            send(peer, heartbeat.data(), heartbeat.size(), nullptr, 0);
+            if (peer.isAlive &&
+                now - peer.lastHeartbeat >
+                    heartbeatInterval * m_MissedHeartbeats) {
+                TOYVPN_LOG_INFO("Cluster node "
+                                << int(peer.nodeIndex.value())
+                                << " stopped responding");
+                forgetPeer(peer);
+            }
+        }
+    }
+
+    // Tells the peers to forget this node's sessions right away
+    void leave() {
+        std::array<uint8_t, m_HeaderSize> message;
+        writeHeader(message.data(), MessageType::Leave);
+        for (const auto &peer : m_Peers) {
+            send(peer, message.data(), message.size(), nullptr, 0);
+        }
+    }
+
+    // Handles one message, like the server socket one datagram per wakeup
+    void receive(const std::chrono::steady_clock::time_point &now) {
+        sockaddr_in6 source;
+        auto sourceLen = static_cast<socklen_t>(sizeof(source));
+        auto size = recvfrom(m_Socket, m_Buffer.data(), m_Buffer.size(), 0,
+                             reinterpret_cast<sockaddr *>(&source),
+                             &sourceLen);
+        if (size < static_cast<ssize_t>(m_HeaderSize + m_TagSize)) {
+            return;
+        }
+
+        auto peer = std::find_if(m_Peers.begin(), m_Peers.end(),
+                                 [&source](const Peer &peer) {
+                                     return sockaddrIn6Equal()(peer.address,
+                                                               source);
+                                 });
+        if (peer == m_Peers.end()) {
+            TOYVPN_LOG_DEBUG("Ignoring a cluster message from an unknown "
+                             "peer");
+            return;
+        }
+
+        size_t signedSize = size - m_TagSize;
+        Tag expected;
+        if (!createTag(m_Buffer.data(), signedSize, nullptr, 0, expected) ||
+            CRYPTO_memcmp(expected.data(), m_Buffer.data() + signedSize,
+                          m_TagSize) != 0) {
+            TOYVPN_LOG_DEBUG("Ignoring a cluster message that failed "
+                             "authentication");
+            return;
+        }
+
+        // A heartbeat is how a peer becomes alive and tells its node index
+        auto type = static_cast<MessageType>(m_Buffer[0]);
+        uint8_t node = m_Buffer[1];
+        if (node >= maxNodes || node == m_NodeIndex ||
+            (type != MessageType::Heartbeat &&
+             (!peer->isAlive || peer->nodeIndex != node))) {
+            TOYVPN_LOG_DEBUG("Ignoring a cluster message from a peer that "
+                             "isn't alive or as another node");
+            return;
+        }
+
+        const uint8_t *payload = m_Buffer.data() + m_HeaderSize;
+        size_t payloadSize = signedSize - m_HeaderSize;
+        switch (type) {
+        case MessageType::Heartbeat:
+            if (payloadSize >= 8) {
+                handleHeartbeat(*peer, node, readUint32(payload),
+                                readUint32(payload + 4), now);
+            }
+            break;
+        case MessageType::SyncRequest:
+            sendAllSessions(*peer);
+            break;
+        case MessageType::SessionUp:
+        case MessageType::SessionDown:
+            for (size_t offset = 0;
+                 offset + m_SessionEntrySize <= payloadSize;
+                 offset += m_SessionEntrySize) {
+                auto vpnAddress = readUint32(payload + offset);
+                auto clientAddress = readEndpoint(payload + offset + 4);
+                if (m_Buffer[0] ==
+                    static_cast<uint8_t>(MessageType::SessionUp)) {
+                    addRemoteSession(node, vpnAddress, clientAddress);
+                } else {
+                    removeRemoteSession(node, vpnAddress);
+                }
+            }
+            break;
+        case MessageType::ClientDatagram:
+            if (payloadSize > m_EndpointSize) {
+                m_OnDatagram(readEndpoint(payload), payload + m_EndpointSize,
+                             payloadSize - m_EndpointSize);
+            }
+            break;
+        case MessageType::TunPacket:
+            m_OnTunPacket(payload, payloadSize);
+            break;
+        case MessageType::Leave:
+            TOYVPN_LOG_INFO("Cluster node " << int(node)
+                                            << " left the cluster");
+            forgetPeer(*peer);
+            break;
+        }
+    }
+
+  private:
+    enum class MessageType : uint8_t {
+        Heartbeat = 0,
+        SyncRequest = 1,
+        SessionUp = 2,
+        SessionDown = 3,
+        ClientDatagram = 4,
+        TunPacket = 5,
+        Leave = 6,
+    };
+
+    struct Peer {
+        sockaddr_in6 address;
+        // Learned from its heartbeats
+        std::optional<uint8_t> nodeIndex;
+        uint32_t generation = 0;
+        bool isAlive = false;
+        std::chrono::steady_clock::time_point lastHeartbeat;
+        int mismatchedHeartbeats = 0;
+    };
+
+    struct SessionEntry {
+        uint32_t vpnAddress;
+        sockaddr_in6 clientAddress;
+    };
+
+    struct RemoteSession {
+        uint8_t node;
+        sockaddr_in6 clientAddress;
+    };
+
+    // A truncated HMAC-SHA256 over the header and payload
+    using Tag = std::array<uint8_t, 16>;
+
+    // Type and sender node
+    constexpr static size_t m_HeaderSize = 2;
+    constexpr static size_t m_TagSize = std::tuple_size<Tag>::value;
+    constexpr static std::string_view m_KeyLabel = "ToyVpn cluster";
+    // IPv6 address and port
+    constexpr static size_t m_EndpointSize = 18;
+    constexpr static size_t m_SessionEntrySize = 4 + m_EndpointSize;
+    // Keeps session updates in one unfragmented datagram
+    constexpr static size_t m_MaxSessionsPerMessage =
+        (1200 - m_HeaderSize - m_TagSize) / m_SessionEntrySize;
+    constexpr static int m_MissedHeartbeats = 3;
+    constexpr static int m_MaxPartitionPrefixLen = 30;
+
+    DatagramCallback m_OnDatagram;
+    TunPacketCallback m_OnTunPacket;
+    // Keyed once, so every message only hashes its own bytes
+    std::unique_ptr<EVP_MAC_CTX, decltype(&EVP_MAC_CTX_free)> m_Mac{
+        nullptr, EVP_MAC_CTX_free};
+    int m_Socket = -1;
+    uint8_t m_NodeIndex = 0;
+    // Tells the peers when this node restarted and lost its sessions
+    uint32_t m_Generation = 0;
+    std::vector<Peer> m_Peers;
+    std::unordered_map<uint32_t, sockaddr_in6> m_LocalSessions;
+    std::unordered_map<uint32_t, RemoteSession> m_RemoteSessions;
+    // The VPN address of the remote session each client address belongs to
+    std::unordered_map<sockaddr_in6, uint32_t, sockaddrIn6Hash,
+                       sockaddrIn6Equal>
+        m_RemoteClients;
+    std::array<uint32_t, maxNodes> m_RemoteSessionCounts{};
+    std::array<uint8_t, 65536> m_Buffer;
+
+    void handleHeartbeat(Peer &peer, uint8_t node, uint32_t generation,
+                         uint32_t sessionCount,
+                         const std::chrono::steady_clock::time_point &now) {
+        peer.lastHeartbeat = now;
+        if (!peer.isAlive || peer.generation != generation ||
+            peer.nodeIndex != node) {
+            forgetPeer(peer);
+            peer.nodeIndex = node;
+            peer.generation = generation;
+            peer.isAlive = true;
+            TOYVPN_LOG_INFO("Cluster node " << int(node) << " joined");
+            requestSync(peer);
+        } else if (sessionCount != m_RemoteSessionCounts[node]) {
+            if (++peer.mismatchedHeartbeats >= 2) {
+                TOYVPN_LOG_DEBUG("Resynchronizing the sessions of cluster node "
+                                 << int(node));
+                forgetSessions(node);
+                requestSync(peer);
+            }
+        } else {
+            peer.mismatchedHeartbeats = 0;
+        }
+    }
+
+    void requestSync(Peer &peer) {
+        peer.mismatchedHeartbeats = 0;
+        std::array<uint8_t, m_HeaderSize> message;
+        writeHeader(message.data(), MessageType::SyncRequest);
+        send(peer, message.data(), message.size(), nullptr, 0);
+    }
+
+    void sendAllSessions(const Peer &peer) {
+        std::vector<SessionEntry> entries;
+        entries.reserve(m_LocalSessions.size());
+        for (const auto &[vpnAddress, clientAddress] : m_LocalSessions) {
+            entries.push_back({vpnAddress, clientAddress});
+        }
+        for (size_t first = 0; first < entries.size();
+             first += m_MaxSessionsPerMessage) {
+            sendSessions(peer, MessageType::SessionUp, &entries[first],
+                         std::min(m_MaxSessionsPerMessage,
+                                  entries.size() - first));
+        }
+    }
+
+    void sendSessions(const Peer &peer, MessageType type,
+                      const SessionEntry *entries, size_t count) {
+        std::array<uint8_t, m_HeaderSize +
+                                m_MaxSessionsPerMessage * m_SessionEntrySize>
+            message;
+        writeHeader(message.data(), type);
+        uint8_t *entry = message.data() + m_HeaderSize;
+        for (size_t i = 0; i < count; i++) {
+            writeUint32(entry, entries[i].vpnAddress);
+            writeEndpoint(entry + 4, entries[i].clientAddress);
+            entry += m_SessionEntrySize;
+        }
+        send(peer, message.data(), entry - message.data(), nullptr, 0);
+    }
+
+    void addRemoteSession(uint8_t node, uint32_t vpnAddress,
+                          const sockaddr_in6 &clientAddress) {
+        // A client that roamed is announced again from its new address, and
+        // an address that moved to another node by that node
+        if (auto it = m_RemoteSessions.find(vpnAddress);
+            it != m_RemoteSessions.end()) {
+            removeRemoteSession(it->second.node, vpnAddress);
+        }
+        m_RemoteSessions[vpnAddress] = RemoteSession{node, clientAddress};
+        // Takes the client address from a session that hasn't been
+        // withdrawn yet, which keeps its VPN address
+        m_RemoteClients[clientAddress] = vpnAddress;
+        m_RemoteSessionCounts[node]++;
+    }
+
+    void removeRemoteSession(uint8_t node, uint32_t vpnAddress) {
+        auto it = m_RemoteSessions.find(vpnAddress);
+        if (it == m_RemoteSessions.end() || it->second.node != node) {
+            return;
+        }
+        eraseRemoteClient(it->second.clientAddress, vpnAddress);
+        m_RemoteSessions.erase(it);
+        m_RemoteSessionCounts[node]--;
+    }
+
+    // Another session may have taken the client address since
+    void eraseRemoteClient(const sockaddr_in6 &clientAddress,
+                           uint32_t vpnAddress) {
+        if (auto client = m_RemoteClients.find(clientAddress);
+            client != m_RemoteClients.end() && client->second == vpnAddress) {
+            m_RemoteClients.erase(client);
+        }
+    }
+
+    void forgetPeer(Peer &peer) {
+        if (peer.nodeIndex.has_value()) {
+            forgetSessions(peer.nodeIndex.value());
+        }
+        peer.isAlive = false;
+    }
+
+    void forgetSessions(uint8_t node) {
+        for (auto it = m_RemoteSessions.begin();
+             it != m_RemoteSessions.end();) {
+            if (it->second.node == node) {
+                eraseRemoteClient(it->second.clientAddress, it->first);
+                it = m_RemoteSessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        m_RemoteSessionCounts[node] = 0;
+    }
+
+    const Peer *findPeer(uint8_t node) const {
+        for (const auto &peer : m_Peers) {
+            if (peer.isAlive && peer.nodeIndex == node) {
+                return &peer;
+            }
+        }
+        return nullptr;
+    }
+
+    // The key is HMAC-SHA256(secret, label), so the cluster doesn't use the
+    // secret the clients prove they know directly
+    void initMac(const std::string &secret) {
+        std::array<uint8_t, EVP_MAX_MD_SIZE> key;
+        unsigned int keyLength = 0;
+        HMAC(EVP_sha256(), secret.data(), secret.size(),
+             reinterpret_cast<const uint8_t *>(m_KeyLabel.data()),
+             m_KeyLabel.size(), key.data(), &keyLength);
+
+        std::unique_ptr<EVP_MAC, decltype(&EVP_MAC_free)> mac(
+            EVP_MAC_fetch(nullptr, "HMAC", nullptr), EVP_MAC_free);
+        if (mac) {
+            m_Mac.reset(EVP_MAC_CTX_new(mac.get()));
+        }
+        std::array<OSSL_PARAM, 2> params{
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                             const_cast<char *>("SHA256"), 0),
+            OSSL_PARAM_construct_end()};
+        if (!m_Mac ||
+            EVP_MAC_init(m_Mac.get(), key.data(), keyLength, params.data()) !=
+                1) {
+            throw std::runtime_error("Couldn't create the cluster HMAC");
+        }
+    }
+
+    bool createTag(const uint8_t *header, size_t headerSize,
+                   const uint8_t *payload, size_t payloadSize,
+                   Tag &tag) const {
+        std::array<uint8_t, EVP_MAX_MD_SIZE> mac;
+        size_t macLength = 0;
+        // Initializing without a key starts over with the same key
+        if (EVP_MAC_init(m_Mac.get(), nullptr, 0, nullptr) != 1 ||
+            EVP_MAC_update(m_Mac.get(), header, headerSize) != 1 ||
+            (payloadSize > 0 &&
+             EVP_MAC_update(m_Mac.get(), payload, payloadSize) != 1) ||
+            EVP_MAC_final(m_Mac.get(), mac.data(), &macLength, mac.size()) !=
+                1) {
+            return false;
+        }
+        std::copy(mac.begin(), mac.begin() + tag.size(), tag.begin());
+        return true;
+    }
+
+    // The payload is sent from where it is, without copying it behind the
+    // header, and the tag after it
+    bool send(const Peer &peer, const uint8_t *header, size_t headerSize,
+              const uint8_t *payload, size_t payloadSize) const {
+        Tag tag;
+        if (!createTag(header, headerSize, payload, payloadSize, tag)) {
+            return false;
+        }
+        std::array<iovec, 3> iovecs{
+            iovec{const_cast<uint8_t *>(header), headerSize},
+            iovec{const_cast<uint8_t *>(payload), payloadSize},
+            iovec{tag.data(), tag.size()}};
+        msghdr message{};
+        message.msg_name = const_cast<sockaddr_in6 *>(&peer.address);
+        message.msg_namelen = sizeof(peer.address);
+        message.msg_iov = iovecs.data();
+        message.msg_iovlen = iovecs.size();
+        return sendmsg(m_Socket, &message, MSG_DONTWAIT) >= 0;
+    }
+
+    void writeHeader(uint8_t *data, MessageType type) const {
+        data[0] = static_cast<uint8_t>(type);
+        data[1] = m_NodeIndex;
+    }
+
+    static void writeUint32(uint8_t *data, uint32_t value) {
+        value = htonl(value);
+        memcpy(data, &value, sizeof(value));
+    }
+
+    static uint32_t readUint32(const uint8_t *data) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return ntohl(value);
+    }
+
+    static void writeEndpoint(uint8_t *data, const sockaddr_in6 &address) {
+        memcpy(data, &address.sin6_addr, sizeof(address.sin6_addr));
+        memcpy(data + 16, &address.sin6_port, sizeof(address.sin6_port));
+    }
+
+    static sockaddr_in6 readEndpoint(const uint8_t *data) {
+        sockaddr_in6 address;
+        memset(&address, 0, sizeof(address));
+        address.sin6_family = AF_INET6;
+        memcpy(&address.sin6_addr, data, sizeof(address.sin6_addr));
+        memcpy(&address.sin6_port, data + 16, sizeof(address.sin6_port));
+        return address;
+    }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Controlled Delay active queue management (RFC 8289). shouldDrop() is
+// called for every packet leaving the queue with the time it spent there,
+// and tells whether the packet should be dropped (or ECN-marked) to keep the
+// standing queue below the target delay.
+class CoDel {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    bool shouldDrop(const Clock::duration &sojournTime,
+                    const Clock::time_point &now, size_t queueBytes) {
+        bool okToDrop = isAboveTarget(sojournTime, now, queueBytes);
+
+        if (m_IsDropping) {
+            if (!okToDrop) {
+                m_IsDropping = false;
+                return false;
+            }
+
+            if (now >= m_DropNext) {
+                m_Count++;
+                m_DropNext = controlLaw(m_DropNext);
+                return true;
+            }
+
+            return false;
+        }
+
+        if (okToDrop) {
+            m_IsDropping = true;
+
+            // Start from the previous drop rate if the last dropping state
+            // ended recently, the queue is probably still not under control
+            uint32_t delta = m_Count - m_LastCount;
+            m_Count = delta > 1 && now - m_DropNext < 16 * m_Interval ? delta
+                                                                      : 1;
+            m_DropNext = controlLaw(now);
+            m_LastCount = m_Count;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Sets the ECN Congestion Experienced codepoint on an ECN-capable IPv4 or
+    // IPv6 packet. Returns false if the packet isn't ECN-capable.
+    static bool markCongestionExperienced(uint8_t *packet, size_t packetSize) {
+        if (packetSize >= m_IPv4HeaderSize && (packet[0] >> 4) == 4) {
+            uint8_t ecn = packet[1] & 0x03;
+            if (ecn == 0) {
+                return false;
+            }
+
+            // Incremental checksum update (RFC 1624)
+            uint16_t oldWord = (packet[0] << 8) | packet[1];
+            packet[1] |= 0x03;
+            uint16_t newWord = (packet[0] << 8) | packet[1];
+            uint16_t checksum = (packet[10] << 8) | packet[11];
+            uint32_t sum = static_cast<uint16_t>(~checksum) +
+                           static_cast<uint16_t>(~oldWord) + newWord;
+            sum = (sum & 0xffff) + (sum >> 16);
+            sum = (sum & 0xffff) + (sum >> 16);
+            checksum = ~sum;
+            packet[10] = checksum >> 8;
+            packet[11] = checksum & 0xff;
+            return true;
+        }
+
+        if (packetSize >= m_IPv6HeaderSize && (packet[0] >> 4) == 6) {
+            uint8_t ecn = (packet[1] >> 4) & 0x03;
+            if (ecn == 0) {
+                return false;
+            }
+
+            packet[1] |= 0x30;
+            return true;
+        }
+
+        return false;
+    }
+
+  private:
+    constexpr static std::chrono::duration m_Target =
+        std::chrono::milliseconds(5);
+    constexpr static std::chrono::duration m_Interval =
+        std::chrono::milliseconds(100);
+    constexpr static size_t m_MaxPacketSize = 1500;
+    constexpr static size_t m_IPv4HeaderSize = 20;
+    constexpr static size_t m_IPv6HeaderSize = 40;
+
+    Clock::time_point m_FirstAboveTime;
+    Clock::time_point m_DropNext;
+    uint32_t m_Count = 0;
+    uint32_t m_LastCount = 0;
+    bool m_IsDropping = false;
+
+    bool isAboveTarget(const Clock::duration &sojournTime,
+                       const Clock::time_point &now, size_t queueBytes) {
+        if (sojournTime < m_Target || queueBytes <= m_MaxPacketSize) {
+            m_FirstAboveTime = Clock::time_point();
+            return false;
+        }
+
+        if (m_FirstAboveTime == Clock::time_point()) {
+            m_FirstAboveTime = now + m_Interval;
+            return false;
+        }
+
+        return now >= m_FirstAboveTime;
+    }
+
+    Clock::time_point controlLaw(const Clock::time_point &time) const {
+        return time + std::chrono::duration_cast<Clock::duration>(
+                          m_Interval / std::sqrt(m_Count));
+    }
+};
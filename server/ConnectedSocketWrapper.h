@@ -0,0 +1,101 @@
+#pragma once
+
+#include "Log.h"
+#include "ServerSocket.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A socket of its own for one client, bound to the server port and connected
+// to the client's address. The kernel hands it the client's datagrams
+// without the shared socket's queue, and sends skip the route and address
+// lookups of sendto().
+class ConnectedSocketWrapper : public ServerSocket {
+  public:
+    using ServerSocket::receive;
+    using ServerSocket::send;
+
+    virtual ~ConnectedSocketWrapper() {
+        if (m_Socket != -1) {
+            close(m_Socket);
+        }
+    }
+
+    // Not SO_REUSEPORT, the socket would join the group of the shared
+    // socket and be picked for other clients' datagrams. SO_REUSEADDR is
+    // enough to bind next to it, and the kernel prefers the connected
+    // socket for the client's datagrams.
+    void init(uint16_t port, const sockaddr_in6 &clientAddress) {
+        m_Socket = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (m_Socket < 0) {
+            throw std::runtime_error("Couldn't create a client socket: " +
+                                     getError());
+        }
+
+        int flag = 1;
+        setsockopt(m_Socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        flag = 0;
+        setsockopt(m_Socket, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+
+        sockaddr_in6 serverAddress;
+        memset(&serverAddress, 0, sizeof(serverAddress));
+        serverAddress.sin6_family = AF_INET6;
+        serverAddress.sin6_port = htons(port);
+        if (bind(m_Socket, reinterpret_cast<sockaddr *>(&serverAddress),
+                 sizeof(serverAddress)) < 0 ||
+            connect(m_Socket,
+                    reinterpret_cast<const sockaddr *>(&clientAddress),
+                    sizeof(clientAddress)) < 0) {
+            auto error = getError();
+            close(m_Socket);
+            m_Socket = -1;
+            throw std::runtime_error("Couldn't connect a client socket: " +
+                                     error);
+        }
+    }
+
+    int getSocketFd() const override { return m_Socket; }
+
+    // Other clients' datagrams can arrive between bind() and connect(), so
+    // the source address still matters
+    ssize_t receive(uint8_t *data, size_t dataSize,
+                    sockaddr_in6 &clientAddress) const override {
+        auto clientAddressLen = static_cast<socklen_t>(sizeof(clientAddress));
+        return recvfrom(m_Socket, data, dataSize, 0,
+                        reinterpret_cast<sockaddr *>(&clientAddress),
+                        &clientAddressLen);
+    }
+
+    // Everything goes to the connected client, so the destination is unused
+    int send(const uint8_t *data, size_t dataSize,
+             const sockaddr_in6 &) const override {
+        return ::send(m_Socket, data, dataSize, 0);
+    }
+
+    int sendBatch(const Datagram *datagrams, size_t count) const override {
+        count = std::min(count, maxBatchSize);
+        std::array<mmsghdr, maxBatchSize> messages;
+        std::array<iovec, maxBatchSize> iovecs;
+        for (size_t i = 0; i < count; i++) {
+            iovecs[i].iov_base = const_cast<uint8_t *>(datagrams[i].data);
+            iovecs[i].iov_len = datagrams[i].dataSize;
+            memset(&messages[i], 0, sizeof(mmsghdr));
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        return sendmmsg(m_Socket, messages.data(), count, MSG_DONTWAIT);
+    }
+
+  private:
+    int m_Socket = -1;
+
+    static std::string getError() {
+        std::array<char, 256> buffer;
+        return strerror_r(errno, buffer.data(), buffer.size());
+    }
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "BufferPool.h"
+#include "CoDel.h"
+#include "PacketCompressor.h"
+#include "ServerSocket.h"
+#include "TunnelCipher.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <optional>
+
+struct EgressQueueCounters {
+    uint64_t aqmDropped = 0;
+    uint64_t ecnMarked = 0;
+};
+
+class EgressQueue {
+  public:
+    EgressQueue(const sockaddr_in6 &destination, uint32_t quantum,
+                bool codelEnabled)
+        : m_Destination(destination), m_Quantum(quantum) {
+        if (codelEnabled) {
+            m_CoDel.emplace();
+        }
+    }
+
+    size_t getLength() const { return m_Packets.size(); }
+
+    const EgressQueueCounters &getCounters() const { return m_Counters; }
+
+    // Packets are encrypted with the cipher right before they are sent
+    void setCipher(const std::shared_ptr<TunnelCipher> &cipher) {
+        m_Cipher = cipher;
+    }
+
+    // Packets that are already queued go to the new destination too
+    void setDestination(const sockaddr_in6 &destination) {
+        m_Destination = destination;
+    }
+
+    // Packets are compressed right before they are encrypted
+    void setCompressor(PacketCompressor *compressor) {
+        m_Compressor = compressor;
+    }
+
+  private:
+    friend class EgressScheduler;
+
+    std::deque<PacketBuffer *> m_Packets;
+    size_t m_Bytes = 0;
+    sockaddr_in6 m_Destination;
+    uint32_t m_Quantum;
+    int64_t m_Deficit = 0;
+    bool m_IsActive = false;
+    bool m_IsTurnInProgress = false;
+    std::optional<CoDel> m_CoDel;
+    std::shared_ptr<TunnelCipher> m_Cipher;
+    PacketCompressor *m_Compressor = nullptr;
+    EgressQueueCounters m_Counters;
+};
+
+// Schedules packets from the TUN interface to clients using deficit round
+// robin. Every client has its own queue of pooled buffers, and in every round
+// a queue may send up to its quantum (proportional to the client's weight) in
+// bytes. Packets are sent in batches and draining stops when the socket send
+// buffer is full, so the order in which clients are served is decided here
+// and not by arrival order. When CoDel is enabled every queue also drops or
+// ECN-marks packets that have been waiting for too long. Packets of encrypted
+// sessions are compressed and sealed when they are scheduled, after CoDel has
+// seen them.
+class EgressScheduler {
+  public:
+    using Datagram = ServerSocket::Datagram;
+    using SendBatchFunction = std::function<int(const Datagram *, size_t)>;
+
+    EgressScheduler(const SendBatchFunction &sendBatch, bool codelEnabled)
+        : m_SendBatch(sendBatch), m_CoDelEnabled(codelEnabled),
+          m_BufferPool(m_MaxBufferedPackets) {}
+
+    std::shared_ptr<EgressQueue> createQueue(const sockaddr_in6 &destination,
+                                             uint16_t weight) {
+        return std::make_shared<EgressQueue>(
+            destination, m_BaseQuantum * weight, m_CoDelEnabled);
+    }
+
+    void closeQueue(EgressQueue &queue) {
+        for (auto buffer : queue.m_Packets) {
+            m_BufferPool.release(buffer);
+        }
+        queue.m_Packets.clear();
+        queue.m_Bytes = 0;
+    }
+
+    bool enqueue(const std::shared_ptr<EgressQueue> &queue, const uint8_t *data,
+                 size_t dataSize,
+                 const std::chrono::steady_clock::time_point &now) {
+        auto overhead = queue->m_Cipher ? TunnelCipher::overhead : 0;
+        if (queue->m_Packets.size() >= m_MaxQueueLength ||
+            dataSize + overhead > PacketBuffer::capacity) {
+            return false;
+        }
+
+        auto buffer = m_BufferPool.acquire();
+        if (buffer == nullptr) {
+            return false;
+        }
+
+        std::copy(data, data + dataSize, buffer->data.begin());
+        buffer->dataSize = dataSize;
+        buffer->timestamp = now;
+        queue->m_Packets.push_back(buffer);
+        queue->m_Bytes += dataSize;
+
+        if (!queue->m_IsActive) {
+            queue->m_IsActive = true;
+            queue->m_Deficit = 0;
+            m_ActiveQueues.push_back(queue);
+        }
+
+        return true;
+    }
+
+    // Packets in all the queues, including the ones of a batch in flight
+    size_t getQueuedPacketCount() const { return m_BufferPool.getUsedCount(); }
+
+    // Sends queued packets until the queues are empty or the socket is full.
+    // Returns true if packets are still waiting to be sent.
+    bool drain(const std::chrono::steady_clock::time_point &now) {
+        while (!m_ActiveQueues.empty()) {
+            size_t batchSize = 0;
+            while (batchSize < m_BatchSize && !m_ActiveQueues.empty()) {
+                batchSize = schedule(batchSize, now);
+            }
+
+            if (batchSize == 0) {
+                break;
+            }
+
+            auto sent = m_SendBatch(m_Batch.data(), batchSize);
+            if (sent < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    // Drop the datagram that failed and carry on
+                    sent = 1;
+                } else {
+                    sent = 0;
+                }
+            }
+
+            for (size_t i = 0; i < static_cast<size_t>(sent); i++) {
+                m_BufferPool.release(m_BatchBuffers[i].second);
+                m_BatchBuffers[i].first.reset();
+            }
+
+            if (static_cast<size_t>(sent) < batchSize) {
+                requeue(sent, batchSize);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+  private:
+    constexpr static size_t m_MaxBufferedPackets = 8192;
+    constexpr static size_t m_MaxQueueLength = 256;
+    constexpr static size_t m_BatchSize = ServerSocket::maxBatchSize;
+    constexpr static uint32_t m_BaseQuantum = 1500;
+
+    SendBatchFunction m_SendBatch;
+    bool m_CoDelEnabled;
+    BufferPool m_BufferPool;
+    std::deque<std::shared_ptr<EgressQueue>> m_ActiveQueues;
+    std::array<Datagram, m_BatchSize> m_Batch;
+    std::array<std::pair<std::shared_ptr<EgressQueue>, PacketBuffer *>,
+               m_BatchSize>
+        m_BatchBuffers;
+    std::array<uint8_t, PacketBuffer::capacity> m_CompressionBuffer;
+
+    // Gives the queue at the head of the active list its turn, adding its
+    // packets to the batch while it has a positive deficit
+    size_t schedule(size_t batchSize,
+                    const std::chrono::steady_clock::time_point &now) {
+        auto queue = m_ActiveQueues.front();
+        m_ActiveQueues.pop_front();
+
+        if (!queue->m_IsTurnInProgress) {
+            queue->m_Deficit += queue->m_Quantum;
+        }
+        queue->m_IsTurnInProgress = false;
+
+        while (queue->m_Deficit > 0 && batchSize < m_BatchSize) {
+            auto buffer = dequeue(*queue, now);
+            if (buffer == nullptr) {
+                break;
+            }
+
+            queue->m_Deficit -= buffer->dataSize;
+            if (queue->m_Cipher && !buffer->isSealed) {
+                seal(*queue, buffer);
+                if (!buffer->isSealed) {
+                    m_BufferPool.release(buffer);
+                    continue;
+                }
+            }
+            m_Batch[batchSize] = {buffer->data.data(), buffer->dataSize,
+                                  &queue->m_Destination};
+            m_BatchBuffers[batchSize] = {queue, buffer};
+            batchSize++;
+        }
+
+        if (queue->m_Packets.empty()) {
+            queue->m_IsActive = false;
+            queue->m_Deficit = 0;
+        } else if (queue->m_Deficit > 0) {
+            // The batch is full but the queue's turn isn't over yet
+            queue->m_IsTurnInProgress = true;
+            m_ActiveQueues.push_front(queue);
+        } else {
+            m_ActiveQueues.push_back(queue);
+        }
+
+        return batchSize;
+    }
+
+    void seal(EgressQueue &queue, PacketBuffer *buffer) {
+        if (queue.m_Compressor != nullptr) {
+            auto compressedSize = queue.m_Compressor->compress(
+                buffer->data.data(), buffer->dataSize,
+                m_CompressionBuffer.data());
+            if (compressedSize != 0) {
+                std::copy(m_CompressionBuffer.begin(),
+                          m_CompressionBuffer.begin() + compressedSize,
+                          buffer->data.begin());
+                buffer->dataSize = compressedSize;
+            }
+        }
+
+        auto sealedSize =
+            queue.m_Cipher->seal(buffer->data.data(), buffer->dataSize);
+        buffer->isSealed = sealedSize != 0;
+        buffer->dataSize = sealedSize;
+    }
+
+    PacketBuffer *dequeue(EgressQueue &queue,
+                          const std::chrono::steady_clock::time_point &now) {
+        while (!queue.m_Packets.empty()) {
+            auto buffer = queue.m_Packets.front();
+            queue.m_Packets.pop_front();
+            queue.m_Bytes -= buffer->dataSize;
+
+            // Packets requeued after a partial send are already encrypted
+            if (buffer->isSealed || !queue.m_CoDel.has_value() ||
+                !queue.m_CoDel->shouldDrop(now - buffer->timestamp, now,
+                                           queue.m_Bytes)) {
+                return buffer;
+            }
+
+            if (CoDel::markCongestionExperienced(buffer->data.data(),
+                                                 buffer->dataSize)) {
+                queue.m_Counters.ecnMarked++;
+                return buffer;
+            }
+
+            queue.m_Counters.aqmDropped++;
+            m_BufferPool.release(buffer);
+        }
+
+        return nullptr;
+    }
+
+    // Puts packets that couldn't be sent back at the head of their queues
+    void requeue(size_t from, size_t to) {
+        for (size_t i = to; i > from; i--) {
+            auto &[queue, buffer] = m_BatchBuffers[i - 1];
+            queue->m_Packets.push_front(buffer);
+            queue->m_Bytes += buffer->dataSize;
+            queue->m_Deficit += buffer->dataSize;
+            if (!queue->m_IsActive) {
+                queue->m_IsActive = true;
+                queue->m_IsTurnInProgress = true;
+                m_ActiveQueues.push_front(queue);
+            }
+            queue.reset();
+        }
+    }
+};
@@ -1,13 +1,16 @@
 #pragma once
 
+#include "Tracing.h"
+#include <chrono>
 #include <functional>
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 
 class EPollWrapper {
   public:
-    using EPollCallback = std::function<void(int)>;
+    using EPollCallback = std::function<void(int, uint32_t)>;
 
     virtual ~EPollWrapper() {
         if (m_EPollFd != -1) {
@@ -24,23 +27,45 @@ class EPollWrapper {
         m_MaxEvents = maxEvents;
     }
 
-    void add(int fd, const EPollCallback &callback) {
+    void add(int fd, const EPollCallback &callback,
+             uint32_t events = EPOLLIN) {
         if (m_EPollFd == -1) {
             throw std::runtime_error(
                 "Instance not initialized, please call init()!");
         }
 
         struct epoll_event event;
-        event.events = EPOLLIN;
+        event.events = events;
         event.data.fd = fd;
         if (epoll_ctl(m_EPollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
             throw std::runtime_error("Error adding fd to epoll!");
         }
 
         m_FdToCallbackMap[event.data.fd] = callback;
+        // The number of a descriptor removed in this batch can be reused
+        m_RemovedFds.erase(fd);
     }
 
-    void remove(int fd) { m_FdToCallbackMap.erase(fd); }
+    void modify(int fd, uint32_t events) {
+        struct epoll_event event;
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(m_EPollFd, EPOLL_CTL_MOD, fd, &event) == -1) {
+            throw std::runtime_error("Error modifying fd in epoll!");
+        }
+    }
+
+    // Safe from a callback, even the fd's own. The callback is kept until
+    // the end of the batch and isn't called for the rest of it.
+    void remove(int fd) {
+        epoll_ctl(m_EPollFd, EPOLL_CTL_DEL, fd, nullptr);
+        m_RemovedFds.insert(fd);
+    }
+
+    // Called after all the callbacks of one wakeup have run
+    void setBatchEndCallback(const std::function<void()> &callback) {
+        m_BatchEndCallback = callback;
+    }
 
     void startPolling() {
         if (m_IsPolling) {
@@ -57,16 +82,41 @@ class EPollWrapper {
                 if (!m_IsPolling) {
                     return;
                 }
+                // A signal, like the one asking for a latency dump
+                if (errno == EINTR) {
+                    continue;
+                }
                 m_IsPolling = false;
                 throw std::runtime_error("Error with epoll_wait!");
             }
 
+            m_LoopTime = std::chrono::steady_clock::now();
+            TOYVPN_TRACE(EpollWakeup, 'B', numEvents);
+
             for (int i = 0; i < numEvents; ++i) {
-                m_FdToCallbackMap[events[i].data.fd](events[i].data.fd);
+                if (m_RemovedFds.count(events[i].data.fd) != 0) {
+                    continue;
+                }
+                m_FdToCallbackMap[events[i].data.fd](events[i].data.fd,
+                                                     events[i].events);
+            }
+            for (int fd : m_RemovedFds) {
+                m_FdToCallbackMap.erase(fd);
             }
+            m_RemovedFds.clear();
+
+            if (m_BatchEndCallback) {
+                m_BatchEndCallback();
+            }
+            TOYVPN_TRACE(EpollWakeup, 'E', numEvents);
         }
     }
 
+    // The time of the last wakeup, shared by all callbacks of the same batch
+    const std::chrono::steady_clock::time_point &getLoopTime() const {
+        return m_LoopTime;
+    }
+
     void stopPolling() {
         m_IsPolling = false;
         close(m_EPollFd);
@@ -76,5 +126,8 @@ class EPollWrapper {
     int m_EPollFd = -1;
     int m_MaxEvents = -1;
     std::unordered_map<int, EPollCallback> m_FdToCallbackMap;
+    std::unordered_set<int> m_RemovedFds;
+    std::function<void()> m_BatchEndCallback;
     bool m_IsPolling = false;
+    std::chrono::steady_clock::time_point m_LoopTime;
 };
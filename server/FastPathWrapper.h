@@ -0,0 +1,223 @@
+#pragma once
+
+#include "BpfMap.h"
+#include "Log.h"
+#include "bpf/FastPathMaps.h"
+#include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
+#include <arpa/inet.h>
+#include <cstring>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+struct FastPathCounters {
+    uint64_t packetsFromClient = 0;
+    uint64_t bytesFromClient = 0;
+    uint64_t packetsToClient = 0;
+    uint64_t bytesToClient = 0;
+};
+
+// Attaches the programs of bpf/ToyVpnFastPath.bpf.c to the public interface
+// and the TUN device with tc, and tells them which sessions they may forward
+// in the kernel. The programs hand everything else to the server as before.
+class FastPathWrapper {
+  public:
+    virtual ~FastPathWrapper() {
+        if (m_IsInitialized) {
+            detach(m_PublicNetworkInterface, "ingress",
+                   m_IsPublicQdiscCreated);
+            detach(m_TunInterfaceName, "egress", m_IsTunQdiscCreated);
+            removePinnedMaps();
+        }
+    }
+
+    void init(const std::string &objectPath,
+              const std::string &publicNetworkInterface,
+              const std::string &tunInterfaceName, uint16_t port) {
+        m_PublicNetworkInterface = publicNetworkInterface;
+        m_TunInterfaceName = tunInterfaceName;
+
+        FastPathConfig config{};
+        config.publicInterfaceIndex =
+            getInterfaceIndex(publicNetworkInterface);
+        config.tunInterfaceIndex = getInterfaceIndex(tunInterfaceName);
+        config.serverPort = htons(port);
+
+        // Sessions left pinned by a server that didn't exit cleanly would be
+        // forwarded with stale addresses
+        removePinnedMaps();
+        m_IsInitialized = true;
+        m_IsPublicQdiscCreated =
+            attach(publicNetworkInterface, "ingress", objectPath);
+        m_IsTunQdiscCreated = attach(tunInterfaceName, "egress", objectPath);
+
+        m_Clients.open(m_PinDirectory + FAST_PATH_CLIENTS_MAP);
+        m_Sessions.open(m_PinDirectory + FAST_PATH_SESSIONS_MAP);
+        m_Config.open(m_PinDirectory + FAST_PATH_CONFIG_MAP);
+        m_Config.update(uint32_t(0), config);
+
+        TOYVPN_LOG_INFO("Forwarding established sessions in the kernel");
+    }
+
+    // Only clients that send from IPv4 addresses can take the fast path,
+    // the others stay in userspace
+    void addSession(const pcpp::IPv4Address &vpnAddress,
+                    const sockaddr_in6 &clientAddress) {
+        auto endpoint = toEndpoint(clientAddress);
+        if (!endpoint.has_value()) {
+            return;
+        }
+
+        FastPathSession session{};
+        session.client = endpoint.value();
+        uint32_t key = vpnAddress.toInt();
+        m_Sessions.update(key, session);
+        m_Clients.update(endpoint.value(), key);
+        TOYVPN_LOG_DEBUG("Added " << vpnAddress << " to the fast path");
+    }
+
+    // The session is found by its VPN address, so it goes with the address
+    // it was added or moved to whatever the client's address is now
+    void removeSession(const pcpp::IPv4Address &vpnAddress) {
+        uint32_t key = vpnAddress.toInt();
+        FastPathSession session;
+        if (!m_Sessions.lookup(key, session)) {
+            return;
+        }
+
+        eraseClient(session.client, key);
+        m_Sessions.erase(key);
+    }
+
+    // Points the session of a client that roamed at its new address and
+    // keeps its counters, apart from the packets the programs count while
+    // it is rewritten. A client that moves to IPv6 leaves the fast path.
+    void moveSession(const pcpp::IPv4Address &vpnAddress,
+                     const sockaddr_in6 &clientAddress) {
+        uint32_t key = vpnAddress.toInt();
+        FastPathSession session;
+        if (!m_Sessions.lookup(key, session)) {
+            return;
+        }
+
+        eraseClient(session.client, key);
+        auto endpoint = toEndpoint(clientAddress);
+        if (!endpoint.has_value()) {
+            m_Sessions.erase(key);
+            return;
+        }
+
+        session.client = endpoint.value();
+        m_Sessions.update(key, session);
+        m_Clients.update(endpoint.value(), key);
+        TOYVPN_LOG_DEBUG("Moved " << vpnAddress << " on the fast path");
+    }
+
+    // The traffic the programs forwarded for the session since it was added
+    std::optional<FastPathCounters>
+    getCounters(const pcpp::IPv4Address &vpnAddress) const {
+        FastPathSession session;
+        if (!m_Sessions.lookup(vpnAddress.toInt(), session)) {
+            return std::nullopt;
+        }
+
+        FastPathCounters counters;
+        counters.packetsFromClient = session.packetsFromClient;
+        counters.bytesFromClient = session.bytesFromClient;
+        counters.packetsToClient = session.packetsToClient;
+        counters.bytesToClient = session.bytesToClient;
+        return counters;
+    }
+
+  private:
+    // Where tc pins maps declared with LIBBPF_PIN_BY_NAME
+    inline static const std::string m_PinDirectory = "/sys/fs/bpf/tc/globals/";
+    // Our filters are the only ones at this priority, so they can be
+    // removed without touching filters others attached to the same qdisc
+    constexpr static int m_FilterPriority = 49;
+
+    std::string m_PublicNetworkInterface;
+    std::string m_TunInterfaceName;
+    bool m_IsInitialized = false;
+    bool m_IsPublicQdiscCreated = false;
+    bool m_IsTunQdiscCreated = false;
+    BpfMap m_Clients;
+    BpfMap m_Sessions;
+    BpfMap m_Config;
+
+    static uint32_t getInterfaceIndex(const std::string &interfaceName) {
+        auto interfaceIndex = if_nametoindex(interfaceName.c_str());
+        if (interfaceIndex == 0) {
+            throw std::runtime_error("Couldn't find network interface '" +
+                                     interfaceName + "'");
+        }
+        return interfaceIndex;
+    }
+
+    static std::optional<FastPathEndpoint>
+    toEndpoint(const sockaddr_in6 &clientAddress) {
+        if (!IN6_IS_ADDR_V4MAPPED(&clientAddress.sin6_addr)) {
+            return std::nullopt;
+        }
+
+        FastPathEndpoint endpoint{};
+        std::memcpy(&endpoint.address, &clientAddress.sin6_addr.s6_addr[12],
+                    sizeof(endpoint.address));
+        endpoint.port = clientAddress.sin6_port;
+        return endpoint;
+    }
+
+    // Another session may have taken the address since
+    void eraseClient(const FastPathEndpoint &endpoint, uint32_t key) {
+        uint32_t owner;
+        if (m_Clients.lookup(endpoint, owner) && owner == key) {
+            m_Clients.erase(endpoint);
+        }
+    }
+
+    // Returns whether the clsact qdisc had to be created, in which case
+    // detaching removes it together with the filter
+    static bool attach(const std::string &interfaceName,
+                       const std::string &direction,
+                       const std::string &objectPath) {
+        bool isQdiscCreated =
+            std::system(("tc qdisc add dev " + interfaceName +
+                         " clsact 2>/dev/null")
+                            .c_str()) == 0;
+
+        auto command = "tc filter add dev " + interfaceName + " " +
+                       direction + " pref " +
+                       std::to_string(m_FilterPriority) +
+                       " bpf direct-action object-file " + objectPath +
+                       " section tc/" + direction;
+        if (std::system(command.c_str()) != 0) {
+            throw std::runtime_error("Couldn't attach the fast path: '" +
+                                     command + "'");
+        }
+        TOYVPN_LOG_DEBUG("Attached the fast path: '" << command << "'");
+        return isQdiscCreated;
+    }
+
+    static void detach(const std::string &interfaceName,
+                       const std::string &direction, bool isQdiscCreated) {
+        auto command =
+            isQdiscCreated
+                ? "tc qdisc del dev " + interfaceName + " clsact"
+                : "tc filter del dev " + interfaceName + " " + direction +
+                      " pref " + std::to_string(m_FilterPriority);
+        if (std::system((command + " 2>/dev/null").c_str()) != 0) {
+            TOYVPN_LOG_ERROR("Couldn't detach the fast path: '" << command
+                                                                << "'");
+        }
+    }
+
+    static void removePinnedMaps() {
+        for (auto name : {FAST_PATH_CLIENTS_MAP, FAST_PATH_SESSIONS_MAP,
+                          FAST_PATH_CONFIG_MAP}) {
+            unlink((m_PinDirectory + name).c_str());
+        }
+    }
+};
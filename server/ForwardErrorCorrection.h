@@ -0,0 +1,294 @@
+#pragma once
+
+#include "TunnelCipher.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <utility>
+
+// XORs src into dst, 32 bytes at a time so the compiler emits SSE2/AVX2
+// instructions for the bulk of the block
+inline void xorBlock(uint8_t *dst, const uint8_t *src, size_t size) {
+    typedef uint8_t Vector __attribute__((vector_size(32)));
+    size_t i = 0;
+    for (; i + sizeof(Vector) <= size; i += sizeof(Vector)) {
+        Vector a, b;
+        std::memcpy(&a, dst + i, sizeof(a));
+        std::memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        std::memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < size; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// Forward error correction with one XOR parity message per group of up to
+// maxGroupSize data messages, which is enough to recover any single loss in
+// the group without waiting a round trip for a retransmission.
+//
+// A protected message is (6, group, index, payload) and a parity message is
+// (7, group, group size, parity block). Every data message contributes the
+// block (payload size, payload) padded with zeros, and the parity block is
+// the XOR of all the blocks of the group.
+struct ForwardErrorCorrection {
+    constexpr static uint8_t dataMessageType = 6;
+    constexpr static uint8_t parityMessageType = 7;
+    constexpr static size_t headerSize = 4;
+    constexpr static size_t lengthSize = 2;
+    constexpr static size_t maxPayloadSize = 2048;
+    constexpr static size_t maxGroupSize = 16;
+    constexpr static size_t blockSize = lengthSize + maxPayloadSize;
+
+    using Block = std::array<uint8_t, blockSize>;
+    using Payload = std::pair<uint8_t *, size_t>;
+
+    // How many data messages share a parity message at a given loss rate,
+    // 0 means no FEC. The chance a group loses two messages stays well below
+    // the loss rate itself.
+    static size_t getGroupSize(double lossRate) {
+        if (lossRate < 0.001) {
+            return 0;
+        }
+        if (lossRate < 0.01) {
+            return 16;
+        }
+        if (lossRate < 0.03) {
+            return 8;
+        }
+        if (lossRate < 0.06) {
+            return 4;
+        }
+        return 2;
+    }
+};
+
+// Estimates the loss rate of a link from the gaps in the cipher counters of
+// the datagrams received over it, smoothed over samples of m_SampleSize
+// expected datagrams
+class LossEstimator {
+  public:
+    double getLossRate() const { return m_LossRate; }
+
+    void onReceived(uint64_t highestCounter) {
+        if (!m_IsStarted) {
+            m_IsStarted = true;
+            m_SampleStart = highestCounter;
+            return;
+        }
+
+        m_Received++;
+        uint64_t expected = highestCounter - m_SampleStart;
+        if (expected < m_SampleSize) {
+            return;
+        }
+
+        double sampleLossRate =
+            m_Received >= expected ? 0 : 1 - double(m_Received) / expected;
+        m_LossRate = m_LossRate * (1 - m_Smoothing) +
+                     sampleLossRate * m_Smoothing;
+        m_SampleStart = highestCounter;
+        m_Received = 0;
+    }
+
+  private:
+    constexpr static uint64_t m_SampleSize = 256;
+    constexpr static double m_Smoothing = 0.25;
+
+    bool m_IsStarted = false;
+    uint64_t m_SampleStart = 0;
+    uint64_t m_Received = 0;
+    double m_LossRate = 0;
+};
+
+class FecEncoder {
+  public:
+    using Payload = ForwardErrorCorrection::Payload;
+
+    void setGroupSize(size_t groupSize) { m_NextGroupSize = groupSize; }
+
+    size_t getGroupSize() const { return m_NextGroupSize; }
+
+    bool hasOpenGroup() const { return m_Count > 0; }
+
+    bool canProtect(size_t payloadSize) const {
+        size_t groupSize = hasOpenGroup() ? m_GroupSize : m_NextGroupSize;
+        return groupSize > 0 &&
+               payloadSize <= ForwardErrorCorrection::maxPayloadSize;
+    }
+
+    // Returns the protected message, with room for the cipher overhead after
+    // it. canProtect() must be checked first.
+    Payload protect(const uint8_t *payload, size_t payloadSize) {
+        if (!hasOpenGroup()) {
+            m_GroupSize = m_NextGroupSize;
+            m_Parity.fill(0);
+            m_ParitySize = 0;
+        }
+
+        auto message = m_Message.data();
+        message[0] = ForwardErrorCorrection::dataMessageType;
+        message[1] = m_GroupId >> 8;
+        message[2] = m_GroupId & 0xff;
+        message[3] = m_Count;
+        std::memcpy(message + ForwardErrorCorrection::headerSize, payload,
+                    payloadSize);
+
+        auto block = m_Parity.data() + ForwardErrorCorrection::headerSize;
+        block[0] ^= payloadSize >> 8;
+        block[1] ^= payloadSize & 0xff;
+        xorBlock(block + ForwardErrorCorrection::lengthSize, payload,
+                 payloadSize);
+        m_ParitySize = std::max(
+            m_ParitySize, ForwardErrorCorrection::lengthSize + payloadSize);
+        m_Count++;
+
+        return {message, ForwardErrorCorrection::headerSize + payloadSize};
+    }
+
+    bool isGroupComplete() const {
+        return hasOpenGroup() && m_Count >= m_GroupSize;
+    }
+
+    // Returns the parity message of the current group, even if it isn't
+    // complete, with room for the cipher overhead after it
+    Payload takeParity() {
+        auto message = m_Parity.data();
+        message[0] = ForwardErrorCorrection::parityMessageType;
+        message[1] = m_GroupId >> 8;
+        message[2] = m_GroupId & 0xff;
+        message[3] = m_Count;
+
+        m_GroupId++;
+        m_Count = 0;
+        return {message, ForwardErrorCorrection::headerSize + m_ParitySize};
+    }
+
+  private:
+    constexpr static size_t m_BufferSize = ForwardErrorCorrection::headerSize +
+                                           ForwardErrorCorrection::blockSize +
+                                           TunnelCipher::overhead;
+
+    size_t m_NextGroupSize = 0;
+    size_t m_GroupSize = 0;
+    uint16_t m_GroupId = 0;
+    size_t m_Count = 0;
+    size_t m_ParitySize = 0;
+    std::array<uint8_t, m_BufferSize> m_Message;
+    std::array<uint8_t, m_BufferSize> m_Parity;
+};
+
+// Keeps the XOR of everything received for the last few groups. Once the
+// parity and all but one data message of a group have arrived, the XOR is the
+// block of the missing message.
+class FecDecoder {
+  public:
+    using Payload = ForwardErrorCorrection::Payload;
+
+    // Returns the payload of a protected message, or nullopt if it is
+    // malformed or was already recovered from the parity
+    std::optional<Payload> receiveData(uint8_t *message, size_t messageSize) {
+        if (messageSize < ForwardErrorCorrection::headerSize ||
+            message[0] != ForwardErrorCorrection::dataMessageType ||
+            message[3] >= ForwardErrorCorrection::maxGroupSize ||
+            messageSize - ForwardErrorCorrection::headerSize >
+                ForwardErrorCorrection::maxPayloadSize) {
+            return std::nullopt;
+        }
+
+        auto &group = getGroup((message[1] << 8) | message[2]);
+        uint32_t bit = 1u << message[3];
+        if (group.received & bit) {
+            return std::nullopt;
+        }
+
+        auto payload = message + ForwardErrorCorrection::headerSize;
+        size_t payloadSize = messageSize - ForwardErrorCorrection::headerSize;
+        group.received |= bit;
+        group.count++;
+        group.block[0] ^= payloadSize >> 8;
+        group.block[1] ^= payloadSize & 0xff;
+        xorBlock(group.block.data() + ForwardErrorCorrection::lengthSize,
+                 payload, payloadSize);
+
+        if (!group.isRecovered) {
+            return Payload{payload, payloadSize};
+        }
+        return std::nullopt;
+    }
+
+    // Returns the payload of the missing message if the parity completes its
+    // group, otherwise nullopt
+    std::optional<Payload> receiveParity(const uint8_t *message,
+                                         size_t messageSize) {
+        if (messageSize < ForwardErrorCorrection::headerSize +
+                              ForwardErrorCorrection::lengthSize ||
+            message[0] != ForwardErrorCorrection::parityMessageType ||
+            message[3] == 0 ||
+            message[3] > ForwardErrorCorrection::maxGroupSize ||
+            messageSize - ForwardErrorCorrection::headerSize >
+                ForwardErrorCorrection::blockSize) {
+            return std::nullopt;
+        }
+
+        auto &group = getGroup((message[1] << 8) | message[2]);
+        if (group.hasParity) {
+            return std::nullopt;
+        }
+        group.hasParity = true;
+        group.size = message[3];
+        xorBlock(group.block.data(),
+                 message + ForwardErrorCorrection::headerSize,
+                 messageSize - ForwardErrorCorrection::headerSize);
+
+        return tryRecover(group);
+    }
+
+  private:
+    struct Group {
+        uint16_t id = 0;
+        bool isUsed = false;
+        uint32_t received = 0;
+        size_t count = 0;
+        size_t size = 0;
+        bool hasParity = false;
+        bool isRecovered = false;
+        ForwardErrorCorrection::Block block;
+    };
+
+    constexpr static size_t m_GroupCount = 4;
+
+    std::array<Group, m_GroupCount> m_Groups;
+
+    Group &getGroup(uint16_t id) {
+        auto &group = m_Groups[id % m_GroupCount];
+        if (!group.isUsed || group.id != id) {
+            group = Group();
+            group.id = id;
+            group.isUsed = true;
+            group.block.fill(0);
+        }
+        return group;
+    }
+
+    std::optional<Payload> tryRecover(Group &group) {
+        if (group.isRecovered || group.count + 1 != group.size) {
+            return std::nullopt;
+        }
+
+        size_t payloadSize = (group.block[0] << 8) | group.block[1];
+        if (payloadSize > ForwardErrorCorrection::maxPayloadSize) {
+            return std::nullopt;
+        }
+
+        // Later copies of the missing message are duplicates now
+        for (size_t i = 0; i < group.size; i++) {
+            group.received |= 1u << i;
+        }
+        group.isRecovered = true;
+        return Payload{group.block.data() + ForwardErrorCorrection::lengthSize,
+                       payloadSize};
+    }
+};
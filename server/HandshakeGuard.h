@@ -0,0 +1,424 @@
+#pragma once
+
+#include "Log.h"
+#include "ResumptionTokens.h"
+#include "ServerSocket.h"
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <netinet/in.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <unordered_set>
+
+// A count-min sketch of failed handshake attempts per source IP address.
+// It has a fixed size no matter how many sources are seen and is cleared at
+// the start of every window. Once so many sources went over the threshold
+// that an unrelated one would likely collide with them in every row, it stops
+// blocking anyone rather than blocking everyone.
+class FailedAttemptSketch {
+  public:
+    explicit FailedAttemptSketch(uint16_t threshold) : m_Threshold(threshold) {
+        std::random_device randomDevice;
+        for (auto &seed : m_Seeds) {
+            seed = (static_cast<uint64_t>(randomDevice()) << 32) |
+                   randomDevice();
+        }
+        m_Counters.fill(0);
+    }
+
+    void add(const in6_addr &address) {
+        for (size_t row = 0; row < m_Depth; row++) {
+            auto &counter = m_Counters[row * m_Width + getColumn(address, row)];
+            if (counter < UINT16_MAX) {
+                counter++;
+            }
+            if (counter == m_Threshold) {
+                m_CountersOverThreshold[row]++;
+            }
+        }
+    }
+
+    bool isBlocked(const in6_addr &address) const {
+        return estimate(address) >= m_Threshold && !isSaturated();
+    }
+
+    // Whether an address that never failed would be blocked more often than
+    // m_MaxFalsePositiveRate, the chance that every row maps it to a counter
+    // that went over the threshold
+    bool isSaturated() const {
+        double falsePositiveRate = 1;
+        for (auto count : m_CountersOverThreshold) {
+            falsePositiveRate *= double(count) / m_Width;
+        }
+        return falsePositiveRate > m_MaxFalsePositiveRate;
+    }
+
+    uint16_t estimate(const in6_addr &address) const {
+        uint16_t result = UINT16_MAX;
+        for (size_t row = 0; row < m_Depth; row++) {
+            result = std::min(
+                result, m_Counters[row * m_Width + getColumn(address, row)]);
+        }
+        return result;
+    }
+
+    void clear() {
+        m_Counters.fill(0);
+        m_CountersOverThreshold.fill(0);
+    }
+
+  private:
+    constexpr static size_t m_Depth = 4;
+    constexpr static size_t m_Width = 4096;
+    constexpr static double m_MaxFalsePositiveRate = 0.001;
+
+    uint16_t m_Threshold;
+    std::array<uint64_t, m_Depth> m_Seeds;
+    std::array<uint16_t, m_Depth * m_Width> m_Counters;
+    std::array<size_t, m_Depth> m_CountersOverThreshold{};
+
+    size_t getColumn(const in6_addr &address, size_t row) const {
+        uint64_t high, low;
+        std::memcpy(&high, address.s6_addr, sizeof(high));
+        std::memcpy(&low, address.s6_addr + sizeof(high), sizeof(low));
+
+        // splitmix64 finalizer over the seeded address
+        uint64_t hash = high ^ (low * 0x9e3779b97f4a7c15ULL) ^ m_Seeds[row];
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+        hash ^= hash >> 31;
+        return hash % m_Width;
+    }
+};
+
+// A parsed hello message. A plaintext hello (0, secret) carries the secret
+// itself. An encrypted hello (3, nonce, public key, features, timestamp,
+// proof) carries an X25519 public key, the optional features the client
+// supports and the time it was sent in seconds since the Unix epoch, and only
+// proves the client knows the secret with an HMAC over the rest of the
+// message. A client that resumes puts its resumption token before the proof.
+struct HelloMessage {
+    enum class Type { Plaintext, Encrypted };
+
+    constexpr static size_t nonceSize = 16;
+    constexpr static size_t publicKeySize = 32;
+    constexpr static size_t timestampSize = 8;
+    constexpr static size_t proofSize = 32;
+    constexpr static size_t signedSize =
+        nonceSize + publicKeySize + 1 + timestampSize;
+    constexpr static size_t encryptedSize = 1 + signedSize + proofSize;
+    constexpr static size_t resumingSize =
+        encryptedSize + ResumptionTokens::tokenSize;
+
+    constexpr static uint8_t compressionFeature = 0x01;
+    constexpr static uint8_t coalescingFeature = 0x02;
+    constexpr static uint8_t fecFeature = 0x04;
+    constexpr static uint8_t headerCompressionFeature = 0x08;
+    constexpr static uint8_t roamingFeature = 0x10;
+    constexpr static uint8_t resumptionFeature = 0x20;
+
+    Type type;
+    std::string_view secret;
+    const uint8_t *nonce = nullptr;
+    const uint8_t *publicKey = nullptr;
+    uint8_t features = 0;
+    uint64_t timestamp = 0;
+    const uint8_t *resumptionToken = nullptr;
+    const uint8_t *proof = nullptr;
+    // Everything between the type and the proof
+    size_t signedDataSize = signedSize;
+};
+
+// Decides whether a packet from an unknown source may create a client session.
+//
+// The secret is verified before any state is created. When cookies are
+// enabled the first round trip is stateless as well: a hello message is
+// answered with a cookie message (1, cookie) where the cookie is an HMAC over
+// the source address, port and current time slot. Only a cookie echo
+// (1, cookie, hello) with a valid cookie and hello is admitted. Sources that
+// keep failing are dropped without any further processing. Only the failures
+// of sources that echoed a valid cookie count, as anyone can send datagrams
+// from someone else's address, so without cookies no source is ever dropped.
+class HandshakeGuard {
+  public:
+    HandshakeGuard(const ServerSocket &serverSocket,
+                   const std::string &secret, bool cookiesEnabled,
+                   bool encryptionRequired)
+        : m_ServerSocket(serverSocket), m_Secret(secret),
+          m_CookiesEnabled(cookiesEnabled),
+          m_EncryptionRequired(encryptionRequired),
+          m_FailedAttempts(m_MaxFailedAttempts) {
+        if (RAND_bytes(m_CookieKey.data(), m_CookieKey.size()) != 1) {
+            throw std::runtime_error(
+                "Couldn't generate a handshake cookie key");
+        }
+    }
+
+    // Parses a hello message, unwrapping it from a cookie echo if needed
+    static std::optional<HelloMessage> parseHello(const uint8_t *data,
+                                                  size_t dataSize) {
+        if (dataSize > 1 + m_CookieSize && data[0] == m_CookieMessageType) {
+            data += 1 + m_CookieSize;
+            dataSize -= 1 + m_CookieSize;
+        }
+
+        if (dataSize >= 2 && data[0] == m_PlaintextHelloMessageType) {
+            return HelloMessage{
+                HelloMessage::Type::Plaintext,
+                std::string_view(reinterpret_cast<const char *>(data + 1),
+                                 dataSize - 1)};
+        }
+
+        if ((dataSize == HelloMessage::encryptedSize ||
+             dataSize == HelloMessage::resumingSize) &&
+            data[0] == m_EncryptedHelloMessageType) {
+            HelloMessage hello{HelloMessage::Type::Encrypted, {}};
+            hello.nonce = data + 1;
+            hello.publicKey = hello.nonce + HelloMessage::nonceSize;
+            hello.features = hello.publicKey[HelloMessage::publicKeySize];
+            for (size_t i = 0; i < HelloMessage::timestampSize; i++) {
+                hello.timestamp = (hello.timestamp << 8) |
+                                  hello.publicKey[HelloMessage::publicKeySize +
+                                                  1 + i];
+            }
+            hello.signedDataSize = dataSize - 1 - HelloMessage::proofSize;
+            if (dataSize == HelloMessage::resumingSize) {
+                hello.resumptionToken = data + 1 + HelloMessage::signedSize;
+            }
+            hello.proof = data + 1 + hello.signedDataSize;
+            return hello;
+        }
+
+        return std::nullopt;
+    }
+
+    // The proof an encrypted hello carries:
+    // HMAC-SHA256(secret, label, nonce, public key, features, timestamp
+    //             [, token])
+    static std::array<uint8_t, HelloMessage::proofSize>
+    createProof(const std::string &secret, const uint8_t *signedData,
+                size_t signedDataSize = HelloMessage::signedSize) {
+        std::array<uint8_t, m_ProofLabel.size() + HelloMessage::signedSize +
+                                ResumptionTokens::tokenSize>
+            input;
+        signedDataSize = std::min(signedDataSize,
+                                  input.size() - m_ProofLabel.size());
+        std::copy(m_ProofLabel.begin(), m_ProofLabel.end(), input.begin());
+        std::copy(signedData, signedData + signedDataSize,
+                  input.begin() + m_ProofLabel.size());
+
+        std::array<uint8_t, HelloMessage::proofSize> proof;
+        unsigned int proofLength = 0;
+        HMAC(EVP_sha256(), secret.data(), secret.size(), input.data(),
+             m_ProofLabel.size() + signedDataSize, proof.data(),
+             &proofLength);
+        return proof;
+    }
+
+    bool admit(const uint8_t *data, size_t dataSize,
+               const sockaddr_in6 &clientAddress,
+               const std::chrono::steady_clock::time_point &now) {
+        if (now - m_WindowStart > m_FailureWindow) {
+            m_FailedAttempts.clear();
+            m_WindowStart = now;
+        }
+
+        if (m_FailedAttempts.isBlocked(clientAddress.sin6_addr)) {
+            return false;
+        }
+
+        auto hello = parseHello(data, dataSize);
+        if (!hello.has_value()) {
+            return false;
+        }
+
+        if (m_EncryptionRequired &&
+            hello->type == HelloMessage::Type::Plaintext) {
+            TOYVPN_LOG_DEBUG("Rejecting a plaintext hello, encryption is "
+                             "required");
+            return false;
+        }
+
+        if (m_CookiesEnabled) {
+            if (data[0] != m_CookieMessageType) {
+                sendCookie(clientAddress, now);
+                return false;
+            }
+
+            if (!isCookieValid(data + 1, clientAddress, now)) {
+                return false;
+            }
+        }
+
+        // The valid cookie proved the source address
+        if (!isHelloValid(hello.value())) {
+            if (m_CookiesEnabled) {
+                m_FailedAttempts.add(clientAddress.sin6_addr);
+            }
+            return false;
+        }
+
+        // A captured hello is valid too, so it is only accepted once, see
+        // rememberHello(), and while it is fresh. Replays don't count as
+        // failures, the source address of a replay is whatever the attacker
+        // wants.
+        if (hello->type == HelloMessage::Type::Encrypted &&
+            !isHelloFresh(hello.value(), now)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    // Called once the key exchange of an admitted encrypted hello is under
+    // way, so a hello that was shed can be retried as it is
+    void rememberHello(const HelloMessage &hello,
+                       const std::chrono::steady_clock::time_point &now) {
+        std::string nonce(reinterpret_cast<const char *>(hello.nonce),
+                          HelloMessage::nonceSize);
+        if (m_RememberedNonces.insert(nonce).second) {
+            m_NonceExpiries.emplace_back(now + 2 * m_MaxHelloAge, nonce);
+        }
+    }
+
+  private:
+    using Cookie = std::array<uint8_t, 16>;
+
+    constexpr static uint8_t m_PlaintextHelloMessageType = 0;
+    constexpr static uint8_t m_CookieMessageType = 1;
+    constexpr static uint8_t m_EncryptedHelloMessageType = 3;
+    constexpr static std::string_view m_ProofLabel = "ToyVpn hello";
+    constexpr static size_t m_CookieSize = std::tuple_size<Cookie>::value;
+    constexpr static std::chrono::duration m_CookieTimeSlot =
+        std::chrono::seconds(30);
+    constexpr static std::chrono::duration m_FailureWindow =
+        std::chrono::seconds(60);
+    constexpr static uint16_t m_MaxFailedAttempts = 10;
+    // How far the timestamp of an encrypted hello may be from the server's
+    // clock, which also bounds how long its nonce has to be remembered
+    constexpr static std::chrono::duration m_MaxHelloAge =
+        std::chrono::seconds(30);
+    constexpr static size_t m_MaxRememberedHellos = 65536;
+
+    const ServerSocket &m_ServerSocket;
+    std::string m_Secret;
+    bool m_CookiesEnabled;
+    bool m_EncryptionRequired;
+    std::array<uint8_t, 32> m_CookieKey;
+    FailedAttemptSketch m_FailedAttempts;
+    std::chrono::steady_clock::time_point m_WindowStart;
+    // The nonces of the encrypted hellos whose key exchange started in the
+    // last two m_MaxHelloAge, oldest first in the queue
+    std::unordered_set<std::string> m_RememberedNonces;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>>
+        m_NonceExpiries;
+
+    bool isHelloValid(const HelloMessage &hello) const {
+        if (hello.type == HelloMessage::Type::Encrypted) {
+            auto expected =
+                createProof(m_Secret, hello.nonce, hello.signedDataSize);
+            return CRYPTO_memcmp(expected.data(), hello.proof,
+                                 expected.size()) == 0;
+        }
+
+        if (hello.secret.size() != m_Secret.size() ||
+            CRYPTO_memcmp(hello.secret.data(), m_Secret.data(),
+                          m_Secret.size()) != 0) {
+            // Anyone can send hellos, so the secrets they guess aren't logged
+            TOYVPN_LOG_DEBUG("Got a hello with the wrong secret");
+            return false;
+        }
+
+        return true;
+    }
+
+    bool isHelloFresh(const HelloMessage &hello,
+                      const std::chrono::steady_clock::time_point &now) {
+        auto sentAt = std::chrono::system_clock::time_point(
+            std::chrono::seconds(hello.timestamp));
+        auto age = std::chrono::system_clock::now() - sentAt;
+        if (age > m_MaxHelloAge || age < -m_MaxHelloAge) {
+            TOYVPN_LOG_DEBUG("Rejecting a hello that is too old or from the "
+                             "future, check the clocks");
+            return false;
+        }
+
+        while (!m_NonceExpiries.empty() &&
+               m_NonceExpiries.front().first < now) {
+            m_RememberedNonces.erase(m_NonceExpiries.front().second);
+            m_NonceExpiries.pop_front();
+        }
+
+        std::string nonce(reinterpret_cast<const char *>(hello.nonce),
+                          HelloMessage::nonceSize);
+        if (m_RememberedNonces.count(nonce) != 0) {
+            TOYVPN_LOG_DEBUG("Rejecting a replayed hello");
+            return false;
+        }
+        // Forgetting a nonce early would let its hello be replayed, so new
+        // hellos wait until there is room
+        if (m_RememberedNonces.size() >= m_MaxRememberedHellos) {
+            TOYVPN_LOG_DEBUG("Too many recent hellos, dropping a new one");
+            return false;
+        }
+
+        return true;
+    }
+
+    Cookie createCookie(const sockaddr_in6 &clientAddress,
+                        uint64_t timeSlot) const {
+        std::array<uint8_t, sizeof(in6_addr) + sizeof(in_port_t) +
+                                sizeof(timeSlot)>
+            input;
+        std::memcpy(input.data(), &clientAddress.sin6_addr, sizeof(in6_addr));
+        std::memcpy(input.data() + sizeof(in6_addr), &clientAddress.sin6_port,
+                    sizeof(in_port_t));
+        std::memcpy(input.data() + sizeof(in6_addr) + sizeof(in_port_t),
+                    &timeSlot, sizeof(timeSlot));
+
+        std::array<uint8_t, EVP_MAX_MD_SIZE> mac;
+        unsigned int macLength = 0;
+        HMAC(EVP_sha256(), m_CookieKey.data(), m_CookieKey.size(),
+             input.data(), input.size(), mac.data(), &macLength);
+
+        Cookie cookie;
+        std::copy(mac.begin(), mac.begin() + cookie.size(), cookie.begin());
+        return cookie;
+    }
+
+    uint64_t getTimeSlot(const std::chrono::steady_clock::time_point &now) {
+        return now.time_since_epoch() / m_CookieTimeSlot;
+    }
+
+    void sendCookie(const sockaddr_in6 &clientAddress,
+                    const std::chrono::steady_clock::time_point &now) {
+        auto cookie = createCookie(clientAddress, getTimeSlot(now));
+        std::vector<uint8_t> cookieMessage;
+        cookieMessage.push_back(m_CookieMessageType);
+        cookieMessage.insert(cookieMessage.end(), cookie.begin(),
+                             cookie.end());
+        m_ServerSocket.send(cookieMessage, clientAddress);
+    }
+
+    bool isCookieValid(const uint8_t *cookie, const sockaddr_in6 &clientAddress,
+                       const std::chrono::steady_clock::time_point &now) {
+        // Accept cookies from the previous time slot too so a cookie issued
+        // right before a slot boundary is still valid
+        auto timeSlot = getTimeSlot(now);
+        for (auto slot : {timeSlot, timeSlot - 1}) {
+            auto expected = createCookie(clientAddress, slot);
+            if (CRYPTO_memcmp(expected.data(), cookie, expected.size()) == 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "HandshakeGuard.h"
+#include "KeyExchange.h"
+#include "Log.h"
+#include "ResumptionTokens.h"
+#include "Tracing.h"
+#include "libs/concurrentqueue/concurrentqueue.h"
+#include <atomic>
+#include <netinet/in.h>
+#include <openssl/rand.h>
+#include <optional>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct KeyExchangeJob {
+    sockaddr_in6 clientAddress;
+    std::array<uint8_t, HelloMessage::nonceSize> clientNonce;
+    X25519KeyPair::PublicKey clientPublicKey;
+    uint8_t features;
+    // The lease of a valid resumption token
+    std::optional<ResumptionTokens::Lease> resumedLease;
+};
+
+struct KeyExchangeResult {
+    sockaddr_in6 clientAddress;
+    bool isValid = false;
+    std::array<uint8_t, HelloMessage::nonceSize> clientNonce;
+    std::array<uint8_t, HelloMessage::nonceSize> serverNonce;
+    X25519KeyPair::PublicKey serverPublicKey;
+    uint8_t features = 0;
+    std::optional<ResumptionTokens::Lease> resumedLease;
+    SessionKeys keys;
+};
+
+// Runs the public key part of encrypted handshakes on worker threads so a
+// burst of handshakes doesn't stall forwarding on the reactor thread.
+//
+// Jobs go to the workers through a lock-free queue and a semaphore, and the
+// results come back through another lock-free queue and an eventfd that the
+// reactor polls. Only the reactor submits and collects, and at most
+// maxPendingJobs handshakes are in flight; anything beyond that is shed and
+// the client retries.
+class HandshakeWorkerPool {
+  public:
+    HandshakeWorkerPool(const std::string &secret, size_t threadCount,
+                        size_t maxPendingJobs)
+        : m_Secret(secret), m_MaxPendingJobs(maxPendingJobs) {
+        m_EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_EventFd == -1) {
+            throw std::runtime_error("Couldn't create the handshake eventfd");
+        }
+        if (sem_init(&m_JobsAvailable, 0, 0) == -1) {
+            close(m_EventFd);
+            throw std::runtime_error(
+                "Couldn't create the handshake semaphore");
+        }
+
+        for (size_t i = 0; i < threadCount; i++) {
+            m_Threads.emplace_back(&HandshakeWorkerPool::run, this);
+        }
+    }
+
+    virtual ~HandshakeWorkerPool() {
+        m_StopFlag = true;
+        for (size_t i = 0; i < m_Threads.size(); i++) {
+            sem_post(&m_JobsAvailable);
+        }
+        for (auto &thread : m_Threads) {
+            thread.join();
+        }
+
+        sem_destroy(&m_JobsAvailable);
+        close(m_EventFd);
+    }
+
+    int getEventFd() const { return m_EventFd; }
+
+    size_t getPendingJobs() const { return m_PendingJobs; }
+
+    uint64_t getShedJobs() const { return m_ShedJobs; }
+
+    // Returns false if the job was shed because too many are in flight
+    bool submit(const KeyExchangeJob &job) {
+        if (m_PendingJobs >= m_MaxPendingJobs) {
+            m_ShedJobs++;
+            if (!m_IsShedding) {
+                TOYVPN_LOG_ERROR("Too many pending handshakes, dropping new "
+                                 "ones until the workers catch up");
+                m_IsShedding = true;
+            }
+            return false;
+        }
+
+        m_PendingJobs++;
+        m_Jobs.enqueue(job);
+        sem_post(&m_JobsAvailable);
+        return true;
+    }
+
+    // Calls the callback with every finished job, must be called when the
+    // eventfd is readable
+    template <typename Callback> void collect(const Callback &callback) {
+        uint64_t value;
+        if (read(m_EventFd, &value, sizeof(value)) == -1) {
+            return;
+        }
+
+        KeyExchangeResult results[m_CollectBulkSize];
+        size_t count;
+        while ((count = m_Results.try_dequeue_bulk(results,
+                                                   m_CollectBulkSize)) > 0) {
+            m_PendingJobs -= count;
+            for (size_t i = 0; i < count; i++) {
+                callback(results[i]);
+            }
+        }
+
+        if (m_PendingJobs == 0) {
+            m_IsShedding = false;
+        }
+    }
+
+  private:
+    constexpr static size_t m_CollectBulkSize = 64;
+
+    std::string m_Secret;
+    size_t m_MaxPendingJobs;
+    size_t m_PendingJobs = 0;
+    uint64_t m_ShedJobs = 0;
+    bool m_IsShedding = false;
+    int m_EventFd = -1;
+    sem_t m_JobsAvailable;
+    moodycamel::ConcurrentQueue<KeyExchangeJob> m_Jobs;
+    moodycamel::ConcurrentQueue<KeyExchangeResult> m_Results;
+    std::atomic<bool> m_StopFlag{false};
+    std::vector<std::thread> m_Threads;
+
+    void run() {
+        Tracing::setThreadName("handshake worker");
+        while (true) {
+            while (sem_wait(&m_JobsAvailable) == -1 && errno == EINTR) {
+            }
+            if (m_StopFlag) {
+                return;
+            }
+
+            KeyExchangeJob job;
+            if (!m_Jobs.try_dequeue(job)) {
+                continue;
+            }
+
+            TOYVPN_TRACE(KeyExchange, 'B', 0);
+            try {
+                m_Results.enqueue(exchangeKeys(job));
+            } catch (const std::exception &err) {
+                TOYVPN_LOG_ERROR("Key exchange failed: " << err.what());
+                KeyExchangeResult result;
+                result.clientAddress = job.clientAddress;
+                m_Results.enqueue(result);
+            }
+            TOYVPN_TRACE(KeyExchange, 'E', 0);
+            uint64_t value = 1;
+            write(m_EventFd, &value, sizeof(value));
+        }
+    }
+
+    KeyExchangeResult exchangeKeys(const KeyExchangeJob &job) const {
+        KeyExchangeResult result;
+        result.clientAddress = job.clientAddress;
+        result.clientNonce = job.clientNonce;
+        result.features = job.features;
+        result.resumedLease = job.resumedLease;
+
+        std::array<uint8_t, 2 * HelloMessage::nonceSize> nonces;
+        std::copy(job.clientNonce.begin(), job.clientNonce.end(),
+                  nonces.begin());
+        auto serverNonce = nonces.data() + HelloMessage::nonceSize;
+        if (RAND_bytes(serverNonce, HelloMessage::nonceSize) != 1) {
+            return result;
+        }
+        std::copy(serverNonce, serverNonce + HelloMessage::nonceSize,
+                  result.serverNonce.begin());
+
+        X25519KeyPair keyPair;
+        auto sharedSecret =
+            keyPair.deriveSharedSecret(job.clientPublicKey.data());
+        if (!sharedSecret.has_value()) {
+            return result;
+        }
+
+        result.serverPublicKey = keyPair.getPublicKey();
+        result.keys = deriveSessionKeys(sharedSecret.value(), m_Secret,
+                                        nonces.data(), nonces.size());
+        result.isValid = true;
+        return result;
+    }
+};
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+
+// Per-flow compression of inner IPv4 TCP and UDP headers, in the spirit of
+// RFC 1144 and the unidirectional mode of ROHC. The fields that stay the same
+// for a flow are kept in one of contextCount contexts on both sides, and the
+// compressed message (8, context, 16-bit check, IP ID, changing transport
+// fields, payload) only carries the rest. Changing fields are sent as they are rather
+// than as deltas, so a lost message can't desynchronize a context.
+//
+// A context is set up by sending the full packet as (9, context, packet) for
+// the first packets of a flow and again every refreshInterval packets, so a
+// lost setup heals by itself. The check lets the receiver drop packets that
+// refer to a context it doesn't have yet.
+struct HeaderCompression {
+    constexpr static uint8_t compressedMessageType = 8;
+    constexpr static uint8_t contextMessageType = 9;
+    constexpr static size_t contextCount = 64;
+    constexpr static size_t contextHeaderSize = 2;
+    constexpr static size_t compressedHeaderSize = 4;
+    constexpr static size_t staticFieldsSize = 18;
+
+    using StaticFields = std::array<uint8_t, staticFieldsSize>;
+
+    struct Flow {
+        StaticFields fields;
+        uint8_t protocol;
+        size_t transportHeaderSize;
+    };
+
+    // Returns the flow of a packet whose headers can be compressed: IPv4
+    // without options or fragmentation carrying TCP or UDP
+    static std::optional<Flow> parse(const uint8_t *packet, size_t size) {
+        if (size < m_IpHeaderSize || packet[0] != 0x45 ||
+            size_t((packet[2] << 8) | packet[3]) != size ||
+            (packet[6] & 0x3f) != 0 || packet[7] != 0) {
+            return std::nullopt;
+        }
+
+        Flow flow;
+        flow.protocol = packet[9];
+        auto transport = packet + m_IpHeaderSize;
+        size_t transportSize = size - m_IpHeaderSize;
+        uint8_t dataOffset = 0;
+        if (flow.protocol == m_TcpProtocol) {
+            if (transportSize < m_TcpHeaderSize) {
+                return std::nullopt;
+            }
+            dataOffset = transport[12];
+            flow.transportHeaderSize = (dataOffset >> 4) * 4;
+            if (flow.transportHeaderSize < m_TcpHeaderSize ||
+                flow.transportHeaderSize > transportSize) {
+                return std::nullopt;
+            }
+        } else if (flow.protocol == m_UdpProtocol) {
+            if (transportSize < m_UdpHeaderSize ||
+                size_t((transport[4] << 8) | transport[5]) != transportSize) {
+                return std::nullopt;
+            }
+            flow.transportHeaderSize = m_UdpHeaderSize;
+        } else {
+            return std::nullopt;
+        }
+
+        // Version and TOS, DF, TTL, protocol, addresses, ports and the TCP
+        // data offset
+        auto fields = flow.fields.data();
+        fields[0] = packet[0];
+        fields[1] = packet[1];
+        fields[2] = packet[6];
+        fields[3] = packet[8];
+        fields[4] = packet[9];
+        std::memcpy(fields + 5, packet + 12, 8);
+        std::memcpy(fields + 13, transport, 4);
+        fields[17] = dataOffset;
+        return flow;
+    }
+
+    static uint16_t getCheck(const StaticFields &fields) {
+        return hash(fields.data(), fields.size()) & 0xffff;
+    }
+
+  protected:
+    constexpr static size_t m_IpHeaderSize = 20;
+    constexpr static size_t m_TcpHeaderSize = 20;
+    constexpr static size_t m_UdpHeaderSize = 8;
+    constexpr static uint8_t m_TcpProtocol = 6;
+    constexpr static uint8_t m_UdpProtocol = 17;
+    // Protocol, addresses and ports
+    constexpr static size_t m_FlowIdOffset = 4;
+    constexpr static size_t m_FlowIdSize = 13;
+
+    // FNV-1a, with the MurmurHash3 finalizer so the low bits are usable
+    static uint32_t hash(const uint8_t *data, size_t size) {
+        uint32_t result = 2166136261u;
+        for (size_t i = 0; i < size; i++) {
+            result = (result ^ data[i]) * 16777619u;
+        }
+        result ^= result >> 16;
+        result *= 0x85ebca6bu;
+        result ^= result >> 13;
+        return result;
+    }
+};
+
+class HeaderCompressor : HeaderCompression {
+  public:
+    // The most a message can be larger than the packet
+    constexpr static size_t maxExpansion = contextHeaderSize;
+
+    // Writes the message for a packet to output, which must have room for
+    // dataSize + maxExpansion bytes. Returns 0 if the packet should be sent
+    // as it is.
+    size_t compress(const uint8_t *packet, size_t size, uint8_t *output) {
+        auto flow = parse(packet, size);
+        if (!flow.has_value()) {
+            return 0;
+        }
+
+        auto contextId = findContext(flow->fields);
+        auto &context = m_Contexts[contextId];
+        context.lastUsed = ++m_Clock;
+        if (!context.isValid || context.fields != flow->fields) {
+            context.isValid = true;
+            context.fields = flow->fields;
+            context.check = getCheck(flow->fields);
+            context.packetCount = 0;
+        }
+
+        if (context.packetCount++ % m_RefreshInterval < m_SetupPacketCount) {
+            output[0] = contextMessageType;
+            output[1] = contextId;
+            std::memcpy(output + contextHeaderSize, packet, size);
+            return contextHeaderSize + size;
+        }
+
+        auto transport = packet + m_IpHeaderSize;
+        auto out = output;
+        *out++ = compressedMessageType;
+        *out++ = contextId;
+        *out++ = context.check >> 8;
+        *out++ = context.check & 0xff;
+        // IP ID
+        *out++ = packet[4];
+        *out++ = packet[5];
+        if (flow->protocol == m_TcpProtocol) {
+            // Sequence and ack numbers, flags, window, checksum and urgent
+            // pointer, which the checksum covers even when URG is clear
+            std::memcpy(out, transport + 4, 8);
+            out += 8;
+            std::memcpy(out, transport + 13, 7);
+            out += 7;
+            // Options, like timestamps, change with every packet
+            size_t optionsSize = flow->transportHeaderSize - m_TcpHeaderSize;
+            std::memcpy(out, transport + m_TcpHeaderSize, optionsSize);
+            out += optionsSize;
+        } else {
+            // Checksum
+            std::memcpy(out, transport + 6, 2);
+            out += 2;
+        }
+
+        size_t headerSize = m_IpHeaderSize + flow->transportHeaderSize;
+        std::memcpy(out, packet + headerSize, size - headerSize);
+        return out - output + size - headerSize;
+    }
+
+  private:
+    constexpr static uint32_t m_SetupPacketCount = 2;
+    constexpr static uint32_t m_RefreshInterval = 64;
+    constexpr static size_t m_ProbeCount = 4;
+
+    struct Context {
+        bool isValid = false;
+        StaticFields fields;
+        uint16_t check;
+        uint32_t packetCount;
+        uint64_t lastUsed = 0;
+    };
+
+    std::array<Context, contextCount> m_Contexts;
+    uint64_t m_Clock = 0;
+
+    // The context of a flow is one of m_ProbeCount slots picked by its hash.
+    // A new flow takes a free slot or the least recently used one, and a flow
+    // whose TTL or TOS changes keeps its slot.
+    size_t findContext(const StaticFields &fields) const {
+        auto flowId = fields.data() + m_FlowIdOffset;
+        size_t first = hash(flowId, m_FlowIdSize);
+        size_t victim = first % contextCount;
+        for (size_t i = 0; i < m_ProbeCount; i++) {
+            size_t contextId = (first + i) % contextCount;
+            auto &context = m_Contexts[contextId];
+            if (!context.isValid) {
+                return contextId;
+            }
+            if (std::memcmp(context.fields.data() + m_FlowIdOffset, flowId,
+                            m_FlowIdSize) == 0) {
+                return contextId;
+            }
+            if (context.lastUsed < m_Contexts[victim].lastUsed) {
+                victim = contextId;
+            }
+        }
+        return victim;
+    }
+};
+
+class HeaderDecompressor : HeaderCompression {
+  public:
+    // Writes the packet of a message to output. Returns its size, or nullopt
+    // if the message is malformed, its context is missing or it doesn't fit
+    // in outputCapacity.
+    std::optional<size_t> decompress(const uint8_t *message, size_t size,
+                                     uint8_t *output, size_t outputCapacity) {
+        if (size >= contextHeaderSize && message[0] == contextMessageType) {
+            return setUpContext(message, size, output, outputCapacity);
+        }
+
+        if (size < compressedHeaderSize + 2 ||
+            message[0] != compressedMessageType ||
+            message[1] >= contextCount) {
+            return std::nullopt;
+        }
+
+        auto &context = m_Contexts[message[1]];
+        if (!context.isValid ||
+            context.check != ((message[2] << 8) | message[3])) {
+            return std::nullopt;
+        }
+
+        auto &fields = context.fields;
+        auto in = message + compressedHeaderSize;
+        auto end = message + size;
+        bool isTcp = fields[4] == m_TcpProtocol;
+        size_t transportHeaderSize =
+            isTcp ? (fields[17] >> 4) * 4 : m_UdpHeaderSize;
+        size_t dynamicSize =
+            2 + (isTcp ? 15 + transportHeaderSize - m_TcpHeaderSize : 2);
+        if (in + dynamicSize > end) {
+            return std::nullopt;
+        }
+
+        size_t payloadSize = end - in - dynamicSize;
+        size_t packetSize = m_IpHeaderSize + transportHeaderSize + payloadSize;
+        if (packetSize > outputCapacity || packetSize > UINT16_MAX) {
+            return std::nullopt;
+        }
+
+        auto ip = output;
+        ip[0] = fields[0];
+        ip[1] = fields[1];
+        ip[2] = packetSize >> 8;
+        ip[3] = packetSize & 0xff;
+        ip[4] = *in++;
+        ip[5] = *in++;
+        ip[6] = fields[2];
+        ip[7] = 0;
+        ip[8] = fields[3];
+        ip[9] = fields[4];
+        ip[10] = 0;
+        ip[11] = 0;
+        std::memcpy(ip + 12, fields.data() + 5, 8);
+        uint16_t checksum = getIpChecksum(ip);
+        ip[10] = checksum >> 8;
+        ip[11] = checksum & 0xff;
+
+        auto transport = output + m_IpHeaderSize;
+        std::memcpy(transport, fields.data() + 13, 4);
+        if (isTcp) {
+            std::memcpy(transport + 4, in, 8);
+            in += 8;
+            transport[12] = fields[17];
+            std::memcpy(transport + 13, in, 7);
+            in += 7;
+            size_t optionsSize = transportHeaderSize - m_TcpHeaderSize;
+            std::memcpy(transport + m_TcpHeaderSize, in, optionsSize);
+            in += optionsSize;
+        } else {
+            size_t udpSize = m_UdpHeaderSize + payloadSize;
+            transport[4] = udpSize >> 8;
+            transport[5] = udpSize & 0xff;
+            std::memcpy(transport + 6, in, 2);
+            in += 2;
+        }
+
+        std::memcpy(transport + transportHeaderSize, in, payloadSize);
+        return packetSize;
+    }
+
+  private:
+    struct Context {
+        bool isValid = false;
+        StaticFields fields;
+        uint16_t check;
+    };
+
+    std::array<Context, contextCount> m_Contexts;
+
+    std::optional<size_t> setUpContext(const uint8_t *message, size_t size,
+                                       uint8_t *output,
+                                       size_t outputCapacity) {
+        auto packet = message + contextHeaderSize;
+        size_t packetSize = size - contextHeaderSize;
+        auto flow = parse(packet, packetSize);
+        if (message[1] >= contextCount || !flow.has_value() ||
+            packetSize > outputCapacity) {
+            return std::nullopt;
+        }
+
+        auto &context = m_Contexts[message[1]];
+        context.isValid = true;
+        context.fields = flow->fields;
+        context.check = getCheck(flow->fields);
+
+        std::memcpy(output, packet, packetSize);
+        return packetSize;
+    }
+
+    static uint16_t getIpChecksum(const uint8_t *header) {
+        uint32_t sum = 0;
+        for (size_t i = 0; i < m_IpHeaderSize; i += 2) {
+            sum += (header[i] << 8) | header[i + 1];
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return ~sum & 0xffff;
+    }
+};
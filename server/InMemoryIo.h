@@ -0,0 +1,229 @@
+#pragma once
+
+#include "ServerSocket.h"
+#include "TunInterface.h"
+#include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+// Packets waiting for the reactor to read them as if from a device. The
+// eventfd is readable in epoll while the queue isn't empty. Writers block
+// while the queue is full, so a producer faster than the server waits for it
+// instead of queueing up an unbounded backlog.
+class InMemoryPacketQueue {
+  public:
+    InMemoryPacketQueue(size_t capacity) : m_Capacity(capacity) {
+        m_EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_EventFd < 0) {
+            throw std::runtime_error("Couldn't create an eventfd");
+        }
+    }
+
+    virtual ~InMemoryPacketQueue() { close(m_EventFd); }
+
+    int getEventFd() const { return m_EventFd; }
+
+    void push(const uint8_t *data, size_t dataSize,
+              const sockaddr_in6 &address) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_NotFull.wait(lock,
+                       [this]() { return m_Packets.size() < m_Capacity; });
+        m_Packets.push_back({std::vector<uint8_t>(data, data + dataSize),
+                             address});
+        if (m_Packets.size() == 1) {
+            signal();
+        }
+    }
+
+    // Copies the oldest packet and returns its size, or returns -1 with errno
+    // set to EAGAIN if there is none, like a non-blocking read
+    ssize_t pop(uint8_t *data, size_t dataSize, sockaddr_in6 &address) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Packets.empty()) {
+            clearSignal();
+            errno = EAGAIN;
+            return -1;
+        }
+
+        auto &packet = m_Packets.front();
+        auto packetSize = std::min(packet.data.size(), dataSize);
+        std::memcpy(data, packet.data.data(), packetSize);
+        address = packet.address;
+        m_Packets.pop_front();
+        if (m_Packets.empty()) {
+            clearSignal();
+        }
+        m_NotFull.notify_one();
+        return packetSize;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Packets.size();
+    }
+
+    // Makes the reactor wake up even though there is nothing to read
+    void wake() {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        signal();
+    }
+
+  private:
+    struct Packet {
+        std::vector<uint8_t> data;
+        sockaddr_in6 address;
+    };
+
+    size_t m_Capacity;
+    int m_EventFd = -1;
+    mutable std::mutex m_Mutex;
+    std::condition_variable m_NotFull;
+    std::deque<Packet> m_Packets;
+
+    void signal() {
+        uint64_t value = 1;
+        [[maybe_unused]] auto result = write(m_EventFd, &value, sizeof(value));
+    }
+
+    void clearSignal() {
+        uint64_t value;
+        [[maybe_unused]] auto result = read(m_EventFd, &value, sizeof(value));
+    }
+};
+
+// A TUN interface without a device: the packets the server receives are
+// injected from any thread and the packets it sends go to a callback, which
+// runs on the reactor
+class InMemoryTunInterface : public TunInterface {
+  public:
+    using TunInterface::receive;
+    using TunInterface::send;
+    using Sink = std::function<void(const uint8_t *data, size_t dataSize)>;
+
+    InMemoryTunInterface(const pcpp::IPv4Network &privateNetwork,
+                         const Sink &sink,
+                         size_t capacity = m_DefaultCapacity)
+        : m_TunIpAddress(privateNetwork.getLowestAddress()), m_Sink(sink),
+          m_Queue(capacity) {}
+
+    // Queues a packet for the server as if it arrived from the internet
+    void inject(const uint8_t *data, size_t dataSize) {
+        m_Queue.push(data, dataSize, {});
+    }
+
+    size_t getQueuedCount() const { return m_Queue.size(); }
+
+    int getInterfaceFd() const override { return m_Queue.getEventFd(); }
+
+    const pcpp::IPv4Address &getTunIpAddress() const override {
+        return m_TunIpAddress;
+    }
+
+    ssize_t receive(uint8_t *data, size_t dataSize) const override {
+        sockaddr_in6 address;
+        return m_Queue.pop(data, dataSize, address);
+    }
+
+    size_t send(const uint8_t *data, size_t dataSize) const override {
+        m_Sink(data, dataSize);
+        return dataSize;
+    }
+
+  private:
+    constexpr static size_t m_DefaultCapacity = 4096;
+
+    pcpp::IPv4Address m_TunIpAddress;
+    Sink m_Sink;
+    mutable InMemoryPacketQueue m_Queue;
+};
+
+// A server socket without a socket: the datagrams the server receives are
+// injected from any thread and the datagrams it sends go to a callback,
+// which runs on the reactor
+class InMemoryServerSocket : public ServerSocket {
+  public:
+    using ServerSocket::receive;
+    using ServerSocket::send;
+    using Sink = std::function<void(const uint8_t *data, size_t dataSize,
+                                    const sockaddr_in6 &sendTo)>;
+
+    InMemoryServerSocket(const Sink &sink,
+                         size_t capacity = m_DefaultCapacity)
+        : m_Sink(sink), m_Queue(capacity) {}
+
+    // Queues a datagram for the server as if a client sent it from the given
+    // address
+    void inject(const uint8_t *data, size_t dataSize,
+                const sockaddr_in6 &clientAddress) {
+        m_Queue.push(data, dataSize, clientAddress);
+    }
+
+    size_t getQueuedCount() const { return m_Queue.size(); }
+
+    // Runs a function on the reactor the next time it reads from the socket,
+    // e.g. to stop the server from another thread
+    void post(const std::function<void()> &function) {
+        {
+            std::lock_guard<std::mutex> lock(m_PostedMutex);
+            m_Posted.push_back(function);
+            m_HasPosted = true;
+        }
+        m_Queue.wake();
+    }
+
+    int getSocketFd() const override { return m_Queue.getEventFd(); }
+
+    ssize_t receive(uint8_t *data, size_t dataSize,
+                    sockaddr_in6 &clientAddress) const override {
+        if (m_HasPosted.load(std::memory_order_acquire)) {
+            runPosted();
+        }
+        return m_Queue.pop(data, dataSize, clientAddress);
+    }
+
+    int send(const uint8_t *data, size_t dataSize,
+             const sockaddr_in6 &sendTo) const override {
+        m_Sink(data, dataSize, sendTo);
+        return dataSize;
+    }
+
+    int sendBatch(const Datagram *datagrams, size_t count) const override {
+        count = std::min(count, maxBatchSize);
+        for (size_t i = 0; i < count; i++) {
+            m_Sink(datagrams[i].data, datagrams[i].dataSize,
+                   *datagrams[i].sendTo);
+        }
+        return count;
+    }
+
+  private:
+    constexpr static size_t m_DefaultCapacity = 4096;
+
+    Sink m_Sink;
+    mutable InMemoryPacketQueue m_Queue;
+    mutable std::mutex m_PostedMutex;
+    mutable std::vector<std::function<void()>> m_Posted;
+    mutable std::atomic<bool> m_HasPosted{false};
+
+    void runPosted() const {
+        std::vector<std::function<void()>> posted;
+        {
+            std::lock_guard<std::mutex> lock(m_PostedMutex);
+            posted.swap(m_Posted);
+            m_HasPosted = false;
+        }
+        for (const auto &function : posted) {
+            function();
+        }
+    }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "TunnelCipher.h"
+#include <array>
+#include <memory>
+#include <openssl/evp.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// An ephemeral X25519 key pair, used once per handshake
+class X25519KeyPair {
+  public:
+    constexpr static size_t keySize = 32;
+
+    using PublicKey = std::array<uint8_t, keySize>;
+    using SharedSecret = std::array<uint8_t, keySize>;
+
+    X25519KeyPair() : m_Key(nullptr, EVP_PKEY_free) {
+        PKeyContext context(EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr),
+                            EVP_PKEY_CTX_free);
+        EVP_PKEY *key = nullptr;
+        if (!context || EVP_PKEY_keygen_init(context.get()) != 1 ||
+            EVP_PKEY_keygen(context.get(), &key) != 1) {
+            throw std::runtime_error("Couldn't generate an X25519 key pair");
+        }
+        m_Key.reset(key);
+
+        size_t publicKeySize = m_PublicKey.size();
+        if (EVP_PKEY_get_raw_public_key(m_Key.get(), m_PublicKey.data(),
+                                        &publicKeySize) != 1) {
+            throw std::runtime_error("Couldn't get the X25519 public key");
+        }
+    }
+
+    const PublicKey &getPublicKey() const { return m_PublicKey; }
+
+    // Returns nullopt if the peer's key is invalid, e.g. a low order point
+    std::optional<SharedSecret>
+    deriveSharedSecret(const uint8_t *peerPublicKey) const {
+        std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> peerKey(
+            EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr,
+                                        peerPublicKey, keySize),
+            EVP_PKEY_free);
+        PKeyContext context(EVP_PKEY_CTX_new(m_Key.get(), nullptr),
+                            EVP_PKEY_CTX_free);
+
+        SharedSecret sharedSecret;
+        size_t sharedSecretSize = sharedSecret.size();
+        if (!peerKey || !context || EVP_PKEY_derive_init(context.get()) != 1 ||
+            EVP_PKEY_derive_set_peer(context.get(), peerKey.get()) != 1 ||
+            EVP_PKEY_derive(context.get(), sharedSecret.data(),
+                            &sharedSecretSize) != 1) {
+            return std::nullopt;
+        }
+
+        return sharedSecret;
+    }
+
+  private:
+    using PKeyContext =
+        std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)>;
+
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> m_Key;
+    PublicKey m_PublicKey;
+};
+
+struct SessionKeys {
+    TunnelCipher::Key clientToServer;
+    TunnelCipher::Key serverToClient;
+};
+
+// Derives the tunnel keys of both directions with HKDF-SHA256. The input key
+// is the X25519 shared secret followed by the pre-shared secret, and the salt
+// is the client nonce followed by the server nonce.
+inline SessionKeys deriveSessionKeys(
+    const X25519KeyPair::SharedSecret &sharedSecret, const std::string &secret,
+    const uint8_t *nonces, size_t noncesSize) {
+    std::vector<uint8_t> inputKey(sharedSecret.begin(), sharedSecret.end());
+    inputKey.insert(inputKey.end(), secret.begin(), secret.end());
+
+    return {TunnelCipher::deriveKey(inputKey.data(), inputKey.size(), nonces,
+                                    noncesSize, "ToyVpn client to server"),
+            TunnelCipher::deriveKey(inputKey.data(), inputKey.size(), nonces,
+                                    noncesSize, "ToyVpn server to client")};
+}
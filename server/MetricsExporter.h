@@ -0,0 +1,221 @@
+#pragma once
+
+#include "Log.h"
+#include "StatsSegment.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Serves the stats segment as Prometheus text on a loopback TCP port, from
+// its own thread. It only reads the segment, so scrapes never take a lock or
+// slow down the reactor.
+class MetricsExporter {
+  public:
+    MetricsExporter(const StatsSegment &stats, uint16_t port)
+        : m_Stats(stats) {
+        int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenSocket < 0) {
+            throw std::runtime_error("Error creating the metrics socket!");
+        }
+
+        int flag = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &flag,
+                   sizeof(flag));
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (bind(listenSocket, reinterpret_cast<sockaddr *>(&address),
+                 sizeof(address)) < 0 ||
+            listen(listenSocket, m_Backlog) < 0) {
+            close(listenSocket);
+            std::array<char, 256> buffer;
+            throw std::runtime_error(
+                "Error binding the metrics socket: " +
+                std::string(strerror_r(errno, buffer.data(), buffer.size())));
+        }
+
+        TOYVPN_LOG_INFO("Serving metrics on http://127.0.0.1:"
+                        << port << "/metrics");
+        m_ListenSocket = listenSocket;
+        m_Thread = std::thread(&MetricsExporter::run, this);
+    }
+
+    virtual ~MetricsExporter() {
+        stop();
+        close(m_ListenSocket);
+    }
+
+    void stop() {
+        m_StopFlag = true;
+        if (m_Thread.joinable()) {
+            m_Thread.join();
+        }
+    }
+
+    // The Prometheus text exposition format of everything in the segment
+    static std::string render(const StatsSegment &stats) {
+        std::ostringstream text;
+        auto &reactor = stats.getReactorStats();
+        for (const auto &metric : m_ReactorMetrics) {
+            text << "# HELP toyvpn_" << metric.name << " " << metric.help
+                 << "\n# TYPE toyvpn_" << metric.name << " " << metric.type
+                 << "\ntoyvpn_" << metric.name << "{reactor=\"0\"} "
+                 << (reactor.*metric.counter).get() << "\n";
+        }
+
+        // Every metric has to be in one group, so the clients are read once
+        // and printed per metric
+        std::vector<std::pair<uint32_t, StatsSegment::ClientValues>> clients;
+        stats.forEachClient(
+            [&](uint32_t address, const StatsSegment::ClientValues &values) {
+                clients.emplace_back(address, values);
+            });
+
+        for (size_t i = 0; i < m_ClientMetrics.size(); i++) {
+            const auto &metric = m_ClientMetrics[i];
+            text << "# HELP toyvpn_client_" << metric.name << " "
+                 << metric.help << "\n# TYPE toyvpn_client_" << metric.name
+                 << " counter\n";
+            for (const auto &[address, values] : clients) {
+                std::array<char, INET_ADDRSTRLEN> addressString;
+                inet_ntop(AF_INET, &address, addressString.data(),
+                          addressString.size());
+                text << "toyvpn_client_" << metric.name << "{address=\""
+                     << addressString.data() << "\"} " << values[i] << "\n";
+            }
+        }
+        return text.str();
+    }
+
+  private:
+    struct ReactorMetric {
+        const char *name;
+        const char *type;
+        const char *help;
+        StatCounter ReactorStats::*counter;
+    };
+
+    struct ClientMetric {
+        const char *name;
+        const char *help;
+    };
+
+    constexpr static int m_Backlog = 16;
+    constexpr static int m_PollTimeoutMs = 200;
+    constexpr static size_t m_RequestBufferSize = 4096;
+
+    // In the order of clientStatCounters
+    constexpr static std::array<ClientMetric, clientStatCounters.size()>
+        m_ClientMetrics = {{
+            {"packets_received_total", "Packets from the client to the TUN"},
+            {"bytes_received_total", "Bytes from the client to the TUN"},
+            {"packets_sent_total", "Packets from the TUN to the client"},
+            {"bytes_sent_total", "Bytes from the TUN to the client"},
+            {"dropped_received_total",
+             "Packets from the client over its rate limit"},
+            {"dropped_sent_total",
+             "Packets to the client over its rate limit or queue"},
+            {"invalid_received_total",
+             "Datagrams from the client that failed decryption or parsing"},
+            {"recovered_received_total",
+             "Packets from the client recovered by FEC"},
+        }};
+
+    constexpr static std::array<ReactorMetric, 13> m_ReactorMetrics = {{
+        {"wakeups_total", "counter", "Epoll wakeups", &ReactorStats::wakeups},
+        {"datagrams_received_total", "counter", "Datagrams from clients",
+         &ReactorStats::datagramsReceived},
+        {"tun_packets_received_total", "counter",
+         "Packets read from the TUN interface",
+         &ReactorStats::tunPacketsReceived},
+        {"handshakes_started_total", "counter",
+         "Encrypted handshakes handed to the key exchange workers",
+         &ReactorStats::handshakesStarted},
+        {"handshakes_rejected_total", "counter",
+         "Hellos rejected by the handshake guard",
+         &ReactorStats::handshakesRejected},
+        {"sessions_created_total", "counter", "Sessions created",
+         &ReactorStats::sessionsCreated},
+        {"sessions_resumed_total", "counter",
+         "Sessions that got their address back with a resumption token",
+         &ReactorStats::sessionsResumed},
+        {"sessions_evicted_total", "counter",
+         "Sessions removed after disconnecting or going idle",
+         &ReactorStats::sessionsEvicted},
+        {"active_clients", "gauge", "Sessions", &ReactorStats::activeClients},
+        {"pending_key_exchanges", "gauge",
+         "Key exchanges running on the workers",
+         &ReactorStats::pendingKeyExchanges},
+        {"held_addresses", "gauge",
+         "Addresses held for clients that may resume",
+         &ReactorStats::heldAddresses},
+        {"free_addresses", "gauge", "Free addresses in the pool",
+         &ReactorStats::freeAddresses},
+        {"egress_queued_packets", "gauge",
+         "Packets waiting in the egress queues",
+         &ReactorStats::egressQueuedPackets},
+    }};
+
+    const StatsSegment &m_Stats;
+    int m_ListenSocket = -1;
+    std::atomic<bool> m_StopFlag{false};
+    std::thread m_Thread;
+
+    void run() {
+        TOYVPN_LOG_DEBUG("Starting metrics thread");
+        pollfd listenPoll{m_ListenSocket, POLLIN, 0};
+        while (!m_StopFlag) {
+            if (poll(&listenPoll, 1, m_PollTimeoutMs) <= 0) {
+                continue;
+            }
+
+            int connection = accept(m_ListenSocket, nullptr, nullptr);
+            if (connection < 0) {
+                continue;
+            }
+            serve(connection);
+            close(connection);
+        }
+        TOYVPN_LOG_DEBUG("Stopping metrics thread");
+    }
+
+    // Every request gets the metrics, whatever its path
+    void serve(int connection) const {
+        timeval timeout{0, m_PollTimeoutMs * 1000};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout));
+        std::array<char, m_RequestBufferSize> request;
+        if (recv(connection, request.data(), request.size(), 0) <= 0) {
+            return;
+        }
+
+        auto body = render(m_Stats);
+        auto response = "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: " +
+                        std::to_string(body.size()) +
+                        "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            auto result = send(connection, response.data() + sent,
+                               response.size() - sent, MSG_NOSIGNAL);
+            if (result <= 0) {
+                return;
+            }
+            sent += result;
+        }
+    }
+};
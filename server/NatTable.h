@@ -0,0 +1,422 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Source NAT of the clients' IPv4 TCP, UDP and ICMP echo traffic to a single
+// public address, done in userspace (NAPT as in RFC 4787, 5382 and 5508).
+//
+// The mappings are endpoint independent: a client address and port keeps its
+// public port whatever it talks to. That makes the table flat, one entry per
+// public port and protocol, so translating a packet from the internet is an
+// array lookup. Entries expire after a protocol-specific idle time and their
+// port is reused by the next new mapping. Checksums are updated
+// incrementally (RFC 1624) rather than recomputed.
+//
+// Fragments can't be matched to a mapping and are dropped.
+class NatTable {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    NatTable(uint32_t natAddress) : m_NatAddress(natAddress) {
+        for (auto &entries : m_Entries) {
+            entries.resize(UINT16_MAX + 1);
+        }
+    }
+
+    // Rewrites the source of an IPv4 packet from a client to the NAT address
+    // and the port mapped to the client's address and port, creating the
+    // mapping if needed, and decrements its TTL. Returns false if the packet
+    // has to be dropped.
+    bool translateOutbound(uint8_t *packet, size_t packetSize,
+                           const Clock::time_point &now) {
+        auto transportSize = getTransportSize(packet, packetSize);
+        if (transportSize == 0) {
+            return false;
+        }
+
+        auto transport = packet + packetSize - transportSize;
+        auto field = getPortField(packet[9], transport, transportSize, true);
+        if (!field.has_value()) {
+            return false;
+        }
+
+        uint32_t clientAddress = read32(packet + 12);
+        uint16_t clientPort = read16(transport + field->portOffset);
+        auto natPort = getMapping(field->protocol, clientAddress, clientPort,
+                                  now);
+        if (natPort == 0) {
+            return false;
+        }
+
+        auto &entry = m_Entries[field->protocol][natPort];
+        updateEntry(entry, field->protocol, transport, now);
+
+        decrementTtl(packet);
+        write32(packet + 12, m_NatAddress, packet + 10);
+        auto checksum = transport + field->checksumOffset;
+        if (field->protocol != m_IcmpIndex) {
+            adjustChecksum32(checksum, clientAddress, m_NatAddress,
+                             field->protocol == m_UdpIndex);
+        }
+        write16(transport + field->portOffset, natPort, checksum,
+                field->protocol == m_UdpIndex);
+        return true;
+    }
+
+    // Rewrites the destination of an IPv4 packet to the NAT address back to
+    // the client it is mapped to and decrements its TTL. ICMP errors about a
+    // translated packet are translated along with the packet they carry.
+    // Returns false if the packet has to be dropped.
+    bool translateInbound(uint8_t *packet, size_t packetSize,
+                          const Clock::time_point &now) {
+        auto transportSize = getTransportSize(packet, packetSize);
+        if (transportSize == 0 || read32(packet + 16) != m_NatAddress) {
+            return false;
+        }
+
+        auto transport = packet + packetSize - transportSize;
+        if (packet[9] == m_IcmpProtocol && isIcmpError(transport[0])) {
+            return translateIcmpError(packet, transport, transportSize, now);
+        }
+
+        auto field = getPortField(packet[9], transport, transportSize, false);
+        if (!field.has_value()) {
+            return false;
+        }
+
+        uint16_t natPort = read16(transport + field->portOffset);
+        auto &entry = m_Entries[field->protocol][natPort];
+        if (!isActive(entry, now)) {
+            return false;
+        }
+        updateEntry(entry, field->protocol, transport, now);
+
+        decrementTtl(packet);
+        write32(packet + 16, entry.clientAddress, packet + 10);
+        auto checksum = transport + field->checksumOffset;
+        if (field->protocol != m_IcmpIndex) {
+            adjustChecksum32(checksum, m_NatAddress, entry.clientAddress,
+                             field->protocol == m_UdpIndex);
+        }
+        write16(transport + field->portOffset, entry.clientPort, checksum,
+                field->protocol == m_UdpIndex);
+        return true;
+    }
+
+    // Computes the TCP or UDP checksum of an IPv4 packet from scratch, for
+    // packets whose sender left it to checksum offload
+    static void fillTransportChecksum(uint8_t *packet, size_t packetSize) {
+        auto transportSize = getTransportSize(packet, packetSize);
+        size_t checksumOffset = 0;
+        if (packet[9] == m_TcpProtocol && transportSize >= m_TcpHeaderSize) {
+            checksumOffset = 16;
+        } else if (packet[9] == m_UdpProtocol &&
+                   transportSize >= m_UdpHeaderSize) {
+            checksumOffset = 6;
+        } else {
+            return;
+        }
+
+        auto transport = packet + packetSize - transportSize;
+        transport[checksumOffset] = 0;
+        transport[checksumOffset + 1] = 0;
+        // The pseudo header: addresses, protocol and transport length
+        uint32_t sum = static_cast<uint16_t>(~getChecksum(packet + 12, 8)) +
+                       packet[9] + transportSize;
+        sum = (sum & 0xffff) + (sum >> 16);
+        uint16_t checksum = getChecksum(transport, transportSize, sum);
+        if (packet[9] == m_UdpProtocol && checksum == 0) {
+            checksum = 0xffff;
+        }
+        transport[checksumOffset] = checksum >> 8;
+        transport[checksumOffset + 1] = checksum & 0xff;
+    }
+
+    size_t getMappingCount() const {
+        size_t count = 0;
+        for (const auto &mappings : m_Mappings) {
+            count += mappings.size();
+        }
+        return count;
+    }
+
+  private:
+    struct Entry {
+        uint32_t clientAddress = 0;
+        uint16_t clientPort = 0;
+        bool isUsed = false;
+        bool isClosing = false;
+        Clock::time_point expiry;
+    };
+
+    struct PortField {
+        size_t protocol;
+        size_t portOffset;
+        size_t checksumOffset;
+    };
+
+    constexpr static uint8_t m_IcmpProtocol = 1;
+    constexpr static uint8_t m_TcpProtocol = 6;
+    constexpr static uint8_t m_UdpProtocol = 17;
+    constexpr static size_t m_TcpIndex = 0;
+    constexpr static size_t m_UdpIndex = 1;
+    constexpr static size_t m_IcmpIndex = 2;
+    constexpr static size_t m_IpHeaderSize = 20;
+    constexpr static size_t m_TcpHeaderSize = 20;
+    constexpr static size_t m_UdpHeaderSize = 8;
+    constexpr static size_t m_IcmpHeaderSize = 8;
+    constexpr static uint8_t m_IcmpEchoReply = 0;
+    constexpr static uint8_t m_IcmpEchoRequest = 8;
+    constexpr static uint8_t m_TcpFinOrRst = 0x05;
+    constexpr static uint8_t m_TcpSyn = 0x02;
+    constexpr static uint16_t m_FirstPort = 1024;
+    constexpr static size_t m_PortCount = UINT16_MAX + 1 - m_FirstPort;
+    // RFC 5382 REQ-5, RFC 4787 REQ-5 and RFC 5508 REQ-1
+    constexpr static std::chrono::duration m_TcpTimeout =
+        std::chrono::minutes(124);
+    constexpr static std::chrono::duration m_TcpClosingTimeout =
+        std::chrono::minutes(4);
+    constexpr static std::chrono::duration m_UdpTimeout =
+        std::chrono::minutes(5);
+    constexpr static std::chrono::duration m_IcmpTimeout =
+        std::chrono::minutes(1);
+
+    uint32_t m_NatAddress;
+    // Indexed by protocol and then by public port
+    std::array<std::vector<Entry>, 3> m_Entries;
+    // The public port of every client address and port, by protocol
+    std::array<std::unordered_map<uint64_t, uint16_t>, 3> m_Mappings;
+    std::array<size_t, 3> m_NextPort = {};
+
+    static uint16_t read16(const uint8_t *data) {
+        return (data[0] << 8) | data[1];
+    }
+
+    static uint32_t read32(const uint8_t *data) {
+        return (uint32_t(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) |
+               data[3];
+    }
+
+    // Incremental checksum update (RFC 1624) for one 16 bit word. A UDP
+    // checksum of 0 means there is none, so it stays 0 and a result of 0 is
+    // sent as 0xffff.
+    static void adjustChecksum(uint8_t *checksumField, uint16_t oldWord,
+                               uint16_t newWord, bool isUdp = false) {
+        uint16_t checksum = read16(checksumField);
+        if (isUdp && checksum == 0) {
+            return;
+        }
+        uint32_t sum = static_cast<uint16_t>(~checksum) +
+                       static_cast<uint16_t>(~oldWord) + newWord;
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = (sum & 0xffff) + (sum >> 16);
+        checksum = ~sum;
+        if (isUdp && checksum == 0) {
+            checksum = 0xffff;
+        }
+        checksumField[0] = checksum >> 8;
+        checksumField[1] = checksum & 0xff;
+    }
+
+    static void adjustChecksum32(uint8_t *checksumField, uint32_t oldValue,
+                                 uint32_t newValue, bool isUdp) {
+        adjustChecksum(checksumField, oldValue >> 16, newValue >> 16, isUdp);
+        adjustChecksum(checksumField, oldValue & 0xffff, newValue & 0xffff,
+                       isUdp);
+    }
+
+    static void write16(uint8_t *data, uint16_t value, uint8_t *checksumField,
+                        bool isUdp = false) {
+        adjustChecksum(checksumField, read16(data), value, isUdp);
+        data[0] = value >> 8;
+        data[1] = value & 0xff;
+    }
+
+    static void write32(uint8_t *data, uint32_t value, uint8_t *checksumField) {
+        adjustChecksum32(checksumField, read32(data), value, false);
+        for (int i = 0; i < 4; i++) {
+            data[i] = value >> (24 - 8 * i);
+        }
+    }
+
+    static void decrementTtl(uint8_t *packet) {
+        uint16_t oldWord = read16(packet + 8);
+        packet[8]--;
+        adjustChecksum(packet + 10, oldWord, read16(packet + 8));
+    }
+
+    static uint16_t getChecksum(const uint8_t *data, size_t dataSize,
+                                uint32_t sum = 0) {
+        for (size_t i = 0; i + 1 < dataSize; i += 2) {
+            sum += read16(data + i);
+        }
+        if (dataSize % 2 == 1) {
+            sum += data[dataSize - 1] << 8;
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return ~sum & 0xffff;
+    }
+
+    static bool isIcmpError(uint8_t type) {
+        // Destination unreachable, time exceeded and parameter problem
+        return type == 3 || type == 11 || type == 12;
+    }
+
+    // Returns the size of the transport header and payload of an unfragmented
+    // IPv4 packet whose TTL allows forwarding it, or 0
+    static size_t getTransportSize(const uint8_t *packet, size_t packetSize) {
+        if (packetSize < m_IpHeaderSize || (packet[0] >> 4) != 4) {
+            return 0;
+        }
+        size_t headerSize = (packet[0] & 0x0f) * 4;
+        if (headerSize < m_IpHeaderSize || headerSize >= packetSize ||
+            read16(packet + 2) != packetSize || (packet[6] & 0x3f) != 0 ||
+            packet[7] != 0 || packet[8] <= 1) {
+            return 0;
+        }
+        return packetSize - headerSize;
+    }
+
+    // Where the port, or the ICMP echo identifier, and the checksum of a
+    // translatable transport header are
+    static std::optional<PortField> getPortField(uint8_t protocol,
+                                                 const uint8_t *transport,
+                                                 size_t transportSize,
+                                                 bool isOutbound) {
+        switch (protocol) {
+        case m_TcpProtocol:
+            if (transportSize < m_TcpHeaderSize) {
+                return std::nullopt;
+            }
+            return PortField{m_TcpIndex, isOutbound ? 0u : 2u, 16};
+        case m_UdpProtocol:
+            if (transportSize < m_UdpHeaderSize) {
+                return std::nullopt;
+            }
+            return PortField{m_UdpIndex, isOutbound ? 0u : 2u, 6};
+        case m_IcmpProtocol:
+            if (transportSize < m_IcmpHeaderSize ||
+                transport[0] !=
+                    (isOutbound ? m_IcmpEchoRequest : m_IcmpEchoReply)) {
+                return std::nullopt;
+            }
+            return PortField{m_IcmpIndex, 4, 2};
+        default:
+            return std::nullopt;
+        }
+    }
+
+    static bool isActive(const Entry &entry, const Clock::time_point &now) {
+        return entry.isUsed && now < entry.expiry;
+    }
+
+    // Both directions keep a mapping alive. TCP mappings time out sooner once
+    // a FIN or RST was seen, until a new SYN reuses them.
+    static void updateEntry(Entry &entry, size_t protocol,
+                            const uint8_t *transport,
+                            const Clock::time_point &now) {
+        if (protocol == m_TcpIndex) {
+            uint8_t flags = transport[13];
+            if (flags & m_TcpFinOrRst) {
+                entry.isClosing = true;
+            } else if (flags & m_TcpSyn) {
+                entry.isClosing = false;
+            }
+            entry.expiry = now + (entry.isClosing ? m_TcpClosingTimeout
+                                                  : m_TcpTimeout);
+        } else if (protocol == m_UdpIndex) {
+            entry.expiry = now + m_UdpTimeout;
+        } else {
+            entry.expiry = now + m_IcmpTimeout;
+        }
+    }
+
+    // Returns the public port of a client address and port, allocating one
+    // that is free or expired if there is none yet, or 0 if all are in use
+    uint16_t getMapping(size_t protocol, uint32_t clientAddress,
+                        uint16_t clientPort, const Clock::time_point &now) {
+        auto &mappings = m_Mappings[protocol];
+        uint64_t key = (uint64_t(clientAddress) << 16) | clientPort;
+        if (auto it = mappings.find(key); it != mappings.end()) {
+            return it->second;
+        }
+
+        auto &entries = m_Entries[protocol];
+        auto &nextPort = m_NextPort[protocol];
+        for (size_t i = 0; i < m_PortCount; i++) {
+            uint16_t port = m_FirstPort + nextPort;
+            nextPort = (nextPort + 1) % m_PortCount;
+            auto &entry = entries[port];
+            if (isActive(entry, now)) {
+                continue;
+            }
+            if (entry.isUsed) {
+                mappings.erase((uint64_t(entry.clientAddress) << 16) |
+                               entry.clientPort);
+            }
+            entry = Entry{clientAddress, clientPort, true, false, now};
+            mappings[key] = port;
+            return port;
+        }
+
+        return 0;
+    }
+
+    bool translateIcmpError(uint8_t *packet, uint8_t *icmp, size_t icmpSize,
+                            const Clock::time_point &now) {
+        // The packet in the error is one the NAT sent, so its source is the
+        // NAT address and port
+        auto inner = icmp + m_IcmpHeaderSize;
+        size_t innerSize = icmpSize - m_IcmpHeaderSize;
+        if (icmpSize < m_IcmpHeaderSize + m_IpHeaderSize ||
+            (inner[0] >> 4) != 4 || read32(inner + 12) != m_NatAddress) {
+            return false;
+        }
+        size_t innerHeaderSize = (inner[0] & 0x0f) * 4;
+        if (innerHeaderSize < m_IpHeaderSize ||
+            innerHeaderSize + 8 > innerSize) {
+            return false;
+        }
+
+        auto innerTransport = inner + innerHeaderSize;
+        size_t protocol = 0;
+        size_t portOffset = 0;
+        if (inner[9] == m_TcpProtocol) {
+            protocol = m_TcpIndex;
+        } else if (inner[9] == m_UdpProtocol) {
+            protocol = m_UdpIndex;
+        } else if (inner[9] == m_IcmpProtocol &&
+                   innerTransport[0] == m_IcmpEchoRequest) {
+            protocol = m_IcmpIndex;
+            portOffset = 4;
+        } else {
+            return false;
+        }
+
+        auto &entry = m_Entries[protocol][read16(innerTransport + portOffset)];
+        if (!isActive(entry, now)) {
+            return false;
+        }
+
+        // The transport checksum of the inner packet is left alone, the
+        // packet is usually truncated so it can't be checked anyway
+        decrementTtl(packet);
+        write32(packet + 16, entry.clientAddress, packet + 10);
+        write32(inner + 12, entry.clientAddress, inner + 10);
+        innerTransport[portOffset] = entry.clientPort >> 8;
+        innerTransport[portOffset + 1] = entry.clientPort & 0xff;
+        icmp[2] = 0;
+        icmp[3] = 0;
+        uint16_t checksum = getChecksum(icmp, icmpSize);
+        icmp[2] = checksum >> 8;
+        icmp[3] = checksum & 0xff;
+        return true;
+    }
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Packs the packets to one client into a single datagram as
+// (5, size, message, size, message, ...), so small packets like ACKs don't
+// each pay for an outer IP/UDP header and a system call on both ends. The
+// buffer has room for the cipher overhead after the payload so it can be
+// encrypted in place.
+class PacketCoalescer {
+  public:
+    constexpr static uint8_t messageType = 5;
+    constexpr static size_t frameHeaderSize = 2;
+
+    PacketCoalescer(size_t maxPayloadSize, size_t overhead)
+        : m_MaxPayloadSize(maxPayloadSize),
+          m_Buffer(maxPayloadSize + overhead) {}
+
+    bool isEmpty() const { return m_FrameCount == 0; }
+
+    bool canAdd(size_t dataSize) const {
+        size_t payloadSize = isEmpty() ? 1 : m_PayloadSize;
+        return payloadSize + frameHeaderSize + dataSize <= m_MaxPayloadSize;
+    }
+
+    // canAdd() must be checked first
+    void add(const uint8_t *data, size_t dataSize) {
+        if (isEmpty()) {
+            m_Buffer[0] = messageType;
+            m_PayloadSize = 1;
+        }
+
+        m_Buffer[m_PayloadSize] = dataSize >> 8;
+        m_Buffer[m_PayloadSize + 1] = dataSize & 0xff;
+        std::memcpy(m_Buffer.data() + m_PayloadSize + frameHeaderSize, data,
+                    dataSize);
+        m_PayloadSize += frameHeaderSize + dataSize;
+        m_FrameCount++;
+    }
+
+    // Returns the payload to send and empties the coalescer. A single packet
+    // is returned as it is, without the framing.
+    std::pair<uint8_t *, size_t> take() {
+        auto frameCount = m_FrameCount;
+        m_FrameCount = 0;
+        if (frameCount == 1) {
+            return {m_Buffer.data() + 1 + frameHeaderSize,
+                    m_PayloadSize - 1 - frameHeaderSize};
+        }
+        return {m_Buffer.data(), m_PayloadSize};
+    }
+
+    // Calls the callback with every message of a coalesced datagram. Returns
+    // false if the framing is malformed.
+    template <typename Callback>
+    static bool forEachFrame(const uint8_t *data, size_t dataSize,
+                             const Callback &callback) {
+        if (dataSize == 0 || data[0] != messageType) {
+            return false;
+        }
+
+        size_t offset = 1;
+        while (offset < dataSize) {
+            if (offset + frameHeaderSize > dataSize) {
+                return false;
+            }
+
+            size_t frameSize = (data[offset] << 8) | data[offset + 1];
+            offset += frameHeaderSize;
+            if (frameSize == 0 || offset + frameSize > dataSize) {
+                return false;
+            }
+
+            callback(data + offset, frameSize);
+            offset += frameSize;
+        }
+
+        return true;
+    }
+
+  private:
+    size_t m_MaxPayloadSize;
+    std::vector<uint8_t> m_Buffer;
+    size_t m_PayloadSize = 0;
+    size_t m_FrameCount = 0;
+};
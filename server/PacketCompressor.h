@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdint>
+#include <lz4.h>
+#include <optional>
+#include <vector>
+
+struct CompressionCounters {
+    uint64_t compressedPackets = 0;
+    uint64_t skippedPackets = 0;
+    uint64_t bytesBefore = 0;
+    uint64_t bytesAfter = 0;
+};
+
+// Per-packet LZ4 compression of tunnel payloads. A compressed packet is
+// (4, original size, LZ4 block) and every packet is compressed on its own, so
+// losing one doesn't affect the others. Packets that are unlikely to compress,
+// like TLS records and other encrypted protocols, are sent as they are without
+// running the compressor, and so are packets where it didn't save enough.
+class PacketCompressor {
+  public:
+    constexpr static uint8_t messageType = 4;
+    constexpr static size_t headerSize = 3;
+
+    PacketCompressor() : m_State(LZ4_sizeofState()) {}
+
+    // Writes the compressed message to output, which must have room for
+    // dataSize bytes. Returns 0 if the packet should be sent uncompressed.
+    size_t compress(const uint8_t *data, size_t dataSize, uint8_t *output) {
+        if (dataSize < m_MinPacketSize || dataSize > UINT16_MAX ||
+            !isCompressible(data, dataSize)) {
+            m_Counters.skippedPackets++;
+            return 0;
+        }
+
+        int compressedSize = LZ4_compress_fast_extState(
+            m_State.data(), reinterpret_cast<const char *>(data),
+            reinterpret_cast<char *>(output + headerSize), dataSize,
+            dataSize - headerSize - m_MinSavings, m_Acceleration);
+        if (compressedSize <= 0) {
+            m_Counters.skippedPackets++;
+            return 0;
+        }
+
+        output[0] = messageType;
+        output[1] = dataSize >> 8;
+        output[2] = dataSize & 0xff;
+
+        m_Counters.compressedPackets++;
+        m_Counters.bytesBefore += dataSize;
+        m_Counters.bytesAfter += compressedSize + headerSize;
+        return compressedSize + headerSize;
+    }
+
+    // Returns the size of the decompressed packet, or nullopt if the message
+    // is malformed or doesn't fit in outputCapacity
+    static std::optional<size_t> decompress(const uint8_t *data,
+                                            size_t dataSize, uint8_t *output,
+                                            size_t outputCapacity) {
+        if (dataSize <= headerSize || data[0] != messageType) {
+            return std::nullopt;
+        }
+
+        size_t originalSize = (data[1] << 8) | data[2];
+        if (originalSize > outputCapacity) {
+            return std::nullopt;
+        }
+
+        int decompressedSize = LZ4_decompress_safe(
+            reinterpret_cast<const char *>(data + headerSize),
+            reinterpret_cast<char *>(output), dataSize - headerSize,
+            originalSize);
+        if (decompressedSize < 0 ||
+            static_cast<size_t>(decompressedSize) != originalSize) {
+            return std::nullopt;
+        }
+
+        return originalSize;
+    }
+
+    // A cheap guess based on the IP and transport headers, so packets that
+    // are already encrypted or compressed don't cost a compression attempt
+    static bool isCompressible(const uint8_t *packet, size_t packetSize) {
+        uint8_t protocol;
+        size_t headerLength;
+        if ((packet[0] >> 4) == 4 && packetSize >= 20) {
+            protocol = packet[9];
+            headerLength = (packet[0] & 0x0f) * 4;
+            // Only the first fragment has the transport header
+            if (((packet[6] & 0x1f) << 8 | packet[7]) != 0) {
+                return true;
+            }
+        } else if ((packet[0] >> 4) == 6 && packetSize >= 40) {
+            protocol = packet[6];
+            headerLength = 40;
+        } else {
+            return true;
+        }
+
+        if (protocol == m_EspProtocol) {
+            return false;
+        }
+
+        if (headerLength + 4 > packetSize ||
+            (protocol != m_TcpProtocol && protocol != m_UdpProtocol)) {
+            return true;
+        }
+
+        auto transport = packet + headerLength;
+        size_t transportSize = packetSize - headerLength;
+
+        uint16_t sourcePort = (transport[0] << 8) | transport[1];
+        uint16_t destinationPort = (transport[2] << 8) | transport[3];
+        if (isEncryptedPort(sourcePort) || isEncryptedPort(destinationPort)) {
+            return false;
+        }
+
+        size_t payloadOffset = 8;
+        if (protocol == m_TcpProtocol) {
+            if (transportSize < 20) {
+                return true;
+            }
+            payloadOffset = (transport[12] >> 4) * 4;
+        }
+        if (payloadOffset + 3 > transportSize) {
+            return true;
+        }
+
+        return !isTlsRecord(transport + payloadOffset);
+    }
+
+    const CompressionCounters &getCounters() const { return m_Counters; }
+
+  private:
+    constexpr static uint8_t m_TcpProtocol = 6;
+    constexpr static uint8_t m_UdpProtocol = 17;
+    constexpr static uint8_t m_EspProtocol = 50;
+    constexpr static size_t m_MinPacketSize = 128;
+    constexpr static size_t m_MinSavings = 16;
+    constexpr static int m_Acceleration = 1;
+
+    std::vector<char> m_State;
+    CompressionCounters m_Counters;
+
+    // HTTPS and QUIC, DNS over TLS/QUIC, SSH, IMAPS, POP3S and SMTPS
+    static bool isEncryptedPort(uint16_t port) {
+        switch (port) {
+        case 22:
+        case 443:
+        case 465:
+        case 853:
+        case 993:
+        case 995:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // A TLS record header: content type 20-23 and protocol version 3.x
+    static bool isTlsRecord(const uint8_t *payload) {
+        return payload[0] >= 20 && payload[0] <= 23 && payload[1] == 3 &&
+               payload[2] <= 4;
+    }
+};
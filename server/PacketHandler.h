@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Log.h"
+#include "Tracing.h"
 #include "libs/concurrentqueue/concurrentqueue.h"
 #include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
 #include "libs/pcapplusplus/include/pcapplusplus/PcapFileDevice.h"
@@ -40,8 +41,12 @@ class PacketHandler {
     void handlePacket(const pcpp::IPv4Address &clientAddress,
                       const std::array<uint8_t, BUFFER_SIZE> &buffer,
                       size_t dataSize) {
-        std::vector<uint8_t> bufferVector(buffer.begin(),
-                                          buffer.begin() + dataSize);
+        handlePacket(clientAddress, buffer.data(), dataSize);
+    }
+
+    void handlePacket(const pcpp::IPv4Address &clientAddress,
+                      const uint8_t *data, size_t dataSize) {
+        std::vector<uint8_t> bufferVector(data, data + dataSize);
         m_PacketQueue.enqueue({clientAddress, bufferVector});
     }
 
@@ -61,10 +66,14 @@ class PacketHandler {
 
     void run() {
         TOYVPN_LOG_DEBUG("Starting packet handling thread");
+        Tracing::setThreadName("capture");
         while (!m_StopFlag) {
             PacketQueueItem items[m_DequeueBulkSize];
             auto itemCount =
                 m_PacketQueue.try_dequeue_bulk(items, m_DequeueBulkSize);
+            if (itemCount > 0) {
+                TOYVPN_TRACE(CaptureFlush, 'B', itemCount);
+            }
             auto timestamp = getCurrentTimestamp();
             for (auto it = std::begin(items);
                  it != std::begin(items) + itemCount; ++it) {
@@ -78,6 +87,9 @@ class PacketHandler {
                                           pcpp::LINKTYPE_DLT_RAW1);
                 pcapWriter->writePacket(rawPacket);
             }
+            if (itemCount > 0) {
+                TOYVPN_TRACE(CaptureFlush, 'E', itemCount);
+            }
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
         TOYVPN_LOG_DEBUG("Stopping packet handling thread");
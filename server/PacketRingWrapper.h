@@ -0,0 +1,248 @@
+#pragma once
+
+#include "Log.h"
+#include <arpa/inet.h>
+#include <array>
+#include <cstring>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// An AF_PACKET socket on a network interface with TPACKET_V3 receive and
+// transmit rings mapped into the process, so whole Ethernet frames are read
+// and written in place without a system call per frame.
+//
+// The kernel fills the receive ring a block at a time and hands a block over
+// when it is full or after m_RxBlockTimeoutMs, which bounds the latency added
+// at low rates. Transmitted frames are queued in the transmit ring and sent
+// by flush() with one system call.
+class PacketRingWrapper {
+  public:
+    // A frame to send and its header fit in 2048 bytes of the ring
+    constexpr static size_t maxFrameSize = 2000;
+
+    virtual ~PacketRingWrapper() {
+        if (m_Ring != MAP_FAILED) {
+            munmap(m_Ring, m_RingSize);
+        }
+        if (m_Socket != -1) {
+            close(m_Socket);
+        }
+    }
+
+    // Only the frames the filter accepts reach the receive ring
+    void init(const std::string &interfaceName,
+              std::vector<sock_filter> filter) {
+        m_InterfaceIndex = if_nametoindex(interfaceName.c_str());
+        if (m_InterfaceIndex == 0) {
+            throw std::runtime_error("Couldn't find network interface '" +
+                                     interfaceName + "'");
+        }
+
+        // No protocol until the filter is attached, so nothing else gets in
+        m_Socket = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, 0);
+        if (m_Socket < 0) {
+            throw std::runtime_error("Couldn't create packet socket: " +
+                                     getError());
+        }
+
+        int version = TPACKET_V3;
+        setOption(PACKET_VERSION, &version, sizeof(version), "PACKET_VERSION");
+
+        sock_fprog program{static_cast<unsigned short>(filter.size()),
+                           filter.data()};
+        if (setsockopt(m_Socket, SOL_SOCKET, SO_ATTACH_FILTER, &program,
+                       sizeof(program)) < 0) {
+            throw std::runtime_error("Couldn't attach packet filter: " +
+                                     getError());
+        }
+
+        int ignoreOutgoing = 1;
+        setOption(PACKET_IGNORE_OUTGOING, &ignoreOutgoing,
+                  sizeof(ignoreOutgoing), "PACKET_IGNORE_OUTGOING");
+
+        tpacket_req3 rxRing{};
+        rxRing.tp_block_size = m_RxBlockSize;
+        rxRing.tp_block_nr = m_RxBlockCount;
+        rxRing.tp_frame_size = m_FrameSize;
+        rxRing.tp_frame_nr = m_RxBlockSize / m_FrameSize * m_RxBlockCount;
+        rxRing.tp_retire_blk_tov = m_RxBlockTimeoutMs;
+        setOption(PACKET_RX_RING, &rxRing, sizeof(rxRing), "PACKET_RX_RING");
+
+        tpacket_req3 txRing{};
+        txRing.tp_block_size = m_TxBlockSize;
+        txRing.tp_block_nr = m_TxBlockCount;
+        txRing.tp_frame_size = m_FrameSize;
+        txRing.tp_frame_nr = m_TxFrameCount;
+        setOption(PACKET_TX_RING, &txRing, sizeof(txRing), "PACKET_TX_RING");
+
+        m_RingSize = size_t(m_RxBlockSize) * m_RxBlockCount +
+                     size_t(m_TxBlockSize) * m_TxBlockCount;
+        m_Ring = mmap(nullptr, m_RingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_Socket, 0);
+        if (m_Ring == MAP_FAILED) {
+            throw std::runtime_error("Couldn't map packet rings: " +
+                                     getError());
+        }
+        m_RxRing = static_cast<uint8_t *>(m_Ring);
+        m_TxRing = m_RxRing + size_t(m_RxBlockSize) * m_RxBlockCount;
+
+        sockaddr_ll address{};
+        address.sll_family = AF_PACKET;
+        address.sll_protocol = htons(ETH_P_ALL);
+        address.sll_ifindex = m_InterfaceIndex;
+        if (bind(m_Socket, reinterpret_cast<sockaddr *>(&address),
+                 sizeof(address)) < 0) {
+            throw std::runtime_error("Couldn't bind packet socket to '" +
+                                     interfaceName + "': " + getError());
+        }
+
+        TOYVPN_LOG_DEBUG("Mapped packet rings on '" << interfaceName << "'");
+    }
+
+    // Readable in epoll while the kernel has handed over a block
+    int getSocketFd() const { return m_Socket; }
+
+    // Makes the interface accept frames sent to another MAC address
+    void addUnicastAddress(const std::array<uint8_t, ETH_ALEN> &macAddress) {
+        packet_mreq membership{};
+        membership.mr_ifindex = m_InterfaceIndex;
+        membership.mr_type = PACKET_MR_UNICAST;
+        membership.mr_alen = ETH_ALEN;
+        std::memcpy(membership.mr_address, macAddress.data(), ETH_ALEN);
+        setOption(PACKET_ADD_MEMBERSHIP, &membership, sizeof(membership),
+                  "PACKET_ADD_MEMBERSHIP");
+    }
+
+    // Returns the next received frame, which stays valid until the next call,
+    // or nullptr if there is none. Frames from a local sender with checksum
+    // offload, e.g. over a veth pair, arrive with the transport checksum
+    // still to be filled in.
+    const uint8_t *receive(size_t &frameSize, bool &isChecksumPartial) {
+        if (m_RxBlock == nullptr) {
+            auto block = reinterpret_cast<tpacket_block_desc *>(
+                m_RxRing + size_t(m_RxBlockIndex) * m_RxBlockSize);
+            if ((__atomic_load_n(&block->hdr.bh1.block_status,
+                                 __ATOMIC_ACQUIRE) &
+                 TP_STATUS_USER) == 0) {
+                return nullptr;
+            }
+            m_RxBlock = block;
+            m_RxFrame = reinterpret_cast<tpacket3_hdr *>(
+                reinterpret_cast<uint8_t *>(block) +
+                block->hdr.bh1.offset_to_first_pkt);
+            m_RxFramesLeft = block->hdr.bh1.num_pkts;
+        }
+
+        if (m_RxFramesLeft == 0) {
+            releaseRxBlock();
+            return receive(frameSize, isChecksumPartial);
+        }
+
+        auto frame = m_RxFrame;
+        m_RxFrame = reinterpret_cast<tpacket3_hdr *>(
+            reinterpret_cast<uint8_t *>(frame) + frame->tp_next_offset);
+        m_RxFramesLeft--;
+        frameSize = frame->tp_snaplen;
+        isChecksumPartial = frame->tp_status & TP_STATUS_CSUMNOTREADY;
+        return reinterpret_cast<const uint8_t *>(frame) + frame->tp_mac;
+    }
+
+    // Returns the next free frame of the transmit ring, to be filled with up
+    // to maxFrameSize bytes and queued with commitTransmitFrame(), or nullptr
+    // if the ring is full
+    uint8_t *getTransmitFrame() {
+        auto header = getTxHeader();
+        auto status = __atomic_load_n(&header->tp_status, __ATOMIC_ACQUIRE);
+        if (status != TP_STATUS_AVAILABLE &&
+            status != TP_STATUS_WRONG_FORMAT) {
+            return nullptr;
+        }
+        return reinterpret_cast<uint8_t *>(header) + m_TxDataOffset;
+    }
+
+    void commitTransmitFrame(size_t frameSize) {
+        auto header = getTxHeader();
+        header->tp_len = frameSize;
+        header->tp_snaplen = frameSize;
+        __atomic_store_n(&header->tp_status, TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
+        m_TxFrameIndex = (m_TxFrameIndex + 1) % m_TxFrameCount;
+        m_PendingFrames++;
+    }
+
+    size_t getPendingFrameCount() const { return m_PendingFrames; }
+
+    // Sends the queued frames without waiting for them to go out
+    void flush() {
+        if (m_PendingFrames == 0) {
+            return;
+        }
+        m_PendingFrames = 0;
+        if (sendto(m_Socket, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 &&
+            errno != EAGAIN && errno != ENOBUFS) {
+            TOYVPN_LOG_DEBUG("Couldn't send packet ring frames: "
+                             << getError());
+        }
+    }
+
+  private:
+    // Without PACKET_TX_HAS_OFF the data of a frame to send starts right
+    // after its header
+    constexpr static size_t m_TxDataOffset =
+        TPACKET_ALIGN(sizeof(tpacket3_hdr));
+    constexpr static unsigned int m_FrameSize = maxFrameSize + m_TxDataOffset;
+    constexpr static unsigned int m_RxBlockSize = 1 << 18;
+    constexpr static unsigned int m_RxBlockCount = 32;
+    constexpr static unsigned int m_RxBlockTimeoutMs = 1;
+    constexpr static unsigned int m_TxBlockSize = 1 << 16;
+    constexpr static unsigned int m_TxBlockCount = 32;
+    constexpr static unsigned int m_TxFrameCount =
+        m_TxBlockSize / m_FrameSize * m_TxBlockCount;
+
+    int m_Socket = -1;
+    int m_InterfaceIndex = 0;
+    void *m_Ring = MAP_FAILED;
+    size_t m_RingSize = 0;
+    uint8_t *m_RxRing = nullptr;
+    uint8_t *m_TxRing = nullptr;
+    unsigned int m_RxBlockIndex = 0;
+    tpacket_block_desc *m_RxBlock = nullptr;
+    tpacket3_hdr *m_RxFrame = nullptr;
+    uint32_t m_RxFramesLeft = 0;
+    unsigned int m_TxFrameIndex = 0;
+    size_t m_PendingFrames = 0;
+
+    static std::string getError() {
+        std::array<char, 256> buffer;
+        return strerror_r(errno, buffer.data(), buffer.size());
+    }
+
+    void setOption(int option, const void *value, socklen_t valueSize,
+                   const std::string &name) {
+        if (setsockopt(m_Socket, SOL_PACKET, option, value, valueSize) < 0) {
+            throw std::runtime_error("Couldn't set " + name +
+                                     " on packet socket: " + getError());
+        }
+    }
+
+    tpacket3_hdr *getTxHeader() const {
+        return reinterpret_cast<tpacket3_hdr *>(
+            m_TxRing + size_t(m_TxFrameIndex) * m_FrameSize);
+    }
+
+    // Gives a block whose frames were all read back to the kernel
+    void releaseRxBlock() {
+        __atomic_store_n(&m_RxBlock->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                         __ATOMIC_RELEASE);
+        m_RxBlock = nullptr;
+        m_RxBlockIndex = (m_RxBlockIndex + 1) % m_RxBlockCount;
+    }
+};
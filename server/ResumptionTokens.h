@@ -0,0 +1,168 @@
+#pragma once
+
+#include "TunnelCipher.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+// Issues and checks the tokens that let a client get its address back after
+// its session is gone. A token is (nonce, sealed address, lease and expiry,
+// tag) under ChaCha20-Poly1305 with a key derived from the secret. The lease
+// is a random ID for the time the address belongs to the client. Only the
+// current lease of every address given out since the start is kept, so a
+// token stops working once its address is released, and tokens from before
+// a restart work until their address is given out again.
+class ResumptionTokens {
+  public:
+    constexpr static size_t tokenSize = 48;
+
+    using Token = std::array<uint8_t, tokenSize>;
+
+    struct Lease {
+        // In network byte order, like pcpp::IPv4Address::toInt()
+        uint32_t address;
+        uint64_t id;
+    };
+
+    ResumptionTokens(const std::string &secret,
+                     const std::chrono::seconds &lifetime)
+        : m_Lifetime(lifetime),
+          m_Context(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free) {
+        // No salt, which HKDF takes as a block of zeros
+        std::array<uint8_t, 32> salt{};
+        auto key = TunnelCipher::deriveKey(
+            reinterpret_cast<const uint8_t *>(secret.data()), secret.size(),
+            salt.data(), salt.size(), m_KeyLabel);
+        if (!m_Context ||
+            EVP_CipherInit_ex(m_Context.get(), EVP_chacha20_poly1305(),
+                              nullptr, key.data(), nullptr, -1) != 1) {
+            throw std::runtime_error(
+                "Couldn't initialize the resumption token cipher");
+        }
+    }
+
+    // Starts a new lease of the address, which ends the ones of the tokens
+    // issued for it before. The address is in network byte order.
+    Token issue(uint32_t address,
+                const std::chrono::system_clock::time_point &now) {
+        Token token;
+        auto nonce = token.data();
+        auto payload = nonce + m_NonceSize;
+        uint64_t lease = m_RevokedLease;
+        while (lease == m_RevokedLease) {
+            if (RAND_bytes(nonce, m_NonceSize) != 1 ||
+                RAND_bytes(reinterpret_cast<uint8_t *>(&lease),
+                           sizeof(lease)) != 1) {
+                throw std::runtime_error("Couldn't generate a token nonce");
+            }
+        }
+        m_Leases[address] = lease;
+
+        uint64_t expiry = toSeconds(now + m_Lifetime);
+        std::memcpy(payload, &address, sizeof(address));
+        std::memcpy(payload + sizeof(address), &lease, sizeof(lease));
+        for (size_t i = 0; i < sizeof(expiry); i++) {
+            payload[sizeof(address) + sizeof(lease) + i] =
+                expiry >> (8 * (7 - i));
+        }
+
+        int length = 0;
+        auto context = m_Context.get();
+        if (EVP_EncryptInit_ex(context, nullptr, nullptr, nullptr, nonce) !=
+                1 ||
+            EVP_EncryptUpdate(context, payload, &length, payload,
+                              m_PayloadSize) != 1 ||
+            EVP_EncryptFinal_ex(context, payload + m_PayloadSize, &length) !=
+                1 ||
+            EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_GET_TAG, m_TagSize,
+                                payload + m_PayloadSize) != 1) {
+            throw std::runtime_error("Couldn't seal a resumption token");
+        }
+
+        return token;
+    }
+
+    // Returns the lease of a valid token that hasn't expired or ended
+    std::optional<Lease>
+    redeem(const uint8_t *token,
+           const std::chrono::system_clock::time_point &now) {
+        std::array<uint8_t, m_PayloadSize> payload;
+        auto nonce = token;
+        auto tag = token + m_NonceSize + m_PayloadSize;
+        int length = 0;
+        auto context = m_Context.get();
+        if (EVP_DecryptInit_ex(context, nullptr, nullptr, nullptr, nonce) !=
+                1 ||
+            EVP_DecryptUpdate(context, payload.data(), &length,
+                              token + m_NonceSize, m_PayloadSize) != 1 ||
+            EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_TAG, m_TagSize,
+                                const_cast<uint8_t *>(tag)) != 1 ||
+            EVP_DecryptFinal_ex(context, payload.data() + m_PayloadSize,
+                                &length) != 1) {
+            return std::nullopt;
+        }
+
+        Lease lease;
+        std::memcpy(&lease.address, payload.data(), sizeof(lease.address));
+        std::memcpy(&lease.id, payload.data() + sizeof(lease.address),
+                    sizeof(lease.id));
+        uint64_t expiry = 0;
+        for (size_t i = sizeof(lease.address) + sizeof(lease.id);
+             i < m_PayloadSize; i++) {
+            expiry = (expiry << 8) | payload[i];
+        }
+        if (toSeconds(now) > expiry || !isCurrent(lease)) {
+            return std::nullopt;
+        }
+
+        return lease;
+    }
+
+    // Whether the address still belongs to the lease, or hasn't been given
+    // out since the start
+    bool isCurrent(const Lease &lease) const {
+        auto it = m_Leases.find(lease.address);
+        return it == m_Leases.end() || it->second == lease.id;
+    }
+
+    // Ends the lease of an address that is released or given to a client
+    // without a token
+    void revoke(uint32_t address) { m_Leases[address] = m_RevokedLease; }
+
+    // Tokens are sent to the client as hex in the params
+    static std::string toString(const Token &token) {
+        constexpr static char digits[] = "0123456789abcdef";
+        std::string result;
+        for (auto byte : token) {
+            result.push_back(digits[byte >> 4]);
+            result.push_back(digits[byte & 0x0f]);
+        }
+        return result;
+    }
+
+  private:
+    constexpr static size_t m_NonceSize = 12;
+    constexpr static size_t m_PayloadSize = 20;
+    constexpr static size_t m_TagSize = 16;
+    static_assert(m_NonceSize + m_PayloadSize + m_TagSize == tokenSize);
+    constexpr static char m_KeyLabel[] = "ToyVpn resumption token";
+    constexpr static uint64_t m_RevokedLease = 0;
+
+    std::chrono::seconds m_Lifetime;
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> m_Context;
+    std::unordered_map<uint32_t, uint64_t> m_Leases;
+
+    static uint64_t toSeconds(const std::chrono::system_clock::time_point &t) {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+                   t.time_since_epoch())
+            .count();
+    }
+};
@@ -0,0 +1,309 @@
+#pragma once
+
+#include "BpfMap.h"
+#include "ClientHandler.h"
+#include "Log.h"
+#include <array>
+#include <cstddef>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Several servers can share the UDP port with SO_REUSEPORT, each with its
+// own TUN interface and private network, to spread the clients over the
+// cores. The kernel would pick a server for every datagram by a hash of its
+// addresses, which moves clients whenever a server joins or leaves the
+// group. Instead a BPF program attached to the group sends every datagram to
+// the server that owns the client:
+// - datagrams that start with a session ID go to the server whose member
+//   index is in its top byte, wherever the client roamed to
+// - other datagrams go to the owner of their source address and port in the
+//   owners map, which every server fills when its clients connect
+// - datagrams of unknown clients, i.e. handshakes, fall back to the hash,
+//   and the server they land on becomes the owner
+//
+// The maps are pinned in /sys/fs/bpf, where the first server of the group
+// creates them and the others find them. Every server removes its own owners
+// when it starts and when it stops, so the entries of one that crashed don't
+// outlive its next run.
+class ReuseportSteering {
+  public:
+    constexpr static uint32_t maxMembers = 64;
+
+    virtual ~ReuseportSteering() {
+        if (m_Program != -1) {
+            close(m_Program);
+            removeOwnedClients();
+        }
+    }
+
+    // The socket has to be bound with SO_REUSEPORT already
+    void init(int socketFd, uint16_t port, uint8_t memberIndex) {
+        if (memberIndex >= maxMembers) {
+            throw std::runtime_error("The member index has to be below " +
+                                     std::to_string(maxMembers));
+        }
+        m_MemberIndex = memberIndex;
+
+        auto pinPrefix = m_PinDirectory + "toyvpn_" + std::to_string(port);
+        m_Owners.create(BPF_MAP_TYPE_HASH, sizeof(OwnerKey), sizeof(uint32_t),
+                        m_MaxOwners);
+        if (!m_Owners.pin(pinPrefix + "_owners")) {
+            m_Owners.open(pinPrefix + "_owners");
+        }
+        removeOwnedClients();
+        m_Sockets.create(BPF_MAP_TYPE_REUSEPORT_SOCKARRAY, sizeof(uint32_t),
+                         sizeof(uint32_t), maxMembers);
+        if (!m_Sockets.pin(pinPrefix + "_sockets")) {
+            m_Sockets.open(pinPrefix + "_sockets");
+        }
+        m_Sockets.update(uint32_t(memberIndex), uint32_t(socketFd));
+
+        auto program = buildProgram(m_Owners.getFd(), m_Sockets.getFd());
+        m_Program = loadProgram(program);
+        if (setsockopt(socketFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+                       &m_Program, sizeof(m_Program)) < 0) {
+            throw std::runtime_error(
+                "Couldn't attach the reuseport program: " + getError());
+        }
+
+        TOYVPN_LOG_INFO("Steering datagrams on UDP port "
+                        << port << " as member " << int(memberIndex));
+    }
+
+    uint8_t getMemberIndex() const { return m_MemberIndex; }
+
+    // Throws if the owners map is full
+    void addClient(const sockaddr_in6 &clientAddress) {
+        m_Owners.update(toKey(clientAddress), uint32_t(m_MemberIndex));
+    }
+
+    // Leaves the entry alone if another server owns the client by now
+    void removeClient(const sockaddr_in6 &clientAddress) {
+        auto key = toKey(clientAddress);
+        uint32_t owner;
+        if (m_Owners.lookup(key, owner) && owner == m_MemberIndex) {
+            m_Owners.erase(key);
+        }
+    }
+
+  private:
+    // The source of a datagram, with IPv4 addresses mapped to IPv6 like the
+    // dual-stack socket reports them
+    struct OwnerKey {
+        in6_addr address;
+        uint16_t port;
+        uint16_t padding;
+    };
+
+    inline static const std::string m_PinDirectory = "/sys/fs/bpf/";
+    constexpr static uint32_t m_MaxOwners = 65536;
+    constexpr static size_t m_UdpHeaderSize = 8;
+
+    uint8_t m_MemberIndex = 0;
+    BpfMap m_Owners;
+    BpfMap m_Sockets;
+    int m_Program = -1;
+
+    void removeOwnedClients() {
+        size_t removedCount = 0;
+        for (const auto &key : m_Owners.getKeys<OwnerKey>()) {
+            uint32_t owner;
+            if (m_Owners.lookup(key, owner) && owner == m_MemberIndex) {
+                m_Owners.erase(key);
+                removedCount++;
+            }
+        }
+        if (removedCount > 0) {
+            TOYVPN_LOG_DEBUG("Removed " << removedCount
+                                        << " clients of member "
+                                        << int(m_MemberIndex)
+                                        << " from the owners map");
+        }
+    }
+
+    static OwnerKey toKey(const sockaddr_in6 &clientAddress) {
+        OwnerKey key{};
+        key.address = clientAddress.sin6_addr;
+        key.port = clientAddress.sin6_port;
+        return key;
+    }
+
+    static bpf_insn instruction(uint8_t code, uint8_t dst, uint8_t src,
+                                int16_t offset, int32_t imm) {
+        bpf_insn insn{};
+        insn.code = code;
+        insn.dst_reg = dst;
+        insn.src_reg = src;
+        insn.off = offset;
+        insn.imm = imm;
+        return insn;
+    }
+
+    // Hand-assembled so it needs no compiler, the equivalent of:
+    //
+    //   uint32_t member;
+    //   if (data + 8 + 5 <= data_end && data[8] == 10) {
+    //       member = data[9];
+    //   } else {
+    //       OwnerKey key = {source address, source port};
+    //       uint32_t *owner = bpf_map_lookup_elem(owners, &key);
+    //       if (owner == NULL)
+    //           return SK_PASS;
+    //       member = *owner;
+    //   }
+    //   bpf_sk_select_reuseport(ctx, sockets, &member, 0);
+    //   return SK_PASS;
+    //
+    // The key lives at r10 - 24 and the member index at r10 - 4.
+    static std::vector<bpf_insn> buildProgram(int ownersFd, int socketsFd) {
+        constexpr uint8_t alu64Mov = BPF_ALU64 | BPF_MOV;
+        constexpr uint8_t alu64Add = BPF_ALU64 | BPF_ADD | BPF_K;
+        constexpr int16_t keyOffset = -24;
+        constexpr int16_t memberOffset = -4;
+        constexpr int16_t portOffset =
+            keyOffset + static_cast<int16_t>(offsetof(OwnerKey, port));
+        constexpr int32_t sessionSize =
+            m_UdpHeaderSize + ClientHandler::sessionHeaderSize;
+
+        std::vector<bpf_insn> program;
+        auto emit = [&program](bpf_insn insn) {
+            program.push_back(insn);
+            return program.size() - 1;
+        };
+        auto loadMap = [&emit](uint8_t dst, int fd) {
+            emit(instruction(BPF_LD | BPF_IMM | BPF_DW, dst,
+                             BPF_PSEUDO_MAP_FD, 0, fd));
+            emit(instruction(0, 0, 0, 0, 0));
+        };
+        auto call = [&emit](int32_t function) {
+            emit(instruction(BPF_JMP | BPF_CALL, 0, 0, 0, function));
+        };
+        // Jumps are emitted before their target is known and patched later
+        auto jumpTo = [&program](size_t jump, size_t target) {
+            program[jump].off = target - jump - 1;
+        };
+
+        emit(instruction(alu64Mov | BPF_X, 6, 1, 0, 0));
+        emit(instruction(BPF_LDX | BPF_MEM | BPF_DW, 2, 6,
+                         offsetof(sk_reuseport_md, data), 0));
+        emit(instruction(BPF_LDX | BPF_MEM | BPF_DW, 3, 6,
+                         offsetof(sk_reuseport_md, data_end), 0));
+
+        // A session ID picks the member
+        emit(instruction(alu64Mov | BPF_X, 4, 2, 0, 0));
+        emit(instruction(alu64Add, 4, 0, 0, sessionSize));
+        auto tooShortForSession =
+            emit(instruction(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0));
+        emit(instruction(BPF_LDX | BPF_MEM | BPF_B, 4, 2, m_UdpHeaderSize, 0));
+        auto notSession =
+            emit(instruction(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0,
+                             ClientHandler::sessionMessageType));
+        emit(instruction(BPF_LDX | BPF_MEM | BPF_B, 4, 2, m_UdpHeaderSize + 1,
+                         0));
+        emit(instruction(BPF_STX | BPF_MEM | BPF_W, 10, 4, memberOffset, 0));
+        auto sessionDone = emit(instruction(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+
+        // Otherwise the owner of the source address and port does
+        auto endpoint =
+            emit(instruction(alu64Mov | BPF_X, 4, 2, 0, 0));
+        jumpTo(tooShortForSession, endpoint);
+        jumpTo(notSession, endpoint);
+        emit(instruction(alu64Add, 4, 0, 0, m_UdpHeaderSize));
+        auto tooShort =
+            emit(instruction(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0));
+        emit(instruction(BPF_ST | BPF_MEM | BPF_DW, 10, 0, keyOffset, 0));
+        emit(instruction(BPF_ST | BPF_MEM | BPF_DW, 10, 0, keyOffset + 8, 0));
+        emit(instruction(BPF_ST | BPF_MEM | BPF_W, 10, 0, keyOffset + 16, 0));
+        emit(instruction(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 0, 0));
+        emit(instruction(BPF_STX | BPF_MEM | BPF_H, 10, 4, portOffset, 0));
+        emit(instruction(BPF_LDX | BPF_MEM | BPF_W, 4, 6,
+                         offsetof(sk_reuseport_md, eth_protocol), 0));
+        auto isIpv6 = emit(instruction(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 0,
+                                       htons(ETH_P_IPV6)));
+
+        // The IPv4 source address after ::ffff:
+        emit(instruction(BPF_ST | BPF_MEM | BPF_H, 10, 0, keyOffset + 10,
+                         0xffff));
+        emit(instruction(alu64Mov | BPF_X, 1, 6, 0, 0));
+        emit(instruction(alu64Mov | BPF_K, 2, 0, 0, 12));
+        emit(instruction(alu64Mov | BPF_X, 3, 10, 0, 0));
+        emit(instruction(alu64Add, 3, 0, 0, keyOffset + 12));
+        emit(instruction(alu64Mov | BPF_K, 4, 0, 0, 4));
+        emit(instruction(alu64Mov | BPF_K, 5, 0, 0, BPF_HDR_START_NET));
+        call(BPF_FUNC_skb_load_bytes_relative);
+        auto ipv4Done = emit(instruction(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+
+        auto ipv6 = emit(instruction(alu64Mov | BPF_X, 1, 6, 0, 0));
+        jumpTo(isIpv6, ipv6);
+        emit(instruction(alu64Mov | BPF_K, 2, 0, 0, 8));
+        emit(instruction(alu64Mov | BPF_X, 3, 10, 0, 0));
+        emit(instruction(alu64Add, 3, 0, 0, keyOffset));
+        emit(instruction(alu64Mov | BPF_K, 4, 0, 0, 16));
+        emit(instruction(alu64Mov | BPF_K, 5, 0, 0, BPF_HDR_START_NET));
+        call(BPF_FUNC_skb_load_bytes_relative);
+
+        auto loaded =
+            emit(instruction(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 0, 0));
+        jumpTo(ipv4Done, loaded);
+        loadMap(1, ownersFd);
+        emit(instruction(alu64Mov | BPF_X, 2, 10, 0, 0));
+        emit(instruction(alu64Add, 2, 0, 0, keyOffset));
+        call(BPF_FUNC_map_lookup_elem);
+        auto noOwner = emit(instruction(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0, 0));
+        emit(instruction(BPF_LDX | BPF_MEM | BPF_W, 4, 0, 0, 0));
+        emit(instruction(BPF_STX | BPF_MEM | BPF_W, 10, 4, memberOffset, 0));
+
+        auto select = emit(instruction(alu64Mov | BPF_X, 1, 6, 0, 0));
+        jumpTo(sessionDone, select);
+        loadMap(2, socketsFd);
+        emit(instruction(alu64Mov | BPF_X, 3, 10, 0, 0));
+        emit(instruction(alu64Add, 3, 0, 0, memberOffset));
+        emit(instruction(alu64Mov | BPF_K, 4, 0, 0, 0));
+        call(BPF_FUNC_sk_select_reuseport);
+
+        // Without a selected socket the kernel falls back to the hash
+        auto pass = emit(instruction(alu64Mov | BPF_K, 0, 0, 0, SK_PASS));
+        jumpTo(tooShort, pass);
+        jumpTo(loaded, pass);
+        jumpTo(noOwner, pass);
+        emit(instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+        return program;
+    }
+
+    static int loadProgram(const std::vector<bpf_insn> &program) {
+        static const char license[] = "Dual MIT/GPL";
+        bpf_attr attr{};
+        attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+        attr.expected_attach_type = BPF_SK_REUSEPORT_SELECT;
+        attr.insns = reinterpret_cast<uint64_t>(program.data());
+        attr.insn_cnt = program.size();
+        attr.license = reinterpret_cast<uint64_t>(license);
+        int fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+        if (fd >= 0) {
+            return fd;
+        }
+
+        // Loads it again for the verifier's reason
+        std::vector<char> log(65536);
+        attr.log_buf = reinterpret_cast<uint64_t>(log.data());
+        attr.log_size = log.size();
+        attr.log_level = 1;
+        fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+        if (fd >= 0) {
+            return fd;
+        }
+        throw std::runtime_error("Couldn't load the reuseport program: " +
+                                 getError() + "\n" + log.data());
+    }
+
+    static std::string getError() {
+        std::array<char, 256> buffer;
+        return strerror_r(errno, buffer.data(), buffer.size());
+    }
+};
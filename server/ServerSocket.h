@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <vector>
+
+// The UDP socket the clients talk to, as the server sees it.
+// ServerSocketWrapper is the real socket and InMemoryServerSocket stands in
+// for it when the server runs offline.
+class ServerSocket {
+  public:
+    struct Datagram {
+        const uint8_t *data;
+        size_t dataSize;
+        const sockaddr_in6 *sendTo;
+    };
+
+    constexpr static size_t maxBatchSize = 64;
+
+    virtual ~ServerSocket() = default;
+
+    // Readable in epoll while there are datagrams to receive
+    virtual int getSocketFd() const = 0;
+
+    // Returns the size of the datagram or -1 if there is none
+    virtual ssize_t receive(uint8_t *data, size_t dataSize,
+                            sockaddr_in6 &clientAddress) const = 0;
+
+    virtual int send(const uint8_t *data, size_t dataSize,
+                     const sockaddr_in6 &sendTo) const = 0;
+
+    // Sends up to maxBatchSize datagrams without blocking. Returns the number
+    // of datagrams sent or -1 if the first one failed.
+    virtual int sendBatch(const Datagram *datagrams, size_t count) const = 0;
+
+    template <std::size_t BUFFER_SIZE>
+    ssize_t receive(std::array<uint8_t, BUFFER_SIZE> &buffer,
+                    sockaddr_in6 &clientAddress) const {
+        return receive(buffer.data(), buffer.size(), clientAddress);
+    }
+
+    template <std::size_t BUFFER_SIZE>
+    int send(const std::array<uint8_t, BUFFER_SIZE> &buffer, size_t dataSize,
+             const sockaddr_in6 &sendTo) const {
+        return send(buffer.data(), dataSize, sendTo);
+    }
+
+    int send(const std::vector<uint8_t> &buffer,
+             const sockaddr_in6 &sendTo) const {
+        return send(buffer.data(), buffer.size(), sendTo);
+    }
+};
@@ -1,20 +1,29 @@
 #pragma once
 
 #include "Log.h"
+#include "ServerSocket.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <vector>
 
-class ServerSocketWrapper {
+class ServerSocketWrapper : public ServerSocket {
   public:
+    using ServerSocket::receive;
+    using ServerSocket::send;
+
     virtual ~ServerSocketWrapper() {
         if (m_IsInitialized) {
             close(m_ServerSocket);
         }
     }
 
-    void init(uint16_t port) {
+    // With reusePort other sockets can be bound to the same port, see
+    // ReuseportSteering
+    void init(uint16_t port, bool reusePort = false) {
         int serverSocket = socket(AF_INET6, SOCK_DGRAM, 0);
         if (serverSocket < 0) {
             throw std::runtime_error("Error creating server socket!");
@@ -22,6 +31,10 @@ class ServerSocketWrapper {
 
         int flag = 1;
         setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        if (reusePort) {
+            setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &flag,
+                       sizeof(flag));
+        }
 
         // Dual stack - accept both IPv4 and IPv6 clients
         flag = 0;
@@ -48,38 +61,48 @@ class ServerSocketWrapper {
         m_IsInitialized = true;
     }
 
-    int getSocketFd() const { return m_ServerSocket; }
+    int getSocketFd() const override { return m_ServerSocket; }
 
-    template <std::size_t BUFFER_SIZE>
-    size_t receive(std::array<uint8_t, BUFFER_SIZE> &buffer,
-                   sockaddr_in6 &clientAddress) const {
+    ssize_t receive(uint8_t *data, size_t dataSize,
+                    sockaddr_in6 &clientAddress) const override {
         auto clientAddressLen = static_cast<socklen_t>(sizeof(clientAddress));
-        return recvfrom(m_ServerSocket, buffer.data(), buffer.size(), 0,
+        return recvfrom(m_ServerSocket, data, dataSize, 0,
                         reinterpret_cast<sockaddr *>(&clientAddress),
                         &clientAddressLen);
     }
 
-    template <std::size_t BUFFER_SIZE>
-    int send(const std::array<uint8_t, BUFFER_SIZE> &buffer, size_t dataSize,
-             const sockaddr_in6 &sendTo) const {
+    int send(const uint8_t *data, size_t dataSize,
+             const sockaddr_in6 &sendTo) const override {
         if (!m_IsInitialized) {
             throw std::runtime_error("TUN interface is not initialized");
         }
 
-        return sendto(m_ServerSocket, buffer.data(), dataSize, 0,
+        return sendto(m_ServerSocket, data, dataSize, 0,
                       reinterpret_cast<const sockaddr *>(&sendTo),
                       sizeof(sendTo));
     }
 
-    int send(const std::vector<uint8_t> &buffer,
-             const sockaddr_in6 &sendTo) const {
+    // Sends the whole batch in one system call
+    int sendBatch(const Datagram *datagrams, size_t count) const override {
         if (!m_IsInitialized) {
             throw std::runtime_error("TUN interface is not initialized");
         }
 
-        return sendto(m_ServerSocket, buffer.data(), buffer.size(), 0,
-                      reinterpret_cast<const sockaddr *>(&sendTo),
-                      sizeof(sendTo));
+        count = std::min(count, maxBatchSize);
+        std::array<mmsghdr, maxBatchSize> messages;
+        std::array<iovec, maxBatchSize> iovecs;
+        for (size_t i = 0; i < count; i++) {
+            iovecs[i].iov_base = const_cast<uint8_t *>(datagrams[i].data);
+            iovecs[i].iov_len = datagrams[i].dataSize;
+            memset(&messages[i], 0, sizeof(mmsghdr));
+            messages[i].msg_hdr.msg_name =
+                const_cast<sockaddr_in6 *>(datagrams[i].sendTo);
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        return sendmmsg(m_ServerSocket, messages.data(), count, MSG_DONTWAIT);
     }
 
   private:
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The stages of the forwarding pipeline that are timed when the server is
+// built with TOYVPN_STAGE_LATENCY
+enum class LatencyStage {
+    SocketReceive,
+    SessionLookup,
+    Open,
+    TunSend,
+    CaptureEnqueue,
+    TunReceive,
+    Seal,
+    SocketSend,
+    Count
+};
+
+// Reads the time stamp counter, which needs no system call, and converts
+// ticks to nanoseconds with a rate measured once against the steady clock.
+// Other architectures fall back to the steady clock.
+class TscClock {
+  public:
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+
+    static double getNanosecondsPerTick() {
+        static const double nanosecondsPerTick = calibrate();
+        return nanosecondsPerTick;
+    }
+
+  private:
+    constexpr static std::chrono::duration m_CalibrationTime =
+        std::chrono::milliseconds(20);
+
+    static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+        auto startTime = std::chrono::steady_clock::now();
+        auto startTicks = now();
+        std::this_thread::sleep_for(m_CalibrationTime);
+        auto ticks = now() - startTicks;
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - startTime;
+        return ticks > 0 ? elapsed.count() / ticks : 1;
+#else
+        return 1;
+#endif
+    }
+};
+
+// A histogram of latencies in the spirit of HdrHistogram: values below 32
+// have a bucket each and every power of two above that is split into 32
+// buckets, so any value is recorded within about 3% over the whole 64-bit
+// range in a fixed 15 KB. Recording is a count leading zeros and an
+// increment.
+class LatencyHistogram {
+  public:
+    constexpr static size_t subBucketBits = 5;
+    constexpr static size_t subBucketCount = size_t(1) << subBucketBits;
+    constexpr static size_t bucketCount = (64 - subBucketBits + 1) *
+                                          subBucketCount;
+
+    void record(uint64_t value) {
+        m_Buckets[getBucket(value)]++;
+        m_Count++;
+        if (value > m_Max) {
+            m_Max = value;
+        }
+    }
+
+    uint64_t getCount() const { return m_Count; }
+
+    uint64_t getMax() const { return m_Max; }
+
+    // The lowest value of the bucket that holds the given fraction of the
+    // recorded values
+    uint64_t getPercentile(double fraction) const {
+        auto target = static_cast<uint64_t>(fraction * m_Count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; i++) {
+            seen += m_Buckets[i];
+            if (seen > target) {
+                return getBucketStart(i);
+            }
+        }
+        return m_Max;
+    }
+
+    void clear() {
+        m_Buckets.fill(0);
+        m_Count = 0;
+        m_Max = 0;
+    }
+
+    static size_t getBucket(uint64_t value) {
+        if (value < subBucketCount) {
+            return value;
+        }
+        size_t msb = 63 - __builtin_clzll(value);
+        size_t shift = msb - subBucketBits;
+        return (shift + 1) * subBucketCount +
+               ((value >> shift) & (subBucketCount - 1));
+    }
+
+    static uint64_t getBucketStart(size_t bucket) {
+        if (bucket < subBucketCount) {
+            return bucket;
+        }
+        size_t shift = bucket / subBucketCount - 1;
+        return (subBucketCount + bucket % subBucketCount) << shift;
+    }
+
+  private:
+    std::array<uint64_t, bucketCount> m_Buckets{};
+    uint64_t m_Count = 0;
+    uint64_t m_Max = 0;
+};
+
+// One histogram per stage for every thread, in ticks. Only the thread that
+// owns them records into or dumps them, so there are no locks or atomics.
+//
+// Reading the TSC twice costs more than some stages themselves, 15-45 ns
+// depending on the machine and whether it is virtualized, so only one in
+// sampleInterval runs of every stage is timed. That keeps the cost per stage
+// to a few nanoseconds, and with millions of packets the percentiles of the
+// samples are those of all the runs.
+class StageLatency {
+  public:
+    constexpr static uint32_t sampleInterval = 16;
+
+    static StageLatency &local() {
+        thread_local StageLatency stageLatency;
+        return stageLatency;
+    }
+
+    bool shouldSample(LatencyStage stage) {
+        auto &countdown = m_Countdowns[static_cast<size_t>(stage)];
+        if (countdown > 0) {
+            countdown--;
+            return false;
+        }
+        countdown = sampleInterval - 1;
+        return true;
+    }
+
+    void record(LatencyStage stage, uint64_t ticks) {
+        m_Histograms[static_cast<size_t>(stage)].record(ticks);
+    }
+
+    // Writes the number of samples and the percentiles, in nanoseconds, of
+    // every stage that was recorded, and starts over
+    void dump(std::ostream &out) {
+        auto nanosecondsPerTick = TscClock::getNanosecondsPerTick();
+        auto toNanoseconds = [&](uint64_t ticks) {
+            return static_cast<uint64_t>(ticks * nanosecondsPerTick);
+        };
+
+        for (size_t i = 0; i < m_Histograms.size(); i++) {
+            auto &histogram = m_Histograms[i];
+            if (histogram.getCount() == 0) {
+                continue;
+            }
+            out << m_StageNames[i] << ": samples " << histogram.getCount()
+                << ", p50 " << toNanoseconds(histogram.getPercentile(0.5))
+                << " ns, p90 " << toNanoseconds(histogram.getPercentile(0.9))
+                << " ns, p99 " << toNanoseconds(histogram.getPercentile(0.99))
+                << " ns, p99.9 "
+                << toNanoseconds(histogram.getPercentile(0.999))
+                << " ns, max " << toNanoseconds(histogram.getMax()) << " ns\n";
+            histogram.clear();
+        }
+    }
+
+  private:
+    constexpr static std::array<const char *,
+                                static_cast<size_t>(LatencyStage::Count)>
+        m_StageNames = {"socket receive", "session lookup", "open",
+                        "TUN send",       "capture enqueue", "TUN receive",
+                        "seal",           "socket send"};
+
+    std::array<LatencyHistogram, static_cast<size_t>(LatencyStage::Count)>
+        m_Histograms;
+    std::array<uint32_t, static_cast<size_t>(LatencyStage::Count)>
+        m_Countdowns{};
+
+    StageLatency() = default;
+};
+
+// Records the time a function takes in the histogram of a stage, if this run
+// is sampled, and returns its result
+template <typename Function>
+inline auto timeStage(LatencyStage stage, const Function &function) {
+    auto &stageLatency = StageLatency::local();
+    if (!stageLatency.shouldSample(stage)) {
+        return function();
+    }
+
+    struct StageTimer {
+        StageLatency &stageLatency;
+        LatencyStage stage;
+        uint64_t start = TscClock::now();
+        ~StageTimer() {
+            stageLatency.record(stage, TscClock::now() - start);
+        }
+    } timer{stageLatency, stage};
+    return function();
+}
+
+// Without TOYVPN_STAGE_LATENCY the expression is left as it is, so the
+// instrumentation costs nothing
+#ifdef TOYVPN_STAGE_LATENCY
+#define TOYVPN_TIMED(stage, expression)                                        \
+    timeStage(LatencyStage::stage, [&]() { return expression; })
+#else
+#define TOYVPN_TIMED(stage, expression) (expression)
+#endif
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// A counter with a single writer. Updates are a relaxed load and store, which
+// compile to plain moves, and readers in other threads or processes always
+// see a whole value.
+class StatCounter {
+  public:
+    void add(uint64_t value = 1) {
+        m_Value.store(m_Value.load(std::memory_order_relaxed) + value,
+                      std::memory_order_relaxed);
+    }
+
+    void set(uint64_t value) {
+        m_Value.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const { return m_Value.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<uint64_t> m_Value{0};
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+};
+
+// The counters of one client, written only by the reactor thread. A slot is
+// in use while its address isn't 0, and its generation changes whenever it
+// is given back, so a reader can tell that a slot was reused while it was
+// reading it.
+struct alignas(64) ClientStats {
+    std::atomic<uint32_t> generation{0};
+    // In network byte order, like pcpp::IPv4Address::toInt()
+    std::atomic<uint32_t> address{0};
+    StatCounter packetsFromClient;
+    StatCounter bytesFromClient;
+    StatCounter packetsToClient;
+    StatCounter bytesToClient;
+    StatCounter droppedFromClient;
+    StatCounter droppedFromTun;
+    StatCounter invalidFromClient;
+    StatCounter recoveredFromClient;
+};
+
+// The counters of ClientStats, in the order readers get their values
+constexpr std::array<StatCounter ClientStats::*, 8> clientStatCounters = {
+    &ClientStats::packetsFromClient, &ClientStats::bytesFromClient,
+    &ClientStats::packetsToClient,   &ClientStats::bytesToClient,
+    &ClientStats::droppedFromClient, &ClientStats::droppedFromTun,
+    &ClientStats::invalidFromClient, &ClientStats::recoveredFromClient};
+
+// The counters and gauges of a reactor, written only by its thread
+struct alignas(64) ReactorStats {
+    StatCounter wakeups;
+    StatCounter datagramsReceived;
+    StatCounter tunPacketsReceived;
+    StatCounter handshakesStarted;
+    StatCounter handshakesRejected;
+    StatCounter sessionsCreated;
+    StatCounter sessionsResumed;
+    StatCounter sessionsEvicted;
+    StatCounter activeClients;
+    StatCounter pendingKeyExchanges;
+    StatCounter heldAddresses;
+    StatCounter freeAddresses;
+    StatCounter egressQueuedPackets;
+};
+
+// The statistics of the server in one memory mapping: a header, the reactor
+// stats and clientSlotCount client slots, each on its own cache lines. With
+// a name the mapping is a POSIX shared memory object (/dev/shm/<name>) that
+// other processes can map read-only, otherwise it is private to the process.
+// Pages of slots that were never used are never touched, so a large slot
+// count costs address space but not memory.
+class StatsSegment {
+  public:
+    constexpr static uint64_t magic = 0x5354534e50565954; // "TYVPNSTS"
+    constexpr static uint32_t version = 1;
+
+    struct alignas(64) Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t clientSlotCount;
+        uint32_t headerSize;
+        uint32_t reactorStatsSize;
+        uint32_t clientStatsSize;
+    };
+
+    StatsSegment(const std::optional<std::string> &name,
+                 uint32_t clientSlotCount)
+        : m_Name(name), m_ClientSlotCount(clientSlotCount),
+          m_Size(sizeof(Header) + sizeof(ReactorStats) +
+                 clientSlotCount * sizeof(ClientStats)) {
+        int flags = MAP_SHARED | MAP_ANONYMOUS;
+        int fd = -1;
+        if (m_Name.has_value()) {
+            fd = shm_open(m_Name->c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+            if (fd == -1 || ftruncate(fd, m_Size) == -1) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                throw std::runtime_error("Couldn't create the stats segment " +
+                                         m_Name.value());
+            }
+            flags = MAP_SHARED;
+        }
+
+        void *mapping =
+            mmap(nullptr, m_Size, PROT_READ | PROT_WRITE, flags, fd, 0);
+        if (fd != -1) {
+            close(fd);
+        }
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Couldn't map the stats segment");
+        }
+
+        m_Mapping = static_cast<uint8_t *>(mapping);
+        m_Reactor = new (m_Mapping + sizeof(Header)) ReactorStats();
+        m_Clients = reinterpret_cast<ClientStats *>(
+            m_Mapping + sizeof(Header) + sizeof(ReactorStats));
+
+        // A new mapping is zero-filled, which is what a free slot looks like
+        m_FreeSlots.reserve(m_ClientSlotCount);
+        for (uint32_t i = m_ClientSlotCount; i > 0; i--) {
+            m_FreeSlots.push_back(i - 1);
+        }
+
+        // The header goes last, so readers only see a complete segment
+        auto header = new (m_Mapping) Header();
+        header->version = version;
+        header->clientSlotCount = m_ClientSlotCount;
+        header->headerSize = sizeof(Header);
+        header->reactorStatsSize = sizeof(ReactorStats);
+        header->clientStatsSize = sizeof(ClientStats);
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = magic;
+    }
+
+    StatsSegment(const StatsSegment &) = delete;
+    StatsSegment &operator=(const StatsSegment &) = delete;
+
+    virtual ~StatsSegment() {
+        munmap(m_Mapping, m_Size);
+        if (m_Name.has_value()) {
+            shm_unlink(m_Name->c_str());
+        }
+    }
+
+    ReactorStats &getReactorStats() { return *m_Reactor; }
+
+    const ReactorStats &getReactorStats() const { return *m_Reactor; }
+
+    // Returns a zeroed slot for a client, or nullptr if all are in use
+    ClientStats *acquireClient(uint32_t address) {
+        if (m_FreeSlots.empty()) {
+            return nullptr;
+        }
+
+        auto stats = &m_Clients[m_FreeSlots.back()];
+        m_FreeSlots.pop_back();
+        for (auto counter : clientStatCounters) {
+            (stats->*counter).set(0);
+        }
+        stats->address.store(address, std::memory_order_release);
+        return stats;
+    }
+
+    // Like the writer of a seqlock: a reader that started before this and
+    // sees anything written to the slot afterwards sees the new generation
+    void releaseClient(ClientStats *stats) {
+        stats->generation.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        stats->address.store(0, std::memory_order_relaxed);
+        m_FreeSlots.push_back(stats - m_Clients);
+    }
+
+    uint32_t getClientSlotCount() const { return m_ClientSlotCount; }
+
+    using ClientValues = std::array<uint64_t, clientStatCounters.size()>;
+
+    // Calls callback(address, values) for every slot in use, with the values
+    // in the order of clientStatCounters. It may run on any thread and never
+    // blocks the writer; slots that are reused while they are read are
+    // skipped.
+    template <typename Callback>
+    void forEachClient(const Callback &callback) const {
+        ClientValues values;
+        for (uint32_t i = 0; i < m_ClientSlotCount; i++) {
+            auto &stats = m_Clients[i];
+            auto generation = stats.generation.load(std::memory_order_acquire);
+            auto address = stats.address.load(std::memory_order_acquire);
+            if (address == 0) {
+                continue;
+            }
+
+            for (size_t j = 0; j < values.size(); j++) {
+                values[j] = (stats.*clientStatCounters[j]).get();
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (stats.generation.load(std::memory_order_relaxed) ==
+                generation) {
+                callback(address, values);
+            }
+        }
+    }
+
+  private:
+    std::optional<std::string> m_Name;
+    uint32_t m_ClientSlotCount;
+    size_t m_Size;
+    uint8_t *m_Mapping = nullptr;
+    ReactorStats *m_Reactor = nullptr;
+    ClientStats *m_Clients = nullptr;
+    std::vector<uint32_t> m_FreeSlots;
+};
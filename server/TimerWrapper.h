@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <stdexcept>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// A one-shot monotonic timerfd that can be polled with epoll
+class TimerWrapper {
+  public:
+    virtual ~TimerWrapper() {
+        if (m_TimerFd != -1) {
+            close(m_TimerFd);
+        }
+    }
+
+    void init() {
+        m_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_TimerFd == -1) {
+            throw std::runtime_error("Couldn't create timerfd");
+        }
+    }
+
+    int getTimerFd() const { return m_TimerFd; }
+
+    bool isArmed() const { return m_IsArmed; }
+
+    void arm(const std::chrono::nanoseconds &timeout) {
+        itimerspec spec{};
+        spec.it_value.tv_sec = timeout.count() / 1'000'000'000;
+        spec.it_value.tv_nsec = timeout.count() % 1'000'000'000;
+        if (timerfd_settime(m_TimerFd, 0, &spec, nullptr) == -1) {
+            throw std::runtime_error("Couldn't arm timerfd");
+        }
+        m_IsArmed = true;
+    }
+
+    // Must be called when the timer fires so it stops being readable
+    void acknowledge() {
+        uint64_t expirations;
+        read(m_TimerFd, &expirations, sizeof(expirations));
+        m_IsArmed = false;
+    }
+
+  private:
+    int m_TimerFd = -1;
+    bool m_IsArmed = false;
+};
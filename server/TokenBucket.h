@@ -0,0 +1,38 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Polices traffic to a configured rate. Tokens are refilled lazily from the
+// time passed to consume(), so there are no timers involved.
+class TokenBucket {
+  public:
+    TokenBucket(uint64_t bytesPerSecond, uint64_t burstBytes)
+        : m_BytesPerSecond(static_cast<double>(bytesPerSecond)),
+          m_BurstBytes(static_cast<double>(burstBytes)),
+          m_Tokens(static_cast<double>(burstBytes)) {}
+
+    bool consume(size_t bytes,
+                 const std::chrono::steady_clock::time_point &now) {
+        if (now > m_LastRefill) {
+            std::chrono::duration<double> elapsed = now - m_LastRefill;
+            m_Tokens = std::min(m_BurstBytes,
+                                m_Tokens + elapsed.count() * m_BytesPerSecond);
+            m_LastRefill = now;
+        }
+
+        if (m_Tokens < bytes) {
+            return false;
+        }
+
+        m_Tokens -= bytes;
+        return true;
+    }
+
+  private:
+    double m_BytesPerSecond;
+    double m_BurstBytes;
+    double m_Tokens;
+    std::chrono::steady_clock::time_point m_LastRefill;
+};
@@ -1,16 +1,57 @@
 #pragma once
 
+#include "TunnelCipher.h"
 #include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
+#include <netinet/in.h>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 
 struct ToyVpnConfiguration {
     std::string &tunInterfaceName;
-    uint16_t port;
+    uint16_t port = 0;
     pcpp::IPv4Network &privateNetwork;
     std::string publicNetworkInterface;
     pcpp::IPv4Network &route;
-    uint16_t mtu;
+    uint16_t mtu = 1400;
     std::string secret;
     std::optional<std::string> saveFilePath;
     std::optional<pcpp::IPv4Address> dnsServer;
+    bool handshakeCookies = false;
+    std::optional<uint32_t> clientRateLimit;
+    uint32_t clientBurstSize = 64;
+    bool fairQueueing = false;
+    bool codel = false;
+    std::unordered_map<uint32_t, uint16_t> clientWeights;
+    std::optional<TunnelCipher::Algorithm> encryption;
+    uint16_t handshakeThreads = 2;
+    bool compression = false;
+    bool coalescing = false;
+    bool fec = false;
+    bool headerCompression = false;
+    bool roaming = false;
+    bool resumption = false;
+    std::optional<std::string> statsSegment;
+    std::optional<uint16_t> metricsPort;
+    std::optional<std::string> trace;
+    std::optional<pcpp::IPv4Address> userspaceNat;
+    std::optional<std::string> fastPath;
+    std::optional<uint8_t> reuseportMember;
+    bool connectedSockets = false;
+    std::optional<uint8_t> clusterNode;
+    in6_addr clusterAddress = in6addr_any;
+    uint16_t clusterPort = 5679;
+    std::vector<sockaddr_in6> clusterPeers;
+
+    // The defaults of the command line, with every optional feature off, for
+    // the tools that run a server in-process and set what they need by name
+    static ToyVpnConfiguration
+    withDefaults(std::string &tunInterfaceName,
+                 pcpp::IPv4Network &privateNetwork, pcpp::IPv4Network &route,
+                 const std::string &secret) {
+        ToyVpnConfiguration config{tunInterfaceName, 0, privateNetwork, "",
+                                   route};
+        config.secret = secret;
+        return config;
+    }
 };
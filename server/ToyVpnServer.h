@@ -1,41 +1,118 @@
 #pragma once
 
+#include "AddressPool.h"
 #include "ClientHandler.h"
+#include "ClusterChannel.h"
+#include "ConnectedSocketWrapper.h"
+#include "EgressScheduler.h"
 #include "EpollWrapper.h"
+#include "FastPathWrapper.h"
+#include "HandshakeGuard.h"
+#include "HandshakeWorkerPool.h"
 #include "IpForwardingWrapper.h"
 #include "Log.h"
+#include "MetricsExporter.h"
 #include "NatAndRoutingWrapper.h"
+#include "PacketCompressor.h"
 #include "PacketHandler.h"
+#include "ResumptionTokens.h"
+#include "ReuseportSteering.h"
+#include "ServerSocket.h"
 #include "ServerSocketWrapper.h"
+#include "StageLatency.h"
+#include "StatsSegment.h"
+#include "TimerWrapper.h"
 #include "ToyVpnConfiguration.h"
+#include "Tracing.h"
+#include "TunInterface.h"
 #include "TunInterfaceWrapper.h"
+#include "UserspaceNatInterface.h"
 #include "Utils.h"
 #include "libs/pcapplusplus/include/pcapplusplus/IPv4Layer.h"
 #include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
 #include "libs/pcapplusplus/include/pcapplusplus/Packet.h"
+#include <algorithm>
 #include <chrono>
+#include <csignal>
+#include <fstream>
+#include <openssl/rand.h>
+#include <sstream>
+#include <sys/resource.h>
 #include <unordered_map>
+#include <unordered_set>
 
 class ToyVpnServer {
   public:
-    ToyVpnServer(const ToyVpnConfiguration &config) : m_Config(config) {}
+    ToyVpnServer(const ToyVpnConfiguration &config)
+        : ToyVpnServer(config, nullptr, nullptr, true) {}
+
+    // Runs on the given TUN interface and socket instead of creating them
+    // and leaves IP forwarding, NAT and routing alone, so nothing needs root
+    ToyVpnServer(const ToyVpnConfiguration &config, TunInterface &tunInterface,
+                 ServerSocket &serverSocket)
+        : ToyVpnServer(config, &tunInterface, &serverSocket, false) {}
 
     void start() {
         TOYVPN_LOG_INFO("Starting server...");
-        m_IpForwarding.init();
-        m_TunInterface.init(m_Config.tunInterfaceName, m_Config.privateNetwork);
-        m_ServerSocket.init(m_Config.port);
-        m_NatAndRouting.init(m_Config.publicNetworkInterface,
-                             m_Config.tunInterfaceName,
-                             m_Config.privateNetwork);
+        Tracing::setThreadName("reactor");
+        if (m_Config.trace.has_value()) {
+            Tracing::enable();
+            signal(SIGUSR2, [](int) { m_IsTraceDumpRequested = 1; });
+            TOYVPN_LOG_INFO("Tracing, send SIGUSR2 to write the trace to "
+                            << m_Config.trace.value());
+        }
+        if (m_IsSystemSetUp && m_Config.userspaceNat.has_value()) {
+            m_ServerSocketWrapper.init(m_Config.port,
+                                       m_Config.reuseportMember.has_value());
+            m_UserspaceNat.init(m_Config.publicNetworkInterface,
+                                m_Config.userspaceNat.value(),
+                                m_Config.privateNetwork);
+        } else if (m_IsSystemSetUp) {
+            m_IpForwarding.init();
+            m_TunInterfaceWrapper.init(m_Config.tunInterfaceName,
+                                       m_Config.privateNetwork);
+            m_ServerSocketWrapper.init(m_Config.port,
+                                       m_Config.reuseportMember.has_value());
+            m_NatAndRouting.init(m_Config.publicNetworkInterface,
+                                 m_Config.tunInterfaceName,
+                                 m_Config.privateNetwork);
+            if (m_Config.fastPath.has_value()) {
+                m_FastPath.emplace();
+                m_FastPath->init(m_Config.fastPath.value(),
+                                 m_Config.publicNetworkInterface,
+                                 m_Config.tunInterfaceName, m_Config.port);
+            }
+        }
+
+        if (m_IsSystemSetUp && m_Config.reuseportMember.has_value()) {
+            m_Steering.emplace();
+            m_Steering->init(m_ServerSocket.getSocketFd(), m_Config.port,
+                             m_Config.reuseportMember.value());
+        }
+
+        if (m_IsSystemSetUp && m_Config.connectedSockets) {
+            raiseOpenFileLimit();
+        }
 
         m_EpollWrapper.init(10);
         m_EpollWrapper.add(m_ServerSocket.getSocketFd(),
-                           [this](int fd) { handleClient(); });
-        m_EpollWrapper.add(m_TunInterface.getInterfaceFd(),
-                           [this](int fd) { handleTunInterface(); });
+                           [this](int fd, uint32_t events) {
+                               if (events & EPOLLOUT) {
+                                   drainEgressQueues();
+                               }
+                               if (events & ~EPOLLOUT) {
+                                   handleClient(m_ServerSocket);
+                               }
+                           });
+        m_EpollWrapper.add(
+            m_TunInterface.getInterfaceFd(),
+            [this](int fd, uint32_t events) { handleTunInterface(); });
+
+        if (m_Config.clusterNode.has_value()) {
+            startCluster();
+        }
 
-        m_LastUsedClientAddress = m_TunInterface.getTunIpAddress();
+        m_AddressPool.reserve(m_TunInterface.getTunIpAddress());
 
         m_LastIdleClientsCheck = std::chrono::steady_clock::now();
 
@@ -43,7 +120,76 @@ class ToyVpnServer {
             m_PacketHandler.emplace(m_Config.saveFilePath.value());
         }
 
+        if (m_Config.encryption.has_value()) {
+            m_HandshakeWorkers.emplace(m_Config.secret,
+                                       m_Config.handshakeThreads,
+                                       m_MaxPendingKeyExchanges);
+            m_EpollWrapper.add(m_HandshakeWorkers->getEventFd(),
+                               [this](int fd, uint32_t events) {
+                                   handleKeyExchangeResults();
+                               });
+        }
+
+        if (m_Config.compression) {
+            m_Compressor.emplace();
+        }
+
+        if (m_Config.resumption) {
+            m_ResumptionTokens.emplace(m_Config.secret, m_TokenLifetime);
+        }
+
+        if (m_Config.coalescing || m_Config.fec) {
+            m_FlushTimer.init();
+            m_EpollWrapper.add(m_FlushTimer.getTimerFd(),
+                               [this](int fd, uint32_t events) {
+                                   m_FlushTimer.acknowledge();
+                                   flushPendingPackets();
+                               });
+        }
+        m_EpollWrapper.setBatchEndCallback([this]() {
+            if (m_IsTunDrained) {
+                flushPendingPackets();
+            }
+            m_TunInterface.flush();
+            publishGauges();
+#ifdef TOYVPN_STAGE_LATENCY
+            if (m_IsLatencyDumpRequested) {
+                m_IsLatencyDumpRequested = 0;
+                dumpStageLatency();
+            }
+#endif
+            if (m_IsTraceDumpRequested) {
+                m_IsTraceDumpRequested = 0;
+                writeTrace();
+            }
+        });
+
+#ifdef TOYVPN_STAGE_LATENCY
+        // Calibrate before the first packet rather than on it
+        TscClock::getNanosecondsPerTick();
+        signal(SIGUSR1, [](int) { m_IsLatencyDumpRequested = 1; });
+        TOYVPN_LOG_INFO("Send SIGUSR1 to log the per-stage latencies");
+#endif
+
+        if (m_Config.fairQueueing || m_Config.codel) {
+            m_EgressScheduler.emplace(
+                [this](const ServerSocket::Datagram *datagrams,
+                       size_t count) {
+                    return TOYVPN_TIMED(SocketSend, m_ServerSocket.sendBatch(
+                                                        datagrams, count));
+                },
+                m_Config.codel);
+        }
+
+        if (m_Config.metricsPort.has_value()) {
+            m_MetricsExporter.emplace(m_Stats, m_Config.metricsPort.value());
+        }
+
         m_EpollWrapper.startPolling();
+
+        if (m_Config.trace.has_value()) {
+            writeTrace();
+        }
     }
 
     void stop() {
@@ -51,110 +197,787 @@ class ToyVpnServer {
         for (const auto &item : m_Clients) {
             item.second->disconnect();
         }
+        if (m_Cluster.has_value()) {
+            m_Cluster->leave();
+        }
 
         m_EpollWrapper.stopPolling();
         if (m_PacketHandler.has_value()) {
             m_PacketHandler->stop();
         }
+        if (m_MetricsExporter.has_value()) {
+            m_MetricsExporter->stop();
+        }
         TOYVPN_LOG_INFO("Server stopped");
     }
 
   private:
+    // The microbenchmarks drive the session table and the idle sweep
+    friend class ServerBenchAccess;
+
+    // A null TUN interface or socket stands for the server's own wrapper, or
+    // the userspace NAT, which can only be bound once it is constructed
+    ToyVpnServer(const ToyVpnConfiguration &config, TunInterface *tunInterface,
+                 ServerSocket *serverSocket, bool isSystemSetUp)
+        : m_Config(config), m_Stats(config.statsSegment, m_MaxClientStats),
+          m_ReactorStats(m_Stats.getReactorStats()),
+          m_TunInterface(tunInterface != nullptr ? *tunInterface
+                         : config.userspaceNat.has_value()
+                             ? static_cast<TunInterface &>(m_UserspaceNat)
+                             : m_TunInterfaceWrapper),
+          m_ServerSocket(serverSocket != nullptr ? *serverSocket
+                                                 : m_ServerSocketWrapper),
+          m_IsSystemSetUp(isSystemSetUp),
+          m_HandshakeGuard(m_ServerSocket, config.secret,
+                           config.handshakeCookies,
+                           config.encryption.has_value()),
+          m_AddressPool(config.clusterNode.has_value()
+                            ? ClusterChannel::getAddressPartition(
+                                  config.privateNetwork,
+                                  config.clusterNode.value(),
+                                  config.clusterPeers.size() + 1)
+                            : config.privateNetwork) {}
+
     constexpr static int m_MaxConnections = 50;
     constexpr static int m_BufferSize = 32767;
     constexpr static std::chrono::duration m_CheckIdleClientsSec =
         std::chrono::seconds(5);
     constexpr static int m_MaxQueueCapacity = 1000;
+    constexpr static int m_TunBatchSize = 64;
+    constexpr static size_t m_MaxPendingKeyExchanges = 1024;
+    constexpr static std::chrono::duration m_FlushDeadline =
+        std::chrono::microseconds(100);
+    constexpr static std::chrono::duration m_TokenLifetime =
+        std::chrono::hours(24);
+    constexpr static std::chrono::duration m_AddressHoldTime =
+        std::chrono::minutes(5);
+    constexpr static uint32_t m_MaxClientStats = 65536;
+
+#ifdef TOYVPN_STAGE_LATENCY
+    static inline volatile std::sig_atomic_t m_IsLatencyDumpRequested = 0;
+#endif
+    static inline volatile std::sig_atomic_t m_IsTraceDumpRequested = 0;
 
     ToyVpnConfiguration m_Config;
+    StatsSegment m_Stats;
+    ReactorStats &m_ReactorStats;
 
     EPollWrapper m_EpollWrapper;
-    TunInterfaceWrapper m_TunInterface;
-    ServerSocketWrapper m_ServerSocket;
+    TunInterfaceWrapper m_TunInterfaceWrapper;
+    UserspaceNatInterface m_UserspaceNat;
+    ServerSocketWrapper m_ServerSocketWrapper;
+    TunInterface &m_TunInterface;
+    ServerSocket &m_ServerSocket;
+    // False when the server runs on an injected TUN interface and socket
+    bool m_IsSystemSetUp;
     IpForwardingWrapper m_IpForwarding;
     NatAndRoutingWrapper m_NatAndRouting;
+    // Detached before the TUN device it is attached to goes away
+    std::optional<FastPathWrapper> m_FastPath;
+    std::optional<ReuseportSteering> m_Steering;
+    std::optional<ClusterChannel> m_Cluster;
+    TimerWrapper m_ClusterTimer;
+    HandshakeGuard m_HandshakeGuard;
+    // Clients close their egress queues when they go, so these have to
+    // outlive them
+    std::optional<PacketHandler> m_PacketHandler;
+    std::optional<EgressScheduler> m_EgressScheduler;
 
     std::unordered_map<sockaddr_in6, std::shared_ptr<ClientHandler>,
                        sockaddrIn6Hash, sockaddrIn6Equal>
         m_Clients;
     std::unordered_map<uint32_t, std::shared_ptr<ClientHandler>>
         m_ClientAddressMap;
+    std::unordered_map<uint32_t, std::shared_ptr<ClientHandler>> m_Sessions;
     std::array<uint8_t, m_BufferSize> m_Buffer;
     std::chrono::steady_clock::time_point m_LastIdleClientsCheck;
-    pcpp::IPv4Address m_LastUsedClientAddress;
+    AddressPool m_AddressPool;
 
-    std::optional<PacketHandler> m_PacketHandler;
+    bool m_IsWaitingForSocket = false;
+    std::optional<HandshakeWorkerPool> m_HandshakeWorkers;
+    std::optional<PacketCompressor> m_Compressor;
+    TimerWrapper m_FlushTimer;
+    std::vector<std::shared_ptr<ClientHandler>> m_ClientsToFlush;
+    bool m_IsTunDrained = true;
+    std::unordered_set<sockaddr_in6, sockaddrIn6Hash, sockaddrIn6Equal>
+        m_PendingKeyExchanges;
+    std::optional<ResumptionTokens> m_ResumptionTokens;
+    // Addresses of resumable clients that went idle, kept out of the pool
+    // until the hold expires
+    std::unordered_map<uint32_t, std::chrono::steady_clock::time_point>
+        m_HeldAddresses;
+    // Reads m_Stats on its own thread, so it has to go first
+    std::optional<MetricsExporter> m_MetricsExporter;
 
-    void handleClient() {
+    // Datagrams are dispatched by their source address whichever socket
+    // they came in on
+    void handleClient(const ServerSocket &socket) {
         sockaddr_in6 clientAddress;
-        auto bytesReceived = m_ServerSocket.receive(m_Buffer, clientAddress);
+        auto bytesReceived = TOYVPN_TIMED(
+            SocketReceive, socket.receive(m_Buffer, clientAddress));
+        auto &now = m_EpollWrapper.getLoopTime();
         if (bytesReceived > 0) {
-            // New client
-            if (m_Clients.find(clientAddress) == m_Clients.end()) {
-                auto newClient = std::make_shared<ClientHandler>(
-                    m_ServerSocket, clientAddress, m_TunInterface,
-                    createVpnSettings(), m_PacketHandler);
-                m_Clients[clientAddress] = newClient;
-                m_ClientAddressMap[newClient->getClientVpnAddress().toInt()] =
-                    newClient;
-            }
-
-            m_Clients[clientAddress]->handleDataFromClient(m_Buffer,
-                                                           bytesReceived);
+            m_ReactorStats.datagramsReceived.add();
+            handleDatagram(clientAddress, bytesReceived, now, false);
         }
 
-        auto now = std::chrono::steady_clock::now();
         if (now - m_LastIdleClientsCheck > m_CheckIdleClientsSec) {
             checkIdleClients(now);
             m_LastIdleClientsCheck = now;
         }
     }
 
+    // Handles the datagram in m_Buffer. Datagrams of clients another node
+    // of the cluster owns are handed to it, and the ones it handed over
+    // aren't handed back.
+    void handleDatagram(const sockaddr_in6 &clientAddress, size_t dataSize,
+                        const std::chrono::steady_clock::time_point &now,
+                        bool isForwarded) {
+        if (m_Buffer[0] == ClientHandler::sessionMessageType) {
+            handleSessionDatagram(clientAddress, dataSize, now, isForwarded);
+        } else if (auto client = TOYVPN_TIMED(SessionLookup,
+                                              m_Clients.find(clientAddress));
+                   client != m_Clients.end()) {
+            client->second->handleDataFromClient(m_Buffer, dataSize, now);
+        } else if (isForwarded || !forwardDatagram(clientAddress, dataSize)) {
+            if (addClient(clientAddress, dataSize, now)) {
+                m_Clients[clientAddress]->handleDataFromClient(
+                    m_Buffer, dataSize, now);
+            }
+        }
+    }
+
+    // Datagrams of clients that roam are found by their session ID, so they
+    // keep working from a new address without a new handshake
+    void handleSessionDatagram(
+        const sockaddr_in6 &clientAddress, size_t dataSize,
+        const std::chrono::steady_clock::time_point &now, bool isForwarded) {
+        if (dataSize < ClientHandler::sessionHeaderSize) {
+            return;
+        }
+
+        uint32_t sessionId = 0;
+        for (size_t i = 1; i < ClientHandler::sessionHeaderSize; i++) {
+            sessionId = (sessionId << 8) | m_Buffer[i];
+        }
+
+        auto it = TOYVPN_TIMED(SessionLookup, m_Sessions.find(sessionId));
+        if (it == m_Sessions.end()) {
+            // The top byte of the session ID is the node that owns it
+            if (m_Cluster.has_value() && !isForwarded &&
+                (sessionId >> 24) != m_Cluster->getNodeIndex()) {
+                m_Cluster->forwardDatagram(sessionId >> 24, clientAddress,
+                                           m_Buffer.data(), dataSize);
+            }
+            return;
+        }
+
+        auto client = it->second;
+        auto previousAddress = client->getClientExternalAddress();
+        if (client->handleSessionDataFromClient(m_Buffer, dataSize,
+                                                clientAddress, now)) {
+            if (auto previous = m_Clients.find(previousAddress);
+                previous != m_Clients.end() && previous->second == client) {
+                m_Clients.erase(previous);
+            }
+            // Whoever had the address before is gone from it
+            if (auto displaced = m_Clients.find(clientAddress);
+                displaced != m_Clients.end() && displaced->second != client) {
+                TOYVPN_LOG_DEBUG("Session " << sessionId
+                                            << " moved to the address of "
+                                            << displaced->second
+                                                   ->getClientVpnAddress());
+                removeClient(*displaced->second);
+                releaseClientAddress(*displaced->second, now);
+                m_Clients.erase(displaced);
+                m_ReactorStats.sessionsEvicted.add();
+            }
+            m_Clients[clientAddress] = client;
+            if (m_Cluster.has_value()) {
+                m_Cluster->announceSession(client->getClientVpnAddress(),
+                                           clientAddress);
+            }
+        }
+    }
+
     void handleTunInterface() {
-        size_t bytesReceived = m_TunInterface.receive(m_Buffer);
-        if (bytesReceived > 0) {
-            timespec ts;
-            pcpp::RawPacket rawPacket(m_Buffer.data(), bytesReceived, ts, false,
-                                      pcpp::LINKTYPE_DLT_RAW1);
-            pcpp::Packet packet(&rawPacket);
-            if (packet.isPacketOfType(pcpp::IPv4)) {
-                auto ipv4Layer = packet.getLayerOfType<pcpp::IPv4Layer>();
-                if (auto it = m_ClientAddressMap.find(
-                        ipv4Layer->getDstIPv4Address().toInt());
-                    it != m_ClientAddressMap.end()) {
-                    it->second->handleDataFromTun(m_Buffer, bytesReceived);
-                }
+        auto &now = m_EpollWrapper.getLoopTime();
+
+        // Read everything that is waiting, up to a batch, so the egress
+        // scheduler gets to choose between the clients
+        m_IsTunDrained = false;
+        uint32_t packetCount = 0;
+        for (int i = 0; i < m_TunBatchSize; i++) {
+            auto bytesReceived =
+                TOYVPN_TIMED(TunReceive, m_TunInterface.receive(m_Buffer));
+            if (bytesReceived <= 0) {
+                m_IsTunDrained = true;
+                break;
             }
+            m_ReactorStats.tunPacketsReceived.add();
+            packetCount++;
+            handleTunPacket(bytesReceived, now, false);
         }
 
-        auto now = std::chrono::steady_clock::now();
+        TOYVPN_TRACE(TunBatch, 'C', packetCount);
+
+        // Coalesced packets and FEC parity are flushed at the end of the epoll
+        // batch if the TUN interface has nothing more to read, otherwise more
+        // packets may join them until the deadline
+        if (!m_IsTunDrained && !m_ClientsToFlush.empty() &&
+            !m_FlushTimer.isArmed()) {
+            m_FlushTimer.arm(m_FlushDeadline);
+        }
+
+        drainEgressQueues();
+
         if (now - m_LastIdleClientsCheck > m_CheckIdleClientsSec) {
             checkIdleClients(now);
             m_LastIdleClientsCheck = now;
         }
     }
 
-    VpnSettings createVpnSettings() {
-        auto nextClientAddress = pcpp::IPv4Address(
-            htonl(ntohl(m_LastUsedClientAddress.toInt()) + 1));
-        if (nextClientAddress == m_Config.privateNetwork.getHighestAddress()) {
-            throw std::runtime_error(
-                "Ran out of private network IPv4 addresses!");
+    // Handles the packet in m_Buffer. Packets for clients another node of
+    // the cluster owns are handed to it.
+    void handleTunPacket(size_t dataSize,
+                         const std::chrono::steady_clock::time_point &now,
+                         bool isForwarded) {
+        timespec ts;
+        pcpp::RawPacket rawPacket(m_Buffer.data(), dataSize, ts, false,
+                                  pcpp::LINKTYPE_DLT_RAW1);
+        pcpp::Packet packet(&rawPacket);
+        if (!packet.isPacketOfType(pcpp::IPv4)) {
+            return;
+        }
+
+        auto destination =
+            packet.getLayerOfType<pcpp::IPv4Layer>()->getDstIPv4Address();
+        if (auto it = TOYVPN_TIMED(SessionLookup,
+                                   m_ClientAddressMap.find(destination.toInt()));
+            it != m_ClientAddressMap.end()) {
+            auto &client = it->second;
+            bool hadPendingPackets = client->hasPendingPackets();
+            client->handleDataFromTun(m_Buffer, dataSize, now);
+            if (!hadPendingPackets && client->hasPendingPackets()) {
+                m_ClientsToFlush.push_back(client);
+            }
+        } else if (m_Cluster.has_value() && !isForwarded) {
+            if (auto owner = m_Cluster->findAddressOwner(destination)) {
+                m_Cluster->forwardTunPacket(owner.value(), m_Buffer.data(),
+                                            dataSize);
+            }
         }
-        m_LastUsedClientAddress = nextClientAddress;
-        return VpnSettings{nextClientAddress, m_Config.route, m_Config.mtu,
-                           m_Config.dnsServer, m_Config.secret};
+    }
+
+    bool addClient(const sockaddr_in6 &clientAddress, size_t dataSize,
+                   const std::chrono::steady_clock::time_point &now) {
+        // Hellos retransmitted while the key exchange is running are dropped
+        if (m_PendingKeyExchanges.find(clientAddress) !=
+            m_PendingKeyExchanges.end()) {
+            return false;
+        }
+
+        // No state is created until the handshake checks out
+        if (!m_HandshakeGuard.admit(m_Buffer.data(), dataSize, clientAddress,
+                                    now)) {
+            m_ReactorStats.handshakesRejected.add();
+            TOYVPN_TRACE(HelloRejected, 'i', 0);
+            return false;
+        }
+        TOYVPN_TRACE(HelloAdmitted, 'i', 0);
+
+        auto hello = HandshakeGuard::parseHello(m_Buffer.data(), dataSize);
+        if (hello->type == HelloMessage::Type::Encrypted) {
+            startKeyExchange(clientAddress, hello.value(), now);
+            return false;
+        }
+
+        auto vpnSettings = createVpnSettings();
+        if (!vpnSettings.has_value()) {
+            TOYVPN_LOG_ERROR("Ran out of private network IPv4 addresses!");
+            return false;
+        }
+
+        createClient(clientAddress, vpnSettings.value());
+        return true;
+    }
+
+    // The session is created when the result comes back from the workers
+    void startKeyExchange(const sockaddr_in6 &clientAddress,
+                          const HelloMessage &hello,
+                          const std::chrono::steady_clock::time_point &now) {
+        if (!m_HandshakeWorkers.has_value()) {
+            TOYVPN_LOG_DEBUG("Ignoring an encrypted hello, encryption is "
+                             "disabled");
+            return;
+        }
+
+        KeyExchangeJob job;
+        job.clientAddress = clientAddress;
+        std::copy(hello.nonce, hello.nonce + HelloMessage::nonceSize,
+                  job.clientNonce.begin());
+        std::copy(hello.publicKey,
+                  hello.publicKey + HelloMessage::publicKeySize,
+                  job.clientPublicKey.begin());
+        job.features = hello.features;
+        if (m_ResumptionTokens.has_value() &&
+            hello.resumptionToken != nullptr) {
+            job.resumedLease = m_ResumptionTokens->redeem(
+                hello.resumptionToken, std::chrono::system_clock::now());
+        }
+        if (m_HandshakeWorkers->submit(job)) {
+            m_HandshakeGuard.rememberHello(hello, now);
+            m_PendingKeyExchanges.insert(clientAddress);
+            m_ReactorStats.handshakesStarted.add();
+            TOYVPN_TRACE(KeyExchangeQueued, 'i', 0);
+        }
+    }
+
+    void handleKeyExchangeResults() {
+        m_HandshakeWorkers->collect([this](const KeyExchangeResult &result) {
+            m_PendingKeyExchanges.erase(result.clientAddress);
+            if (result.isValid) {
+                addEncryptedClient(result);
+            }
+        });
+    }
+
+    void addEncryptedClient(const KeyExchangeResult &result) {
+        if (m_Clients.find(result.clientAddress) != m_Clients.end()) {
+            return;
+        }
+
+        std::optional<VpnSettings> vpnSettings;
+        if (result.resumedLease.has_value()) {
+            vpnSettings = resumeVpnSettings(result.resumedLease.value(),
+                                            m_EpollWrapper.getLoopTime());
+        }
+        if (!vpnSettings.has_value()) {
+            vpnSettings = createVpnSettings();
+        }
+        if (!vpnSettings.has_value()) {
+            TOYVPN_LOG_ERROR("Ran out of private network IPv4 addresses!");
+            return;
+        }
+
+        createClient(result.clientAddress, vpnSettings.value(), result.features)
+            ->completeKeyExchange(result, m_EpollWrapper.getLoopTime());
+    }
+
+    std::shared_ptr<ClientHandler>
+    createClient(const sockaddr_in6 &clientAddress, VpnSettings vpnSettings,
+                 uint8_t features = 0) {
+        // Optional features are only used if both sides want them
+        ClientOptions options;
+        if (m_Compressor.has_value() &&
+            (features & HelloMessage::compressionFeature)) {
+            options.compressor = &m_Compressor.value();
+        }
+        options.coalescing = m_Config.coalescing &&
+                             (features & HelloMessage::coalescingFeature);
+        options.fec = m_Config.fec && (features & HelloMessage::fecFeature);
+        options.headerCompression =
+            m_Config.headerCompression &&
+            (features & HelloMessage::headerCompressionFeature);
+        options.rateLimiter = createRateLimiter();
+        options.egressWeight = getClientWeight(vpnSettings.clientAddress);
+        if (m_Config.encryption.has_value()) {
+            options.encryptionAlgorithm = m_Config.encryption.value();
+        }
+        options.stats = &m_Stats;
+        if (m_Config.roaming && (features & HelloMessage::roamingFeature)) {
+            options.sessionId = createSessionId();
+        }
+        // The programs only know plain datagrams, so sessions that
+        // negotiated anything else stay in the server
+        if (m_FastPath.has_value() && features == 0 &&
+            !options.sessionId.has_value()) {
+            options.fastPath = &m_FastPath.value();
+        }
+        // Clients that roam change addresses, so they stay on the shared
+        // socket
+        if (m_IsSystemSetUp && m_Config.connectedSockets &&
+            !options.sessionId.has_value()) {
+            options.connectedSocket = createConnectedSocket(clientAddress);
+        }
+        if (m_ResumptionTokens.has_value() &&
+            (features & HelloMessage::resumptionFeature)) {
+            vpnSettings.resumptionToken =
+                ResumptionTokens::toString(m_ResumptionTokens->issue(
+                    vpnSettings.clientAddress.toInt(),
+                    std::chrono::system_clock::now()));
+        }
+
+        auto newClient = std::make_shared<ClientHandler>(
+            m_ServerSocket, clientAddress, m_TunInterface, vpnSettings,
+            m_PacketHandler, m_EgressScheduler, options);
+        m_Clients[clientAddress] = newClient;
+        m_ClientAddressMap[newClient->getClientVpnAddress().toInt()] =
+            newClient;
+        if (options.sessionId.has_value()) {
+            m_Sessions[options.sessionId.value()] = newClient;
+        } else if (m_Steering.has_value()) {
+            // Clients that roam are steered by their session ID. Without an
+            // entry the kernel's hash picks a server, which works as long as
+            // it picks this one.
+            try {
+                m_Steering->addClient(clientAddress);
+            } catch (const std::runtime_error &err) {
+                TOYVPN_LOG_ERROR("Couldn't steer the datagrams of "
+                                 << newClient->getClientVpnAddress() << ": "
+                                 << err.what());
+            }
+        }
+        if (m_Cluster.has_value()) {
+            m_Cluster->announceSession(newClient->getClientVpnAddress(),
+                                       clientAddress);
+        }
+        if (auto socket = options.connectedSocket.get()) {
+            m_EpollWrapper.add(socket->getSocketFd(),
+                               [this, socket](int fd, uint32_t events) {
+                                   handleClient(*socket);
+                               });
+        }
+        m_ReactorStats.sessionsCreated.add();
+        return newClient;
+    }
+
+    void startCluster() {
+        m_Cluster.emplace(
+            [this](const sockaddr_in6 &clientAddress, const uint8_t *data,
+                   size_t dataSize) {
+                if (dataSize > m_Buffer.size()) {
+                    return;
+                }
+                std::copy(data, data + dataSize, m_Buffer.begin());
+                handleDatagram(clientAddress, dataSize,
+                               m_EpollWrapper.getLoopTime(), true);
+            },
+            [this](const uint8_t *data, size_t dataSize) {
+                if (dataSize > m_Buffer.size()) {
+                    return;
+                }
+                std::copy(data, data + dataSize, m_Buffer.begin());
+                handleTunPacket(dataSize, m_EpollWrapper.getLoopTime(), true);
+                drainEgressQueues();
+            });
+        m_Cluster->init(m_Config.clusterNode.value(),
+                        m_Config.clusterAddress, m_Config.clusterPort,
+                        m_Config.clusterPeers, m_Config.secret);
+        m_EpollWrapper.add(m_Cluster->getSocketFd(),
+                           [this](int fd, uint32_t events) {
+                               m_Cluster->receive(
+                                   m_EpollWrapper.getLoopTime());
+                           });
+
+        m_ClusterTimer.init();
+        m_ClusterTimer.arm(ClusterChannel::heartbeatInterval);
+        m_EpollWrapper.add(m_ClusterTimer.getTimerFd(),
+                           [this](int fd, uint32_t events) {
+                               m_ClusterTimer.acknowledge();
+                               m_Cluster->tick(m_EpollWrapper.getLoopTime());
+                               m_ClusterTimer.arm(
+                                   ClusterChannel::heartbeatInterval);
+                           });
+    }
+
+    // A datagram from an address another node owns the session of, e.g.
+    // after the load balancer moved the client
+    bool forwardDatagram(const sockaddr_in6 &clientAddress, size_t dataSize) {
+        if (!m_Cluster.has_value()) {
+            return false;
+        }
+        auto owner = m_Cluster->findClientOwner(clientAddress);
+        return owner.has_value() &&
+               m_Cluster->forwardDatagram(owner.value(), clientAddress,
+                                          m_Buffer.data(), dataSize);
+    }
+
+    // Falls back to the shared socket when the client can't have its own,
+    // e.g. when the server runs out of file descriptors
+    std::shared_ptr<ServerSocket>
+    createConnectedSocket(const sockaddr_in6 &clientAddress) {
+        auto socket = std::make_shared<ConnectedSocketWrapper>();
+        try {
+            socket->init(m_Config.port, clientAddress);
+        } catch (const std::runtime_error &error) {
+            TOYVPN_LOG_ERROR(error.what());
+            return nullptr;
+        }
+        return socket;
+    }
+
+    // Every connected client holds a file descriptor
+    static void raiseOpenFileLimit() {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        TOYVPN_LOG_INFO("Connecting a socket per client, up to "
+                        << limit.rlim_cur << " open files");
+    }
+
+    uint32_t createSessionId() const {
+        uint32_t sessionId = 0;
+        while (sessionId == 0 || m_Sessions.count(sessionId) != 0) {
+            if (RAND_bytes(reinterpret_cast<uint8_t *>(&sessionId),
+                           sizeof(sessionId)) != 1) {
+                throw std::runtime_error("Couldn't generate a session ID");
+            }
+            // The top byte tells the steering program or the other nodes of
+            // the cluster which server owns it
+            if (m_Steering.has_value()) {
+                sessionId = (sessionId & 0x00ffffff) |
+                            (uint32_t(m_Steering->getMemberIndex()) << 24);
+            } else if (m_Cluster.has_value()) {
+                sessionId = (sessionId & 0x00ffffff) |
+                            (uint32_t(m_Cluster->getNodeIndex()) << 24);
+            }
+        }
+        return sessionId;
+    }
+
+    std::optional<VpnSettings> createVpnSettings() {
+        auto clientAddress = m_AddressPool.allocate();
+        if (!clientAddress.has_value()) {
+            // Held addresses are given up before turning clients away
+            if (m_HeldAddresses.empty()) {
+                return std::nullopt;
+            }
+            auto oldest = std::min_element(
+                m_HeldAddresses.begin(), m_HeldAddresses.end(),
+                [](const auto &a, const auto &b) {
+                    return a.second < b.second;
+                });
+            clientAddress = pcpp::IPv4Address(oldest->first);
+            m_HeldAddresses.erase(oldest);
+        }
+        // The tokens from before, even from before a restart, are no good
+        // for the address from now on
+        if (m_ResumptionTokens.has_value()) {
+            m_ResumptionTokens->revoke(clientAddress->toInt());
+        }
+        return VpnSettings{clientAddress.value(), m_Config.route, m_Config.mtu,
+                           m_Config.dnsServer, m_Config.secret, std::nullopt};
+    }
+
+    // Gives a client with a valid resumption token its previous address if
+    // it is held for it, free, or still taken by its own session that went
+    // idle or disconnected. Every address a client has was given out with
+    // a new lease, so the session on it is the token's own if the lease is
+    // current.
+    std::optional<VpnSettings>
+    resumeVpnSettings(const ResumptionTokens::Lease &lease,
+                      const std::chrono::steady_clock::time_point &now) {
+        // The address may have changed hands while the key exchange ran
+        if (!m_ResumptionTokens->isCurrent(lease)) {
+            return std::nullopt;
+        }
+
+        pcpp::IPv4Address clientAddress(lease.address);
+        if (auto held = m_HeldAddresses.find(lease.address);
+            held != m_HeldAddresses.end()) {
+            m_HeldAddresses.erase(held);
+        } else if (auto stale = m_ClientAddressMap.find(lease.address);
+                   stale != m_ClientAddressMap.end()) {
+            auto client = stale->second;
+            client->updateFromFastPath(now);
+            if (!client->isIdle(now)) {
+                TOYVPN_LOG_DEBUG("Not resuming " << clientAddress
+                                                 << ", its session is active");
+                return std::nullopt;
+            }
+            TOYVPN_LOG_DEBUG("Replacing the stale session of "
+                             << clientAddress);
+            removeClient(*client);
+            m_Clients.erase(client->getClientExternalAddress());
+            m_ReactorStats.sessionsEvicted.add();
+        } else if (m_AddressPool.reserve(clientAddress)) {
+            // Other tokens from before a restart may name the address too
+            m_ResumptionTokens->revoke(lease.address);
+        } else {
+            return std::nullopt;
+        }
+
+        TOYVPN_LOG_INFO("Client resumed with address " << clientAddress);
+        m_ReactorStats.sessionsResumed.add();
+        return VpnSettings{clientAddress, m_Config.route, m_Config.mtu,
+                           m_Config.dnsServer, m_Config.secret, std::nullopt};
+    }
+
+    uint16_t getClientWeight(const pcpp::IPv4Address &clientAddress) const {
+        auto it = m_Config.clientWeights.find(clientAddress.toInt());
+        return it != m_Config.clientWeights.end() ? it->second : 1;
+    }
+
+    void drainEgressQueues() {
+        if (!m_EgressScheduler.has_value()) {
+            return;
+        }
+
+        // Wait for the socket to become writable while there is a backlog
+        bool hasBacklog =
+            m_EgressScheduler->drain(m_EpollWrapper.getLoopTime());
+        if (hasBacklog != m_IsWaitingForSocket) {
+            m_EpollWrapper.modify(m_ServerSocket.getSocketFd(),
+                                  hasBacklog ? EPOLLIN | EPOLLOUT : EPOLLIN);
+            m_IsWaitingForSocket = hasBacklog;
+        }
+    }
+
+    void flushPendingPackets() {
+        for (const auto &client : m_ClientsToFlush) {
+            client->flushPendingPackets();
+        }
+        m_ClientsToFlush.clear();
+    }
+
+    std::optional<TokenBucket> createRateLimiter() const {
+        if (!m_Config.clientRateLimit.has_value()) {
+            return std::nullopt;
+        }
+
+        // Large limits overflow 32 bits once converted to bytes
+        return TokenBucket(
+            uint64_t(m_Config.clientRateLimit.value()) * 1000 / 8,
+            uint64_t(m_Config.clientBurstSize) * 1024);
     }
 
     void checkIdleClients(const std::chrono::steady_clock::time_point &now) {
+        TOYVPN_TRACE(IdleSweep, 'B', 0);
+        uint32_t evictedCount = 0;
         for (auto it = m_Clients.begin(); it != m_Clients.end();) {
+            it->second->updateFromFastPath(now);
             if (it->second->isIdle(now)) {
-                m_ClientAddressMap.erase(
-                    it->second->getClientVpnAddress().toInt());
+                auto clientVpnAddress = it->second->getClientVpnAddress();
+                auto counters = it->second->getCounters();
+                if (counters.droppedFromClient > 0 ||
+                    counters.droppedFromTun > 0) {
+                    TOYVPN_LOG_DEBUG("Client "
+                                     << clientVpnAddress
+                                     << " exceeded the rate limit, dropped "
+                                     << counters.droppedFromClient
+                                     << " packets from the client and "
+                                     << counters.droppedFromTun
+                                     << " packets to the client");
+                }
+                if (counters.egressQueue.aqmDropped > 0 ||
+                    counters.egressQueue.ecnMarked > 0) {
+                    TOYVPN_LOG_DEBUG("Client "
+                                     << clientVpnAddress << " had "
+                                     << counters.egressQueue.aqmDropped
+                                     << " packets dropped and "
+                                     << counters.egressQueue.ecnMarked
+                                     << " packets ECN-marked by CoDel");
+                }
+                if (counters.invalidFromClient > 0) {
+                    TOYVPN_LOG_DEBUG("Client "
+                                     << clientVpnAddress << " sent "
+                                     << counters.invalidFromClient
+                                     << " packets that failed decryption");
+                }
+                if (counters.recoveredFromClient > 0) {
+                    TOYVPN_LOG_DEBUG("Client "
+                                     << clientVpnAddress << " had "
+                                     << counters.recoveredFromClient
+                                     << " lost packets recovered by FEC");
+                }
+                removeClient(*it->second);
+                releaseClientAddress(*it->second, now);
                 it = m_Clients.erase(it);
+                m_ReactorStats.sessionsEvicted.add();
+                evictedCount++;
+            } else {
+                ++it;
+            }
+        }
+
+        for (auto it = m_HeldAddresses.begin(); it != m_HeldAddresses.end();) {
+            if (now > it->second) {
+                releaseAddress(pcpp::IPv4Address(it->first));
+                it = m_HeldAddresses.erase(it);
             } else {
                 ++it;
             }
         }
+        TOYVPN_TRACE(IdleSweep, 'E', evictedCount);
+    }
+
+    // Gives the address of a removed client back to the pool, or holds it
+    // for a while if the client can resume its session
+    void
+    releaseClientAddress(const ClientHandler &client,
+                         const std::chrono::steady_clock::time_point &now) {
+        auto clientVpnAddress = client.getClientVpnAddress();
+        if (m_ResumptionTokens.has_value() && client.isResumable()) {
+            m_HeldAddresses[clientVpnAddress.toInt()] = now + m_AddressHoldTime;
+        } else {
+            releaseAddress(clientVpnAddress);
+        }
+    }
+
+    void releaseAddress(const pcpp::IPv4Address &address) {
+        m_AddressPool.release(address);
+        if (m_ResumptionTokens.has_value()) {
+            m_ResumptionTokens->revoke(address.toInt());
+        }
+    }
+
+    void writeTrace() {
+        std::ofstream file(m_Config.trace.value());
+        Tracing::writeChromeJson(file);
+        if (!file) {
+            TOYVPN_LOG_ERROR("Couldn't write the trace to "
+                             << m_Config.trace.value());
+            return;
+        }
+        TOYVPN_LOG_INFO("Wrote the trace to " << m_Config.trace.value());
+    }
+
+#ifdef TOYVPN_STAGE_LATENCY
+    void dumpStageLatency() {
+        std::ostringstream out;
+        StageLatency::local().dump(out);
+        TOYVPN_LOG_INFO("Per-stage latencies since the last dump:\n"
+                        << out.str());
+    }
+#endif
+
+    // The gauges are cheap to read on the reactor, so they are refreshed
+    // after every wakeup rather than computed by the exporter
+    void publishGauges() {
+        m_ReactorStats.wakeups.add();
+        m_ReactorStats.activeClients.set(m_Clients.size());
+        m_ReactorStats.pendingKeyExchanges.set(m_PendingKeyExchanges.size());
+        m_ReactorStats.heldAddresses.set(m_HeldAddresses.size());
+        m_ReactorStats.freeAddresses.set(m_AddressPool.getFreeCount());
+        if (m_EgressScheduler.has_value()) {
+            m_ReactorStats.egressQueuedPackets.set(
+                m_EgressScheduler->getQueuedPacketCount());
+        }
+    }
+
+    // Forgets everything that leads to a client except m_Clients, which the
+    // caller erases from, and leaves its address to the caller
+    void removeClient(const ClientHandler &client) {
+        if (auto sessionId = client.getSessionId()) {
+            m_Sessions.erase(sessionId.value());
+        } else if (m_Steering.has_value()) {
+            m_Steering->removeClient(client.getClientExternalAddress());
+        }
+        m_ClientAddressMap.erase(client.getClientVpnAddress().toInt());
+        if (m_Cluster.has_value()) {
+            m_Cluster->withdrawSession(client.getClientVpnAddress(),
+                                       client.getClientExternalAddress());
+        }
+        // The socket closes with the client
+        if (auto socket = client.getConnectedSocket()) {
+            m_EpollWrapper.remove(socket->getSocketFd());
+        }
+        if (m_FastPath.has_value()) {
+            m_FastPath->removeSession(client.getClientVpnAddress());
+        }
     }
 };
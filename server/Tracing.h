@@ -0,0 +1,259 @@
+#pragma once
+
+#include "StageLatency.h"
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// The events of the data plane that can be traced. Spans are recorded with
+// a begin and an end event, everything else is an instant event or a counter.
+enum class TraceEventType : uint8_t {
+    EpollWakeup,
+    TunBatch,
+    HelloAdmitted,
+    HelloRejected,
+    KeyExchangeQueued,
+    KeyExchange,
+    ClientConnected,
+    ClientDisconnected,
+    ClientFailed,
+    ClientMoved,
+    IdleSweep,
+    CaptureFlush,
+    Count
+};
+
+struct TraceEvent {
+    uint64_t ticks;
+    uint32_t value;
+    TraceEventType type;
+    // As in the Chrome trace format: 'B'egin, 'E'nd, 'i'nstant or 'C'ounter
+    char phase;
+};
+
+// A fixed-size ring of the latest events of one thread. Only that thread
+// writes to it, publishing every event by bumping m_Written, and a reader
+// copies the ring without stopping it and drops whatever may have been
+// overwritten while it was copying.
+class TraceRing {
+  public:
+    constexpr static size_t capacity = 1 << 16;
+
+    TraceRing(const std::string &threadName, long threadId)
+        : m_ThreadName(threadName), m_ThreadId(threadId),
+          m_Events(capacity) {}
+
+    void push(const TraceEvent &event) {
+        auto position = m_Written.load(std::memory_order_relaxed);
+        m_Events[position & (capacity - 1)] = event;
+        m_Written.store(position + 1, std::memory_order_release);
+    }
+
+    std::vector<TraceEvent> snapshot() const {
+        auto end = m_Written.load(std::memory_order_acquire);
+        auto begin = end > capacity ? end - capacity : 0;
+        std::vector<TraceEvent> events;
+        events.reserve(end - begin);
+        for (auto position = begin; position < end; position++) {
+            events.push_back(m_Events[position & (capacity - 1)]);
+        }
+
+        // The writer may be overwriting the oldest copied event right now
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto written = m_Written.load(std::memory_order_relaxed);
+        auto firstIntact = written >= capacity ? written - capacity + 1 : 0;
+        if (firstIntact > begin) {
+            events.erase(events.begin(),
+                         events.begin() +
+                             std::min<size_t>(firstIntact - begin,
+                                              events.size()));
+        }
+        return events;
+    }
+
+    const std::string &getThreadName() const { return m_ThreadName; }
+
+    long getThreadId() const { return m_ThreadId; }
+
+  private:
+    std::string m_ThreadName;
+    long m_ThreadId;
+    std::atomic<uint64_t> m_Written{0};
+    std::vector<TraceEvent> m_Events;
+};
+
+// Records data-plane events into per-thread rings and exports them in the
+// Chrome trace event format, which chrome://tracing and the Perfetto UI
+// open. While tracing is disabled an event costs a relaxed load and a
+// branch. A ring is created the first time its thread records an event and
+// lives until the process exits, so the export still sees threads that are
+// gone.
+class Tracing {
+  public:
+    static void enable() {
+        TscClock::getNanosecondsPerTick();
+        m_IsEnabled.store(true, std::memory_order_relaxed);
+    }
+
+    static bool isEnabled() {
+        return __builtin_expect(m_IsEnabled.load(std::memory_order_relaxed),
+                                false);
+    }
+
+    // Names the ring of the calling thread in the export; it has to be called
+    // before the thread records its first event
+    static void setThreadName(const std::string &name) {
+        getThreadName() = name;
+    }
+
+    static void record(TraceEventType type, char phase, uint32_t value = 0) {
+        thread_local TraceRing *ring = nullptr;
+        if (ring == nullptr) {
+            ring = createRing();
+        }
+        ring->push({TscClock::now(), value, type, phase});
+    }
+
+    static void writeChromeJson(std::ostream &out) {
+        std::vector<std::pair<const TraceRing *, std::vector<TraceEvent>>>
+            snapshots;
+        {
+            std::lock_guard<std::mutex> lock(getRegistryMutex());
+            for (const auto &ring : getRings()) {
+                snapshots.emplace_back(ring.get(), ring->snapshot());
+            }
+        }
+
+        uint64_t base = UINT64_MAX;
+        for (const auto &[ring, events] : snapshots) {
+            if (!events.empty()) {
+                base = std::min(base, events.front().ticks);
+            }
+        }
+        auto nanosecondsPerTick = TscClock::getNanosecondsPerTick();
+        auto pid = getpid();
+
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool isFirst = true;
+        for (const auto &[ring, events] : snapshots) {
+            out << (isFirst ? "" : ",") << "\n{\"name\":\"thread_name\","
+                << "\"ph\":\"M\",\"pid\":" << pid
+                << ",\"tid\":" << ring->getThreadId()
+                << ",\"args\":{\"name\":\"" << ring->getThreadName()
+                << "\"}}";
+            isFirst = false;
+
+            for (const auto &event : events) {
+                const auto &info =
+                    m_EventInfo[static_cast<size_t>(event.type)];
+                out << ",\n{\"name\":\"" << info.name << "\",\"cat\":\""
+                    << info.category << "\",\"ph\":\"" << event.phase
+                    << "\",\"ts\":";
+                writeMicroseconds(out, static_cast<uint64_t>(
+                                           (event.ticks - base) *
+                                           nanosecondsPerTick));
+                out << ",\"pid\":" << pid
+                    << ",\"tid\":" << ring->getThreadId();
+                if (event.phase == 'i') {
+                    out << ",\"s\":\"t\"";
+                }
+                if (info.argument != nullptr) {
+                    out << ",\"args\":{\"" << info.argument << "\":";
+                    writeValue(out, info, event.value);
+                    out << "}";
+                }
+                out << "}";
+            }
+        }
+        out << "\n]}\n";
+    }
+
+  private:
+    struct EventInfo {
+        const char *name;
+        const char *category;
+        // The name of the event's value, nullptr if it has none
+        const char *argument;
+        bool isAddress;
+    };
+
+    constexpr static std::array<EventInfo,
+                                static_cast<size_t>(TraceEventType::Count)>
+        m_EventInfo = {{
+            {"epoll wakeup", "reactor", "events", false},
+            {"TUN batch", "reactor", "packets", false},
+            {"hello admitted", "handshake", nullptr, false},
+            {"hello rejected", "handshake", nullptr, false},
+            {"key exchange queued", "handshake", nullptr, false},
+            {"key exchange", "handshake", nullptr, false},
+            {"client connected", "client", "address", true},
+            {"client disconnected", "client", "address", true},
+            {"client failed", "client", "address", true},
+            {"client moved", "client", "address", true},
+            {"idle sweep", "reactor", "evicted", false},
+            {"capture flush", "capture", "packets", false},
+        }};
+
+    static inline std::atomic<bool> m_IsEnabled{false};
+
+    static std::mutex &getRegistryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::vector<std::unique_ptr<TraceRing>> &getRings() {
+        static std::vector<std::unique_ptr<TraceRing>> rings;
+        return rings;
+    }
+
+    static std::string &getThreadName() {
+        thread_local std::string name = "thread";
+        return name;
+    }
+
+    // Only the first event of every thread takes the lock
+    static TraceRing *createRing() {
+        auto ring = std::make_unique<TraceRing>(getThreadName(),
+                                                syscall(SYS_gettid));
+        std::lock_guard<std::mutex> lock(getRegistryMutex());
+        getRings().push_back(std::move(ring));
+        return getRings().back().get();
+    }
+
+    // Timestamps are in microseconds; printing them as doubles would round
+    // them to six digits
+    static void writeMicroseconds(std::ostream &out, uint64_t nanoseconds) {
+        std::array<char, 32> text;
+        snprintf(text.data(), text.size(), "%" PRIu64 ".%03" PRIu64,
+                 nanoseconds / 1000, nanoseconds % 1000);
+        out << text.data();
+    }
+
+    static void writeValue(std::ostream &out, const EventInfo &info,
+                           uint32_t value) {
+        if (!info.isAddress) {
+            out << value;
+            return;
+        }
+        std::array<char, INET_ADDRSTRLEN> address;
+        inet_ntop(AF_INET, &value, address.data(), address.size());
+        out << "\"" << address.data() << "\"";
+    }
+};
+
+#define TOYVPN_TRACE(type, phase, value)                                       \
+    do {                                                                       \
+        if (Tracing::isEnabled()) {                                            \
+            Tracing::record(TraceEventType::type, phase, value);               \
+        }                                                                      \
+    } while (0)
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
+#include <array>
+#include <cstdint>
+#include <sys/types.h>
+
+// The TUN interface as the server sees it. TunInterfaceWrapper is the real
+// device, UserspaceNatInterface replaces it with a NAT on the public
+// interface and InMemoryTunInterface stands in for it when the server runs
+// offline.
+class TunInterface {
+  public:
+    virtual ~TunInterface() = default;
+
+    // Readable in epoll while there are packets to receive
+    virtual int getInterfaceFd() const = 0;
+
+    virtual const pcpp::IPv4Address &getTunIpAddress() const = 0;
+
+    // Returns the size of the packet or -1 if there is none, without
+    // blocking
+    virtual ssize_t receive(uint8_t *data, size_t dataSize) const = 0;
+
+    virtual size_t send(const uint8_t *data, size_t dataSize) const = 0;
+
+    // Sends what send() has queued, called at the end of every epoll batch
+    virtual void flush() const {}
+
+    template <std::size_t BUFFER_SIZE>
+    ssize_t receive(std::array<uint8_t, BUFFER_SIZE> &buffer) const {
+        return receive(buffer.data(), buffer.size());
+    }
+
+    template <std::size_t BUFFER_SIZE>
+    size_t send(const std::array<uint8_t, BUFFER_SIZE> &buffer,
+                size_t dataSize) const {
+        return send(buffer.data(), dataSize);
+    }
+};
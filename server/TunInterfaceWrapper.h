@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Log.h"
+#include "TunInterface.h"
 #include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
 #include <fcntl.h>
 #include <iostream>
@@ -9,8 +10,11 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 
-class TunInterfaceWrapper {
+class TunInterfaceWrapper : public TunInterface {
   public:
+    using TunInterface::receive;
+    using TunInterface::send;
+
     void init(const std::string &tunInterfaceName,
               const pcpp::IPv4Network &privateNetwork) {
         int interface = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
@@ -47,27 +51,26 @@ class TunInterfaceWrapper {
         TOYVPN_LOG_INFO("Created TUN interface '" << tunInterfaceName << "'");
     }
 
-    int getInterfaceFd() const { return m_Interface; }
+    int getInterfaceFd() const override { return m_Interface; }
 
-    const pcpp::IPv4Address &getTunIpAddress() const { return m_TunIpAddress; }
+    const pcpp::IPv4Address &getTunIpAddress() const override {
+        return m_TunIpAddress;
+    }
 
-    template <std::size_t BUFFER_SIZE>
-    size_t receive(std::array<uint8_t, BUFFER_SIZE> &buffer) const {
+    ssize_t receive(uint8_t *data, size_t dataSize) const override {
         if (!m_IsInitialized) {
             throw std::runtime_error("TUN interface is not initialized");
         }
 
-        return read(m_Interface, buffer.data(), buffer.size());
+        return read(m_Interface, data, dataSize);
     }
 
-    template <std::size_t BUFFER_SIZE>
-    size_t send(const std::array<uint8_t, BUFFER_SIZE> &buffer,
-                size_t dataSize) const {
+    size_t send(const uint8_t *data, size_t dataSize) const override {
         if (!m_IsInitialized) {
             throw std::runtime_error("TUN interface is not initialized");
         }
 
-        return write(m_Interface, buffer.data(), dataSize);
+        return write(m_Interface, data, dataSize);
     }
 
   private:
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+// Rejects replayed or too old packet counters (RFC 6479). The window is a
+// ring of 64-bit words so moving it forward only clears the words it skips.
+class ReplayWindow {
+  public:
+    bool check(uint64_t counter) const {
+        if (counter > m_Highest) {
+            return true;
+        }
+
+        if (m_Highest - counter >= m_WindowSize) {
+            return false;
+        }
+
+        return !(m_Bitmap[getWordIndex(counter)] & getBit(counter));
+    }
+
+    // Marks a counter as seen, must only be called after the packet was
+    // authenticated
+    void update(uint64_t counter) {
+        if (counter > m_Highest) {
+            uint64_t currentWord = m_Highest / m_BitsPerWord;
+            uint64_t newWord = counter / m_BitsPerWord;
+            uint64_t wordsToClear =
+                std::min<uint64_t>(newWord - currentWord, m_WordCount);
+            for (uint64_t i = 1; i <= wordsToClear; i++) {
+                m_Bitmap[(currentWord + i) % m_WordCount] = 0;
+            }
+            m_Highest = counter;
+        }
+
+        m_Bitmap[getWordIndex(counter)] |= getBit(counter);
+    }
+
+    uint64_t getHighest() const { return m_Highest; }
+
+  private:
+    constexpr static uint64_t m_BitsPerWord = 64;
+    constexpr static uint64_t m_WordCount = 32;
+    // One word is always partially ahead of the highest counter
+    constexpr static uint64_t m_WindowSize =
+        (m_WordCount - 1) * m_BitsPerWord;
+
+    std::array<uint64_t, m_WordCount> m_Bitmap{};
+    uint64_t m_Highest = 0;
+
+    static size_t getWordIndex(uint64_t counter) {
+        return (counter / m_BitsPerWord) % m_WordCount;
+    }
+
+    static uint64_t getBit(uint64_t counter) {
+        return uint64_t(1) << (counter % m_BitsPerWord);
+    }
+};
+
+// Per-packet authenticated encryption of tunnel traffic.
+//
+// An encrypted datagram is (2, counter, ciphertext, tag): the 8-byte
+// big-endian counter is the nonce and is authenticated together with the
+// message type. Each direction has its own key and counter, and received
+// counters go through a replay window. The batch functions run many packets
+// through the same cipher contexts so the key schedule is done once and the
+// vectorized ChaCha20/AES-GCM kernels of libcrypto stay hot.
+class TunnelCipher {
+  public:
+    enum class Algorithm : uint8_t { ChaCha20Poly1305 = 1, Aes256Gcm = 2 };
+
+    using Key = std::array<uint8_t, 32>;
+
+    struct Packet {
+        uint8_t *data;
+        size_t dataSize;
+        bool isValid;
+    };
+
+    constexpr static uint8_t messageType = 2;
+    constexpr static size_t headerSize = 1 + sizeof(uint64_t);
+    constexpr static size_t tagSize = 16;
+    constexpr static size_t overhead = headerSize + tagSize;
+
+    TunnelCipher(Algorithm algorithm, const Key &sealKey, const Key &openKey)
+        : m_Algorithm(algorithm),
+          m_SealContext(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free),
+          m_OpenContext(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free) {
+        auto cipher = getCipher(algorithm);
+        if (!m_SealContext || !m_OpenContext ||
+            EVP_EncryptInit_ex(m_SealContext.get(), cipher, nullptr,
+                               sealKey.data(), nullptr) != 1 ||
+            EVP_DecryptInit_ex(m_OpenContext.get(), cipher, nullptr,
+                               openKey.data(), nullptr) != 1) {
+            throw std::runtime_error("Couldn't initialize the tunnel cipher");
+        }
+    }
+
+    // Uses AES-256-GCM when the CPU has AES instructions and
+    // ChaCha20-Poly1305 otherwise
+    static Algorithm getPreferredAlgorithm() {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("aes") &&
+            __builtin_cpu_supports("pclmul")) {
+            return Algorithm::Aes256Gcm;
+        }
+#endif
+        return Algorithm::ChaCha20Poly1305;
+    }
+
+    static std::optional<Algorithm>
+    algorithmFromString(const std::string &value) {
+        if (value == "chacha20-poly1305") {
+            return Algorithm::ChaCha20Poly1305;
+        }
+        if (value == "aes-256-gcm") {
+            return Algorithm::Aes256Gcm;
+        }
+        if (value == "auto") {
+            return getPreferredAlgorithm();
+        }
+        return std::nullopt;
+    }
+
+    // Derives a key from the shared secret and the handshake nonces using
+    // HKDF-SHA256
+    static Key deriveKey(const uint8_t *secret, size_t secretSize,
+                         const uint8_t *salt, size_t saltSize,
+                         const std::string &label) {
+        Key key;
+        size_t keySize = key.size();
+        std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> context(
+            EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr), EVP_PKEY_CTX_free);
+        if (!context || EVP_PKEY_derive_init(context.get()) != 1 ||
+            EVP_PKEY_CTX_set_hkdf_md(context.get(), EVP_sha256()) != 1 ||
+            EVP_PKEY_CTX_set1_hkdf_salt(context.get(), salt, saltSize) != 1 ||
+            EVP_PKEY_CTX_set1_hkdf_key(context.get(), secret, secretSize) !=
+                1 ||
+            EVP_PKEY_CTX_add1_hkdf_info(
+                context.get(), reinterpret_cast<const uint8_t *>(label.data()),
+                label.size()) != 1 ||
+            EVP_PKEY_derive(context.get(), key.data(), &keySize) != 1) {
+            throw std::runtime_error("Couldn't derive a tunnel key");
+        }
+
+        return key;
+    }
+
+    Algorithm getAlgorithm() const { return m_Algorithm; }
+
+    // The counter of a datagram, which is its nonce
+    static uint64_t getCounter(const uint8_t *data) {
+        uint64_t counter = 0;
+        for (size_t i = 1; i < headerSize; i++) {
+            counter = (counter << 8) | data[i];
+        }
+        return counter;
+    }
+
+    // The highest counter of an authenticated datagram, gaps below it are
+    // lost or reordered datagrams
+    uint64_t getHighestOpenedCounter() const {
+        return m_ReplayWindow.getHighest();
+    }
+
+    // Encrypts a packet in place. The buffer must have room for overhead
+    // more bytes. Returns the size of the encrypted datagram or 0 on error.
+    size_t seal(uint8_t *data, size_t dataSize) {
+        std::memmove(data + headerSize, data, dataSize);
+
+        uint64_t counter = m_SealCounter++;
+        data[0] = messageType;
+        for (size_t i = 0; i < sizeof(counter); i++) {
+            data[headerSize - 1 - i] = counter >> (8 * i);
+        }
+
+        auto nonce = getNonce(counter);
+        int length = 0;
+        auto context = m_SealContext.get();
+        if (EVP_EncryptInit_ex(context, nullptr, nullptr, nullptr,
+                               nonce.data()) != 1 ||
+            EVP_EncryptUpdate(context, nullptr, &length, data, headerSize) !=
+                1 ||
+            EVP_EncryptUpdate(context, data + headerSize, &length,
+                              data + headerSize, dataSize) != 1 ||
+            EVP_EncryptFinal_ex(context, data + headerSize + dataSize,
+                                &length) != 1 ||
+            EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_GET_TAG, tagSize,
+                                data + headerSize + dataSize) != 1) {
+            return 0;
+        }
+
+        return dataSize + overhead;
+    }
+
+    // Decrypts and authenticates a datagram in place. Returns the size of the
+    // plaintext, which starts right after the header, or nullopt if the
+    // datagram is invalid or replayed.
+    std::optional<size_t> open(uint8_t *data, size_t dataSize) {
+        if (dataSize < overhead || data[0] != messageType) {
+            return std::nullopt;
+        }
+
+        uint64_t counter = getCounter(data);
+        if (!m_ReplayWindow.check(counter)) {
+            return std::nullopt;
+        }
+
+        auto nonce = getNonce(counter);
+        size_t plaintextSize = dataSize - overhead;
+        int length = 0;
+        auto context = m_OpenContext.get();
+        if (EVP_DecryptInit_ex(context, nullptr, nullptr, nullptr,
+                               nonce.data()) != 1 ||
+            EVP_DecryptUpdate(context, nullptr, &length, data, headerSize) !=
+                1 ||
+            EVP_DecryptUpdate(context, data + headerSize, &length,
+                              data + headerSize, plaintextSize) != 1 ||
+            EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_TAG, tagSize,
+                                data + headerSize + plaintextSize) != 1 ||
+            EVP_DecryptFinal_ex(context, data + headerSize + plaintextSize,
+                                &length) != 1) {
+            return std::nullopt;
+        }
+
+        m_ReplayWindow.update(counter);
+        return plaintextSize;
+    }
+
+    // Seals every packet in place, dataSize is updated to the datagram size
+    void sealBatch(Packet *packets, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            auto sealedSize = seal(packets[i].data, packets[i].dataSize);
+            packets[i].isValid = sealedSize != 0;
+            packets[i].dataSize = sealedSize;
+        }
+    }
+
+    // Opens every packet in place, dataSize is updated to the plaintext size
+    void openBatch(Packet *packets, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            auto plaintextSize = open(packets[i].data, packets[i].dataSize);
+            packets[i].isValid = plaintextSize.has_value();
+            packets[i].dataSize = plaintextSize.value_or(0);
+        }
+    }
+
+  private:
+    using CipherContext =
+        std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
+
+    Algorithm m_Algorithm;
+    CipherContext m_SealContext;
+    CipherContext m_OpenContext;
+    uint64_t m_SealCounter = 0;
+    ReplayWindow m_ReplayWindow;
+
+    static const EVP_CIPHER *getCipher(Algorithm algorithm) {
+        return algorithm == Algorithm::Aes256Gcm ? EVP_aes_256_gcm()
+                                                 : EVP_chacha20_poly1305();
+    }
+
+    static std::array<uint8_t, 12> getNonce(uint64_t counter) {
+        std::array<uint8_t, 12> nonce{};
+        for (size_t i = 0; i < sizeof(counter); i++) {
+            nonce[nonce.size() - 1 - i] = counter >> (8 * i);
+        }
+        return nonce;
+    }
+};
@@ -0,0 +1,352 @@
+#pragma once
+
+#include "Log.h"
+#include "NatTable.h"
+#include "PacketRingWrapper.h"
+#include "TunInterface.h"
+#include "libs/pcapplusplus/include/pcapplusplus/IpAddress.h"
+#include <arpa/inet.h>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <net/if.h>
+#include <optional>
+#include <sstream>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// Stands in for the TUN interface, the kernel's forwarding and iptables
+// MASQUERADE when the server runs with --userspace-nat. Packets the server
+// sends to it are translated by a NatTable and written as Ethernet frames
+// straight to the public network interface through a PacketRingWrapper, and
+// the frames to the NAT address that come back are translated to the clients
+// and received by the server as if from the TUN interface.
+//
+// The NAT address is a free address of the public interface's subnet with a
+// locally administered MAC address of its own, which the NAT answers ARP for.
+// The kernel sees the frames to that MAC address as meant for another host,
+// so it neither answers them with resets nor forwards them, and no iptables
+// rules are needed. Next hops are resolved with ARP as well: addresses in
+// the subnet directly and everything else through the default gateway of
+// the interface.
+//
+// Clients can't reach each other or the server's address in this mode.
+class UserspaceNatInterface : public TunInterface {
+  public:
+    using TunInterface::receive;
+    using TunInterface::send;
+
+    void init(const std::string &publicNetworkInterface,
+              const pcpp::IPv4Address &natAddress,
+              const pcpp::IPv4Network &privateNetwork) {
+        readInterfaceAddress(publicNetworkInterface);
+        m_NatAddress = ntohl(natAddress.toInt());
+        if ((m_NatAddress & m_InterfaceNetmask) !=
+                (m_InterfaceAddress & m_InterfaceNetmask) ||
+            m_NatAddress == m_InterfaceAddress) {
+            throw std::runtime_error(
+                "The userspace NAT address has to be a free address in the "
+                "subnet of '" +
+                publicNetworkInterface + "'");
+        }
+        m_Gateway = readDefaultGateway(publicNetworkInterface);
+
+        m_NatMacAddress = {0x02, 0x00};
+        for (int i = 0; i < 4; i++) {
+            m_NatMacAddress[2 + i] = m_NatAddress >> (24 - 8 * i);
+        }
+
+        m_NatTable.emplace(m_NatAddress);
+        m_Ring.init(publicNetworkInterface, getFilter());
+        m_Ring.addUnicastAddress(m_NatMacAddress);
+
+        m_TunIpAddress = privateNetwork.getLowestAddress();
+        m_PrivateNetwork = privateNetwork;
+
+        // Announce the NAT address and look up the gateway right away
+        auto now = Clock::now();
+        sendArp(m_ArpRequest, m_BroadcastMacAddress, m_NatAddress);
+        if (m_Gateway != 0) {
+            resolve(m_Gateway, now);
+        }
+        m_Ring.flush();
+
+        TOYVPN_LOG_INFO("Translating VPN traffic to "
+                        << natAddress.toString() << " on '"
+                        << publicNetworkInterface << "' in userspace");
+    }
+
+    int getInterfaceFd() const override { return m_Ring.getSocketFd(); }
+
+    const pcpp::IPv4Address &getTunIpAddress() const override {
+        return m_TunIpAddress;
+    }
+
+    ssize_t receive(uint8_t *data, size_t dataSize) const override {
+        auto now = Clock::now();
+        size_t frameSize = 0;
+        bool isChecksumPartial = false;
+        while (auto frame = m_Ring.receive(frameSize, isChecksumPartial)) {
+            if (frameSize < m_EthernetHeaderSize) {
+                continue;
+            }
+
+            uint16_t etherType = (frame[12] << 8) | frame[13];
+            auto payload = frame + m_EthernetHeaderSize;
+            size_t payloadSize = frameSize - m_EthernetHeaderSize;
+            if (etherType == ETH_P_ARP) {
+                handleArp(payload, payloadSize, now);
+                continue;
+            }
+
+            // Short frames are padded, the IP header has the real size
+            if (etherType != ETH_P_IP || payloadSize < m_IpHeaderSize) {
+                continue;
+            }
+            size_t packetSize = (payload[2] << 8) | payload[3];
+            if (packetSize > payloadSize || packetSize > dataSize) {
+                continue;
+            }
+
+            std::memcpy(data, payload, packetSize);
+            if (isChecksumPartial) {
+                NatTable::fillTransportChecksum(data, packetSize);
+            }
+            if (m_NatTable->translateInbound(data, packetSize, now)) {
+                return packetSize;
+            }
+        }
+
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Packets that can't be translated or whose next hop isn't resolved yet
+    // are dropped, like the kernel drops them when its queues are full
+    size_t send(const uint8_t *data, size_t dataSize) const override {
+        if (dataSize < m_IpHeaderSize || dataSize > m_InterfaceMtu ||
+            dataSize + m_EthernetHeaderSize > PacketRingWrapper::maxFrameSize) {
+            return 0;
+        }
+
+        uint32_t destination = (uint32_t(data[16]) << 24) | (data[17] << 16) |
+                               (data[18] << 8) | data[19];
+        if (m_PrivateNetwork.includes(pcpp::IPv4Address(htonl(destination)))) {
+            return 0;
+        }
+
+        auto now = Clock::now();
+        bool isOnLink = (destination & m_InterfaceNetmask) ==
+                        (m_InterfaceAddress & m_InterfaceNetmask);
+        if (!isOnLink && m_Gateway == 0) {
+            return 0;
+        }
+        auto macAddress = resolve(isOnLink ? destination : m_Gateway, now);
+        if (!macAddress.has_value()) {
+            return 0;
+        }
+
+        auto frame = m_Ring.getTransmitFrame();
+        if (frame == nullptr) {
+            m_Ring.flush();
+            return 0;
+        }
+
+        auto packet = frame + m_EthernetHeaderSize;
+        std::memcpy(packet, data, dataSize);
+        if (!m_NatTable->translateOutbound(packet, dataSize, now)) {
+            return 0;
+        }
+        writeEthernetHeader(frame, macAddress.value(), ETH_P_IP);
+        m_Ring.commitTransmitFrame(m_EthernetHeaderSize + dataSize);
+
+        if (m_Ring.getPendingFrameCount() >= m_MaxPendingFrames) {
+            m_Ring.flush();
+        }
+        return dataSize;
+    }
+
+    void flush() const override { m_Ring.flush(); }
+
+  private:
+    using Clock = NatTable::Clock;
+    using MacAddress = std::array<uint8_t, ETH_ALEN>;
+
+    struct Neighbor {
+        std::optional<MacAddress> macAddress;
+        Clock::time_point updated;
+        Clock::time_point requested;
+    };
+
+    constexpr static size_t m_EthernetHeaderSize = 14;
+    constexpr static size_t m_IpHeaderSize = 20;
+    constexpr static size_t m_ArpSize = 28;
+    constexpr static uint16_t m_ArpRequest = 1;
+    constexpr static uint16_t m_ArpReply = 2;
+    constexpr static size_t m_MaxPendingFrames = 64;
+    constexpr static std::chrono::duration m_ArpRetryInterval =
+        std::chrono::seconds(1);
+    // Resolved neighbors are asked again after this, and used meanwhile
+    constexpr static std::chrono::duration m_NeighborLifetime =
+        std::chrono::seconds(60);
+    constexpr static MacAddress m_BroadcastMacAddress = {0xff, 0xff, 0xff,
+                                                         0xff, 0xff, 0xff};
+
+    pcpp::IPv4Address m_TunIpAddress;
+    pcpp::IPv4Network m_PrivateNetwork = std::string("0.0.0.0/0");
+    // Addresses are in host byte order
+    uint32_t m_NatAddress = 0;
+    uint32_t m_InterfaceAddress = 0;
+    uint32_t m_InterfaceNetmask = 0;
+    uint32_t m_Gateway = 0;
+    size_t m_InterfaceMtu = 0;
+    MacAddress m_NatMacAddress = {};
+    mutable std::optional<NatTable> m_NatTable;
+    mutable PacketRingWrapper m_Ring;
+    mutable std::unordered_map<uint32_t, Neighbor> m_Neighbors;
+
+    static void write32(uint8_t *data, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            data[i] = value >> (24 - 8 * i);
+        }
+    }
+
+    void readInterfaceAddress(const std::string &interfaceName) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Couldn't create a socket");
+        }
+
+        ifreq request{};
+        strncpy(request.ifr_name, interfaceName.c_str(),
+                sizeof(request.ifr_name) - 1);
+        auto address = reinterpret_cast<sockaddr_in *>(&request.ifr_addr);
+        bool isValid = ioctl(fd, SIOCGIFADDR, &request) == 0;
+        m_InterfaceAddress = ntohl(address->sin_addr.s_addr);
+        isValid = isValid && ioctl(fd, SIOCGIFNETMASK, &request) == 0;
+        m_InterfaceNetmask = ntohl(address->sin_addr.s_addr);
+        isValid = isValid && ioctl(fd, SIOCGIFMTU, &request) == 0;
+        m_InterfaceMtu = request.ifr_mtu;
+        close(fd);
+
+        if (!isValid) {
+            throw std::runtime_error("Couldn't get the IPv4 address of '" +
+                                     interfaceName + "'");
+        }
+    }
+
+    // Returns the default gateway of the interface from the kernel's routing
+    // table, or 0 if it has none
+    static uint32_t readDefaultGateway(const std::string &interfaceName) {
+        std::ifstream routes("/proc/net/route");
+        std::string line;
+        std::getline(routes, line);
+        while (std::getline(routes, line)) {
+            std::istringstream fields(line);
+            std::string name, destination, gateway;
+            fields >> name >> destination >> gateway;
+            if (name == interfaceName && destination == "00000000") {
+                return ntohl(std::stoul(gateway, nullptr, 16));
+            }
+        }
+        return 0;
+    }
+
+    // ARP and IPv4 frames to the NAT address
+    std::vector<sock_filter> getFilter() const {
+        return {
+            BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 3, 0),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 3),
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, m_EthernetHeaderSize + 16),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, m_NatAddress, 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+            BPF_STMT(BPF_RET | BPF_K, 0),
+        };
+    }
+
+    void writeEthernetHeader(uint8_t *frame, const MacAddress &destination,
+                             uint16_t etherType) const {
+        std::memcpy(frame, destination.data(), ETH_ALEN);
+        std::memcpy(frame + ETH_ALEN, m_NatMacAddress.data(), ETH_ALEN);
+        frame[12] = etherType >> 8;
+        frame[13] = etherType & 0xff;
+    }
+
+    // Requests are broadcast and ask for the target address, replies go to
+    // the neighbor that asked. A request for the NAT address itself announces
+    // it.
+    void sendArp(uint16_t operation, const MacAddress &destination,
+                 uint32_t targetAddress) const {
+        auto frame = m_Ring.getTransmitFrame();
+        if (frame == nullptr) {
+            return;
+        }
+
+        writeEthernetHeader(frame, destination, ETH_P_ARP);
+        auto arp = frame + m_EthernetHeaderSize;
+        const uint8_t header[] = {0x00, 0x01, 0x08, 0x00, ETH_ALEN, 4};
+        std::memcpy(arp, header, sizeof(header));
+        arp[6] = 0;
+        arp[7] = operation;
+        std::memcpy(arp + 8, m_NatMacAddress.data(), ETH_ALEN);
+        write32(arp + 14, m_NatAddress);
+        if (operation == m_ArpReply) {
+            std::memcpy(arp + 18, destination.data(), ETH_ALEN);
+        } else {
+            std::memset(arp + 18, 0, ETH_ALEN);
+        }
+        write32(arp + 24, targetAddress);
+        m_Ring.commitTransmitFrame(m_EthernetHeaderSize + m_ArpSize);
+    }
+
+    // Learns the sender of ARP packets about the NAT address or a known
+    // neighbor and answers requests for the NAT address
+    void handleArp(const uint8_t *arp, size_t arpSize,
+                   const Clock::time_point &now) const {
+        if (arpSize < m_ArpSize || arp[0] != 0 || arp[1] != 1 ||
+            arp[2] != 0x08 || arp[3] != 0x00 || arp[4] != ETH_ALEN ||
+            arp[5] != 4) {
+            return;
+        }
+
+        uint16_t operation = (arp[6] << 8) | arp[7];
+        uint32_t senderAddress = (uint32_t(arp[14]) << 24) |
+                                 (arp[15] << 16) | (arp[16] << 8) | arp[17];
+        uint32_t targetAddress = (uint32_t(arp[24]) << 24) |
+                                 (arp[25] << 16) | (arp[26] << 8) | arp[27];
+        bool isForNat = targetAddress == m_NatAddress;
+        auto neighbor = m_Neighbors.find(senderAddress);
+        if (!isForNat && neighbor == m_Neighbors.end()) {
+            return;
+        }
+
+        MacAddress senderMacAddress;
+        std::memcpy(senderMacAddress.data(), arp + 8, ETH_ALEN);
+        auto &entry = m_Neighbors[senderAddress];
+        entry.macAddress = senderMacAddress;
+        entry.updated = now;
+
+        if (isForNat && operation == m_ArpRequest) {
+            sendArp(m_ArpReply, senderMacAddress, senderAddress);
+        }
+    }
+
+    // Returns the MAC address of a neighbor, asking for it if it's unknown
+    // or old
+    std::optional<MacAddress> resolve(uint32_t address,
+                                      const Clock::time_point &now) const {
+        auto &neighbor = m_Neighbors[address];
+        bool isStale = !neighbor.macAddress.has_value() ||
+                       now - neighbor.updated > m_NeighborLifetime;
+        if (isStale && (neighbor.requested == Clock::time_point() ||
+                        now - neighbor.requested > m_ArpRetryInterval)) {
+            neighbor.requested = now;
+            sendArp(m_ArpRequest, m_BroadcastMacAddress, address);
+        }
+        return neighbor.macAddress;
+    }
+};
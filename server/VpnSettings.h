@@ -9,6 +9,8 @@ struct VpnSettings {
     uint16_t mtu;
     std::optional<pcpp::IPv4Address> dnsServer;
     std::string secret;
+    // Only set when the client asked for resumption in its hello
+    std::optional<std::string> resumptionToken;
 
     std::string toParamString() const {
         std::ostringstream params;
@@ -21,6 +23,10 @@ struct VpnSettings {
             params << " d," << dnsServer.value().toString();
         }
 
+        if (resumptionToken) {
+            params << " t," << resumptionToken.value();
+        }
+
         return params.str();
     }
 };
@@ -0,0 +1,36 @@
+#include "../AddressPool.h"
+#include <chrono>
+#include <iostream>
+#include <random>
+
+// Simulates client churn: the pool is kept at a steady occupancy while
+// millions of sessions connect and disconnect in random order.
+int main(int argc, char *argv[]) {
+    std::string network = argc > 1 ? argv[1] : "10.0.0.0/8";
+    size_t operations = argc > 2 ? std::stoul(argv[2]) : 10'000'000;
+
+    AddressPool pool{pcpp::IPv4Network(network)};
+    size_t activeClients = pool.getSize() / 2;
+
+    std::vector<pcpp::IPv4Address> allocated;
+    allocated.reserve(activeClients);
+    for (size_t i = 0; i < activeClients; i++) {
+        allocated.push_back(pool.allocate().value());
+    }
+
+    std::mt19937_64 random(42);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        auto &slot = allocated[random() % allocated.size()];
+        pool.release(slot);
+        slot = pool.allocate().value();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    std::cout << "network: " << network << ", active clients: "
+              << activeClients << ", connect/disconnect cycles: " << operations
+              << ", ns per cycle: "
+              << static_cast<double>(elapsed.count()) / operations << std::endl;
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "../PacketCoalescer.h"
+#include "../TunnelCipher.h"
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Replays an ACK-heavy workload, clients uploading and the server sending
+// mostly pure TCP ACKs back, through the client-facing send path and counts
+// the datagrams and bytes on the wire with and without coalescing. Every
+// epoll wakeup reads a random number of packets from the TUN interface and
+// flushes at the end of the batch, like the server does.
+
+constexpr size_t clientCount = 10;
+constexpr size_t mtu = 1400;
+constexpr size_t ackSize = 52;
+constexpr double ackRatio = 0.9;
+constexpr size_t outerHeaderSize = 28;
+
+struct WireCounters {
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+};
+
+static WireCounters run(bool coalescing, size_t wakeups) {
+    std::mt19937_64 random(42);
+    std::uniform_int_distribution<size_t> batchSize(1, 64);
+    std::uniform_int_distribution<size_t> client(0, clientCount - 1);
+    std::bernoulli_distribution isAck(ackRatio);
+
+    std::vector<std::unique_ptr<TunnelCipher>> ciphers;
+    std::vector<PacketCoalescer> coalescers;
+    for (size_t i = 0; i < clientCount; i++) {
+        ciphers.push_back(std::make_unique<TunnelCipher>(
+            TunnelCipher::Algorithm::ChaCha20Poly1305, TunnelCipher::Key{},
+            TunnelCipher::Key{}));
+        coalescers.emplace_back(mtu, TunnelCipher::overhead);
+    }
+
+    WireCounters counters;
+    std::vector<uint8_t> buffer(mtu + TunnelCipher::overhead);
+    auto send = [&](TunnelCipher &cipher, uint8_t *data, size_t dataSize) {
+        auto sealedSize = cipher.seal(data, dataSize);
+        counters.datagrams++;
+        counters.bytes += sealedSize + outerHeaderSize;
+    };
+
+    for (size_t wakeup = 0; wakeup < wakeups; wakeup++) {
+        for (size_t i = batchSize(random); i > 0; i--) {
+            auto destination = client(random);
+            size_t packetSize = isAck(random) ? ackSize : mtu;
+            auto &coalescer = coalescers[destination];
+            if (coalescing) {
+                if (!coalescer.canAdd(packetSize)) {
+                    auto [payload, payloadSize] = coalescer.take();
+                    if (payloadSize > 0) {
+                        send(*ciphers[destination], payload, payloadSize);
+                    }
+                }
+                if (coalescer.canAdd(packetSize)) {
+                    coalescer.add(buffer.data(), packetSize);
+                    continue;
+                }
+            }
+            send(*ciphers[destination], buffer.data(), packetSize);
+        }
+
+        for (size_t i = 0; i < clientCount; i++) {
+            if (!coalescers[i].isEmpty()) {
+                auto [payload, payloadSize] = coalescers[i].take();
+                send(*ciphers[i], payload, payloadSize);
+            }
+        }
+    }
+
+    return counters;
+}
+
+int main(int argc, char *argv[]) {
+    size_t wakeups = argc > 1 ? std::stoul(argv[1]) : 100'000;
+
+    auto plain = run(false, wakeups);
+    auto coalesced = run(true, wakeups);
+    std::cout << "without coalescing: datagrams: " << plain.datagrams
+              << ", bytes: " << plain.bytes << std::endl;
+    std::cout << "with coalescing: datagrams: " << coalesced.datagrams
+              << ", bytes: " << coalesced.bytes << std::endl;
+    std::cout << "datagrams saved: "
+              << 100.0 * (plain.datagrams - coalesced.datagrams) /
+                     plain.datagrams
+              << "%, bytes saved: "
+              << 100.0 * (plain.bytes - coalesced.bytes) / plain.bytes << "%"
+              << std::endl;
+    return 0;
+}
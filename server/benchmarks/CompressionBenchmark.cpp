@@ -0,0 +1,101 @@
+#include "../PacketCompressor.h"
+#include "../libs/pcapplusplus/include/pcapplusplus/PcapFileDevice.h"
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Runs the tunnel compressor over the packets of a pcapng capture, like the
+// ones saved with --save-to-files, and reports the compression ratio and the
+// compression and decompression throughput.
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t ethernetHeaderSize = 14;
+
+static std::vector<std::vector<uint8_t>> readPackets(const std::string &path) {
+    std::unique_ptr<pcpp::IFileReaderDevice> reader(
+        pcpp::IFileReaderDevice::getReader(path));
+    if (reader == nullptr || !reader->open()) {
+        throw std::runtime_error("Couldn't open " + path);
+    }
+
+    std::vector<std::vector<uint8_t>> packets;
+    pcpp::RawPacket rawPacket;
+    while (reader->getNextPacket(rawPacket)) {
+        // Captures of the server are raw IP, skip the Ethernet header of
+        // anything else
+        size_t offset =
+            rawPacket.getLinkLayerType() == pcpp::LINKTYPE_ETHERNET
+                ? ethernetHeaderSize
+                : 0;
+        if (static_cast<size_t>(rawPacket.getRawDataLen()) > offset) {
+            packets.emplace_back(rawPacket.getRawData() + offset,
+                                 rawPacket.getRawData() +
+                                     rawPacket.getRawDataLen());
+        }
+    }
+    reader->close();
+    return packets;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <pcapng file> [rounds]"
+                  << std::endl;
+        return 1;
+    }
+    size_t rounds = argc > 2 ? std::stoul(argv[2]) : 100;
+
+    auto packets = readPackets(argv[1]);
+    PacketCompressor compressor;
+    std::vector<std::vector<uint8_t>> compressed(packets.size());
+    std::vector<uint8_t> output(UINT16_MAX);
+    size_t bytesBefore = 0;
+    size_t bytesAfter = 0;
+    size_t compressedPackets = 0;
+    Clock::duration compressTime{0};
+    Clock::duration decompressTime{0};
+
+    for (size_t round = 0; round < rounds; round++) {
+        auto start = Clock::now();
+        for (size_t i = 0; i < packets.size(); i++) {
+            compressed[i].resize(packets[i].size());
+            compressed[i].resize(compressor.compress(
+                packets[i].data(), packets[i].size(), compressed[i].data()));
+        }
+        auto end = Clock::now();
+        compressTime += end - start;
+
+        for (const auto &message : compressed) {
+            if (!message.empty() &&
+                !PacketCompressor::decompress(message.data(), message.size(),
+                                              output.data(), output.size())) {
+                std::cerr << "A packet failed to decompress" << std::endl;
+                return 1;
+            }
+        }
+        decompressTime += Clock::now() - end;
+    }
+
+    for (size_t i = 0; i < packets.size(); i++) {
+        bytesBefore += packets[i].size();
+        bytesAfter += compressed[i].empty() ? packets[i].size()
+                                            : compressed[i].size();
+        compressedPackets += !compressed[i].empty();
+    }
+
+    auto toSeconds = [](const Clock::duration &duration) {
+        return std::chrono::duration<double>(duration).count();
+    };
+    double totalBytes = static_cast<double>(bytesBefore) * rounds;
+    std::cout << "packets: " << packets.size()
+              << ", compressed packets: " << compressedPackets
+              << ", bytes: " << bytesBefore << " -> " << bytesAfter
+              << ", ratio: " << static_cast<double>(bytesAfter) / bytesBefore
+              << ", compress MB/s: "
+              << totalBytes / toSeconds(compressTime) / 1e6
+              << ", decompress MB/s: "
+              << totalBytes / toSeconds(decompressTime) / 1e6 << std::endl;
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include "../ConnectedSocketWrapper.h"
+#include "../ServerSocketWrapper.h"
+#include "../Utils.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Compares the shared server socket with --connected-sockets over loopback:
+// the time the reactor spends sending a datagram to a client, and receiving
+// one from a client and finding its session. Datagrams are received the way
+// the reactor does, one per ready descriptor of an epoll_wait() for up to 10
+// events, and looked up by their source address in both modes.
+//
+// The clients are addresses of 127.0.0.0/8 sharing one socket, which sends
+// from any of them with IP_PKTINFO, so only the server's connected sockets
+// take file descriptors. The kernel's lookup of connected sockets depends on
+// its version, older kernels scan all the sockets on the port.
+
+constexpr size_t packetSize = 1200;
+constexpr size_t chunkSize = 64;
+constexpr int maxEvents = 10;
+constexpr uint32_t firstClientAddress = 0x7f010000;
+
+struct Results {
+    double sendNanoseconds = 0;
+    double receiveNanoseconds = 0;
+};
+
+class Clients {
+  public:
+    explicit Clients(size_t count) {
+        m_Socket = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        socklen_t addressSize = sizeof(address);
+        int bufferSize = 8 * 1024 * 1024;
+        if (m_Socket < 0 ||
+            setsockopt(m_Socket, SOL_SOCKET, SO_RCVBUF, &bufferSize,
+                       sizeof(bufferSize)) < 0 ||
+            bind(m_Socket, reinterpret_cast<sockaddr *>(&address),
+                 sizeof(address)) < 0 ||
+            getsockname(m_Socket, reinterpret_cast<sockaddr *>(&address),
+                        &addressSize) < 0) {
+            throw std::runtime_error("Couldn't set up the client socket");
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            sockaddr_in6 clientAddress;
+            memset(&clientAddress, 0, sizeof(clientAddress));
+            clientAddress.sin6_family = AF_INET6;
+            clientAddress.sin6_port = address.sin_port;
+            clientAddress.sin6_addr.s6_addr[10] = 0xff;
+            clientAddress.sin6_addr.s6_addr[11] = 0xff;
+            uint32_t ipv4Address = htonl(firstClientAddress + i);
+            memcpy(&clientAddress.sin6_addr.s6_addr[12], &ipv4Address,
+                   sizeof(ipv4Address));
+            m_Addresses.push_back(clientAddress);
+        }
+    }
+
+    ~Clients() { close(m_Socket); }
+
+    const std::vector<sockaddr_in6> &getAddresses() const {
+        return m_Addresses;
+    }
+
+    void send(size_t client, const sockaddr_in &serverAddress,
+              const std::vector<uint8_t> &packet) {
+        iovec iov{const_cast<uint8_t *>(packet.data()), packet.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(in_pktinfo))] = {};
+        msghdr message{};
+        message.msg_name = const_cast<sockaddr_in *>(&serverAddress);
+        message.msg_namelen = sizeof(serverAddress);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = IPPROTO_IP;
+        header->cmsg_type = IP_PKTINFO;
+        header->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+        in_pktinfo info{};
+        info.ipi_spec_dst.s_addr = htonl(firstClientAddress + client);
+        memcpy(CMSG_DATA(header), &info, sizeof(info));
+        if (sendmsg(m_Socket, &message, 0) < 0) {
+            throw std::runtime_error("Couldn't send from a client");
+        }
+    }
+
+    void receive(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            recv(m_Socket, m_Buffer.data(), m_Buffer.size(), 0);
+        }
+    }
+
+  private:
+    int m_Socket = -1;
+    std::vector<sockaddr_in6> m_Addresses;
+    std::array<uint8_t, 2048> m_Buffer;
+};
+
+static Results run(size_t clientCount, bool connected, size_t rounds) {
+    Clients clients(clientCount);
+    auto &addresses = clients.getAddresses();
+
+    // Bound first, like the server's, and owning the port
+    ServerSocketWrapper serverSocket;
+    serverSocket.init(0);
+    sockaddr_in6 boundAddress;
+    socklen_t boundAddressSize = sizeof(boundAddress);
+    getsockname(serverSocket.getSocketFd(),
+                reinterpret_cast<sockaddr *>(&boundAddress),
+                &boundAddressSize);
+    uint16_t port = ntohs(boundAddress.sin6_port);
+    sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddress.sin_port = htons(port);
+
+    std::vector<std::unique_ptr<ConnectedSocketWrapper>> connectedSockets;
+    std::vector<const ServerSocket *> sockets;
+    if (connected) {
+        for (const auto &address : addresses) {
+            connectedSockets.push_back(
+                std::make_unique<ConnectedSocketWrapper>());
+            connectedSockets.back()->init(port, address);
+            sockets.push_back(connectedSockets.back().get());
+        }
+    } else {
+        sockets.assign(clientCount, &serverSocket);
+    }
+
+    // The sessions and the epoll callbacks as the reactor keeps them
+    std::unordered_map<sockaddr_in6, size_t, sockaddrIn6Hash,
+                       sockaddrIn6Equal>
+        sessions;
+    std::unordered_map<int, const ServerSocket *> callbacks;
+    int epollFd = epoll_create1(0);
+    for (size_t i = 0; i < clientCount; i++) {
+        sessions[addresses[i]] = i;
+    }
+    auto polledSockets =
+        connected ? sockets
+                  : std::vector<const ServerSocket *>{&serverSocket};
+    for (auto socket : polledSockets) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = socket->getSocketFd();
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, event.data.fd, &event);
+        callbacks[event.data.fd] = socket;
+    }
+
+    std::vector<uint8_t> packet(packetSize, 0x5a);
+    std::array<uint8_t, 2048> buffer;
+    std::chrono::steady_clock::duration sendTime{};
+    std::chrono::steady_clock::duration receiveTime{};
+    size_t checksum = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        for (size_t first = 0; first < clientCount; first += chunkSize) {
+            size_t last = std::min(first + chunkSize, clientCount);
+
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = first; i < last; i++) {
+                sockets[i]->send(packet.data(), packet.size(), addresses[i]);
+            }
+            sendTime += std::chrono::steady_clock::now() - start;
+            clients.receive(last - first);
+
+            for (size_t i = first; i < last; i++) {
+                clients.send(i, serverAddress, packet);
+            }
+            start = std::chrono::steady_clock::now();
+            size_t received = 0;
+            epoll_event events[maxEvents];
+            while (received < last - first) {
+                int eventCount = epoll_wait(epollFd, events, maxEvents, 1000);
+                if (eventCount <= 0) {
+                    throw std::runtime_error("Lost datagrams from clients");
+                }
+                for (int i = 0; i < eventCount; i++) {
+                    sockaddr_in6 clientAddress;
+                    if (callbacks[events[i].data.fd]->receive(
+                            buffer, clientAddress) > 0) {
+                        checksum += sessions.find(clientAddress)->second;
+                        received++;
+                    }
+                }
+            }
+            receiveTime += std::chrono::steady_clock::now() - start;
+        }
+    }
+    close(epollFd);
+    asm volatile("" : : "r"(checksum));
+
+    Results results;
+    std::chrono::duration<double, std::nano> sendNanoseconds = sendTime;
+    std::chrono::duration<double, std::nano> receiveNanoseconds = receiveTime;
+    results.sendNanoseconds =
+        sendNanoseconds.count() / (rounds * clientCount);
+    results.receiveNanoseconds =
+        receiveNanoseconds.count() / (rounds * clientCount);
+    return results;
+}
+
+int main(int argc, char *argv[]) {
+    size_t rounds = argc > 1 ? std::stoul(argv[1]) : 20;
+    std::vector<size_t> clientCounts;
+    for (int i = 2; i < argc; i++) {
+        clientCounts.push_back(std::stoul(argv[i]));
+    }
+    if (clientCounts.empty()) {
+        clientCounts = {1000, 10000};
+    }
+
+    AixLog::Log::init<AixLog::SinkCout>(AixLog::Severity::error);
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    for (auto clientCount : clientCounts) {
+        if (clientCount + 16 > limit.rlim_cur) {
+            std::cerr << clientCount << " clients need more than the "
+                      << limit.rlim_cur << " open files allowed" << std::endl;
+            continue;
+        }
+        try {
+            for (bool connected : {false, true}) {
+                auto results = run(clientCount, connected, rounds);
+                std::cout << clientCount << " clients, "
+                          << (connected ? "connected sockets" : "shared socket")
+                          << ": send: " << results.sendNanoseconds
+                          << " ns, receive: " << results.receiveNanoseconds
+                          << " ns per datagram" << std::endl;
+            }
+        } catch (const std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,270 @@
+#include "../ClientHandler.h"
+#include "../EgressScheduler.h"
+#include "../Log.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// Simulates a saturated 100 Mbit/s client link shared by a bulk download that
+// backs off on congestion (AIMD) and an interactive client sending a small
+// packet every 10ms, and reports how long packets wait in the egress queues
+// with tail drop, with CoDel dropping and with CoDel ECN-marking. The packets
+// go through ClientHandler::handleDataFromTun like the server's, and the
+// time they were read from the TUN interface travels in their UDP payload,
+// out of reach of the ECN marking.
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto tick = std::chrono::microseconds(100);
+constexpr size_t linkBytesPerTick = 100'000'000 / 8 / 10'000;
+constexpr size_t bulkPacketSize = 1400;
+constexpr size_t interactivePacketSize = 100;
+constexpr size_t timestampOffset = 28;
+constexpr auto roundTripTime = std::chrono::milliseconds(50);
+constexpr double additiveIncrease = 1.0 / (roundTripTime / tick);
+constexpr int simulatedSeconds = 120;
+const std::string secret = "benchmark";
+
+enum class Mode { TailDrop, CoDelDrop, CoDelEcn };
+
+struct Result {
+    std::vector<double> bulkSojournMs;
+    std::vector<double> interactiveSojournMs;
+    uint64_t aqmDropped = 0;
+    uint64_t ecnMarked = 0;
+    uint64_t tailDropped = 0;
+};
+
+// The client's end of the link, which takes as many bytes as the link
+// carries in the current tick and measures the time every packet waited
+class SimulatedLink : public ServerSocket {
+  public:
+    SimulatedLink(Result &result, const Clock::time_point &now)
+        : m_Result(result), m_Now(now) {}
+
+    int getSocketFd() const override { return -1; }
+
+    ssize_t receive(uint8_t *data, size_t dataSize,
+                    sockaddr_in6 &clientAddress) const override {
+        return -1;
+    }
+
+    // Only the answers to the hellos are sent directly
+    int send(const uint8_t *data, size_t dataSize,
+             const sockaddr_in6 &sendTo) const override {
+        return dataSize;
+    }
+
+    int sendBatch(const Datagram *datagrams, size_t count) const override {
+        size_t sent = 0;
+        for (; sent < count && datagrams[sent].dataSize <= m_Budget; sent++) {
+            m_Budget -= datagrams[sent].dataSize;
+            auto data = datagrams[sent].data;
+            Clock::time_point enqueueTime;
+            std::memcpy(&enqueueTime, data + timestampOffset,
+                        sizeof(enqueueTime));
+            double sojournMs =
+                std::chrono::duration<double, std::milli>(m_Now - enqueueTime)
+                    .count();
+            bool isBulk = datagrams[sent].sendTo->sin6_port == bulkPort;
+            (isBulk ? m_Result.bulkSojournMs : m_Result.interactiveSojournMs)
+                .push_back(sojournMs);
+            if (isBulk && (data[1] & 0x03) == 0x03) {
+                m_BulkCongestionMarks++;
+            }
+        }
+        if (sent == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return static_cast<int>(sent);
+    }
+
+    void refill() {
+        m_Budget = std::min(m_Budget + linkBytesPerTick,
+                            linkBytesPerTick + bulkPacketSize);
+    }
+
+    // The CE marks the bulk receiver echoes back to its sender
+    uint64_t getBulkCongestionMarks() const { return m_BulkCongestionMarks; }
+
+    constexpr static in_port_t bulkPort = 1;
+    constexpr static in_port_t interactivePort = 2;
+
+  private:
+    Result &m_Result;
+    const Clock::time_point &m_Now;
+    mutable size_t m_Budget = 0;
+    mutable uint64_t m_BulkCongestionMarks = 0;
+};
+
+class SimulatedTunInterface : public TunInterface {
+  public:
+    int getInterfaceFd() const override { return -1; }
+
+    const pcpp::IPv4Address &getTunIpAddress() const override {
+        return m_Address;
+    }
+
+    ssize_t receive(uint8_t *data, size_t dataSize) const override {
+        return -1;
+    }
+
+    size_t send(const uint8_t *data, size_t dataSize) const override {
+        return dataSize;
+    }
+
+  private:
+    pcpp::IPv4Address m_Address{"10.0.0.1"};
+};
+
+double percentile(std::vector<double> &values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[static_cast<size_t>(p * (values.size() - 1))];
+}
+
+// An IPv4 UDP packet from the internet to the client, ECN-capable if ecn is
+// set, that carries the time it was read from the TUN interface
+template <std::size_t BUFFER_SIZE>
+void writePacket(std::array<uint8_t, BUFFER_SIZE> &buffer, size_t size,
+                 bool ecn, const Clock::time_point &now) {
+    std::fill(buffer.begin(), buffer.begin() + size, 0);
+    buffer[0] = 0x45;
+    buffer[1] = ecn ? 0x02 : 0x00;
+    buffer[2] = size >> 8;
+    buffer[3] = size;
+    buffer[8] = 64;
+    buffer[9] = IPPROTO_UDP;
+    uint8_t addresses[] = {93, 184, 216, 34, 10, 0, 0, 2};
+    std::copy(std::begin(addresses), std::end(addresses), &buffer[12]);
+    uint32_t sum = 0;
+    for (size_t i = 0; i < 20; i += 2) {
+        sum += (buffer[i] << 8) | buffer[i + 1];
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum += sum >> 16;
+    buffer[10] = ~sum >> 8;
+    buffer[11] = ~sum;
+    std::memcpy(&buffer[timestampOffset], &now, sizeof(now));
+}
+
+std::unique_ptr<ClientHandler>
+createClient(const ServerSocket &link, const TunInterface &tunInterface,
+             std::optional<PacketHandler> &packetHandler,
+             std::optional<EgressScheduler> &scheduler, in_port_t port,
+             const Clock::time_point &now) {
+    sockaddr_in6 address{};
+    address.sin6_family = AF_INET6;
+    address.sin6_port = port;
+    VpnSettings vpnSettings{pcpp::IPv4Address("10.0.0.2"),
+                            pcpp::IPv4Network("0.0.0.0/0"), 1400,
+                            std::nullopt, secret, std::nullopt};
+    auto client = std::make_unique<ClientHandler>(
+        link, address, tunInterface, vpnSettings, packetHandler, scheduler,
+        ClientOptions());
+
+    // The plaintext hello connects it
+    std::array<uint8_t, 2048> hello;
+    hello[0] = 0;
+    std::copy(secret.begin(), secret.end(), hello.begin() + 1);
+    client->handleDataFromClient(hello, secret.size() + 1, now);
+    return client;
+}
+
+Result simulate(Mode mode) {
+    Result result;
+    Clock::time_point now;
+    SimulatedLink link(result, now);
+    SimulatedTunInterface tunInterface;
+    std::optional<PacketHandler> packetHandler;
+    std::optional<EgressScheduler> scheduler;
+    scheduler.emplace(
+        [&link](const EgressScheduler::Datagram *datagrams, size_t count) {
+            return link.sendBatch(datagrams, count);
+        },
+        mode != Mode::TailDrop);
+
+    auto bulkClient = createClient(link, tunInterface, packetHandler,
+                                   scheduler, SimulatedLink::bulkPort, now);
+    auto interactiveClient =
+        createClient(link, tunInterface, packetHandler, scheduler,
+                     SimulatedLink::interactivePort, now);
+
+    bool ecn = mode == Mode::CoDelEcn;
+    std::array<uint8_t, 32767> buffer;
+    double bulkPacketsPerTick = 1;
+    double bulkCredit = 0;
+    Clock::time_point lastBackoff;
+    uint64_t lastCongestionCount = 0;
+
+    auto end = now + std::chrono::seconds(simulatedSeconds);
+    for (int ticks = 0; now < end; now += tick, ticks++) {
+        link.refill();
+
+        for (bulkCredit += bulkPacketsPerTick; bulkCredit >= 1;
+             bulkCredit--) {
+            writePacket(buffer, bulkPacketSize, ecn, now);
+            bulkClient->handleDataFromTun(buffer, bulkPacketSize, now);
+        }
+
+        if (ticks % 100 == 0) {
+            writePacket(buffer, interactivePacketSize, ecn, now);
+            interactiveClient->handleDataFromTun(buffer,
+                                                 interactivePacketSize, now);
+        }
+
+        scheduler->drain(now);
+
+        // The bulk sender halves its rate once per round trip on loss or a
+        // CE mark and grows it by one packet per round trip otherwise, like
+        // TCP Reno with ECN
+        auto counters = bulkClient->getCounters();
+        uint64_t congestionCount = counters.droppedFromTun +
+                                   counters.egressQueue.aqmDropped +
+                                   link.getBulkCongestionMarks();
+        if (now - lastBackoff >= roundTripTime) {
+            if (congestionCount > lastCongestionCount) {
+                bulkPacketsPerTick /= 2;
+            } else {
+                bulkPacketsPerTick += additiveIncrease;
+            }
+            lastBackoff = now;
+            lastCongestionCount = congestionCount;
+        }
+    }
+
+    auto counters = bulkClient->getCounters();
+    result.aqmDropped = counters.egressQueue.aqmDropped;
+    result.ecnMarked = counters.egressQueue.ecnMarked;
+    result.tailDropped = counters.droppedFromTun;
+    return result;
+}
+
+int main() {
+    AixLog::Log::init<AixLog::SinkCout>(AixLog::Severity::error);
+
+    for (auto mode : {Mode::TailDrop, Mode::CoDelDrop, Mode::CoDelEcn}) {
+        auto result = simulate(mode);
+        std::cout << (mode == Mode::TailDrop    ? "DRR, tail drop"
+                      : mode == Mode::CoDelDrop ? "DRR + CoDel, drop"
+                                                : "DRR + CoDel, ECN")
+                  << ":" << std::endl
+                  << "  bulk queueing delay p50/p90/p99 (ms): "
+                  << percentile(result.bulkSojournMs, 0.5) << " / "
+                  << percentile(result.bulkSojournMs, 0.9) << " / "
+                  << percentile(result.bulkSojournMs, 0.99) << std::endl
+                  << "  interactive queueing delay p50/p99 (ms): "
+                  << percentile(result.interactiveSojournMs, 0.5) << " / "
+                  << percentile(result.interactiveSojournMs, 0.99)
+                  << std::endl
+                  << "  bulk packets sent: " << result.bulkSojournMs.size()
+                  << ", CoDel drops: " << result.aqmDropped
+                  << ", ECN marks: " << result.ecnMarked
+                  << ", tail drops: " << result.tailDropped << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,1479 @@
+#include "../ForwardErrorCorrection.h"
+#include "../HandshakeGuard.h"
+#include "../HeaderCompression.h"
+#include "../KeyExchange.h"
+#include "../PacketCoalescer.h"
+#include "../PacketCompressor.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <optional>
+#include <poll.h>
+#include <sched.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Runs ToyVpnServer and a number of emulated clients on one machine, each
+// side in its own network namespace, and measures the forwarding path end to
+// end:
+//
+//   clients 10.201.0.2 -- 10.201.0.1 server 10.200.0.1 -- 10.200.0.2 sink
+//
+// Every client does the handshake and then sends UDP packets through the
+// tunnel to an echo service in the sink namespace, which the server reaches
+// through its NAT. A latency phase keeps one packet in flight per client, a
+// throughput phase keeps a window of them. The results are written to stdout
+// as JSON, so runs before and after a change can be compared. It needs root
+// and iptables, but no other hosts.
+//
+// When the server runs with --encryption the clients do the encrypted
+// handshake, asking for every optional feature, and afterwards check the
+// ones the server granted: every client sends probes in each framing, moves
+// to a new socket if it can roam and reconnects with its resumption token if
+// it got one. The run fails if any of them gets no echo.
+//
+// With more than one node the servers run as a cluster behind one address,
+// each in its own namespace, with a balancer namespace that routes the
+// shared address to one of them and a bridge in the sink namespace that
+// carries both their public traffic and their cluster channel:
+//
+//   clients 10.202.0.2 -- balancer -- 10.203.<n>.2 node <n> 10.200.0.<10+n>
+//                                      10.201.0.1             -- sink bridge
+//
+// The clients do their handshakes with the nodes in turn and then all send
+// to node 0, which hands the datagrams of the other nodes' clients over.
+// Afterwards every client sends packets to the next client's VPN address,
+// which only arrive if the nodes forward them to each other.
+
+using Clock = std::chrono::steady_clock;
+
+const std::string serverNamespace = "tvb-server";
+const std::string clientsNamespace = "tvb-clients";
+const std::string sinkNamespace = "tvb-sink";
+const std::string balancerNamespace = "tvb-balancer";
+const std::string serverAddress = "10.201.0.1";
+const std::string sinkAddress = "10.200.0.2";
+const std::string publicInterface = "tvb-public";
+const std::string secret = "benchmark secret";
+constexpr uint16_t serverPort = 5678;
+constexpr uint16_t echoPort = 7;
+constexpr size_t headersSize = 28;
+constexpr auto handshakeTimeout = std::chrono::seconds(10);
+constexpr auto lossTimeout = std::chrono::milliseconds(50);
+constexpr auto latencyPhaseDuration = std::chrono::seconds(3);
+// Long enough for the nodes to exchange heartbeats, after which they announce
+// their sessions to each other, and to resynchronize a directory that missed
+// an announcement
+constexpr auto clusterSyncTime = std::chrono::seconds(3);
+constexpr uint16_t clusterPort = 5679;
+constexpr size_t clientToClientProbes = 20;
+
+static void runCommand(const std::string &command) {
+    if (std::system(command.c_str()) != 0) {
+        throw std::runtime_error("Command failed: '" + command + "'");
+    }
+}
+
+static std::string getNamespacePath(const std::string &name) {
+    return "/var/run/netns/" + name;
+}
+
+// Moves the calling thread, and the sockets it creates from then on, to a
+// network namespace
+static void enterNamespace(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || setns(fd, CLONE_NEWNET) < 0) {
+        throw std::runtime_error("Couldn't enter the network namespace " +
+                                 path);
+    }
+    close(fd);
+}
+
+// The namespace a single server runs in, or node of a cluster
+static std::string getServerNamespace(size_t node, size_t nodeCount) {
+    return nodeCount == 1 ? serverNamespace
+                          : serverNamespace + std::to_string(node);
+}
+
+// The namespaces and the veth pairs between them. Deleting a namespace
+// deletes its end of the veth pairs, and with it the other end.
+class Topology {
+  public:
+    explicit Topology(size_t nodeCount) : m_NodeCount(nodeCount) {
+        cleanup();
+        for (const auto &name : getNamespaces()) {
+            runCommand("ip netns add " + name);
+            runCommand("ip -n " + name + " link set lo up");
+        }
+        if (nodeCount == 1) {
+            connect(clientsNamespace, "tvb-client", "10.201.0.2/24",
+                    serverNamespace, "tvb-server", "10.201.0.1/24");
+            connect(serverNamespace, publicInterface, "10.200.0.1/24",
+                    sinkNamespace, "tvb-sink", sinkAddress + "/24");
+            return;
+        }
+
+        // Replies come back from the node that answers the client, whichever
+        // node the balancer sends the client's datagrams to
+        runCommand("ip netns exec " + balancerNamespace +
+                   " sysctl -qw net.ipv4.ip_forward=1"
+                   " net.ipv4.conf.all.rp_filter=0"
+                   " net.ipv4.conf.default.rp_filter=0");
+        connect(clientsNamespace, "tvb-client", "10.202.0.2/24",
+                balancerNamespace, "tvb-clients", "10.202.0.1/24");
+        runCommand("ip -n " + clientsNamespace + " route add " +
+                   serverAddress + " via 10.202.0.1");
+
+        runCommand("ip -n " + sinkNamespace +
+                   " link add tvb-bridge type bridge");
+        runCommand("ip -n " + sinkNamespace + " addr add " + sinkAddress +
+                   "/24 dev tvb-bridge");
+        runCommand("ip -n " + sinkNamespace + " link set tvb-bridge up");
+
+        for (size_t node = 0; node < nodeCount; node++) {
+            auto name = getServerNamespace(node, nodeCount);
+            auto link = "10.203." + std::to_string(node);
+            connect(name, "tvb-balancer", link + ".2/24", balancerNamespace,
+                    "tvb-node" + std::to_string(node), link + ".1/24");
+            runCommand("ip -n " + name + " addr add " + serverAddress +
+                       "/32 dev lo");
+            runCommand("ip -n " + name + " route add 10.202.0.0/24 via " +
+                       link + ".1 src " + serverAddress);
+
+            auto port = "tvb-sink" + std::to_string(node);
+            runCommand("ip link add " + publicInterface + " netns " + name +
+                       " type veth peer name " + port + " netns " +
+                       sinkNamespace);
+            runCommand("ip -n " + name + " addr add " +
+                       getPublicAddress(node) + "/24 dev " + publicInterface);
+            runCommand("ip -n " + name + " link set " + publicInterface +
+                       " up");
+            runCommand("ip -n " + sinkNamespace + " link set " + port +
+                       " master tvb-bridge up");
+        }
+    }
+
+    Topology(const Topology &) = delete;
+    Topology &operator=(const Topology &) = delete;
+
+    virtual ~Topology() { cleanup(); }
+
+    // Routes the shared address, and with it the clients' datagrams, to a
+    // node, like a load balancer that moved them
+    void balanceTo(size_t node) const {
+        runCommand("ip -n " + balancerNamespace + " route replace " +
+                   serverAddress + "/32 via 10.203." + std::to_string(node) +
+                   ".2");
+    }
+
+    // The cluster channel runs over the sink's network, which is private here
+    static std::string getPublicAddress(size_t node) {
+        return "10.200.0." + std::to_string(10 + node);
+    }
+
+    static std::string getClusterPeer(size_t node) {
+        return getPublicAddress(node) + ":" + std::to_string(clusterPort);
+    }
+
+  private:
+    size_t m_NodeCount;
+
+    std::vector<std::string> getNamespaces() const {
+        std::vector<std::string> names = {clientsNamespace, sinkNamespace};
+        if (m_NodeCount > 1) {
+            names.push_back(balancerNamespace);
+        }
+        for (size_t node = 0; node < m_NodeCount; node++) {
+            names.push_back(getServerNamespace(node, m_NodeCount));
+        }
+        return names;
+    }
+
+    static void connect(const std::string &namespace1,
+                        const std::string &interface1,
+                        const std::string &address1,
+                        const std::string &namespace2,
+                        const std::string &interface2,
+                        const std::string &address2) {
+        runCommand("ip link add " + interface1 + " netns " + namespace1 +
+                   " type veth peer name " + interface2 + " netns " +
+                   namespace2);
+        runCommand("ip -n " + namespace1 + " addr add " + address1 + " dev " +
+                   interface1);
+        runCommand("ip -n " + namespace1 + " link set " + interface1 + " up");
+        runCommand("ip -n " + namespace2 + " addr add " + address2 + " dev " +
+                   interface2);
+        runCommand("ip -n " + namespace2 + " link set " + interface2 + " up");
+    }
+
+    // Also removes what a crashed run with as many nodes left behind
+    void cleanup() const {
+        for (const auto &name : getNamespaces()) {
+            std::system(("ip netns del " + name + " 2>/dev/null").c_str());
+        }
+    }
+};
+
+// ToyVpnServer in a server namespace, with its output in a log file
+class ServerProcess {
+  public:
+    ServerProcess(const std::string &path, const std::string &namespaceName,
+                  const std::vector<std::string> &extraArguments,
+                  const std::string &logPath) {
+        std::vector<std::string> arguments = {path,
+                                              "--port",
+                                              std::to_string(serverPort),
+                                              "--public-network-iface",
+                                              publicInterface,
+                                              "--secret",
+                                              secret};
+        arguments.insert(arguments.end(), extraArguments.begin(),
+                         extraArguments.end());
+        std::vector<char *> argv;
+        for (auto &argument : arguments) {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
+
+        // Nothing that allocates may run in the child of a threaded process
+        auto namespacePath = getNamespacePath(namespaceName);
+        int logFd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (logFd < 0) {
+            throw std::runtime_error("Couldn't create " + logPath);
+        }
+
+        m_Pid = fork();
+        if (m_Pid == 0) {
+            int namespaceFd = open(namespacePath.c_str(), O_RDONLY);
+            if (namespaceFd < 0 || setns(namespaceFd, CLONE_NEWNET) < 0) {
+                _exit(126);
+            }
+            dup2(logFd, STDOUT_FILENO);
+            dup2(logFd, STDERR_FILENO);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        close(logFd);
+        if (m_Pid < 0) {
+            throw std::runtime_error("Couldn't start the server");
+        }
+    }
+
+    ServerProcess(const ServerProcess &) = delete;
+    ServerProcess &operator=(const ServerProcess &) = delete;
+
+    // SIGINT lets the server remove its iptables rules
+    virtual ~ServerProcess() {
+        if (!isRunning()) {
+            return;
+        }
+        kill(m_Pid, SIGINT);
+        for (int i = 0; i < 50; i++) {
+            if (!isRunning()) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        kill(m_Pid, SIGKILL);
+        waitpid(m_Pid, nullptr, 0);
+    }
+
+    bool isRunning() {
+        if (!m_HasExited && waitpid(m_Pid, nullptr, WNOHANG) == m_Pid) {
+            m_HasExited = true;
+        }
+        return !m_HasExited;
+    }
+
+    // The user and system time of all the threads of the server
+    std::chrono::nanoseconds getCpuTime() const {
+        std::ifstream statFile("/proc/" + std::to_string(m_Pid) + "/stat");
+        std::string stat((std::istreambuf_iterator<char>(statFile)),
+                         std::istreambuf_iterator<char>());
+        // The fields after the command name, which may contain spaces
+        std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+        std::string field;
+        uint64_t userTicks = 0, systemTicks = 0;
+        for (int i = 3; i <= 15 && fields >> field; i++) {
+            if (i == 14) {
+                userTicks = std::stoull(field);
+            } else if (i == 15) {
+                systemTicks = std::stoull(field);
+            }
+        }
+        static const long ticksPerSecond = sysconf(_SC_CLK_TCK);
+        return std::chrono::nanoseconds((userTicks + systemTicks) *
+                                        1'000'000'000 / ticksPerSecond);
+    }
+
+  private:
+    pid_t m_Pid = -1;
+    bool m_HasExited = false;
+};
+
+// A UDP echo service in the sink namespace, standing in for the Internet
+class EchoSink {
+  public:
+    EchoSink() {
+        std::atomic<bool> isReady{false};
+        std::exception_ptr error;
+        m_Thread = std::thread([&]() {
+            try {
+                enterNamespace(getNamespacePath(sinkNamespace));
+                m_Socket = socket(AF_INET, SOCK_DGRAM, 0);
+                sockaddr_in address{};
+                address.sin_family = AF_INET;
+                address.sin_port = htons(echoPort);
+                if (bind(m_Socket, reinterpret_cast<sockaddr *>(&address),
+                         sizeof(address)) < 0) {
+                    throw std::runtime_error("Couldn't bind the echo socket");
+                }
+                timeval timeout{0, 100'000};
+                setsockopt(m_Socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                           sizeof(timeout));
+            } catch (...) {
+                error = std::current_exception();
+            }
+            isReady = true;
+            if (!error) {
+                run();
+            }
+        });
+        while (!isReady) {
+            std::this_thread::yield();
+        }
+        if (error) {
+            m_Thread.join();
+            std::rethrow_exception(error);
+        }
+    }
+
+    EchoSink(const EchoSink &) = delete;
+    EchoSink &operator=(const EchoSink &) = delete;
+
+    virtual ~EchoSink() {
+        m_StopFlag = true;
+        if (m_Thread.joinable()) {
+            m_Thread.join();
+        }
+        if (m_Socket != -1) {
+            close(m_Socket);
+        }
+    }
+
+  private:
+    constexpr static size_t m_BatchSize = 64;
+    constexpr static size_t m_MaxDatagramSize = 2048;
+
+    int m_Socket = -1;
+    std::atomic<bool> m_StopFlag{false};
+    std::thread m_Thread;
+
+    void run() {
+        std::vector<std::array<uint8_t, m_MaxDatagramSize>> buffers(
+            m_BatchSize);
+        std::array<sockaddr_in, m_BatchSize> addresses;
+        std::array<iovec, m_BatchSize> iovecs;
+        std::array<mmsghdr, m_BatchSize> messages;
+        while (!m_StopFlag) {
+            for (size_t i = 0; i < m_BatchSize; i++) {
+                iovecs[i] = {buffers[i].data(), buffers[i].size()};
+                messages[i] = {};
+                messages[i].msg_hdr.msg_name = &addresses[i];
+                messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+                messages[i].msg_hdr.msg_iov = &iovecs[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+            }
+            int count = recvmmsg(m_Socket, messages.data(), m_BatchSize,
+                                 MSG_WAITFORONE, nullptr);
+            if (count <= 0) {
+                continue;
+            }
+            for (int i = 0; i < count; i++) {
+                iovecs[i].iov_len = messages[i].msg_len;
+            }
+            sendmmsg(m_Socket, messages.data(), count, 0);
+        }
+    }
+};
+
+// What every packet carries, so its echo can be matched and timed
+struct Probe {
+    uint64_t sentNanoseconds;
+    uint32_t client;
+    uint32_t sequence;
+};
+
+struct PhaseResult {
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    std::vector<double> latencies;
+};
+
+static uint64_t nowNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               Clock::now().time_since_epoch())
+        .count();
+}
+
+static uint16_t ipChecksum(const uint8_t *data, size_t size) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+// The client's end of an encrypted session, built on the server's own codecs:
+// the encrypted hello, the keys and features from the server's answer to it,
+// and the framing of every feature the server granted in both directions
+class TunnelSession {
+  public:
+    constexpr static uint8_t cookieMessageType = 1;
+    constexpr static size_t cookieSize = 16;
+
+    enum class Framing { Plain, Compressed, HeaderCompressed };
+
+    explicit TunnelSession(
+        const std::optional<ResumptionTokens::Token> &token) {
+        if (RAND_bytes(m_Nonce.data(), m_Nonce.size()) != 1) {
+            throw std::runtime_error("Couldn't generate a hello nonce");
+        }
+        auto &publicKey = m_KeyPair.getPublicKey();
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        uint64_t timestamp =
+            std::chrono::duration_cast<std::chrono::seconds>(now).count();
+
+        m_Hello.push_back(m_HelloMessageType);
+        m_Hello.insert(m_Hello.end(), m_Nonce.begin(), m_Nonce.end());
+        m_Hello.insert(m_Hello.end(), publicKey.begin(), publicKey.end());
+        m_Hello.push_back(m_AllFeatures);
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            m_Hello.push_back(timestamp >> shift);
+        }
+        if (token.has_value()) {
+            m_Hello.insert(m_Hello.end(), token->begin(), token->end());
+        }
+        auto proof = HandshakeGuard::createProof(secret, m_Hello.data() + 1,
+                                                 m_Hello.size() - 1);
+        m_Hello.insert(m_Hello.end(), proof.begin(), proof.end());
+    }
+
+    TunnelSession(const TunnelSession &) = delete;
+    TunnelSession &operator=(const TunnelSession &) = delete;
+
+    const std::vector<uint8_t> &getHello() const { return m_Hello; }
+
+    // Derives the keys from the server's answer to the hello and sets up the
+    // features it granted. Returns the params, or nullopt if the answer is
+    // malformed or doesn't open with the keys.
+    std::optional<std::string> handleResponse(uint8_t *data, size_t size) {
+        size_t offset =
+            1 + HelloMessage::nonceSize + X25519KeyPair::keySize + 2;
+        if (size < offset || data[0] != m_HelloMessageType) {
+            return std::nullopt;
+        }
+
+        auto serverNonce = data + 1;
+        auto serverPublicKey = serverNonce + HelloMessage::nonceSize;
+        auto algorithm = serverPublicKey[X25519KeyPair::keySize];
+        m_Features = serverPublicKey[X25519KeyPair::keySize + 1];
+        if (isRoaming()) {
+            if (size < offset + m_SessionIdSize) {
+                return std::nullopt;
+            }
+            m_SessionHeader[0] = m_SessionMessageType;
+            std::memcpy(m_SessionHeader.data() + 1, data + offset,
+                        m_SessionIdSize);
+            offset += m_SessionIdSize;
+        }
+        if (algorithm != uint8_t(TunnelCipher::Algorithm::ChaCha20Poly1305) &&
+            algorithm != uint8_t(TunnelCipher::Algorithm::Aes256Gcm)) {
+            return std::nullopt;
+        }
+
+        auto sharedSecret = m_KeyPair.deriveSharedSecret(serverPublicKey);
+        if (!sharedSecret.has_value()) {
+            return std::nullopt;
+        }
+        std::vector<uint8_t> nonces(m_Nonce.begin(), m_Nonce.end());
+        nonces.insert(nonces.end(), serverNonce,
+                      serverNonce + HelloMessage::nonceSize);
+        auto keys = deriveSessionKeys(sharedSecret.value(), secret,
+                                      nonces.data(), nonces.size());
+        m_Cipher.emplace(TunnelCipher::Algorithm(algorithm),
+                         keys.clientToServer, keys.serverToClient);
+
+        auto paramsSize = m_Cipher->open(data + offset, size - offset);
+        auto params = data + offset + TunnelCipher::headerSize;
+        if (!paramsSize.has_value() || paramsSize.value() < 1 ||
+            params[0] != m_ControlMessageType) {
+            m_Cipher.reset();
+            return std::nullopt;
+        }
+
+        if (m_Features & HelloMessage::coalescingFeature) {
+            m_Coalescer.emplace(m_MaxPacketSize, TunnelCipher::overhead);
+        }
+        if (m_Features & HelloMessage::fecFeature) {
+            m_FecEncoder.emplace();
+            m_FecDecoder.emplace();
+        }
+        if (m_Features & HelloMessage::headerCompressionFeature) {
+            m_HeaderCompressor.emplace();
+            m_HeaderDecompressor.emplace();
+        }
+        return std::string(reinterpret_cast<char *>(params + 1),
+                           paramsSize.value() - 1);
+    }
+
+    bool hasFeature(uint8_t feature) const { return m_Features & feature; }
+
+    bool isRoaming() const { return hasFeature(HelloMessage::roamingFeature); }
+
+    // Sends a packet in a framing the server granted, or as it is if the
+    // packet can't be sent in it. Returns the name of the message it went
+    // in, or nullopt if the send failed.
+    std::optional<std::string> sendPacket(int socket, const uint8_t *packet,
+                                          size_t size, Framing framing) {
+        std::array<uint8_t, m_MaxPacketSize + HeaderCompressor::maxExpansion>
+            message;
+        size_t messageSize = 0;
+        if (framing == Framing::Compressed &&
+            hasFeature(HelloMessage::compressionFeature)) {
+            messageSize = m_Compressor.compress(packet, size, message.data());
+        } else if (framing == Framing::HeaderCompressed &&
+                   m_HeaderCompressor.has_value()) {
+            messageSize =
+                m_HeaderCompressor->compress(packet, size, message.data());
+        }
+        if (messageSize == 0) {
+            std::memcpy(message.data(), packet, size);
+            messageSize = size;
+        }
+        if (!send(socket, message.data(), messageSize)) {
+            return std::nullopt;
+        }
+        return getMessageName(message[0]);
+    }
+
+    // Sends the packets in one coalesced datagram
+    bool sendCoalesced(int socket,
+                       const std::vector<std::vector<uint8_t>> &packets) {
+        for (auto &packet : packets) {
+            if (!m_Coalescer->canAdd(packet.size())) {
+                return false;
+            }
+            m_Coalescer->add(packet.data(), packet.size());
+        }
+        auto [payload, payloadSize] = m_Coalescer->take();
+        return send(socket, payload, payloadSize);
+    }
+
+    // Sends all but the last of the packets as a group protected by FEC,
+    // followed by its parity, from which the server recovers the last one
+    bool sendFecGroup(int socket,
+                      const std::vector<std::vector<uint8_t>> &packets) {
+        m_FecEncoder->setGroupSize(packets.size());
+        for (size_t i = 0; i < packets.size(); i++) {
+            auto [message, messageSize] =
+                m_FecEncoder->protect(packets[i].data(), packets[i].size());
+            if (i + 1 < packets.size() && !send(socket, message, messageSize)) {
+                return false;
+            }
+        }
+        auto [parity, paritySize] = m_FecEncoder->takeParity();
+        return send(socket, parity, paritySize);
+    }
+
+    bool sendDisconnect(int socket) {
+        std::string message(1, m_ControlMessageType);
+        message += "DISCONNECT";
+        return send(socket, reinterpret_cast<const uint8_t *>(message.data()),
+                    message.size());
+    }
+
+    // Opens a datagram from the server and calls the callback with every
+    // packet in it. Returns false if it doesn't open.
+    template <typename Callback>
+    bool receive(uint8_t *data, size_t size, const Callback &callback) {
+        auto plaintextSize = m_Cipher->open(data, size);
+        if (!plaintextSize.has_value() || plaintextSize.value() == 0) {
+            return false;
+        }
+
+        auto message = data + TunnelCipher::headerSize;
+        size_t messageSize = plaintextSize.value();
+        m_ReceivedMessages[getMessageName(message[0])]++;
+        if (m_FecDecoder.has_value()) {
+            std::optional<ForwardErrorCorrection::Payload> payload;
+            if (message[0] == ForwardErrorCorrection::dataMessageType) {
+                payload = m_FecDecoder->receiveData(message, messageSize);
+            } else if (message[0] ==
+                       ForwardErrorCorrection::parityMessageType) {
+                payload = m_FecDecoder->receiveParity(message, messageSize);
+            } else {
+                payload = ForwardErrorCorrection::Payload{message, messageSize};
+            }
+            if (!payload.has_value() || payload->second == 0) {
+                return true;
+            }
+            if (payload->first != message) {
+                m_ReceivedMessages[getMessageName(payload->first[0])]++;
+            }
+            std::tie(message, messageSize) = payload.value();
+        }
+
+        auto handleFrame = [&](const uint8_t *frame, size_t frameSize) {
+            m_ReceivedMessages[getMessageName(frame[0])]++;
+            handleMessage(frame, frameSize, callback);
+        };
+        if (m_Coalescer.has_value() &&
+            message[0] == PacketCoalescer::messageType) {
+            PacketCoalescer::forEachFrame(message, messageSize, handleFrame);
+        } else {
+            handleMessage(message, messageSize, callback);
+        }
+        return true;
+    }
+
+    // How many messages of every type came from the server, by name
+    const std::map<std::string, uint64_t> &getReceivedMessages() const {
+        return m_ReceivedMessages;
+    }
+
+    void clearReceivedMessages() { m_ReceivedMessages.clear(); }
+
+  private:
+    constexpr static uint8_t m_ControlMessageType = 0;
+    constexpr static uint8_t m_HelloMessageType = 3;
+    // Like ClientHandler::sessionMessageType, which the clients of a server
+    // with --roaming put before every encrypted datagram
+    constexpr static uint8_t m_SessionMessageType = 10;
+    constexpr static size_t m_SessionIdSize = 4;
+    constexpr static uint8_t m_AllFeatures =
+        HelloMessage::compressionFeature | HelloMessage::coalescingFeature |
+        HelloMessage::fecFeature | HelloMessage::headerCompressionFeature |
+        HelloMessage::roamingFeature | HelloMessage::resumptionFeature;
+    constexpr static size_t m_MaxPacketSize = 2048;
+
+    X25519KeyPair m_KeyPair;
+    std::array<uint8_t, HelloMessage::nonceSize> m_Nonce;
+    std::vector<uint8_t> m_Hello;
+    uint8_t m_Features = 0;
+    std::array<uint8_t, 1 + m_SessionIdSize> m_SessionHeader;
+    std::optional<TunnelCipher> m_Cipher;
+    PacketCompressor m_Compressor;
+    std::optional<PacketCoalescer> m_Coalescer;
+    std::optional<FecEncoder> m_FecEncoder;
+    std::optional<FecDecoder> m_FecDecoder;
+    std::optional<HeaderCompressor> m_HeaderCompressor;
+    std::optional<HeaderDecompressor> m_HeaderDecompressor;
+    std::array<uint8_t, 4096> m_Datagram;
+    std::array<uint8_t, m_MaxPacketSize> m_Packet;
+    std::map<std::string, uint64_t> m_ReceivedMessages;
+
+    static std::string getMessageName(uint8_t type) {
+        switch (type) {
+        case m_ControlMessageType:
+            return "control";
+        case PacketCompressor::messageType:
+            return "lz4";
+        case PacketCoalescer::messageType:
+            return "coalesced";
+        case ForwardErrorCorrection::dataMessageType:
+            return "fec_data";
+        case ForwardErrorCorrection::parityMessageType:
+            return "fec_parity";
+        case HeaderCompression::compressedMessageType:
+            return "header_compressed";
+        case HeaderCompression::contextMessageType:
+            return "header_context";
+        default:
+            return "plain";
+        }
+    }
+
+    // Seals a message, puts the session header before it when roaming and
+    // sends it
+    bool send(int socket, const uint8_t *message, size_t messageSize) {
+        size_t headerSize = isRoaming() ? m_SessionHeader.size() : 0;
+        if (headerSize + messageSize + TunnelCipher::overhead >
+            m_Datagram.size()) {
+            return false;
+        }
+        std::memcpy(m_Datagram.data(), m_SessionHeader.data(), headerSize);
+        std::memcpy(m_Datagram.data() + headerSize, message, messageSize);
+        auto sealedSize =
+            m_Cipher->seal(m_Datagram.data() + headerSize, messageSize);
+        if (sealedSize == 0) {
+            return false;
+        }
+        size_t datagramSize = headerSize + sealedSize;
+        return ::send(socket, m_Datagram.data(), datagramSize, 0) >= 0;
+    }
+
+    template <typename Callback>
+    void handleMessage(const uint8_t *message, size_t messageSize,
+                       const Callback &callback) {
+        std::optional<size_t> packetSize;
+        if (message[0] == PacketCompressor::messageType) {
+            packetSize = PacketCompressor::decompress(
+                message, messageSize, m_Packet.data(), m_Packet.size());
+        } else if (m_HeaderDecompressor.has_value() &&
+                   (message[0] == HeaderCompression::compressedMessageType ||
+                    message[0] == HeaderCompression::contextMessageType)) {
+            packetSize = m_HeaderDecompressor->decompress(
+                message, messageSize, m_Packet.data(), m_Packet.size());
+        } else if (message[0] != m_ControlMessageType) {
+            callback(message, messageSize);
+            return;
+        }
+        if (packetSize.has_value()) {
+            callback(m_Packet.data(), packetSize.value());
+        }
+    }
+};
+
+// A client of the tunnel with a connected UDP socket in the clients namespace
+class EmulatedClient {
+  public:
+    EmulatedClient(uint32_t id, size_t packetSize, bool isEncrypted)
+        : m_Id(id), m_IsEncrypted(isEncrypted), m_Socket(openSocket()),
+          m_Packet(packetSize), m_CheckPacket(m_CheckPacketSize) {}
+
+    EmulatedClient(const EmulatedClient &) = delete;
+    EmulatedClient &operator=(const EmulatedClient &) = delete;
+
+    virtual ~EmulatedClient() { close(m_Socket); }
+
+    // Sends the hello until the server answers with the settings, which it
+    // may not do until it has started, and echoes a cookie if the server
+    // asks for one. An encrypted hello carries the resumption token of the
+    // last session, if there is one.
+    void handshake(const Clock::time_point &deadline) {
+        std::vector<uint8_t> hello;
+        if (m_IsEncrypted) {
+            addReceivedMessages();
+            m_Session = std::make_unique<TunnelSession>(m_Token);
+            hello = m_Session->getHello();
+        } else {
+            hello = {0};
+            hello.insert(hello.end(), secret.begin(), secret.end());
+        }
+        auto message = hello;
+        std::array<uint8_t, 2048> response;
+        while (Clock::now() < deadline) {
+            send(m_Socket, message.data(), message.size(), 0);
+            pollfd socketPoll{m_Socket, POLLIN, 0};
+            if (poll(&socketPoll, 1, 200) <= 0) {
+                continue;
+            }
+            auto size = recv(m_Socket, response.data(), response.size(), 0);
+            if (size == 1 + TunnelSession::cookieSize &&
+                response[0] == TunnelSession::cookieMessageType) {
+                message.assign(response.begin(), response.begin() + size);
+                message.insert(message.end(), hello.begin(), hello.end());
+                continue;
+            }
+
+            std::optional<std::string> params;
+            if (m_IsEncrypted && size > 0) {
+                params = m_Session->handleResponse(response.data(), size);
+            } else if (size > 1 && response[0] == 0) {
+                params = std::string(reinterpret_cast<char *>(&response[1]),
+                                     size - 1);
+            }
+            if (params.has_value() && setUp(params.value())) {
+                fcntl(m_Socket, F_SETFL, O_NONBLOCK);
+                return;
+            }
+        }
+        throw std::runtime_error("Client " + std::to_string(m_Id) +
+                                 " got no answer to its hello");
+    }
+
+    // Keeps up to window packets in flight until the deadline, then waits
+    // for the last ones. Every packet counts once, as received if it is
+    // echoed within lossTimeout and as lost otherwise, so late echoes are
+    // ignored.
+    PhaseResult run(size_t window, const Clock::time_point &deadline) {
+        PhaseResult result;
+        // The loss deadline of each packet in flight, by sequence number,
+        // so the first one expires first
+        std::map<uint32_t, Clock::time_point> inFlight;
+        while (Clock::now() < deadline || !inFlight.empty()) {
+            while (inFlight.size() < window && Clock::now() < deadline) {
+                Probe probe{nowNanoseconds(), m_Id, m_Sequence++};
+                memcpy(m_Packet.data() + headersSize, &probe, sizeof(probe));
+                if (!sendPacket(m_Packet)) {
+                    break;
+                }
+                inFlight.emplace(probe.sequence, Clock::now() + lossTimeout);
+                result.sent++;
+            }
+
+            auto now = Clock::now();
+            while (!inFlight.empty() && inFlight.begin()->second <= now) {
+                inFlight.erase(inFlight.begin());
+                result.lost++;
+            }
+            auto wakeup =
+                inFlight.empty() ? deadline : inFlight.begin()->second;
+            auto timeout =
+                std::chrono::ceil<std::chrono::milliseconds>(wakeup - now);
+            pollfd socketPoll{m_Socket, POLLIN, 0};
+            if (poll(&socketPoll, 1, std::max<int>(timeout.count(), 0)) <= 0) {
+                continue;
+            }
+
+            receivePackets([&](const uint8_t *packet, size_t size) {
+                auto probe = readProbe(packet, size);
+                if (!probe.has_value() || probe->client != m_Id ||
+                    inFlight.erase(probe->sequence) == 0) {
+                    return;
+                }
+                result.latencies.push_back(
+                    (nowNanoseconds() - probe->sentNanoseconds) / 1000.0);
+                result.received++;
+            });
+        }
+        return result;
+    }
+
+    // The VPN address the server gave the client, in network byte order
+    uint32_t getAddress() const { return m_Address; }
+
+    // Sends probes through the tunnel to another client's VPN address
+    void sendToClient(uint32_t address, size_t count) {
+        std::vector<uint8_t> packet(m_Packet.size());
+        buildHeaders(packet, address);
+        for (size_t i = 0; i < count; i++) {
+            Probe probe{nowNanoseconds(), m_Id, m_Sequence++};
+            memcpy(packet.data() + headersSize, &probe, sizeof(probe));
+            sendPacket(packet);
+        }
+    }
+
+    // Counts the probes from another client that arrive until the deadline,
+    // skipping late echoes of this client's own packets
+    size_t receiveFromClient(uint32_t id, size_t count,
+                             const Clock::time_point &deadline) {
+        size_t received = 0;
+        while (received < count && Clock::now() < deadline) {
+            auto timeout = std::chrono::ceil<std::chrono::milliseconds>(
+                deadline - Clock::now());
+            pollfd socketPoll{m_Socket, POLLIN, 0};
+            if (poll(&socketPoll, 1, std::max<int>(timeout.count(), 0)) <= 0) {
+                continue;
+            }
+            receivePackets([&](const uint8_t *packet, size_t size) {
+                auto probe = readProbe(packet, size);
+                if (probe.has_value() && probe->client == id) {
+                    received++;
+                }
+            });
+        }
+        return received;
+    }
+
+    // Sends probes in every framing the server granted: as they are, LZ4
+    // compressed, with compressed headers, coalesced, and as FEC groups
+    // whose last packet is only sent as parity. The echoes are counted by
+    // the message the probes went in.
+    void checkFramings(std::map<std::string, uint64_t> &roundTrips,
+                       const Clock::time_point &deadline) {
+        std::map<uint32_t, std::string> inFlight;
+        for (size_t round = 0; round < m_CheckRounds; round++) {
+            for (auto framing : {TunnelSession::Framing::Plain,
+                                 TunnelSession::Framing::Compressed,
+                                 TunnelSession::Framing::HeaderCompressed}) {
+                auto packet = createCheckProbe();
+                auto message = m_Session->sendPacket(
+                    m_Socket, packet.data(), packet.size(), framing);
+                if (message.has_value()) {
+                    inFlight[m_Sequence - 1] = message.value();
+                }
+            }
+            if (m_Session->hasFeature(HelloMessage::coalescingFeature)) {
+                auto first = createCheckProbe();
+                auto second = createCheckProbe();
+                if (m_Session->sendCoalesced(m_Socket, {first, second})) {
+                    inFlight[m_Sequence - 2] = "coalesced";
+                    inFlight[m_Sequence - 1] = "coalesced";
+                }
+            }
+            if (m_Session->hasFeature(HelloMessage::fecFeature)) {
+                auto first = createCheckProbe();
+                auto second = createCheckProbe();
+                if (m_Session->sendFecGroup(m_Socket, {first, second})) {
+                    inFlight[m_Sequence - 2] = "fec_data";
+                    inFlight[m_Sequence - 1] = "fec_recovered";
+                }
+            }
+        }
+        awaitEchoes(inFlight, roundTrips, deadline);
+    }
+
+    // Moves to a new socket, and with it a new source port, like a client
+    // whose NAT binding changed, and sends probes from there
+    void checkRoaming(std::map<std::string, uint64_t> &roundTrips,
+                      const Clock::time_point &deadline) {
+        if (!m_Session->isRoaming()) {
+            return;
+        }
+        close(m_Socket);
+        m_Socket = openSocket();
+        fcntl(m_Socket, F_SETFL, O_NONBLOCK);
+        sendCheckProbes("roaming", roundTrips, deadline);
+    }
+
+    // Ends the session and does a new handshake with the resumption token
+    // from another socket, which has to give the client its address back
+    void checkResumption(std::map<std::string, uint64_t> &roundTrips,
+                         const Clock::time_point &deadline) {
+        if (!m_Token.has_value()) {
+            return;
+        }
+        auto address = m_Address;
+        m_Session->sendDisconnect(m_Socket);
+        close(m_Socket);
+        m_Socket = openSocket();
+        handshake(deadline);
+        if (m_Address != address) {
+            throw std::runtime_error("Client " + std::to_string(m_Id) +
+                                     " got a new address when it resumed");
+        }
+        sendCheckProbes("resumption", roundTrips, deadline);
+    }
+
+    // The messages the server sent in, by name, which depend on the traffic
+    std::map<std::string, uint64_t> getReceivedMessages() {
+        addReceivedMessages();
+        return m_ReceivedMessages;
+    }
+
+  private:
+    // Large enough for LZ4 to compress, whatever the packet size is
+    constexpr static size_t m_CheckPacketSize = 512;
+    // The header compressor sends the first packets of a flow with the
+    // context and compresses the ones after
+    constexpr static size_t m_CheckRounds = 4;
+
+    uint32_t m_Id;
+    bool m_IsEncrypted;
+    int m_Socket = -1;
+    std::unique_ptr<TunnelSession> m_Session;
+    std::optional<ResumptionTokens::Token> m_Token;
+    // The messages from the server of the sessions before the current one
+    std::map<std::string, uint64_t> m_ReceivedMessages;
+    // The VPN address the server gave the client, in network byte order
+    uint32_t m_Address = 0;
+    uint32_t m_Sequence = 0;
+    std::vector<uint8_t> m_Packet;
+    std::vector<uint8_t> m_CheckPacket;
+    std::array<uint8_t, 4096> m_Buffer;
+
+    static int openSocket() {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(serverPort);
+        inet_pton(AF_INET, serverAddress.c_str(), &address.sin_addr);
+        auto server = reinterpret_cast<sockaddr *>(&address);
+        if (fd < 0 || ::connect(fd, server, sizeof(address)) < 0) {
+            throw std::runtime_error("Couldn't create a client socket");
+        }
+        int bufferSize = 4 * 1024 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+        return fd;
+    }
+
+    // Moves the counts of the current session to m_ReceivedMessages
+    void addReceivedMessages() {
+        if (!m_Session) {
+            return;
+        }
+        for (auto &[name, count] : m_Session->getReceivedMessages()) {
+            m_ReceivedMessages[name] += count;
+        }
+        m_Session->clearReceivedMessages();
+    }
+
+    // Takes the address and the resumption token from the params
+    bool setUp(const std::string &params) {
+        auto address = getParam(params, "a");
+        if (inet_pton(AF_INET, address.substr(0, address.find(',')).c_str(),
+                      &m_Address) != 1) {
+            return false;
+        }
+
+        auto token = getParam(params, "t");
+        if (token.size() == 2 * ResumptionTokens::tokenSize) {
+            m_Token.emplace();
+            for (size_t i = 0; i < ResumptionTokens::tokenSize; i++) {
+                (*m_Token)[i] = std::stoul(token.substr(2 * i, 2), nullptr, 16);
+            }
+        } else {
+            m_Token.reset();
+        }
+
+        in_addr sink;
+        inet_pton(AF_INET, sinkAddress.c_str(), &sink);
+        buildHeaders(m_Packet, sink.s_addr);
+        buildHeaders(m_CheckPacket, sink.s_addr);
+        return true;
+    }
+
+    // The value of a parameter like "a,10.0.0.2,32", without the name
+    static std::string getParam(const std::string &params,
+                                const std::string &name) {
+        auto start = (" " + params).find(" " + name + ",");
+        if (start == std::string::npos) {
+            return "";
+        }
+        start += name.size() + 1;
+        return params.substr(start, params.find(' ', start) - start);
+    }
+
+    bool sendPacket(const std::vector<uint8_t> &packet) {
+        if (m_Session) {
+            auto message =
+                m_Session->sendPacket(m_Socket, packet.data(), packet.size(),
+                                      TunnelSession::Framing::Plain);
+            return message.has_value();
+        }
+        return send(m_Socket, packet.data(), packet.size(), 0) >= 0;
+    }
+
+    // Calls the callback with every packet of the datagrams that are waiting
+    template <typename Callback> void receivePackets(const Callback &callback) {
+        while (true) {
+            auto size = recv(m_Socket, m_Buffer.data(), m_Buffer.size(), 0);
+            if (size <= 0) {
+                return;
+            }
+            if (m_Session) {
+                m_Session->receive(m_Buffer.data(), size, callback);
+            } else {
+                callback(m_Buffer.data(), size);
+            }
+        }
+    }
+
+    static std::optional<Probe> readProbe(const uint8_t *packet, size_t size) {
+        size_t ipHeaderSize = (packet[0] & 0x0f) * 4;
+        if ((packet[0] >> 4) != 4 || size < ipHeaderSize + 8 + sizeof(Probe)) {
+            return std::nullopt;
+        }
+        Probe probe;
+        memcpy(&probe, packet + ipHeaderSize + 8, sizeof(probe));
+        return probe;
+    }
+
+    std::vector<uint8_t> createCheckProbe() {
+        Probe probe{nowNanoseconds(), m_Id, m_Sequence++};
+        memcpy(m_CheckPacket.data() + headersSize, &probe, sizeof(probe));
+        return m_CheckPacket;
+    }
+
+    void sendCheckProbes(const std::string &name,
+                         std::map<std::string, uint64_t> &roundTrips,
+                         const Clock::time_point &deadline) {
+        std::map<uint32_t, std::string> inFlight;
+        for (size_t round = 0; round < m_CheckRounds; round++) {
+            if (sendPacket(createCheckProbe())) {
+                inFlight[m_Sequence - 1] = name;
+            }
+        }
+        awaitEchoes(inFlight, roundTrips, deadline);
+    }
+
+    // Counts the echoes of the probes in flight by the name they were sent
+    // under until all are back or the deadline passes, and fails if a name
+    // got none
+    void awaitEchoes(std::map<uint32_t, std::string> &inFlight,
+                     std::map<std::string, uint64_t> &roundTrips,
+                     const Clock::time_point &deadline) {
+        std::map<std::string, uint64_t> received;
+        for (auto &[sequence, name] : inFlight) {
+            received[name];
+        }
+        while (!inFlight.empty() && Clock::now() < deadline) {
+            auto timeout = std::chrono::ceil<std::chrono::milliseconds>(
+                deadline - Clock::now());
+            pollfd socketPoll{m_Socket, POLLIN, 0};
+            if (poll(&socketPoll, 1, std::max<int>(timeout.count(), 0)) <= 0) {
+                continue;
+            }
+            receivePackets([&](const uint8_t *packet, size_t size) {
+                auto probe = readProbe(packet, size);
+                if (!probe.has_value() || probe->client != m_Id) {
+                    return;
+                }
+                if (auto it = inFlight.find(probe->sequence);
+                    it != inFlight.end()) {
+                    received[it->second]++;
+                    inFlight.erase(it);
+                }
+            });
+        }
+        for (auto &[name, count] : received) {
+            if (count == 0) {
+                throw std::runtime_error("Client " + std::to_string(m_Id) +
+                                         " got no echo of its " + name +
+                                         " probes");
+            }
+            roundTrips[name] += count;
+        }
+    }
+
+    // An IPv4 and UDP header from the VPN address to the echo port of a
+    // destination. The UDP checksum is left out, which IPv4 allows.
+    void buildHeaders(std::vector<uint8_t> &buffer, uint32_t destination) {
+        auto packet = buffer.data();
+        packet[0] = 0x45;
+        uint16_t totalLength = htons(buffer.size());
+        memcpy(packet + 2, &totalLength, 2);
+        packet[8] = 64;
+        packet[9] = IPPROTO_UDP;
+        memcpy(packet + 12, &m_Address, 4);
+        memcpy(packet + 16, &destination, 4);
+        // The headers of a packet are built again after a resumption
+        memset(packet + 10, 0, 2);
+        uint16_t checksum = htons(ipChecksum(packet, 20));
+        memcpy(packet + 10, &checksum, 2);
+
+        uint16_t sourcePort = htons(10000 + m_Id);
+        uint16_t destinationPort = htons(echoPort);
+        uint16_t udpLength = htons(buffer.size() - 20);
+        memcpy(packet + 20, &sourcePort, 2);
+        memcpy(packet + 22, &destinationPort, 2);
+        memcpy(packet + 24, &udpLength, 2);
+    }
+};
+
+// The results of every client
+static std::vector<PhaseResult>
+runPhase(std::vector<EmulatedClient *> &clients, size_t window,
+         Clock::duration duration) {
+    std::vector<PhaseResult> results(clients.size());
+    std::vector<std::thread> threads;
+    auto deadline = Clock::now() + duration;
+    for (size_t i = 0; i < clients.size(); i++) {
+        threads.emplace_back([&, i]() {
+            results[i] = clients[i]->run(window, deadline);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return results;
+}
+
+static PhaseResult combine(const std::vector<PhaseResult> &results) {
+    PhaseResult total;
+    for (auto &result : results) {
+        total.sent += result.sent;
+        total.received += result.received;
+        total.lost += result.lost;
+        total.latencies.insert(total.latencies.end(),
+                               result.latencies.begin(),
+                               result.latencies.end());
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    return total;
+}
+
+// In a cluster the echoes of a client that did its handshake with another
+// node than the one its datagrams now go to have to be handed over
+static void checkEveryClientReceived(const std::vector<PhaseResult> &results,
+                                     size_t nodeCount) {
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].received == 0) {
+            throw std::runtime_error(
+                "Client " + std::to_string(i) + " of node " +
+                std::to_string(i % nodeCount) + " got no echoes");
+        }
+    }
+}
+
+// Every client sends probes to the next one, so with several nodes most of
+// them cross from one node to another, and returns how many arrived
+static size_t runClientToClient(std::vector<EmulatedClient *> &clients,
+                                size_t nodeCount) {
+    for (size_t i = 0; i < clients.size(); i++) {
+        auto next = clients[(i + 1) % clients.size()];
+        clients[i]->sendToClient(next->getAddress(), clientToClientProbes);
+    }
+    size_t total = 0;
+    auto deadline = Clock::now() + std::chrono::seconds(1);
+    for (size_t i = 0; i < clients.size(); i++) {
+        size_t next = (i + 1) % clients.size();
+        size_t received = clients[next]->receiveFromClient(
+            i, clientToClientProbes, deadline);
+        if (received == 0) {
+            throw std::runtime_error(
+                "Nothing from client " + std::to_string(i) + " of node " +
+                std::to_string(i % nodeCount) + " reached client " +
+                std::to_string(next) + " of node " +
+                std::to_string(next % nodeCount));
+        }
+        total += received;
+    }
+    return total;
+}
+
+static double percentile(const std::vector<double> &values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    return values[std::min(values.size() - 1, size_t(values.size() * p))];
+}
+
+static std::string formatLatencies(const std::vector<double> &latencies) {
+    std::ostringstream json;
+    json << "{\"p50\": " << percentile(latencies, 0.5)
+         << ", \"p90\": " << percentile(latencies, 0.9)
+         << ", \"p99\": " << percentile(latencies, 0.99)
+         << ", \"p99.9\": " << percentile(latencies, 0.999)
+         << ", \"max\": " << (latencies.empty() ? 0 : latencies.back())
+         << "}";
+    return json.str();
+}
+
+static std::string formatCounts(const std::map<std::string, uint64_t> &counts) {
+    std::ostringstream json;
+    json << "{";
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+        json << (it == counts.begin() ? "" : ", ") << "\"" << it->first
+             << "\": " << it->second;
+    }
+    json << "}";
+    return json.str();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <ToyVpnServer> [clients] [seconds] [packet size] "
+                     "[window] [nodes] [-- server arguments...]"
+                  << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> positional;
+    std::vector<std::string> serverArguments;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--") {
+            serverArguments.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        positional.push_back(argv[i]);
+    }
+    size_t clientCount = positional.size() > 1 ? std::stoul(positional[1]) : 4;
+    size_t seconds = positional.size() > 2 ? std::stoul(positional[2]) : 10;
+    size_t packetSize = positional.size() > 3
+                            ? std::stoul(positional[3])
+                            : 1000;
+    size_t window = positional.size() > 4 ? std::stoul(positional[4]) : 64;
+    size_t nodeCount = positional.size() > 5 ? std::stoul(positional[5]) : 1;
+    packetSize = std::clamp(packetSize, headersSize + sizeof(Probe),
+                            size_t(1400));
+    if (nodeCount < 1 || nodeCount > 16 ||
+        (nodeCount > 1 && clientCount < nodeCount)) {
+        std::cerr << "Between 1 and 16 nodes, with at least a client each"
+                  << std::endl;
+        return 1;
+    }
+    bool isCluster = nodeCount > 1;
+    bool isEncrypted = false;
+    for (auto &argument : serverArguments) {
+        if (argument == "-E" || argument.rfind("--encryption", 0) == 0) {
+            isEncrypted = true;
+        }
+    }
+
+    try {
+        Topology topology(nodeCount);
+        EchoSink sink;
+        std::vector<std::unique_ptr<ServerProcess>> servers;
+        for (size_t node = 0; node < nodeCount; node++) {
+            auto arguments = serverArguments;
+            if (isCluster) {
+                arguments.push_back("--cluster-node");
+                arguments.push_back(std::to_string(node));
+                arguments.push_back("--cluster-address");
+                arguments.push_back(Topology::getPublicAddress(node));
+                for (size_t peer = 0; peer < nodeCount; peer++) {
+                    if (peer != node) {
+                        arguments.push_back("--cluster-peer");
+                        arguments.push_back(Topology::getClusterPeer(peer));
+                    }
+                }
+            }
+            auto logPath = "EndToEndBenchmark-server" +
+                           (isCluster ? std::to_string(node) : "") + ".log";
+            servers.push_back(std::make_unique<ServerProcess>(
+                positional[0], getServerNamespace(node, nodeCount), arguments,
+                logPath));
+        }
+        if (isCluster) {
+            std::this_thread::sleep_for(clusterSyncTime);
+        }
+
+        // The clients' sockets stay in the clients namespace, whichever
+        // thread uses them. In a cluster client i does its handshake with
+        // node i % nodes.
+        std::vector<std::unique_ptr<EmulatedClient>> clients;
+        std::exception_ptr error;
+        std::thread([&]() {
+            try {
+                enterNamespace(getNamespacePath(clientsNamespace));
+                auto deadline = Clock::now() + handshakeTimeout;
+                for (size_t i = 0; i < clientCount; i++) {
+                    if (isCluster) {
+                        topology.balanceTo(i % nodeCount);
+                    }
+                    clients.push_back(std::make_unique<EmulatedClient>(
+                        i, packetSize, isEncrypted));
+                    clients.back()->handshake(deadline);
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }).join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        std::vector<EmulatedClient *> clientPointers;
+        for (auto &client : clients) {
+            clientPointers.push_back(client.get());
+        }
+        std::cerr << clientCount << " clients connected" << std::endl;
+        if (isCluster) {
+            topology.balanceTo(0);
+            std::this_thread::sleep_for(clusterSyncTime);
+        }
+
+        auto idleResults = runPhase(clientPointers, 1, latencyPhaseDuration);
+        if (isCluster) {
+            checkEveryClientReceived(idleResults, nodeCount);
+        }
+        auto idle = combine(idleResults);
+        std::cerr << "Latency phase done" << std::endl;
+
+        auto getCpuTime = [&servers]() {
+            std::chrono::nanoseconds cpuTime{0};
+            for (auto &server : servers) {
+                cpuTime += server->getCpuTime();
+            }
+            return cpuTime;
+        };
+        auto cpuStart = getCpuTime();
+        auto start = Clock::now();
+        auto loaded = combine(
+            runPhase(clientPointers, window, std::chrono::seconds(seconds)));
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        auto cpuTime = getCpuTime() - cpuStart;
+
+        size_t clientToClient =
+            isCluster ? runClientToClient(clientPointers, nodeCount) : 0;
+
+        // The new sockets of roaming and resuming clients have to be in the
+        // clients namespace too. The nodes only know the resumption tokens
+        // they issued themselves, and in a cluster the clients' datagrams all
+        // go to node 0 now.
+        std::map<std::string, uint64_t> roundTrips;
+        std::map<std::string, uint64_t> serverMessages;
+        if (isEncrypted) {
+            std::thread([&]() {
+                try {
+                    enterNamespace(getNamespacePath(clientsNamespace));
+                    auto deadline = Clock::now() + handshakeTimeout;
+                    for (size_t i = 0; i < clientCount; i++) {
+                        clients[i]->checkFramings(roundTrips, deadline);
+                        clients[i]->checkRoaming(roundTrips, deadline);
+                        if (i % nodeCount == 0) {
+                            clients[i]->checkResumption(roundTrips, deadline);
+                        }
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }).join();
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            for (auto &client : clients) {
+                for (auto &[name, count] : client->getReceivedMessages()) {
+                    serverMessages[name] += count;
+                }
+            }
+            std::cerr << "Protocol checks done" << std::endl;
+        }
+        for (size_t node = 0; node < nodeCount; node++) {
+            if (!servers[node]->isRunning()) {
+                throw std::runtime_error(
+                    "The server exited, see EndToEndBenchmark-server" +
+                    (isCluster ? std::to_string(node) : "") + ".log");
+            }
+        }
+
+        // Every echoed packet went through the server twice
+        double forwarded = loaded.received * 2;
+        std::cout << "{\n  \"clients\": " << clientCount
+                  << ",\n  \"nodes\": " << nodeCount
+                  << ",\n  \"encrypted\": " << std::boolalpha << isEncrypted
+                  << ",\n  \"packet_size\": " << packetSize
+                  << ",\n  \"window\": " << window
+                  << ",\n  \"seconds\": " << elapsed.count()
+                  << ",\n  \"idle_latency_us\": "
+                  << formatLatencies(idle.latencies)
+                  << ",\n  \"packets_per_second\": "
+                  << forwarded / elapsed.count()
+                  << ",\n  \"gbps\": "
+                  << forwarded * packetSize * 8 / elapsed.count() / 1e9
+                  << ",\n  \"server_cpu_ns_per_packet\": "
+                  << (forwarded > 0 ? cpuTime.count() / forwarded : 0)
+                  << ",\n  \"loss\": "
+                  << (loaded.sent > 0 ? double(loaded.lost) / loaded.sent : 0);
+        if (isCluster) {
+            std::cout << ",\n  \"client_to_client_loss\": "
+                      << 1 - double(clientToClient) /
+                                 (clientCount * clientToClientProbes);
+        }
+        if (isEncrypted) {
+            std::cout << ",\n  \"round_trips\": " << formatCounts(roundTrips)
+                      << ",\n  \"server_messages\": "
+                      << formatCounts(serverMessages);
+        }
+        std::cout << ",\n  \"loaded_latency_us\": "
+                  << formatLatencies(loaded.latencies) << "\n}" << std::endl;
+    } catch (const std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "../ForwardErrorCorrection.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Sends a bursty stream of packets through the FEC encoder and decoder over a
+// link with random loss, with the redundancy adapting to the loss measured on
+// the receiving side, and reports the overhead, the packets that still need a
+// retransmission and the resulting tail latency. A delivered packet takes the
+// one-way delay, a recovered one also waits for its parity at the end of the
+// batch and a lost one waits for a retransmission timeout on top.
+
+constexpr size_t mtu = 1400;
+constexpr double oneWayDelayMs = 20;
+constexpr double batchDelayMs = 1;
+constexpr double retransmissionTimeoutMs = 200;
+
+struct Results {
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t lost = 0;
+    uint64_t recovered = 0;
+    std::vector<double> latencies;
+};
+
+static Results run(double lossRate, bool fec, size_t packetCount) {
+    std::mt19937_64 random(42);
+    std::uniform_int_distribution<size_t> batchSize(1, 32);
+    std::uniform_int_distribution<size_t> packetSize(64, mtu);
+    std::bernoulli_distribution isLost(lossRate);
+
+    FecEncoder encoder;
+    FecDecoder decoder;
+    LossEstimator lossEstimator;
+    Results results;
+    std::vector<bool> isDelivered(packetCount);
+    std::vector<bool> isRecovered(packetCount);
+    std::vector<uint8_t> packet(mtu);
+    std::vector<uint8_t> received(ForwardErrorCorrection::headerSize +
+                                  ForwardErrorCorrection::blockSize);
+    uint64_t counter = 0;
+
+    auto deliver = [&](const uint8_t *payload, bool recovered) {
+        uint64_t id;
+        std::memcpy(&id, payload, sizeof(id));
+        isDelivered[id] = true;
+        isRecovered[id] = recovered;
+    };
+
+    // Returns false if the datagram was lost
+    auto transmit = [&](const uint8_t *data, size_t dataSize) {
+        results.datagrams++;
+        results.bytes += dataSize + TunnelCipher::overhead;
+        counter++;
+        if (isLost(random)) {
+            return false;
+        }
+        lossEstimator.onReceived(counter);
+        std::memcpy(received.data(), data, dataSize);
+        return true;
+    };
+
+    auto sendParity = [&]() {
+        auto [parity, paritySize] = encoder.takeParity();
+        if (transmit(parity, paritySize)) {
+            auto payload = decoder.receiveParity(received.data(), paritySize);
+            if (payload.has_value()) {
+                deliver(payload->first, true);
+            }
+        }
+    };
+
+    for (uint64_t id = 0; id < packetCount;) {
+        for (size_t i = batchSize(random); i > 0 && id < packetCount; i--) {
+            size_t size = packetSize(random);
+            std::memcpy(packet.data(), &id, sizeof(id));
+            id++;
+
+            if (!fec || !encoder.canProtect(size)) {
+                if (transmit(packet.data(), size)) {
+                    deliver(received.data(), false);
+                }
+                continue;
+            }
+
+            auto [message, messageSize] = encoder.protect(packet.data(), size);
+            if (transmit(message, messageSize)) {
+                auto payload =
+                    decoder.receiveData(received.data(), messageSize);
+                if (payload.has_value()) {
+                    deliver(payload->first, false);
+                }
+            }
+            if (encoder.isGroupComplete()) {
+                sendParity();
+            }
+        }
+
+        if (fec) {
+            if (encoder.hasOpenGroup()) {
+                sendParity();
+            }
+            // The server measures the loss on the other direction, the
+            // simulated link is symmetric
+            auto groupSize = ForwardErrorCorrection::getGroupSize(
+                lossEstimator.getLossRate());
+            encoder.setGroupSize(groupSize);
+        }
+    }
+
+    for (size_t id = 0; id < packetCount; id++) {
+        double latency = oneWayDelayMs;
+        if (!isDelivered[id]) {
+            results.lost++;
+            latency += retransmissionTimeoutMs;
+        } else if (isRecovered[id]) {
+            results.recovered++;
+            latency += batchDelayMs;
+        }
+        results.latencies.push_back(latency);
+    }
+    std::sort(results.latencies.begin(), results.latencies.end());
+    return results;
+}
+
+static double percentile(const std::vector<double> &values, double p) {
+    return values[std::min(values.size() - 1, size_t(values.size() * p))];
+}
+
+static double measureXorThroughput() {
+    std::vector<uint8_t> dst(mtu), src(mtu, 0x5a);
+    constexpr size_t iterations = 2'000'000;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        xorBlock(dst.data(), src.data(), mtu);
+        asm volatile("" : : "r"(dst.data()) : "memory");
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return iterations * mtu * 8 / elapsed.count() / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    size_t packetCount = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+
+    for (double lossRate : {0.01, 0.02, 0.03, 0.05}) {
+        for (bool fec : {false, true}) {
+            auto results = run(lossRate, fec, packetCount);
+            std::cout << "loss " << lossRate * 100 << "%"
+                      << (fec ? ", with FEC" : ", without FEC")
+                      << ": datagrams: " << results.datagrams
+                      << ", bytes: " << results.bytes
+                      << ", recovered: " << results.recovered
+                      << ", needing retransmission: " << results.lost
+                      << ", p99: " << percentile(results.latencies, 0.99)
+                      << " ms, p99.9: "
+                      << percentile(results.latencies, 0.999) << " ms"
+                      << std::endl;
+        }
+    }
+
+    std::cout << "XOR throughput: " << measureXorThroughput() << " Gbit/s"
+              << std::endl;
+    return 0;
+}
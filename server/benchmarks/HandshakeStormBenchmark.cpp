@@ -0,0 +1,129 @@
+#include "../HandshakeWorkerPool.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+// Simulates the reactor during a storm of encrypted handshakes: every loop
+// iteration forwards a batch of established session packets and takes in a
+// batch of new hellos. The key exchanges run either inline on the reactor or
+// on the worker pool, and the forwarding throughput and the longest loop
+// iteration are compared with a reactor that only forwards.
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t batchSize = 64;
+constexpr size_t packetSize = 1400;
+constexpr size_t maxPendingJobs = 1024;
+const std::string secret = "benchmark secret";
+
+struct Result {
+    size_t forwardedPackets = 0;
+    Clock::duration elapsed{0};
+    Clock::duration longestIteration{0};
+};
+
+class Forwarder {
+  public:
+    Forwarder()
+        : m_Sender(TunnelCipher::Algorithm::ChaCha20Poly1305, {}, {}),
+          m_Receiver(TunnelCipher::Algorithm::ChaCha20Poly1305, {}, {}),
+          m_Buffer(packetSize + TunnelCipher::overhead) {}
+
+    void forwardBatch() {
+        for (size_t i = 0; i < batchSize; i++) {
+            auto sealedSize = m_Sender.seal(m_Buffer.data(), packetSize);
+            m_Receiver.open(m_Buffer.data(), sealedSize);
+        }
+    }
+
+  private:
+    TunnelCipher m_Sender;
+    TunnelCipher m_Receiver;
+    std::vector<uint8_t> m_Buffer;
+};
+
+static KeyExchangeJob createJob(const X25519KeyPair &clientKeyPair) {
+    KeyExchangeJob job{};
+    job.clientNonce.fill(1);
+    job.clientPublicKey = clientKeyPair.getPublicKey();
+    return job;
+}
+
+static void exchangeKeysInline(const KeyExchangeJob &job) {
+    X25519KeyPair keyPair;
+    auto sharedSecret = keyPair.deriveSharedSecret(job.clientPublicKey.data());
+    std::array<uint8_t, 2 * HelloMessage::nonceSize> nonces{};
+    deriveSessionKeys(sharedSecret.value(), secret, nonces.data(),
+                      nonces.size());
+}
+
+// handshakes == 0 only forwards, for the given number of iterations
+static Result run(size_t handshakes, size_t iterations,
+                  HandshakeWorkerPool *pool) {
+    Forwarder forwarder;
+    X25519KeyPair clientKeyPair;
+    auto job = createJob(clientKeyPair);
+    size_t waitingHellos = handshakes;
+    size_t finishedHandshakes = 0;
+
+    Result result;
+    auto start = Clock::now();
+    for (size_t i = 0; i < iterations || finishedHandshakes < handshakes;
+         i++) {
+        auto iterationStart = Clock::now();
+        forwarder.forwardBatch();
+        result.forwardedPackets += batchSize;
+
+        // Shed hellos stay waiting, like a client that retries
+        size_t hellos = std::min(batchSize, waitingHellos);
+        for (size_t j = 0; j < hellos; j++) {
+            if (pool == nullptr) {
+                exchangeKeysInline(job);
+                finishedHandshakes++;
+                waitingHellos--;
+            } else if (pool->submit(job)) {
+                waitingHellos--;
+            }
+        }
+        if (pool != nullptr) {
+            pool->collect(
+                [&finishedHandshakes](const KeyExchangeResult &) {
+                    finishedHandshakes++;
+                });
+        }
+
+        result.longestIteration =
+            std::max(result.longestIteration, Clock::now() - iterationStart);
+    }
+    result.elapsed = Clock::now() - start;
+    return result;
+}
+
+static void print(const std::string &name, const Result &result) {
+    auto elapsed =
+        std::chrono::duration_cast<std::chrono::duration<double>>(
+            result.elapsed);
+    auto longest = std::chrono::duration_cast<std::chrono::microseconds>(
+        result.longestIteration);
+    std::cout << name << ": forwarding Gbit/s: "
+              << 8.0 * packetSize * result.forwardedPackets /
+                     elapsed.count() / 1e9
+              << ", elapsed s: " << elapsed.count()
+              << ", longest iteration us: " << longest.count() << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t handshakes = argc > 1 ? std::stoul(argv[1]) : 10'000;
+    size_t threads = argc > 2 ? std::stoul(argv[2]) : 2;
+
+    print("no handshakes", run(0, 20'000, nullptr));
+    print("inline key exchange", run(handshakes, 0, nullptr));
+
+    HandshakeWorkerPool pool(secret, threads, maxPendingJobs);
+    print("worker pool key exchange", run(handshakes, 0, &pool));
+    std::cout << "handshakes: " << handshakes << ", worker threads: "
+              << threads << ", shed hellos: " << pool.getShedJobs()
+              << std::endl;
+    return 0;
+}
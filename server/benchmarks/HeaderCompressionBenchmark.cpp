@@ -0,0 +1,120 @@
+#include "../HeaderCompression.h"
+#include "../TunnelCipher.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Sends small-packet workloads through the header compressor and decompressor
+// and compares the bytes on the wire, including the cipher overhead and the
+// outer IP/UDP header, with and without header compression. Every workload
+// interleaves packets of flowCount flows.
+
+constexpr size_t flowCount = 32;
+constexpr size_t outerHeaderSize = 28;
+constexpr size_t ipHeaderSize = 20;
+
+struct Workload {
+    const char *name;
+    bool isTcp;
+    size_t minPayloadSize;
+    size_t maxPayloadSize;
+};
+
+// TCP packets carry the 12-byte timestamps option, as Linux sends them
+static std::vector<uint8_t> createPacket(size_t flow, const Workload &workload,
+                                         size_t payloadSize, uint32_t sequence,
+                                         std::mt19937 &random) {
+    size_t transportHeaderSize = workload.isTcp ? 32 : 8;
+    size_t size = ipHeaderSize + transportHeaderSize + payloadSize;
+    std::vector<uint8_t> packet(size);
+    for (auto &byte : packet) {
+        byte = random();
+    }
+
+    packet[0] = 0x45;
+    packet[1] = 0;
+    packet[2] = size >> 8;
+    packet[3] = size & 0xff;
+    packet[6] = 0x40;
+    packet[7] = 0;
+    packet[8] = 64;
+    packet[9] = workload.isTcp ? 6 : 17;
+    uint8_t addresses[] = {10, 0, 0, 2, 93, 184, 0, uint8_t(flow)};
+    std::memcpy(packet.data() + 12, addresses, sizeof(addresses));
+
+    auto transport = packet.data() + ipHeaderSize;
+    transport[0] = 0xc0;
+    transport[1] = flow;
+    transport[2] = 0x01;
+    transport[3] = 0xbb;
+    if (workload.isTcp) {
+        transport[4] = sequence >> 24;
+        transport[5] = sequence >> 16;
+        transport[12] = (transportHeaderSize / 4) << 4;
+        transport[13] = 0x10;
+        transport[18] = 0;
+        transport[19] = 0;
+    } else {
+        size_t udpSize = transportHeaderSize + payloadSize;
+        transport[4] = udpSize >> 8;
+        transport[5] = udpSize & 0xff;
+    }
+    return packet;
+}
+
+static void run(const Workload &workload, size_t packetCount) {
+    std::mt19937 random(42);
+    std::uniform_int_distribution<size_t> flow(0, flowCount - 1);
+    std::uniform_int_distribution<size_t> payloadSize(workload.minPayloadSize,
+                                                      workload.maxPayloadSize);
+
+    std::vector<std::vector<uint8_t>> packets;
+    for (size_t i = 0; i < packetCount; i++) {
+        packets.push_back(createPacket(flow(random), workload,
+                                       payloadSize(random), i, random));
+    }
+
+    HeaderCompressor compressor;
+    HeaderDecompressor decompressor;
+    std::vector<uint8_t> message(2048);
+    std::vector<uint8_t> output(2048);
+    uint64_t bytesBefore = 0;
+    uint64_t bytesAfter = 0;
+    size_t failed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &packet : packets) {
+        auto messageSize =
+            compressor.compress(packet.data(), packet.size(), message.data());
+        auto packetSize = decompressor.decompress(
+            message.data(), messageSize, output.data(), output.size());
+        if (!packetSize.has_value() || packetSize.value() != packet.size()) {
+            failed++;
+        }
+        bytesBefore += packet.size() + TunnelCipher::overhead + outerHeaderSize;
+        bytesAfter += messageSize + TunnelCipher::overhead + outerHeaderSize;
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << workload.name << ": bytes on the wire: " << bytesBefore
+              << " -> " << bytesAfter << ", saved: "
+              << 100.0 * (bytesBefore - bytesAfter) / bytesBefore
+              << "%, compress and decompress: "
+              << elapsed.count() / packetCount << " ns/packet"
+              << (failed > 0 ? ", FAILED: " + std::to_string(failed) : "")
+              << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t packetCount = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+
+    run({"TCP ACKs", true, 0, 0}, packetCount);
+    run({"interactive TCP", true, 1, 100}, packetCount);
+    run({"VoIP (RTP over UDP)", false, 172, 172}, packetCount);
+    run({"game updates over UDP", false, 20, 120}, packetCount);
+    return 0;
+}
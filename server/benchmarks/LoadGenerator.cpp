@@ -0,0 +1,550 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <optional>
+#include <poll.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Simulates a large number of clients of a ToyVpnServer running on the same
+// machine, for capacity planning. Every client does the plaintext secret
+// handshake (with a cookie round trip if the server asks for one), then sends
+// a keepalive and a data packet every keepaliveInterval, and finally the
+// DISCONNECT control message. With churn, established clients disconnect and
+// new ones connect in their place.
+//
+// A client is a source address and port on loopback. A few sockets, each on
+// its own port, send from any address of 127.0.0.0/8 with IP_PKTINFO, so
+// millions of clients need no more than socketCount file descriptors. The
+// server's private network has to be large enough for all the sessions,
+// e.g. --private-network 10.0.0.0/12.
+//
+// Every second the established sessions, the handshake rate and the server's
+// RSS are printed, and at the end the handshake latency percentiles and the
+// success rate.
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t socketCount = 64;
+constexpr size_t maxInFlightHandshakes = 1024;
+constexpr int maxHandshakeAttempts = 5;
+constexpr auto handshakeTimeout = std::chrono::seconds(1);
+constexpr auto keepaliveInterval = std::chrono::seconds(10);
+constexpr auto reportInterval = std::chrono::seconds(1);
+constexpr uint32_t firstClientAddress = 0x7f010000; // 127.1.0.0
+constexpr size_t dataPacketSize = 64;
+constexpr size_t cookieSize = 16;
+const std::string disconnectMessage = "DISCONNECT";
+
+struct Client {
+    enum class State { Idle, Handshaking, Established, Disconnected, Failed };
+
+    State state = State::Idle;
+    int attempts = 0;
+    Clock::time_point handshakeStart;
+    Clock::time_point lastSent;
+    // The VPN address the server gave the client, in network byte order
+    uint32_t vpnAddress = 0;
+    std::vector<uint8_t> cookie;
+};
+
+struct Totals {
+    uint64_t handshakesSucceeded = 0;
+    uint64_t handshakesFailed = 0;
+    uint64_t retransmissions = 0;
+    uint64_t cookies = 0;
+    uint64_t dataSent = 0;
+    uint64_t dataReceived = 0;
+    uint64_t disconnects = 0;
+    uint64_t serverDisconnects = 0;
+    std::vector<double> handshakeLatencies;
+};
+
+static double percentile(const std::vector<double> &values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    return values[std::min(values.size() - 1, size_t(values.size() * p))];
+}
+
+static std::optional<pid_t> findServer() {
+    DIR *proc = opendir("/proc");
+    if (proc == nullptr) {
+        return std::nullopt;
+    }
+    std::optional<pid_t> pid;
+    while (auto entry = readdir(proc)) {
+        std::ifstream comm(std::string("/proc/") + entry->d_name + "/comm");
+        std::string name;
+        if (std::getline(comm, name) && name == "ToyVpnServer") {
+            pid = std::stoi(entry->d_name);
+            break;
+        }
+    }
+    closedir(proc);
+    return pid;
+}
+
+// In MB, 0 if the server isn't known or has exited
+static double getRss(std::optional<pid_t> pid) {
+    if (!pid.has_value()) {
+        return 0;
+    }
+    std::ifstream status("/proc/" + std::to_string(pid.value()) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) {
+            return std::stod(line.substr(6)) / 1024;
+        }
+    }
+    return 0;
+}
+
+static uint16_t ipChecksum(const uint8_t *data, size_t size) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+class LoadGenerator {
+  public:
+    LoadGenerator(uint16_t serverPort, const std::string &secret)
+        : m_Hello(1, 0) {
+        m_Hello.insert(m_Hello.end(), secret.begin(), secret.end());
+        m_ServerAddress.sin_family = AF_INET;
+        m_ServerAddress.sin_port = htons(serverPort);
+        m_ServerAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        for (size_t i = 0; i < socketCount; i++) {
+            int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            int flag = 1;
+            int bufferSize = 8 * 1024 * 1024;
+            if (fd < 0 ||
+                setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &flag, sizeof(flag)) <
+                    0) {
+                throw std::runtime_error("Couldn't create a client socket");
+            }
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize,
+                       sizeof(bufferSize));
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize,
+                       sizeof(bufferSize));
+            // Bound to every address, so replies to any client address of
+            // the socket's port come to it
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            if (bind(fd, reinterpret_cast<sockaddr *>(&address),
+                     sizeof(address)) < 0) {
+                throw std::runtime_error("Couldn't bind a client socket");
+            }
+            m_Polls.push_back({fd, POLLIN, 0});
+        }
+    }
+
+    LoadGenerator(const LoadGenerator &) = delete;
+    LoadGenerator &operator=(const LoadGenerator &) = delete;
+
+    virtual ~LoadGenerator() {
+        for (auto &socketPoll : m_Polls) {
+            close(socketPoll.fd);
+        }
+    }
+
+    // Connects clientCount clients at up to connectRate per second (0 for as
+    // fast as the in-flight limit allows), keeps them for holdTime while
+    // replacing churnRate of them per second, then disconnects them all
+    void run(size_t clientCount, double connectRate, Clock::duration holdTime,
+             double churnRate, std::optional<pid_t> serverPid) {
+        auto start = Clock::now();
+        auto nextReport = start + reportInterval;
+        std::optional<Clock::time_point> holdStart;
+        size_t started = 0;
+        double churned = 0;
+        uint64_t lastSucceeded = 0;
+        double peakRss = 0;
+
+        std::cout << "time_s established handshakes_per_s failed rss_mb"
+                  << std::endl;
+        while (true) {
+            auto now = Clock::now();
+            double seconds =
+                std::chrono::duration<double>(now - start).count();
+
+            // New clients, and the replacements of churned ones while
+            // holding
+            size_t target = clientCount + static_cast<size_t>(churned);
+            if (holdStart.has_value() && now - holdStart.value() < holdTime) {
+                double holdSeconds =
+                    std::chrono::duration<double>(now - holdStart.value())
+                        .count();
+                while (churned < churnRate * holdSeconds &&
+                       !m_EstablishedQueue.empty()) {
+                    churnOne();
+                    churned++;
+                }
+                target = clientCount + static_cast<size_t>(churned);
+            }
+            while (started < target &&
+                   m_HandshakeQueue.size() < maxInFlightHandshakes &&
+                   (connectRate <= 0 || started < connectRate * seconds)) {
+                startHandshake(m_Clients.size(), now);
+                started++;
+            }
+
+            retransmitHellos(now);
+            sendKeepalives(now);
+            receive(now);
+
+            if (now >= nextReport) {
+                auto rss = getRss(serverPid);
+                peakRss = std::max(peakRss, rss);
+                std::cout << std::fixed << std::setprecision(1) << seconds
+                          << " " << m_EstablishedCount << " "
+                          << m_Totals.handshakesSucceeded - lastSucceeded
+                          << " " << m_Totals.handshakesFailed << " " << rss
+                          << std::endl;
+                lastSucceeded = m_Totals.handshakesSucceeded;
+                nextReport += reportInterval;
+            }
+
+            if (!holdStart.has_value() && started == clientCount &&
+                m_HandshakeQueue.empty()) {
+                holdStart = now;
+                std::cout << "# all handshakes done after " << seconds
+                          << " s, holding" << std::endl;
+            }
+            if (holdStart.has_value() && now - holdStart.value() >= holdTime &&
+                m_HandshakeQueue.empty()) {
+                break;
+            }
+        }
+
+        disconnectAll();
+        printSummary(peakRss);
+    }
+
+  private:
+    std::vector<uint8_t> m_Hello;
+    sockaddr_in m_ServerAddress{};
+    std::vector<pollfd> m_Polls;
+    std::vector<Client> m_Clients;
+    // Clients in the order their next hello or keepalive is due, which is
+    // the order they were sent in
+    std::deque<size_t> m_HandshakeQueue;
+    std::deque<size_t> m_EstablishedQueue;
+    size_t m_EstablishedCount = 0;
+    Totals m_Totals;
+    std::mt19937 m_Random{1};
+
+    static size_t getSocket(size_t client) { return client % socketCount; }
+
+    static uint32_t getAddress(size_t client) {
+        return htonl(firstClientAddress + client / socketCount);
+    }
+
+    void send(size_t client, const uint8_t *data, size_t size) {
+        iovec iov{const_cast<uint8_t *>(data), size};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(in_pktinfo))] = {};
+        msghdr message{};
+        message.msg_name = &m_ServerAddress;
+        message.msg_namelen = sizeof(m_ServerAddress);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = IPPROTO_IP;
+        header->cmsg_type = IP_PKTINFO;
+        header->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+        in_pktinfo info{};
+        info.ipi_spec_dst.s_addr = getAddress(client);
+        memcpy(CMSG_DATA(header), &info, sizeof(info));
+        sendmsg(m_Polls[getSocket(client)].fd, &message, 0);
+        m_Clients[client].lastSent = Clock::now();
+    }
+
+    void sendHello(size_t client) {
+        auto &cookie = m_Clients[client].cookie;
+        if (cookie.empty()) {
+            send(client, m_Hello.data(), m_Hello.size());
+            return;
+        }
+        std::vector<uint8_t> echo = cookie;
+        echo.insert(echo.end(), m_Hello.begin(), m_Hello.end());
+        send(client, echo.data(), echo.size());
+    }
+
+    void startHandshake(size_t client, const Clock::time_point &now) {
+        if (client == m_Clients.size()) {
+            m_Clients.emplace_back();
+        }
+        auto &state = m_Clients[client];
+        state.state = Client::State::Handshaking;
+        state.attempts = 1;
+        state.handshakeStart = now;
+        sendHello(client);
+        m_HandshakeQueue.push_back(client);
+    }
+
+    void retransmitHellos(const Clock::time_point &now) {
+        while (!m_HandshakeQueue.empty()) {
+            auto client = m_HandshakeQueue.front();
+            auto &state = m_Clients[client];
+            if (state.state != Client::State::Handshaking) {
+                m_HandshakeQueue.pop_front();
+                continue;
+            }
+            if (now - state.lastSent < handshakeTimeout) {
+                break;
+            }
+            m_HandshakeQueue.pop_front();
+            if (state.attempts == maxHandshakeAttempts) {
+                state.state = Client::State::Failed;
+                m_Totals.handshakesFailed++;
+                continue;
+            }
+            state.attempts++;
+            m_Totals.retransmissions++;
+            sendHello(client);
+            m_HandshakeQueue.push_back(client);
+        }
+    }
+
+    void sendKeepalives(const Clock::time_point &now) {
+        while (!m_EstablishedQueue.empty()) {
+            auto client = m_EstablishedQueue.front();
+            auto &state = m_Clients[client];
+            if (state.state != Client::State::Established) {
+                m_EstablishedQueue.pop_front();
+                continue;
+            }
+            if (now - state.lastSent < keepaliveInterval) {
+                break;
+            }
+            m_EstablishedQueue.pop_front();
+            uint8_t keepalive = 0;
+            send(client, &keepalive, 1);
+            sendData(client);
+            m_EstablishedQueue.push_back(client);
+        }
+    }
+
+    // A UDP packet from the client's VPN address to itself, which the server
+    // writes to the TUN interface and the kernel routes back to it
+    void sendData(size_t client) {
+        std::array<uint8_t, dataPacketSize> packet{};
+        auto address = m_Clients[client].vpnAddress;
+        packet[0] = 0x45;
+        uint16_t totalLength = htons(packet.size());
+        memcpy(&packet[2], &totalLength, 2);
+        packet[8] = 64;
+        packet[9] = IPPROTO_UDP;
+        memcpy(&packet[12], &address, 4);
+        memcpy(&packet[16], &address, 4);
+        uint16_t checksum = htons(ipChecksum(packet.data(), 20));
+        memcpy(&packet[10], &checksum, 2);
+        uint16_t port = htons(9);
+        uint16_t udpLength = htons(packet.size() - 20);
+        memcpy(&packet[20], &port, 2);
+        memcpy(&packet[22], &port, 2);
+        memcpy(&packet[24], &udpLength, 2);
+        send(client, packet.data(), packet.size());
+        m_Totals.dataSent++;
+    }
+
+    void sendDisconnect(size_t client) {
+        std::vector<uint8_t> message = {0};
+        message.insert(message.end(), disconnectMessage.begin(),
+                       disconnectMessage.end());
+        send(client, message.data(), message.size());
+        m_Clients[client].state = Client::State::Disconnected;
+        m_EstablishedCount--;
+        m_Totals.disconnects++;
+    }
+
+    // Disconnects a random established client. Its replacement connects from
+    // a new address, like a new device would.
+    void churnOne() {
+        for (int i = 0; i < 8; i++) {
+            auto position = std::uniform_int_distribution<size_t>(
+                0, m_EstablishedQueue.size() - 1)(m_Random);
+            auto client = m_EstablishedQueue[position];
+            if (m_Clients[client].state == Client::State::Established) {
+                sendDisconnect(client);
+                return;
+            }
+        }
+    }
+
+    void disconnectAll() {
+        for (size_t client = 0; client < m_Clients.size(); client++) {
+            if (m_Clients[client].state == Client::State::Established) {
+                sendDisconnect(client);
+            }
+        }
+    }
+
+    void receive(const Clock::time_point &now) {
+        if (poll(m_Polls.data(), m_Polls.size(), 1) <= 0) {
+            return;
+        }
+
+        std::array<uint8_t, 2048> buffer;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(in_pktinfo))];
+        for (size_t socketIndex = 0; socketIndex < m_Polls.size();
+             socketIndex++) {
+            if (!(m_Polls[socketIndex].revents & POLLIN)) {
+                continue;
+            }
+            while (true) {
+                iovec iov{buffer.data(), buffer.size()};
+                msghdr message{};
+                message.msg_iov = &iov;
+                message.msg_iovlen = 1;
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                auto size = recvmsg(m_Polls[socketIndex].fd, &message, 0);
+                if (size <= 0) {
+                    break;
+                }
+
+                auto header = CMSG_FIRSTHDR(&message);
+                if (header == nullptr || header->cmsg_type != IP_PKTINFO) {
+                    continue;
+                }
+                in_pktinfo info;
+                memcpy(&info, CMSG_DATA(header), sizeof(info));
+                auto addressIndex =
+                    ntohl(info.ipi_addr.s_addr) - firstClientAddress;
+                auto client = addressIndex * socketCount + socketIndex;
+                if (client < m_Clients.size()) {
+                    handleMessage(client, buffer.data(), size, now);
+                }
+            }
+        }
+    }
+
+    void handleMessage(size_t client, const uint8_t *data, size_t size,
+                       const Clock::time_point &now) {
+        auto &state = m_Clients[client];
+        if (data[0] == 1 && size == 1 + cookieSize &&
+            state.state == Client::State::Handshaking) {
+            state.cookie.assign(data, data + size);
+            m_Totals.cookies++;
+            sendHello(client);
+            return;
+        }
+
+        if (data[0] == 0 && size > 1) {
+            std::string text(reinterpret_cast<const char *>(data + 1),
+                             size - 1);
+            if (text == disconnectMessage) {
+                if (state.state == Client::State::Established) {
+                    state.state = Client::State::Disconnected;
+                    m_EstablishedCount--;
+                    m_Totals.serverDisconnects++;
+                }
+                return;
+            }
+
+            auto start = text.find("a,");
+            auto end = text.find(',', start + 2);
+            if (state.state != Client::State::Handshaking ||
+                start == std::string::npos || end == std::string::npos ||
+                inet_pton(AF_INET,
+                          text.substr(start + 2, end - start - 2).c_str(),
+                          &state.vpnAddress) != 1) {
+                return;
+            }
+            state.state = Client::State::Established;
+            state.cookie.clear();
+            m_EstablishedCount++;
+            m_Totals.handshakesSucceeded++;
+            m_Totals.handshakeLatencies.push_back(
+                std::chrono::duration<double, std::milli>(
+                    now - state.handshakeStart)
+                    .count());
+            m_EstablishedQueue.push_back(client);
+            return;
+        }
+
+        if ((data[0] >> 4) == 4) {
+            m_Totals.dataReceived++;
+        }
+    }
+
+    void printSummary(double peakRss) {
+        auto &latencies = m_Totals.handshakeLatencies;
+        std::sort(latencies.begin(), latencies.end());
+        auto attempted = m_Totals.handshakesSucceeded +
+                         m_Totals.handshakesFailed;
+        std::cout << std::setprecision(3) << "handshakes: "
+                  << m_Totals.handshakesSucceeded << " succeeded, "
+                  << m_Totals.handshakesFailed << " failed, success rate "
+                  << (attempted > 0 ? 100.0 * m_Totals.handshakesSucceeded /
+                                          attempted
+                                    : 0)
+                  << "%, " << m_Totals.retransmissions
+                  << " hello retransmissions, " << m_Totals.cookies
+                  << " cookies\n"
+                  << "handshake latency: p50 " << percentile(latencies, 0.5)
+                  << " ms, p90 " << percentile(latencies, 0.9) << " ms, p99 "
+                  << percentile(latencies, 0.99) << " ms, p99.9 "
+                  << percentile(latencies, 0.999) << " ms, max "
+                  << (latencies.empty() ? 0 : latencies.back()) << " ms\n"
+                  << "data packets: " << m_Totals.dataSent << " sent, "
+                  << m_Totals.dataReceived << " echoed\n"
+                  << "disconnects: " << m_Totals.disconnects << " sent, "
+                  << m_Totals.serverDisconnects << " by the server\n"
+                  << "peak server RSS: " << peakRss << " MB" << std::endl;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <server port> <secret> [clients] [connects per second] "
+                     "[hold seconds] [churn per second] [server pid]"
+                  << std::endl;
+        return 1;
+    }
+
+    auto serverPort = static_cast<uint16_t>(std::stoul(argv[1]));
+    std::string secret = argv[2];
+    size_t clients = argc > 3 ? std::stoul(argv[3]) : 100'000;
+    double connectRate = argc > 4 ? std::stod(argv[4]) : 0;
+    auto holdTime = std::chrono::seconds(argc > 5 ? std::stoul(argv[5]) : 30);
+    double churnRate = argc > 6 ? std::stod(argv[6]) : 0;
+    std::optional<pid_t> serverPid =
+        argc > 7 ? std::optional<pid_t>(std::stoi(argv[7])) : findServer();
+    if (!serverPid.has_value()) {
+        std::cerr << "ToyVpnServer isn't running here, its RSS won't be "
+                     "reported"
+                  << std::endl;
+    }
+
+    try {
+        LoadGenerator generator(serverPort, secret);
+        generator.run(clients, connectRate, holdTime, churnRate, serverPid);
+    } catch (const std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,444 @@
+#include "../InMemoryIo.h"
+#include "../ToyVpnServer.h"
+#include "../Utils.h"
+#include "../libs/pcapplusplus/include/pcapplusplus/IPv4Layer.h"
+#include "../libs/pcapplusplus/include/pcapplusplus/Packet.h"
+#include "../libs/pcapplusplus/include/pcapplusplus/PcapFileDevice.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Replays captures written with --save-to-files through the forwarding path
+// of a ToyVpnServer that runs on an in-memory TUN interface and socket, so
+// real traffic mixes can be profiled on any machine without root.
+//
+// Every capture holds the traffic of one client and is named after its VPN
+// address, like 10-0-0-2.pcapng. Each becomes a client that does the
+// plaintext handshake. The packets from the client's address are then sent
+// to the server as that client's datagrams and the others are injected into
+// the TUN interface, with the captured address replaced by the one the
+// server gave the client. The packets of all captures are replayed in the
+// order of their timestamps, as fast as the server takes them or at the
+// recorded timing sped up by a factor, in which case clients that were
+// silent for longer than the idle timeout are evicted like in production.
+//
+// At the end the packets delivered in each direction and the throughput from
+// the first packet to the last delivered one are printed.
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto handshakeTimeout = std::chrono::seconds(5);
+constexpr auto settleTime = std::chrono::milliseconds(100);
+constexpr size_t maxClients = 65536;
+const std::string secret = "replay";
+
+struct CapturedPacket {
+    uint64_t timestamp;
+    size_t client;
+    bool isFromClient;
+    // The IPv4 packet without whatever link layer it was captured with
+    std::vector<uint8_t> data;
+};
+
+struct ReplayClient {
+    std::string captureName;
+    pcpp::IPv4Address capturedAddress;
+    pcpp::IPv4Address vpnAddress;
+    sockaddr_in6 externalAddress{};
+    bool isConnected = false;
+};
+
+struct DirectionCounters {
+    uint64_t sent = 0;
+    uint64_t sentBytes = 0;
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> deliveredBytes{0};
+};
+
+class CaptureReplay {
+  public:
+    CaptureReplay()
+        : m_TunInterfaceName("replay0"), m_PrivateNetwork("10.0.0.0/8"),
+          m_Route("0.0.0.0/0"),
+          m_Config(ToyVpnConfiguration::withDefaults(
+              m_TunInterfaceName, m_PrivateNetwork, m_Route, secret)),
+          m_TunInterface(m_PrivateNetwork,
+                         [this](const uint8_t *data, size_t dataSize) {
+                             handleTunPacket(data, dataSize);
+                         }),
+          m_ServerSocket([this](const uint8_t *data, size_t dataSize,
+                                const sockaddr_in6 &sendTo) {
+              handleDatagram(data, dataSize, sendTo);
+          }),
+          m_Server(m_Config, m_TunInterface, m_ServerSocket) {}
+
+    virtual ~CaptureReplay() { stopServer(); }
+
+    void load(const std::string &captureName) {
+        if (m_Clients.size() == maxClients) {
+            throw std::runtime_error("Can't replay more than " +
+                                     std::to_string(maxClients) + " captures");
+        }
+
+        ReplayClient client;
+        client.captureName = captureName;
+        auto stem = std::filesystem::path(captureName).stem().string();
+        std::replace(stem.begin(), stem.end(), '-', '.');
+        try {
+            client.capturedAddress = pcpp::IPv4Address(stem);
+        } catch (const std::exception &) {
+        }
+        if (client.capturedAddress == pcpp::IPv4Address::Zero) {
+            throw std::runtime_error("Can't tell the client of " +
+                                     captureName + " from its name");
+        }
+
+        // Every client gets its own address in 198.18.0.0/16
+        auto index = m_Clients.size();
+        client.externalAddress.sin6_family = AF_INET6;
+        client.externalAddress.sin6_addr.s6_addr[10] = 0xff;
+        client.externalAddress.sin6_addr.s6_addr[11] = 0xff;
+        client.externalAddress.sin6_addr.s6_addr[12] = 198;
+        client.externalAddress.sin6_addr.s6_addr[13] = 18;
+        client.externalAddress.sin6_addr.s6_addr[14] = index >> 8;
+        client.externalAddress.sin6_addr.s6_addr[15] = index;
+        client.externalAddress.sin6_port = htons(40000);
+
+        std::unique_ptr<pcpp::IFileReaderDevice> reader(
+            pcpp::IFileReaderDevice::getReader(captureName));
+        if (!reader || !reader->open()) {
+            throw std::runtime_error("Couldn't open " + captureName);
+        }
+
+        pcpp::RawPacket rawPacket;
+        while (reader->getNextPacket(rawPacket)) {
+            pcpp::Packet packet(&rawPacket);
+            auto ipv4Layer = packet.getLayerOfType<pcpp::IPv4Layer>();
+            if (ipv4Layer == nullptr) {
+                m_SkippedCount++;
+                continue;
+            }
+
+            bool isFromClient =
+                ipv4Layer->getSrcIPv4Address() == client.capturedAddress;
+            if (!isFromClient &&
+                ipv4Layer->getDstIPv4Address() != client.capturedAddress) {
+                m_SkippedCount++;
+                continue;
+            }
+
+            auto timestamp = rawPacket.getPacketTimeStamp();
+            m_Packets.push_back(
+                {static_cast<uint64_t>(timestamp.tv_sec) * 1'000'000'000 +
+                     timestamp.tv_nsec,
+                 index, isFromClient,
+                 std::vector<uint8_t>(ipv4Layer->getData(),
+                                      ipv4Layer->getData() +
+                                          ipv4Layer->getDataLen())});
+        }
+        reader->close();
+
+        m_ClientIndexes[client.externalAddress] = index;
+        m_Clients.push_back(client);
+    }
+
+    // Replays at the recorded timing sped up by the given factor, or as fast
+    // as possible if it is 0
+    void run(double speed) {
+        if (m_Packets.empty()) {
+            throw std::runtime_error("The captures hold no packets to replay");
+        }
+
+        m_IsServerRunning = true;
+        m_ServerThread = std::thread([this]() {
+            try {
+                m_Server.start();
+            } catch (...) {
+                m_ServerError = std::current_exception();
+            }
+            m_IsServerRunning = false;
+        });
+
+        connectClients();
+        rewriteAddresses();
+        std::stable_sort(m_Packets.begin(), m_Packets.end(),
+                         [](const CapturedPacket &a, const CapturedPacket &b) {
+                             return a.timestamp < b.timestamp;
+                         });
+
+        auto startTime = Clock::now();
+        replayPackets(speed, startTime);
+        waitForDelivery();
+        auto endTime =
+            m_LastDeliveryTime != 0
+                ? Clock::time_point(Clock::duration(m_LastDeliveryTime))
+                : Clock::now();
+        std::chrono::duration<double> elapsed = endTime - startTime;
+        stopServer();
+        if (m_ServerError) {
+            std::rethrow_exception(m_ServerError);
+        }
+
+        report(elapsed.count());
+    }
+
+  private:
+    std::string m_TunInterfaceName;
+    pcpp::IPv4Network m_PrivateNetwork;
+    pcpp::IPv4Network m_Route;
+    ToyVpnConfiguration m_Config;
+    InMemoryTunInterface m_TunInterface;
+    InMemoryServerSocket m_ServerSocket;
+    ToyVpnServer m_Server;
+    std::thread m_ServerThread;
+    std::atomic<bool> m_IsServerRunning{false};
+    std::exception_ptr m_ServerError;
+
+    std::vector<ReplayClient> m_Clients;
+    // Only written before the replay starts, so the reactor reads it freely
+    std::unordered_map<sockaddr_in6, size_t, sockaddrIn6Hash, sockaddrIn6Equal>
+        m_ClientIndexes;
+    std::vector<CapturedPacket> m_Packets;
+    uint64_t m_SkippedCount = 0;
+
+    std::mutex m_HandshakeMutex;
+    std::condition_variable m_HandshakeDone;
+    size_t m_ConnectedCount = 0;
+
+    DirectionCounters m_FromClients;
+    DirectionCounters m_ToClients;
+    std::atomic<Clock::rep> m_LastDeliveryTime{0};
+
+    // Runs on the reactor
+    void handleDatagram(const uint8_t *data, size_t dataSize,
+                        const sockaddr_in6 &sendTo) {
+        if (dataSize == 0) {
+            return;
+        }
+
+        if ((data[0] >> 4) == 4) {
+            delivered(m_ToClients, dataSize);
+            return;
+        }
+
+        auto client = m_ClientIndexes.find(sendTo);
+        if (data[0] != 0 || client == m_ClientIndexes.end()) {
+            return;
+        }
+
+        // The parameters, like "a,10.0.0.2,32 r,0.0.0.0,0 m,1400"
+        std::string params(reinterpret_cast<const char *>(data + 1),
+                           dataSize - 1);
+        auto addressStart = params.find("a,");
+        if (addressStart == std::string::npos) {
+            return;
+        }
+        addressStart += 2;
+        auto addressEnd = params.find(',', addressStart);
+
+        std::lock_guard<std::mutex> lock(m_HandshakeMutex);
+        auto &replayClient = m_Clients[client->second];
+        if (replayClient.isConnected) {
+            return;
+        }
+        replayClient.vpnAddress = pcpp::IPv4Address(
+            params.substr(addressStart, addressEnd - addressStart));
+        replayClient.isConnected = true;
+        m_ConnectedCount++;
+        m_HandshakeDone.notify_one();
+    }
+
+    void handleTunPacket(const uint8_t *data, size_t dataSize) {
+        delivered(m_FromClients, dataSize);
+    }
+
+    void delivered(DirectionCounters &counters, size_t dataSize) {
+        counters.delivered.fetch_add(1, std::memory_order_relaxed);
+        counters.deliveredBytes.fetch_add(dataSize, std::memory_order_relaxed);
+        m_LastDeliveryTime.store(Clock::now().time_since_epoch().count(),
+                                 std::memory_order_relaxed);
+    }
+
+    void connectClients() {
+        std::vector<uint8_t> hello{0};
+        hello.insert(hello.end(), secret.begin(), secret.end());
+        for (const auto &client : m_Clients) {
+            m_ServerSocket.inject(hello.data(), hello.size(),
+                                  client.externalAddress);
+        }
+
+        std::unique_lock<std::mutex> lock(m_HandshakeMutex);
+        if (!m_HandshakeDone.wait_for(lock, handshakeTimeout, [this]() {
+                return m_ConnectedCount == m_Clients.size() ||
+                       !m_IsServerRunning;
+            }) ||
+            m_ConnectedCount != m_Clients.size()) {
+            lock.unlock();
+            stopServer();
+            if (m_ServerError) {
+                std::rethrow_exception(m_ServerError);
+            }
+            throw std::runtime_error(
+                "Only " + std::to_string(m_ConnectedCount) + " of " +
+                std::to_string(m_Clients.size()) + " clients connected");
+        }
+    }
+
+    // Moves the packets to the addresses the server gave the clients
+    void rewriteAddresses() {
+        timespec timestamp{};
+        for (auto &capturedPacket : m_Packets) {
+            const auto &client = m_Clients[capturedPacket.client];
+            pcpp::RawPacket rawPacket(capturedPacket.data.data(),
+                                      capturedPacket.data.size(), timestamp,
+                                      false, pcpp::LINKTYPE_DLT_RAW1);
+            pcpp::Packet packet(&rawPacket);
+            auto ipv4Layer = packet.getLayerOfType<pcpp::IPv4Layer>();
+            if (capturedPacket.isFromClient) {
+                ipv4Layer->setSrcIPv4Address(client.vpnAddress);
+            } else {
+                ipv4Layer->setDstIPv4Address(client.vpnAddress);
+            }
+            // The TCP and UDP checksums cover the addresses too
+            packet.computeCalculateFields();
+        }
+    }
+
+    void replayPackets(double speed, const Clock::time_point &startTime) {
+        auto firstTimestamp = m_Packets.front().timestamp;
+        for (const auto &packet : m_Packets) {
+            if (speed > 0) {
+                std::chrono::duration<double, std::nano> offset(
+                    (packet.timestamp - firstTimestamp) / speed);
+                std::this_thread::sleep_until(
+                    startTime +
+                    std::chrono::duration_cast<Clock::duration>(offset));
+            }
+
+            if (packet.isFromClient) {
+                m_FromClients.sent++;
+                m_FromClients.sentBytes += packet.data.size();
+                m_ServerSocket.inject(
+                    packet.data.data(), packet.data.size(),
+                    m_Clients[packet.client].externalAddress);
+            } else {
+                m_ToClients.sent++;
+                m_ToClients.sentBytes += packet.data.size();
+                m_TunInterface.inject(packet.data.data(), packet.data.size());
+            }
+        }
+    }
+
+    // Done when everything arrived, or nothing more did for settleTime after
+    // the server read the last packet, e.g. because it dropped some
+    void waitForDelivery() {
+        auto isDelivered = [this]() {
+            return m_FromClients.delivered == m_FromClients.sent &&
+                   m_ToClients.delivered == m_ToClients.sent;
+        };
+        uint64_t lastDelivered = 0;
+        auto lastChange = Clock::now();
+        while (!isDelivered() && m_IsServerRunning) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            auto now = Clock::now();
+            auto totalDelivered =
+                m_FromClients.delivered + m_ToClients.delivered;
+            if (totalDelivered != lastDelivered ||
+                m_ServerSocket.getQueuedCount() != 0 ||
+                m_TunInterface.getQueuedCount() != 0) {
+                lastDelivered = totalDelivered;
+                lastChange = now;
+            } else if (now - lastChange > settleTime) {
+                break;
+            }
+        }
+    }
+
+    void stopServer() {
+        if (!m_ServerThread.joinable()) {
+            return;
+        }
+        // The server is stopped on the reactor, like by a signal
+        m_ServerSocket.post([this]() { m_Server.stop(); });
+        m_ServerThread.join();
+    }
+
+    void report(double elapsedSeconds) const {
+        std::cout << "Replayed " << m_Packets.size() << " packets of "
+                  << m_Clients.size() << " clients in " << std::fixed
+                  << std::setprecision(3) << elapsedSeconds << " s";
+        if (m_SkippedCount > 0) {
+            std::cout << ", skipped " << m_SkippedCount
+                      << " that weren't IPv4 packets of their client";
+        }
+        std::cout << "\n";
+        reportDirection("From clients to the TUN interface", m_FromClients,
+                        elapsedSeconds);
+        reportDirection("From the TUN interface to clients", m_ToClients,
+                        elapsedSeconds);
+    }
+
+    static void reportDirection(const std::string &name,
+                                const DirectionCounters &counters,
+                                double elapsedSeconds) {
+        uint64_t delivered = counters.delivered;
+        uint64_t deliveredBytes = counters.deliveredBytes;
+        std::cout << name << ": " << delivered << " of " << counters.sent
+                  << " packets delivered, " << std::setprecision(0)
+                  << delivered / elapsedSeconds << " packets/s, "
+                  << std::setprecision(1)
+                  << deliveredBytes * 8 / elapsedSeconds / 1e6 << " Mbit/s\n";
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <speed, 0 for as fast as possible> "
+                     "<capture file or directory>..."
+                  << std::endl;
+        return 1;
+    }
+
+    double speed = std::stod(argv[1]);
+    AixLog::Log::init<AixLog::SinkCout>(AixLog::Severity::error);
+
+    try {
+        CaptureReplay replay;
+        for (int i = 2; i < argc; i++) {
+            if (!std::filesystem::is_directory(argv[i])) {
+                replay.load(argv[i]);
+                continue;
+            }
+
+            std::vector<std::string> captures;
+            for (const auto &entry :
+                 std::filesystem::directory_iterator(argv[i])) {
+                if (entry.path().extension() == ".pcapng") {
+                    captures.push_back(entry.path().string());
+                }
+            }
+            std::sort(captures.begin(), captures.end());
+            for (const auto &capture : captures) {
+                replay.load(capture);
+            }
+        }
+        replay.run(speed);
+    } catch (const std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "../StageLatency.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Measures what the TOYVPN_STAGE_LATENCY instrumentation costs: the average
+// time of a stage around nothing, sampled or not, against the time the
+// reactor spends on a packet, approximated by a sendto and recvfrom over
+// loopback. A packet from a client goes through 5 timed stages (socket
+// receive, session lookup, open, TUN send and capture enqueue with
+// --save-to-files).
+
+constexpr size_t stagesPerPacket = 5;
+constexpr size_t packetSize = 1200;
+
+static double measureTimedStage(size_t iterations) {
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        sum += timeStage(LatencyStage::SessionLookup, [&]() { return i; });
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    asm volatile("" : : "r"(sum));
+    return elapsed.count() / iterations;
+}
+
+static double measurePacket(size_t iterations, bool timed) {
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressSize = sizeof(address);
+    if (receiver < 0 || sender < 0 ||
+        bind(receiver, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+        getsockname(receiver, reinterpret_cast<sockaddr *>(&address),
+                    &addressSize) < 0) {
+        throw std::runtime_error("Couldn't set up the loopback sockets");
+    }
+
+    std::vector<uint8_t> packet(packetSize, 0x5a);
+    std::vector<uint8_t> buffer(2048);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        auto send = [&]() {
+            return sendto(sender, packet.data(), packet.size(), 0,
+                          reinterpret_cast<sockaddr *>(&address),
+                          sizeof(address));
+        };
+        auto receive = [&]() {
+            return recv(receiver, buffer.data(), buffer.size(), 0);
+        };
+        if (timed) {
+            timeStage(LatencyStage::SocketSend, send);
+            timeStage(LatencyStage::SocketReceive, receive);
+        } else {
+            send();
+            receive();
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    close(sender);
+    close(receiver);
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+
+    std::cout << "TSC: " << TscClock::getNanosecondsPerTick() * 1000
+              << " ps per tick" << std::endl;
+
+    auto stageCost = measureTimedStage(iterations * 10);
+    auto packetCost = measurePacket(iterations, false);
+    auto timedPacketCost = measurePacket(iterations, true);
+    std::cout << "timed stage: " << stageCost << " ns" << std::endl;
+    std::cout << "loopback send and receive: " << packetCost
+              << " ns, timed: " << timedPacketCost << " ns" << std::endl;
+    std::cout << "estimated overhead at " << stagesPerPacket
+              << " stages per packet: "
+              << 100 * stagesPerPacket * stageCost / packetCost << "%"
+              << std::endl;
+
+    std::cout << "\n";
+    StageLatency::local().dump(std::cout);
+    return 0;
+}
@@ -0,0 +1,212 @@
+#include "../PacketHandler.h"
+#include "../ToyVpnServer.h"
+#include "../Utils.h"
+#include "../VpnSettings.h"
+#include "../libs/pcapplusplus/include/pcapplusplus/IPv4Layer.h"
+#include "../libs/pcapplusplus/include/pcapplusplus/Packet.h"
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Microbenchmarks of the components on the forwarding path, in the order a
+// datagram meets them. None of them needs root or a TUN interface. Run with
+// --benchmark_format=json and compare runs of two versions with
+// compare.py from Google Benchmark's tools.
+
+static sockaddr_in6 createClientAddress(uint32_t index) {
+    sockaddr_in6 address{};
+    address.sin6_family = AF_INET6;
+    // An IPv4-mapped address, like the dual-stack server socket sees
+    address.sin6_addr.s6_addr[10] = 0xff;
+    address.sin6_addr.s6_addr[11] = 0xff;
+    address.sin6_addr.s6_addr[12] = 198;
+    address.sin6_addr.s6_addr[13] = 18;
+    address.sin6_addr.s6_addr[14] = index >> 8;
+    address.sin6_addr.s6_addr[15] = index;
+    address.sin6_port = htons(1024 + index % 50000);
+    return address;
+}
+
+// An IPv4 TCP segment with an MSS option, as read from the TUN interface
+static std::vector<uint8_t> createTcpPacket(size_t size) {
+    std::vector<uint8_t> packet(size);
+    packet[0] = 0x45;
+    packet[2] = size >> 8;
+    packet[3] = size;
+    packet[8] = 64;
+    packet[9] = IPPROTO_TCP;
+    uint8_t addresses[] = {93, 184, 216, 34, 10, 0, 0, 2};
+    std::copy(std::begin(addresses), std::end(addresses), &packet[12]);
+    packet[20] = 0x01;
+    packet[21] = 0xbb;
+    packet[22] = 0xc3;
+    packet[23] = 0x50;
+    packet[32] = 0x60;
+    packet[33] = 0x10;
+    packet[40] = 2;
+    packet[41] = 4;
+    packet[42] = 0x05;
+    packet[43] = 0xb4;
+    return packet;
+}
+
+// m_Clients, the session table every datagram from a client is looked up in
+static void BM_ClientLookup(benchmark::State &state) {
+    std::unordered_map<sockaddr_in6, std::shared_ptr<ClientHandler>,
+                       sockaddrIn6Hash, sockaddrIn6Equal>
+        clients;
+    auto clientCount = static_cast<uint32_t>(state.range(0));
+    for (uint32_t i = 0; i < clientCount; i++) {
+        clients[createClientAddress(i)] = nullptr;
+    }
+
+    std::vector<sockaddr_in6> lookups;
+    std::mt19937 random(1);
+    for (size_t i = 0; i < 4096; i++) {
+        lookups.push_back(createClientAddress(random() % clientCount));
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        auto client = clients.find(lookups[i++ & 4095]);
+        benchmark::DoNotOptimize(client);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ClientLookup)->RangeMultiplier(10)->Range(10, 100'000);
+
+// The parse handleTunInterface does to find the client of a packet
+static void BM_TunPacketParse(benchmark::State &state) {
+    auto packetData = createTcpPacket(state.range(0));
+    timespec ts{};
+    for (auto _ : state) {
+        pcpp::RawPacket rawPacket(packetData.data(), packetData.size(), ts,
+                                  false, pcpp::LINKTYPE_DLT_RAW1);
+        pcpp::Packet packet(&rawPacket);
+        if (packet.isPacketOfType(pcpp::IPv4)) {
+            auto ipv4Layer = packet.getLayerOfType<pcpp::IPv4Layer>();
+            benchmark::DoNotOptimize(ipv4Layer->getDstIPv4Address().toInt());
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * packetData.size());
+}
+BENCHMARK(BM_TunPacketParse)->Arg(64)->Arg(1400);
+
+// What the reactor pays for every packet saved with --save-to-files. The
+// capture thread writes the packets to a temporary directory meanwhile, and
+// the iterations are fixed because it empties the queue only 10 times a
+// second.
+static void BM_PacketHandlerEnqueue(benchmark::State &state) {
+    auto directory = std::filesystem::temp_directory_path() / "ToyVpnBench";
+    std::filesystem::create_directories(directory);
+    auto packet = createTcpPacket(state.range(0));
+    pcpp::IPv4Address clientAddress("10.0.0.2");
+    {
+        PacketHandler packetHandler(directory.string() + "/");
+        for (auto _ : state) {
+            packetHandler.handlePacket(clientAddress, packet.data(),
+                                       packet.size());
+        }
+        state.SetItemsProcessed(state.iterations());
+        state.SetBytesProcessed(state.iterations() * packet.size());
+        packetHandler.stop();
+    }
+    std::filesystem::remove_all(directory);
+}
+BENCHMARK(BM_PacketHandlerEnqueue)->Arg(64)->Arg(1400)->Iterations(200'000);
+
+// Sent in every handshake
+static void BM_ToParamString(benchmark::State &state) {
+    VpnSettings vpnSettings{pcpp::IPv4Address("10.0.0.2"),
+                            pcpp::IPv4Network("0.0.0.0/0"),
+                            1400,
+                            std::nullopt,
+                            "secret",
+                            std::nullopt};
+    if (state.range(0) != 0) {
+        vpnSettings.dnsServer = pcpp::IPv4Address("8.8.8.8");
+        vpnSettings.resumptionToken = std::string(80, 'a');
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(vpnSettings.toParamString());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ToParamString)->ArgName("dns_and_token")->Arg(0)->Arg(1);
+
+// Drives the private session table and idle sweep of a server that is never
+// started, so nothing needs root
+class ServerBenchAccess {
+  public:
+    ServerBenchAccess()
+        : m_TunInterfaceName("tun0"), m_PrivateNetwork("10.0.0.0/8"),
+          m_Route("0.0.0.0/0"),
+          m_Config(ToyVpnConfiguration::withDefaults(
+              m_TunInterfaceName, m_PrivateNetwork, m_Route, "secret")),
+          m_Server(std::make_unique<ToyVpnServer>(m_Config)) {}
+
+    void addClients(uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            m_Server->createClient(createClientAddress(i),
+                                   m_Server->createVpnSettings().value());
+        }
+    }
+
+    void checkIdleClients(const std::chrono::steady_clock::time_point &now) {
+        m_Server->checkIdleClients(now);
+    }
+
+    size_t getClientCount() const { return m_Server->m_Clients.size(); }
+
+  private:
+    std::string m_TunInterfaceName;
+    pcpp::IPv4Network m_PrivateNetwork;
+    pcpp::IPv4Network m_Route;
+    ToyVpnConfiguration m_Config;
+    std::unique_ptr<ToyVpnServer> m_Server;
+};
+
+// The sweep every 5 seconds when every client is active. The clients never
+// got a message, so a time right after the clock's epoch is within their
+// idle timeout.
+static void BM_CheckIdleClientsActive(benchmark::State &state) {
+    ServerBenchAccess server;
+    server.addClients(state.range(0));
+    std::chrono::steady_clock::time_point now{std::chrono::seconds(1)};
+    for (auto _ : state) {
+        server.checkIdleClients(now);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CheckIdleClientsActive)
+    ->RangeMultiplier(10)
+    ->Range(100, 50'000)
+    ->Unit(benchmark::kMicrosecond);
+
+// The sweep that finds every client idle and evicts it
+static void BM_CheckIdleClientsEvict(benchmark::State &state) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto server = std::make_unique<ServerBenchAccess>();
+        server->addClients(state.range(0));
+        state.ResumeTiming();
+        server->checkIdleClients(std::chrono::steady_clock::now());
+        state.PauseTiming();
+        if (server->getClientCount() != 0) {
+            state.SkipWithError("Not every client was evicted");
+        }
+        server.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CheckIdleClientsEvict)
+    ->RangeMultiplier(10)
+    ->Range(100, 10'000)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
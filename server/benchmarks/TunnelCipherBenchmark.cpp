@@ -0,0 +1,59 @@
+#include "../TunnelCipher.h"
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+// Seals and opens batches of full-size packets with both algorithms and
+// reports the throughput of a single core.
+
+constexpr size_t batchSize = 64;
+
+int main(int argc, char *argv[]) {
+    size_t packetSize = argc > 1 ? std::stoul(argv[1]) : 1400;
+    size_t batches = argc > 2 ? std::stoul(argv[2]) : 20'000;
+
+    TunnelCipher::Key key{};
+    std::vector<uint8_t> buffers(batchSize * (packetSize +
+                                              TunnelCipher::overhead));
+    std::array<TunnelCipher::Packet, batchSize> packets;
+
+    for (auto algorithm : {TunnelCipher::Algorithm::ChaCha20Poly1305,
+                           TunnelCipher::Algorithm::Aes256Gcm}) {
+        TunnelCipher sender(algorithm, key, key);
+        TunnelCipher receiver(algorithm, key, key);
+        std::chrono::nanoseconds sealTime{0};
+        std::chrono::nanoseconds openTime{0};
+
+        for (size_t batch = 0; batch < batches; batch++) {
+            for (size_t i = 0; i < batchSize; i++) {
+                packets[i] = {buffers.data() +
+                                  i * (packetSize + TunnelCipher::overhead),
+                              packetSize, true};
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            sender.sealBatch(packets.data(), batchSize);
+            auto sealed = std::chrono::steady_clock::now();
+            receiver.openBatch(packets.data(), batchSize);
+            auto opened = std::chrono::steady_clock::now();
+
+            sealTime += sealed - start;
+            openTime += opened - sealed;
+            for (const auto &packet : packets) {
+                if (!packet.isValid) {
+                    std::cerr << "A packet failed to open" << std::endl;
+                    return 1;
+                }
+            }
+        }
+
+        double bits = 8.0 * packetSize * batchSize * batches;
+        std::cout << (algorithm == TunnelCipher::Algorithm::Aes256Gcm
+                          ? "aes-256-gcm"
+                          : "chacha20-poly1305")
+                  << ", packet size: " << packetSize
+                  << ", seal Gbit/s: " << bits / sealTime.count()
+                  << ", open Gbit/s: " << bits / openTime.count() << std::endl;
+    }
+    return 0;
+}
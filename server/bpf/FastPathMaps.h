@@ -0,0 +1,42 @@
+#pragma once
+
+// The maps shared by the tc-bpf programs in ToyVpnFastPath.bpf.c and
+// FastPathWrapper.h. tc pins them by name under /sys/fs/bpf/tc/globals,
+// where the server opens them. Addresses and ports are in network byte order.
+
+#include <linux/types.h>
+
+#define FAST_PATH_MAX_SESSIONS 65536
+
+#define FAST_PATH_CLIENTS_MAP "toyvpn_clients"
+#define FAST_PATH_SESSIONS_MAP "toyvpn_sessions"
+#define FAST_PATH_CONFIG_MAP "toyvpn_config"
+
+// The address and port a client sends from, the key of the clients map whose
+// values are the client's VPN address
+struct FastPathEndpoint {
+    __be32 address;
+    __be16 port;
+    __u16 padding;
+};
+
+// The value of the sessions map, keyed by the client's VPN address
+struct FastPathSession {
+    struct FastPathEndpoint client;
+    // The address the client sends to, learned from its first datagram that
+    // took the fast path. Packets to the client stay in userspace until then.
+    __be32 serverAddress;
+    __u32 padding;
+    __u64 packetsFromClient;
+    __u64 bytesFromClient;
+    __u64 packetsToClient;
+    __u64 bytesToClient;
+};
+
+// The only value of the config array
+struct FastPathConfig {
+    __u32 tunInterfaceIndex;
+    __u32 publicInterfaceIndex;
+    __be16 serverPort;
+    __u16 padding;
+};
@@ -0,0 +1,220 @@
+// The fast path for established plaintext sessions, attached by
+// FastPathWrapper.h with tc:
+//
+// - decapsulate runs on ingress of the public interface. It strips the outer
+//   IPv4 and UDP headers of data datagrams from the clients in the clients
+//   map and redirects the inner packet into the TUN device, as if the server
+//   had written it there. Only datagrams whose UDP checksum is left out or
+//   was verified by the device are taken, checking it here would mean
+//   reading the whole payload. The socket checks the others.
+// - encapsulate runs on egress of the TUN device. It adds the outer headers
+//   to packets for the VPN addresses in the sessions map and redirects them
+//   out of the public interface.
+//
+// Everything else, hellos, disconnects, unknown clients, fragments and
+// datagrams with unverified checksums, is left alone and reaches the server's
+// socket and TUN device as before.
+//
+// Built with clang -target bpf, see TOYVPN_BUILD_FAST_PATH in CMakeLists.txt.
+// The few libbpf definitions it needs are spelled out so it only depends on
+// the kernel headers.
+
+#include "FastPathMaps.h"
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/pkt_cls.h>
+#include <linux/udp.h>
+
+#define SEC(name) __attribute__((section(name), used))
+#define __uint(name, value) int(*name)[value]
+#define __type(name, value) typeof(value) *name
+#define LIBBPF_PIN_BY_NAME 1
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define toNetwork16(value) __builtin_bswap16(value)
+#else
+#define toNetwork16(value) (value)
+#endif
+
+// The more fragments flag and the fragment offset
+#define IP_FRAGMENT_MASK 0x3fff
+#define OUTER_HEADERS_SIZE (sizeof(struct iphdr) + sizeof(struct udphdr))
+
+static void *(*bpf_map_lookup_elem)(void *map, const void *key) =
+    (void *)BPF_FUNC_map_lookup_elem;
+static long (*bpf_skb_store_bytes)(struct __sk_buff *skb, __u32 offset,
+                                   const void *from, __u32 size,
+                                   __u64 flags) =
+    (void *)BPF_FUNC_skb_store_bytes;
+static long (*bpf_skb_adjust_room)(struct __sk_buff *skb, __s32 sizeDiff,
+                                   __u32 mode, __u64 flags) =
+    (void *)BPF_FUNC_skb_adjust_room;
+static long (*bpf_skb_change_head)(struct __sk_buff *skb, __u32 size,
+                                   __u64 flags) =
+    (void *)BPF_FUNC_skb_change_head;
+static long (*bpf_csum_level)(struct __sk_buff *skb, __u64 level) =
+    (void *)BPF_FUNC_csum_level;
+static long (*bpf_redirect)(__u32 interfaceIndex, __u64 flags) =
+    (void *)BPF_FUNC_redirect;
+static long (*bpf_redirect_neigh)(__u32 interfaceIndex,
+                                  struct bpf_redir_neigh *params, int size,
+                                  __u64 flags) =
+    (void *)BPF_FUNC_redirect_neigh;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, FAST_PATH_MAX_SESSIONS);
+    __type(key, struct FastPathEndpoint);
+    __type(value, __be32);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} toyvpn_clients SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, FAST_PATH_MAX_SESSIONS);
+    __type(key, __be32);
+    __type(value, struct FastPathSession);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} toyvpn_sessions SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct FastPathConfig);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} toyvpn_config SEC(".maps");
+
+struct OuterHeaders {
+    struct iphdr ip;
+    struct udphdr udp;
+};
+
+static __always_inline struct FastPathConfig *getConfig(void) {
+    __u32 key = 0;
+    return bpf_map_lookup_elem(&toyvpn_config, &key);
+}
+
+static __always_inline __u16 getIpChecksum(const struct iphdr *ip) {
+    const __u16 *words = (const __u16 *)ip;
+    __u32 sum = 0;
+#pragma unroll
+    for (int i = 0; i < sizeof(*ip) / 2; i++) {
+        sum += words[i];
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum += sum >> 16;
+    return ~sum;
+}
+
+SEC("tc/ingress")
+int decapsulate(struct __sk_buff *skb) {
+    struct FastPathConfig *config = getConfig();
+    void *data = (void *)(long)skb->data;
+    void *dataEnd = (void *)(long)skb->data_end;
+    struct ethhdr *ethernet = data;
+    struct iphdr *outer = (void *)(ethernet + 1);
+    struct udphdr *udp = (void *)(outer + 1);
+    struct iphdr *inner = (void *)(udp + 1);
+    if (config == 0 || (void *)(inner + 1) > dataEnd) {
+        return TC_ACT_OK;
+    }
+
+    // Hellos and disconnects start with a message type, not an IPv4 header
+    if (ethernet->h_proto != toNetwork16(ETH_P_IP) || outer->ihl != 5 ||
+        outer->protocol != IPPROTO_UDP ||
+        (outer->frag_off & toNetwork16(IP_FRAGMENT_MASK)) != 0 ||
+        udp->dest != config->serverPort || inner->version != 4 ||
+        skb->gso_segs > 1) {
+        return TC_ACT_OK;
+    }
+
+    // The query fails unless the device or the stack verified the checksum
+    if (udp->check != 0 && bpf_csum_level(skb, BPF_CSUM_LEVEL_QUERY) < 0) {
+        return TC_ACT_OK;
+    }
+
+    struct FastPathEndpoint endpoint = {outer->saddr, udp->source, 0};
+    __be32 *vpnAddress = bpf_map_lookup_elem(&toyvpn_clients, &endpoint);
+    if (vpnAddress == 0 || inner->saddr != *vpnAddress) {
+        return TC_ACT_OK;
+    }
+    struct FastPathSession *session =
+        bpf_map_lookup_elem(&toyvpn_sessions, vpnAddress);
+    if (session == 0) {
+        return TC_ACT_OK;
+    }
+
+    __be32 serverAddress = outer->daddr;
+    __u32 innerSize = skb->len - sizeof(*ethernet) - OUTER_HEADERS_SIZE;
+    if (bpf_skb_adjust_room(skb, -(__s32)OUTER_HEADERS_SIZE,
+                            BPF_ADJ_ROOM_MAC, 0) != 0) {
+        return TC_ACT_OK;
+    }
+
+    if (session->serverAddress != serverAddress) {
+        session->serverAddress = serverAddress;
+    }
+    __sync_fetch_and_add(&session->packetsFromClient, 1);
+    __sync_fetch_and_add(&session->bytesFromClient, innerSize);
+    return bpf_redirect(config->tunInterfaceIndex, BPF_F_INGRESS);
+}
+
+SEC("tc/egress")
+int encapsulate(struct __sk_buff *skb) {
+    struct FastPathConfig *config = getConfig();
+    void *data = (void *)(long)skb->data;
+    void *dataEnd = (void *)(long)skb->data_end;
+    struct iphdr *inner = data;
+    if (config == 0 || (void *)(inner + 1) > dataEnd ||
+        skb->protocol != toNetwork16(ETH_P_IP) || skb->gso_segs > 1) {
+        return TC_ACT_OK;
+    }
+
+    __be32 destination = inner->daddr;
+    struct FastPathSession *session =
+        bpf_map_lookup_elem(&toyvpn_sessions, &destination);
+    if (session == 0 || session->serverAddress == 0) {
+        return TC_ACT_OK;
+    }
+
+    __u32 innerSize = skb->len;
+    if (bpf_skb_adjust_room(skb, OUTER_HEADERS_SIZE, BPF_ADJ_ROOM_MAC,
+                            BPF_F_ADJ_ROOM_ENCAP_L3_IPV4 |
+                                BPF_F_ADJ_ROOM_ENCAP_L4_UDP) != 0) {
+        return TC_ACT_OK;
+    }
+
+    struct OuterHeaders headers = {};
+    headers.ip.version = 4;
+    headers.ip.ihl = 5;
+    headers.ip.ttl = 64;
+    headers.ip.protocol = IPPROTO_UDP;
+    headers.ip.tot_len = toNetwork16(innerSize + OUTER_HEADERS_SIZE);
+    headers.ip.saddr = session->serverAddress;
+    headers.ip.daddr = session->client.address;
+    headers.ip.check = getIpChecksum(&headers.ip);
+    headers.udp.source = config->serverPort;
+    headers.udp.dest = session->client.port;
+    headers.udp.len = toNetwork16(innerSize + sizeof(struct udphdr));
+    // IPv4 allows leaving out the UDP checksum, which would otherwise mean
+    // reading the whole payload
+    headers.udp.check = 0;
+    if (bpf_skb_store_bytes(skb, 0, &headers, sizeof(headers), 0) != 0) {
+        return TC_ACT_SHOT;
+    }
+
+    // The TUN device has no link layer header, and bpf_redirect_neigh wants
+    // one to replace with the next hop's
+    if (bpf_skb_change_head(skb, sizeof(struct ethhdr), 0) != 0) {
+        return TC_ACT_SHOT;
+    }
+
+    __sync_fetch_and_add(&session->packetsToClient, 1);
+    __sync_fetch_and_add(&session->bytesToClient, innerSize);
+    return bpf_redirect_neigh(config->publicInterfaceIndex, 0, 0, 0);
+}
+
+char _license[] SEC("license") = "Dual MIT/GPL";
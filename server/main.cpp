@@ -92,6 +92,291 @@ int main(int argc, char *argv[]) {
             saveNetworkTrafficToFiles.emplace(fileName);
         });
 
+    program.add_argument("-c", "--handshake-cookies")
+        .help("answer handshakes with a stateless cookie before creating a "
+              "session")
+        .flag();
+
+    std::optional<uint32_t> clientRateLimit;
+    program.add_argument("-R", "--client-rate-limit")
+        .help("limit the traffic of every client in each direction, in kbit/s")
+        .action([&clientRateLimit](const std::string &value) {
+            unsigned long rateLimit = 0;
+            try {
+                rateLimit = std::stoul(value);
+            } catch (const std::exception &) {
+                throw std::invalid_argument("Rate limit is an invalid number");
+            }
+            if (rateLimit == 0 || rateLimit > UINT32_MAX) {
+                throw std::invalid_argument(
+                    "Rate limit has to be between 1 and 4294967295");
+            }
+            clientRateLimit = rateLimit;
+        });
+
+    uint32_t clientBurstSize = 64;
+    program.add_argument("-B", "--client-burst-size")
+        .help("the burst size allowed on top of the client rate limit, in KB")
+        .default_value(64)
+        .action([&clientBurstSize](const std::string &value) {
+            unsigned long burstSize = 0;
+            try {
+                burstSize = std::stoul(value);
+            } catch (const std::exception &) {
+                throw std::invalid_argument("Burst size is an invalid number");
+            }
+            if (burstSize > UINT32_MAX) {
+                throw std::invalid_argument(
+                    "Burst size has to be at most 4294967295");
+            }
+            clientBurstSize = burstSize;
+        });
+
+    program.add_argument("-q", "--fair-queueing")
+        .help("schedule traffic to clients with deficit round robin instead of "
+              "sending it in arrival order")
+        .flag();
+
+    program.add_argument("-k", "--codel")
+        .help("drop or ECN-mark packets that wait too long in the fair "
+              "queueing queues (implies --fair-queueing)")
+        .flag();
+
+    std::unordered_map<uint32_t, uint16_t> clientWeights;
+    program.add_argument("-w", "--client-weight")
+        .help("the fair queueing weight of a client, as "
+              "<internal address>=<weight>")
+        .append()
+        .action([&clientWeights](const std::string &value) {
+            auto separator = value.find('=');
+            if (separator == std::string::npos) {
+                throw std::invalid_argument(
+                    "Client weight has to be <internal address>=<weight>");
+            }
+            pcpp::IPv4Address clientAddress(value.substr(0, separator));
+            int weight = 0;
+            try {
+                weight = std::stoi(value.substr(separator + 1));
+            } catch (const std::exception &) {
+                throw std::invalid_argument(
+                    "Client weight is an invalid number");
+            }
+            if (weight < 1 || weight > 100) {
+                throw std::invalid_argument(
+                    "Client weight has to be between 1 and 100");
+            }
+            clientWeights[clientAddress.toInt()] = weight;
+        });
+
+    std::optional<TunnelCipher::Algorithm> encryption;
+    program.add_argument("-E", "--encryption")
+        .help("encrypt the tunnel traffic and require encrypted handshakes, "
+              "one of: auto, chacha20-poly1305, aes-256-gcm")
+        .action([&encryption](const std::string &value) {
+            encryption = TunnelCipher::algorithmFromString(value);
+            if (!encryption.has_value()) {
+                throw std::invalid_argument(
+                    "Encryption has to be one of: auto, chacha20-poly1305, "
+                    "aes-256-gcm");
+            }
+        });
+
+    uint16_t handshakeThreads = 2;
+    program.add_argument("-H", "--handshake-threads")
+        .help("the number of threads doing the key exchange of encrypted "
+              "handshakes")
+        .default_value(2)
+        .action([&handshakeThreads](const std::string &value) {
+            int threads = 0;
+            try {
+                threads = std::stoi(value);
+            } catch (const std::exception &) {
+                throw std::invalid_argument(
+                    "Handshake threads is an invalid number");
+            }
+            if (threads < 1 || threads > 64) {
+                throw std::invalid_argument(
+                    "Handshake threads has to be between 1 and 64");
+            }
+            handshakeThreads = threads;
+        });
+
+    program.add_argument("-z", "--compression")
+        .help("compress the tunnel traffic of clients that ask for it with "
+              "LZ4 (requires --encryption)")
+        .flag();
+
+    program.add_argument("-g", "--coalescing")
+        .help("pack the packets to clients that ask for it into as few "
+              "datagrams as possible (requires --encryption)")
+        .flag();
+
+    program.add_argument("-F", "--fec")
+        .help("protect the tunnel traffic of clients that ask for it with XOR "
+              "parity sized to the measured loss (requires --encryption)")
+        .flag();
+
+    program.add_argument("-C", "--header-compression")
+        .help("compress the inner IPv4 TCP and UDP headers of clients that "
+              "ask for it (requires --encryption)")
+        .flag();
+
+    program.add_argument("-S", "--roaming")
+        .help("give clients that ask for it a session ID so their session "
+              "moves with them when their address changes (requires "
+              "--encryption)")
+        .flag();
+
+    program.add_argument("-T", "--resumption")
+        .help("give clients that ask for it a token that gets them the same "
+              "address back when they reconnect (requires --encryption)")
+        .flag();
+
+    std::optional<std::string> statsSegment;
+    program.add_argument("-N", "--stats-segment")
+        .help("publish the counters in the shared memory object "
+              "/dev/shm/<name>")
+        .action([&statsSegment](const std::string &value) {
+            if (value.empty() || value.find('/') != std::string::npos) {
+                throw std::invalid_argument(
+                    "Stats segment has to be a name without slashes");
+            }
+            statsSegment = "/" + value;
+        });
+
+    std::optional<uint16_t> metricsPort;
+    program.add_argument("-M", "--metrics-port")
+        .help("serve the counters as Prometheus metrics on this port of "
+              "127.0.0.1")
+        .action([&metricsPort](const std::string &value) {
+            int port = 0;
+            try {
+                port = std::stoi(value);
+            } catch (const std::exception &) {
+                throw std::invalid_argument(
+                    "Metrics port is an invalid number");
+            }
+            if (port < 1 || port > UINT16_MAX) {
+                throw std::invalid_argument(
+                    "Metrics port has to be between 1 and 65535");
+            }
+            metricsPort = port;
+        });
+
+    std::optional<std::string> trace;
+    program.add_argument("-X", "--trace")
+        .help("record a trace of the server and write it to this file in the "
+              "Chrome trace format on SIGUSR2 and on exit")
+        .action([&trace](const std::string &value) { trace = value; });
+
+    std::optional<pcpp::IPv4Address> userspaceNat;
+    program.add_argument("-u", "--userspace-nat")
+        .help("translate the VPN traffic to this free address of the public "
+              "network interface's subnet in userspace and send it through "
+              "packet rings, instead of through the TUN interface and "
+              "iptables")
+        .action([&userspaceNat](const std::string &value) {
+            userspaceNat = value;
+        });
+
+    std::optional<std::string> fastPath;
+    program.add_argument("-P", "--fast-path")
+        .help("forward the traffic of established sessions in the kernel with "
+              "the tc-bpf programs in this object file, see "
+              "TOYVPN_BUILD_FAST_PATH")
+        .action([&fastPath](const std::string &value) { fastPath = value; });
+
+    std::optional<uint8_t> reuseportMember;
+    program.add_argument("-G", "--reuseport-member")
+        .help("share the port with other servers on this host as this member "
+              "of the group, and steer the datagrams of every client to the "
+              "server that owns it")
+        .action([&reuseportMember](const std::string &value) {
+            int member = 0;
+            try {
+                member = std::stoi(value);
+            } catch (const std::exception &) {
+                throw std::invalid_argument(
+                    "Reuseport member is an invalid number");
+            }
+            if (member < 0 || member >= int(ReuseportSteering::maxMembers)) {
+                throw std::invalid_argument(
+                    "Reuseport member has to be between 0 and " +
+                    std::to_string(ReuseportSteering::maxMembers - 1));
+            }
+            reuseportMember = member;
+        });
+
+    program.add_argument("-O", "--connected-sockets")
+        .help("give every client that doesn't roam its own socket, connected "
+              "to its address")
+        .flag();
+
+    std::optional<uint8_t> clusterNode;
+    program.add_argument("-K", "--cluster-node")
+        .help("run as this node of an active-active cluster with the servers "
+              "given with --cluster-peer, sharing the private network and the "
+              "sessions with them")
+        .action([&clusterNode](const std::string &value) {
+            int node = 0;
+            try {
+                node = std::stoi(value);
+            } catch (const std::exception &) {
+                throw std::invalid_argument(
+                    "Cluster node is an invalid number");
+            }
+            if (node < 0 || node >= int(ClusterChannel::maxNodes)) {
+                throw std::invalid_argument(
+                    "Cluster node has to be between 0 and " +
+                    std::to_string(ClusterChannel::maxNodes - 1));
+            }
+            clusterNode = node;
+        });
+
+    std::vector<sockaddr_in6> clusterPeers;
+    program.add_argument("-J", "--cluster-peer")
+        .help("the <address>:<port> of another node's cluster channel")
+        .append()
+        .action([&clusterPeers](const std::string &value) {
+            auto peer = ClusterChannel::parsePeer(value);
+            if (!peer.has_value()) {
+                throw std::invalid_argument(
+                    "Cluster peer has to be <address>:<port>");
+            }
+            clusterPeers.push_back(peer.value());
+        });
+
+    std::optional<in6_addr> clusterAddress;
+    program.add_argument("-A", "--cluster-address")
+        .help("the address of this node's cluster channel, on the private "
+              "network the peers share")
+        .action([&clusterAddress](const std::string &value) {
+            clusterAddress = ClusterChannel::parseAddress(value);
+            if (!clusterAddress.has_value()) {
+                throw std::invalid_argument(
+                    "Cluster address is an invalid IP address");
+            }
+        });
+
+    uint16_t clusterPort = 5679;
+    program.add_argument("-W", "--cluster-port")
+        .help("the UDP port of the cluster channel")
+        .default_value(5679)
+        .action([&clusterPort](const std::string &value) {
+            int port = 0;
+            try {
+                port = std::stoi(value);
+            } catch (const std::exception &) {
+                throw std::invalid_argument(
+                    "Cluster port is an invalid number");
+            }
+            if (port < 1 || port > UINT16_MAX) {
+                throw std::invalid_argument(
+                    "Cluster port has to be between 1 and 65535");
+            }
+            clusterPort = port;
+        });
+
     program.add_argument("-l", "--verbose")
         .help("print verbose log messages")
         .flag();
@@ -104,6 +389,122 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (program["--compression"] == true && !encryption.has_value()) {
+        std::cerr << "--compression requires --encryption" << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (program["--coalescing"] == true &&
+        (!encryption.has_value() || program["--fair-queueing"] == true ||
+         program["--codel"] == true)) {
+        std::cerr << "--coalescing requires --encryption and can't be used "
+                     "with --fair-queueing or --codel"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (program["--fec"] == true &&
+        (!encryption.has_value() || program["--fair-queueing"] == true ||
+         program["--codel"] == true)) {
+        std::cerr << "--fec requires --encryption and can't be used with "
+                     "--fair-queueing or --codel"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (program["--header-compression"] == true &&
+        (!encryption.has_value() || program["--fair-queueing"] == true ||
+         program["--codel"] == true)) {
+        std::cerr << "--header-compression requires --encryption and can't be "
+                     "used with --fair-queueing or --codel"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (program["--roaming"] == true && !encryption.has_value()) {
+        std::cerr << "--roaming requires --encryption" << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (program["--resumption"] == true && !encryption.has_value()) {
+        std::cerr << "--resumption requires --encryption" << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (fastPath.has_value() &&
+        (encryption.has_value() || clientRateLimit.has_value() ||
+         program["--fair-queueing"] == true || program["--codel"] == true ||
+         program.is_used("--save-to-files") || userspaceNat.has_value() ||
+         program["--compression"] == true || program["--coalescing"] == true ||
+         program["--fec"] == true || program["--header-compression"] == true ||
+         program["--roaming"] == true)) {
+        std::cerr << "--fast-path can't be used with --encryption, "
+                     "--client-rate-limit, --fair-queueing, --codel, "
+                     "--save-to-files, --userspace-nat, --compression, "
+                     "--coalescing, --fec, --header-compression or --roaming"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    // A smaller bucket never holds enough tokens for a full-size packet
+    if (uint64_t(clientBurstSize) * 1024 < uint64_t(mtu)) {
+        std::cerr << "Burst size has to hold at least one packet of the MTU"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (reuseportMember.has_value() && fastPath.has_value()) {
+        std::cerr << "--reuseport-member can't be used with --fast-path"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (program["--connected-sockets"] == true &&
+        (program["--fair-queueing"] == true || program["--codel"] == true)) {
+        std::cerr << "--connected-sockets can't be used with --fair-queueing "
+                     "or --codel"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (clusterNode.has_value() &&
+        (clusterPeers.empty() || !clusterAddress.has_value() ||
+         reuseportMember.has_value())) {
+        std::cerr << "--cluster-node requires --cluster-peer and "
+                     "--cluster-address and can't be used with "
+                     "--reuseport-member"
+                  << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (clusterNode.has_value()) {
+        try {
+            if (clusterNode.value() > clusterPeers.size()) {
+                throw std::invalid_argument(
+                    "Cluster node has to be below the number of nodes, " +
+                    std::to_string(clusterPeers.size() + 1));
+            }
+            ClusterChannel::getAddressPartition(privateNetwork,
+                                                clusterNode.value(),
+                                                clusterPeers.size() + 1);
+        } catch (const std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            std::cerr << program;
+            return 1;
+        }
+    }
+
     if (program.is_used("--save-to-files") &&
         !saveNetworkTrafficToFiles.has_value()) {
         saveNetworkTrafficToFiles.emplace("");
@@ -122,7 +523,32 @@ int main(int argc, char *argv[]) {
                                       static_cast<uint16_t>(mtu),
                                       secret,
                                       saveNetworkTrafficToFiles,
-                                      dnsServer};
+                                      dnsServer,
+                                      program["--handshake-cookies"] == true,
+                                      clientRateLimit,
+                                      clientBurstSize,
+                                      program["--fair-queueing"] == true,
+                                      program["--codel"] == true,
+                                      clientWeights,
+                                      encryption,
+                                      handshakeThreads,
+                                      program["--compression"] == true,
+                                      program["--coalescing"] == true,
+                                      program["--fec"] == true,
+                                      program["--header-compression"] == true,
+                                      program["--roaming"] == true,
+                                      program["--resumption"] == true,
+                                      statsSegment,
+                                      metricsPort,
+                                      trace,
+                                      userspaceNat,
+                                      fastPath,
+                                      reuseportMember,
+                                      program["--connected-sockets"] == true,
+                                      clusterNode,
+                                      clusterAddress.value_or(in6addr_any),
+                                      clusterPort,
+                                      clusterPeers};
     ToyVpnServer server(config);
     pcpp::ApplicationEventHandler::getInstance().onApplicationInterrupted(
         [](void *cookie) {